@@ -0,0 +1,203 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __CHANNELREGISTRY_H
+#define __CHANNELREGISTRY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace mozilla {
+
+enum ChannelObjectKind
+{
+  eChannelObjectSection = 0,
+  eChannelObjectEvent,
+  // A copy of another object that the sandbox inherits
+  eChannelObjectSandboxCopy,
+  eChannelObjectKindCount
+};
+
+struct ChannelObject
+{
+  uintptr_t         mHandle;
+  ChannelObjectKind mKind;
+  uint64_t          mSize;
+};
+
+/**
+ * Creates and destroys the kernel objects behind channels: a section handle
+ * or file descriptor, an auto-reset event or eventfd. An empty name creates
+ * an anonymous object, which can only reach a sandbox by inheritance.
+ * Implementations must be thread-safe.
+ */
+class ChannelBackend
+{
+public:
+  virtual ~ChannelBackend() {}
+
+  virtual std::optional<uintptr_t> CreateSection(const std::string& aName,
+                                                 uint64_t aSize) = 0;
+  virtual std::optional<uintptr_t> CreateAutoResetEvent(
+    const std::string& aName) = 0;
+  // Returns an inheritable copy of aObject that grants only aAccess, where
+  // the platform supports restricting it
+  virtual std::optional<uintptr_t> CopyForSandbox(const ChannelObject& aObject,
+                                                  uint32_t aAccess) = 0;
+  // Closes aObject and, if it is named, removes its name
+  virtual void Destroy(const ChannelObject& aObject,
+                       const std::string& aName) = 0;
+};
+
+#if defined(_WIN32)
+
+// Sections and events in the session's namespace
+class Win32ChannelBackend final : public ChannelBackend
+{
+public:
+  std::optional<uintptr_t> CreateSection(const std::string& aName,
+                                         uint64_t aSize) override;
+  std::optional<uintptr_t> CreateAutoResetEvent(
+    const std::string& aName) override;
+  std::optional<uintptr_t> CopyForSandbox(const ChannelObject& aObject,
+                                          uint32_t aAccess) override;
+  void Destroy(const ChannelObject& aObject,
+               const std::string& aName) override;
+};
+
+#else
+
+/**
+ * POSIX shared memory sections. Anonymous sections are memfds and events are
+ * eventfds, so both are only available on Linux. There are no named events,
+ * and aAccess is ignored.
+ */
+class PosixChannelBackend final : public ChannelBackend
+{
+public:
+  std::optional<uintptr_t> CreateSection(const std::string& aName,
+                                         uint64_t aSize) override;
+  std::optional<uintptr_t> CreateAutoResetEvent(
+    const std::string& aName) override;
+  std::optional<uintptr_t> CopyForSandbox(const ChannelObject& aObject,
+                                          uint32_t aAccess) override;
+  void Destroy(const ChannelObject& aObject,
+               const std::string& aName) override;
+};
+
+#endif // defined(_WIN32)
+
+#if defined(_WIN32)
+typedef Win32ChannelBackend PlatformChannelBackend;
+#else
+typedef PosixChannelBackend PlatformChannelBackend;
+#endif
+
+/**
+ * Owns the IPC objects of many launcher/sandbox pairs at once. Each pair is
+ * an instance, and every object belongs to one instance and one channel
+ * kind (StartupChannelKind). Named objects get names that no other object
+ * of any registry has, so that any number of pairs may run side by side in
+ * one session. Anonymous objects are preferred, and are passed to the
+ * sandbox with CopyForSandbox and AddChannel.
+ *
+ * Releasing an instance destroys all of its objects, as does destroying the
+ * registry. Instances are spread over kShardCount locks so that thousands of
+ * pairs may come and go concurrently.
+ */
+class ChannelRegistry final
+{
+public:
+  typedef uint64_t InstanceId;
+
+  static constexpr size_t kShardCount = 16;
+
+  // aPrefix starts every name that the registry generates
+  ChannelRegistry(ChannelBackend& aBackend, const std::string_view aPrefix);
+  ~ChannelRegistry();
+
+  // Never returns zero
+  InstanceId CreateInstance();
+  // Destroys every object of aInstance. Returns how many there were.
+  size_t ReleaseInstance(InstanceId aInstance);
+
+  std::optional<ChannelObject> CreateSection(InstanceId aInstance,
+                                             uint32_t aChannelKind,
+                                             uint64_t aSize,
+                                             bool aNamed = false);
+  std::optional<ChannelObject> CreateAutoResetEvent(InstanceId aInstance,
+                                                    uint32_t aChannelKind,
+                                                    bool aNamed = false);
+  // The copy belongs to the same instance and channel as the original
+  std::optional<ChannelObject> CopyForSandbox(InstanceId aInstance,
+                                              uint32_t aChannelKind,
+                                              uint32_t aAccess,
+                                              uint32_t aNth = 0);
+
+  // The aNth object that was created for aChannelKind, not counting copies
+  std::optional<ChannelObject> Find(InstanceId aInstance,
+                                    uint32_t aChannelKind,
+                                    uint32_t aNth = 0) const;
+  // Empty if the object is anonymous or does not exist
+  std::string GetName(InstanceId aInstance, uint32_t aChannelKind,
+                      uint32_t aNth = 0) const;
+
+  size_t GetInstanceCount() const;
+  size_t GetObjectCount() const;
+
+  ChannelRegistry(const ChannelRegistry&) = delete;
+  ChannelRegistry& operator=(const ChannelRegistry&) = delete;
+
+private:
+  struct Entry
+  {
+    uint32_t      mChannelKind;
+    uint32_t      mNth;
+    ChannelObject mObject;
+    // Empty for anonymous objects
+    std::string   mName;
+  };
+
+  struct Shard
+  {
+    mutable std::mutex                                    mMutex;
+    std::unordered_map<InstanceId, std::vector<Entry>>    mInstances;
+  };
+
+  Shard& GetShard(InstanceId aInstance) const
+  {
+    return mShards[aInstance % kShardCount];
+  }
+  // Creates an object with aCreate, outside of any lock, and records it
+  template <typename CreateFn>
+  std::optional<ChannelObject> Add(InstanceId aInstance,
+                                   uint32_t aChannelKind,
+                                   ChannelObjectKind aKind, uint64_t aSize,
+                                   bool aNamed, CreateFn&& aCreate);
+  void DestroyEntries(std::vector<Entry>& aEntries);
+  static const Entry* FindEntry(const std::vector<Entry>& aEntries,
+                                uint32_t aChannelKind, uint32_t aNth);
+
+  ChannelBackend&         mBackend;
+  const std::string       mPrefix;
+  // Keeps names unique across registries and launcher processes
+  const uint64_t          mNonce;
+  std::atomic<InstanceId> mNextInstance;
+  std::atomic<uint64_t>   mNextName;
+  mutable Shard           mShards[kShardCount];
+};
+
+} // namespace mozilla
+
+#endif // __CHANNELREGISTRY_H
+
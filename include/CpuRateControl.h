@@ -0,0 +1,125 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __CPURATECONTROL_H
+#define __CPURATECONTROL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mozilla {
+
+enum SandboxPriority : uint32_t
+{
+  ePriorityBackground = 0,
+  ePriorityNormal,
+  ePriorityForeground,
+  ePriorityCount
+};
+
+/**
+ * How a priority class shares the CPU. Rates are in hundredths of a percent
+ * of the whole machine, like the job object's CPU rate cap.
+ */
+struct CpuShare
+{
+  // The job object CPU weight used when the controller is not active
+  uint32_t  mWeight;
+  // Relative share when the host is saturated
+  uint32_t  mShare;
+  // The controller never caps a sandbox below this rate
+  uint32_t  mMinRate;
+};
+
+const CpuShare& GetCpuShare(SandboxPriority aPriority);
+
+struct CpuUsage
+{
+  uint32_t  mId;
+  // Fraction of the whole machine that the sandbox used over the last
+  // interval, from 0.0 to 1.0
+  double    mUsage;
+};
+
+struct CpuRateDecision
+{
+  uint32_t  mId;
+  // kMaxCpuRate removes the cap
+  uint32_t  mCpuRate;
+};
+
+/**
+ * Adjusts hard CPU rate caps from observed host load and per-sandbox usage.
+ *
+ * While the host has headroom, caps are relaxed additively until they are
+ * removed. Once host load crosses the saturation threshold, the machine is
+ * divided by weighted max-min fairness: each sandbox is entitled to a share
+ * proportional to its priority class, sandboxes that demand less than their
+ * entitlement keep it, and the remainder is redistributed among the others.
+ * No cap ever falls below the class's minimum rate. Caps are raised at once
+ * but lowered gradually, so that a single noisy sample does not cause
+ * oscillation.
+ *
+ * Not thread-safe; expected to be driven from a single sampling thread.
+ */
+class CpuRateController final
+{
+public:
+  struct Config
+  {
+    // Host load at which caps start to be enforced
+    double    mSaturation = 0.9;
+    // Host load below which caps are relaxed
+    double    mRelease = 0.75;
+    // Sandboxes may grow this much beyond their current usage
+    double    mDemandHeadroom = 1.25;
+    // Fraction of the distance to a lower target covered by each update
+    double    mGain = 0.5;
+    // Rate by which caps are relaxed on each update
+    uint32_t  mRelaxStep = 1000;
+  };
+
+  CpuRateController() = default;
+  explicit CpuRateController(const Config& aConfig)
+    : mConfig(aConfig)
+  {}
+
+  bool Add(uint32_t aId, SandboxPriority aPriority);
+  void Remove(uint32_t aId);
+
+  /**
+   * aHostLoad is the fraction of the whole machine that was busy over the last
+   * interval, including work outside of sandboxes. Appends a decision to
+   * aDecisions for every sandbox whose cap changed. Sandboxes that are missing
+   * from aUsage are assumed to have been idle.
+   */
+  void Update(double aHostLoad, const std::vector<CpuUsage>& aUsage,
+              std::vector<CpuRateDecision>& aDecisions);
+
+  uint32_t GetCpuRate(uint32_t aId) const;
+  size_t Count() const { return mEntries.size(); }
+
+private:
+  struct Entry
+  {
+    uint32_t        mId;
+    SandboxPriority mPriority;
+    uint32_t        mCpuRate;
+    double          mUsage;
+  };
+
+  void ComputeTargets(double aCapacity, std::vector<double>& aTargets) const;
+
+  Config              mConfig;
+  std::vector<Entry>  mEntries;
+  bool                mSaturated = false;
+};
+
+} // namespace mozilla
+
+#endif // __CPURATECONTROL_H
+
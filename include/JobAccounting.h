@@ -0,0 +1,145 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __JOBACCOUNTING_H
+#define __JOBACCOUNTING_H
+
+#include "MetricsRing.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mozilla {
+
+/**
+ * One sample of a job's cumulative accounting counters. CPU times are in
+ * 100ns units, as reported by the job object.
+ */
+struct JobAccountingSample
+{
+  uint64_t  mTimestampNs;
+  uint64_t  mTotalUserTime;
+  uint64_t  mTotalKernelTime;
+  uint64_t  mPageFaults;
+  uint64_t  mReadOperations;
+  uint64_t  mWriteOperations;
+  uint64_t  mReadBytes;
+  uint64_t  mWriteBytes;
+  uint64_t  mOtherBytes;
+  uint64_t  mPeakProcessMemory;
+  uint64_t  mPeakJobMemory;
+  uint64_t  mActiveProcesses;
+};
+
+struct JobAccountingRates
+{
+  double    mIntervalSec;
+  // Fraction of a single logical processor, so may exceed 1.0
+  double    mCpuUtilization;
+  double    mPageFaultsPerSec;
+  double    mReadBytesPerSec;
+  double    mWriteBytesPerSec;
+  double    mOtherBytesPerSec;
+  uint64_t  mPeakProcessMemory;
+  uint64_t  mPeakJobMemory;
+};
+
+/**
+ * Computes rates over the interval between two samples of the same job.
+ * Returns false if aNewer does not follow aOlder.
+ */
+bool ComputeJobAccountingRates(const JobAccountingSample& aOlder,
+                               const JobAccountingSample& aNewer,
+                               JobAccountingRates& aRates);
+
+class JobAccountingSource
+{
+public:
+  virtual ~JobAccountingSource() {}
+
+  // Fills in everything except aSample.mTimestampNs
+  virtual bool QueryAccounting(JobAccountingSample& aSample) = 0;
+};
+
+/**
+ * Periodically samples every registered JobAccountingSource on a background
+ * thread and records the results in a per-source MetricsRing. Rings may be
+ * read at any time without blocking the sampler, and sources are queried
+ * without holding the lock that Add, Remove, GetRing and GetRates take.
+ */
+class JobAccountingSampler final
+{
+public:
+  typedef MetricsRing<JobAccountingSample, 64> Ring;
+
+  explicit JobAccountingSampler(std::chrono::milliseconds aInterval);
+  ~JobAccountingSampler();
+
+  bool Start();
+  void Stop();
+  void SetInterval(std::chrono::milliseconds aInterval);
+
+  bool Add(uint32_t aId, JobAccountingSource* aSource);
+  // Once Remove returns, the sampler no longer references the source. Waits
+  // for the source's query if one is in progress, so must not be called from
+  // QueryAccounting.
+  void Remove(uint32_t aId);
+
+  // Samples every source immediately on the calling thread
+  void SampleAll();
+
+  std::shared_ptr<const Ring> GetRing(uint32_t aId) const;
+  /**
+   * Rates between the most recent sample and the one aSpan samples before
+   * it, for the source registered as aId.
+   */
+  bool GetRates(uint32_t aId, JobAccountingRates& aRates,
+                size_t aSpan = 1) const;
+
+  JobAccountingSampler(const JobAccountingSampler&) = delete;
+  JobAccountingSampler& operator=(const JobAccountingSampler&) = delete;
+
+private:
+  struct Registration
+  {
+    JobAccountingSource*  mSource;
+    std::shared_ptr<Ring> mRing;
+    // Set by Remove; the source is not queried once this is
+    std::atomic<bool>     mRemoved;
+  };
+
+  struct Entry
+  {
+    uint32_t                      mId;
+    std::shared_ptr<Registration> mRegistration;
+  };
+
+  void ThreadProc();
+  // Queries aEntries without holding mMutex
+  void Sample(const std::vector<Entry>& aEntries);
+
+  mutable std::mutex        mMutex;
+  // Only one sweep at a time, since each ring has a single writer
+  std::mutex                mSampleMutex;
+  // The registration being queried, which Remove waits for
+  std::atomic<Registration*> mSampling;
+  std::condition_variable   mCondVar;
+  std::chrono::milliseconds mInterval;
+  std::vector<Entry>        mEntries;
+  std::thread               mThread;
+  bool                      mStopping;
+};
+
+} // namespace mozilla
+
+#endif // __JOBACCOUNTING_H
+
@@ -0,0 +1,253 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __JOBLIMITS_H
+#define __JOBLIMITS_H
+
+#include <cstdint>
+#include <optional>
+
+namespace mozilla {
+
+// These mirror the Win32 JOB_OBJECT_* constants so that the translation layer
+// does not depend on windows.h. WindowsSandbox.cpp asserts that they match.
+namespace joblimits {
+
+const uint32_t kLimitWorkingSet           = 0x00000001;
+const uint32_t kLimitProcessTime          = 0x00000002;
+const uint32_t kLimitActiveProcess        = 0x00000008;
+const uint32_t kLimitAffinity             = 0x00000010;
+const uint32_t kLimitPriorityClass        = 0x00000020;
+const uint32_t kLimitProcessMemory        = 0x00000100;
+const uint32_t kLimitJobMemory            = 0x00000200;
+const uint32_t kLimitKillOnJobClose       = 0x00002000;
+const uint32_t kLimitJobReadBytes         = 0x00010000;
+const uint32_t kLimitJobWriteBytes        = 0x00020000;
+
+const uint32_t kCpuRateControlEnable      = 0x1;
+const uint32_t kCpuRateControlWeightBased = 0x2;
+const uint32_t kCpuRateControlHardCap     = 0x4;
+
+const uint32_t kIoRateControlEnable       = 0x1;
+
+const uint32_t kUiLimitHandles            = 0x00000001;
+const uint32_t kUiLimitReadClipboard      = 0x00000002;
+const uint32_t kUiLimitWriteClipboard     = 0x00000004;
+const uint32_t kUiLimitSystemParameters   = 0x00000008;
+const uint32_t kUiLimitDisplaySettings    = 0x00000010;
+const uint32_t kUiLimitGlobalAtoms        = 0x00000020;
+const uint32_t kUiLimitDesktop            = 0x00000040;
+const uint32_t kUiLimitExitWindows        = 0x00000080;
+const uint32_t kUiLimitAll                = 0x000000FF;
+
+const uint32_t kMsgEndOfProcessTime       = 2;
+const uint32_t kMsgActiveProcessLimit     = 3;
+const uint32_t kMsgProcessMemoryLimit     = 9;
+const uint32_t kMsgJobMemoryLimit         = 10;
+const uint32_t kMsgNotificationLimit      = 11;
+
+const uint32_t kMaxCpuRate                = 10000;
+const uint32_t kMinCpuWeight              = 1;
+const uint32_t kMaxCpuWeight              = 9;
+
+} // namespace joblimits
+
+/**
+ * Resource limits for a sandbox's job object. Any field that is left empty
+ * is not limited. Memory values are in bytes, CPU time is in milliseconds and
+ * CPU rates are expressed in hundredths of a percent of the whole machine.
+ */
+struct JobLimits
+{
+  uint32_t                mActiveProcessLimit = 1;
+  std::optional<uint64_t> mProcessMemoryLimit;
+  std::optional<uint64_t> mJobMemoryLimit;
+  std::optional<uint64_t> mMinWorkingSet;
+  std::optional<uint64_t> mMaxWorkingSet;
+  std::optional<uint64_t> mProcessCpuTimeLimitMs;
+  // mCpuRateCap and mCpuWeight are mutually exclusive
+  std::optional<uint32_t> mCpuRateCap;
+  std::optional<uint32_t> mCpuWeight;
+  std::optional<int64_t>  mIoMaxIops;
+  std::optional<int64_t>  mIoMaxBandwidth;
+  // Thresholds that only raise a notification rather than enforcing a limit
+  std::optional<uint64_t> mNotifyJobMemory;
+  std::optional<uint64_t> mNotifyIoReadBytes;
+  std::optional<uint64_t> mNotifyIoWriteBytes;
+  bool                    mKillOnJobClose = false;
+  // To explicitly grant user handles, call UserHandleGrantAccess
+  uint32_t                mUiRestrictions = joblimits::kUiLimitAll;
+};
+
+/**
+ * JobLimitPlan is the flattened form of JobLimits, laid out the way that the
+ * SetInformationJobObject information classes expect it.
+ */
+struct JobLimitPlan
+{
+  // JobObjectExtendedLimitInformation
+  uint32_t  mLimitFlags = joblimits::kLimitActiveProcess;
+  uint32_t  mActiveProcessLimit = 1;
+  int64_t   mPerProcessUserTimeLimit = 0; // 100ns units
+  uint64_t  mMinimumWorkingSetSize = 0;
+  uint64_t  mMaximumWorkingSetSize = 0;
+  uint64_t  mProcessMemoryLimit = 0;
+  uint64_t  mJobMemoryLimit = 0;
+
+  // JobObjectBasicUIRestrictions
+  uint32_t  mUiRestrictions = joblimits::kUiLimitAll;
+
+  // JobObjectCpuRateControlInformation
+  uint32_t  mCpuRateControlFlags = 0;
+  uint32_t  mCpuRateOrWeight = 0;
+
+  // JobObjectIoRateControlInformation
+  uint32_t  mIoRateControlFlags = 0;
+  int64_t   mIoMaxIops = 0;
+  int64_t   mIoMaxBandwidth = 0;
+
+  // JobObjectNotificationLimitInformation
+  uint32_t  mNotificationLimitFlags = 0;
+  uint64_t  mNotifyJobMemoryLimit = 0;
+  uint64_t  mNotifyIoReadBytesLimit = 0;
+  uint64_t  mNotifyIoWriteBytesLimit = 0;
+};
+
+enum JobLimitViolation
+{
+  eViolationNone = 0,
+  eViolationProcessTime,
+  eViolationActiveProcess,
+  eViolationProcessMemory,
+  eViolationJobMemory,
+  eViolationNotificationLimit
+};
+
+struct JobLimitNotification
+{
+  JobLimitViolation mViolation;
+  uint32_t          mProcessId;
+  // For eViolationNotificationLimit, the kLimit* flags that were exceeded
+  uint32_t          mLimitFlags;
+};
+
+/**
+ * Validates aLimits and flattens it into aPlan. Returns false if aLimits
+ * contains an inconsistent or out of range combination of values, in which
+ * case aPlan is left untouched.
+ */
+constexpr bool
+TranslateJobLimits(const JobLimits& aLimits, JobLimitPlan& aPlan)
+{
+  JobLimitPlan plan;
+
+  if (!aLimits.mActiveProcessLimit) {
+    return false;
+  }
+  plan.mActiveProcessLimit = aLimits.mActiveProcessLimit;
+
+  if (aLimits.mProcessMemoryLimit) {
+    plan.mLimitFlags |= joblimits::kLimitProcessMemory;
+    plan.mProcessMemoryLimit = aLimits.mProcessMemoryLimit.value();
+  }
+
+  if (aLimits.mJobMemoryLimit) {
+    plan.mLimitFlags |= joblimits::kLimitJobMemory;
+    plan.mJobMemoryLimit = aLimits.mJobMemoryLimit.value();
+  }
+
+  // The working set bounds may only be set as a pair
+  if (!!aLimits.mMinWorkingSet != !!aLimits.mMaxWorkingSet) {
+    return false;
+  }
+  if (aLimits.mMinWorkingSet) {
+    if (!aLimits.mMinWorkingSet.value() ||
+        aLimits.mMinWorkingSet.value() > aLimits.mMaxWorkingSet.value()) {
+      return false;
+    }
+    plan.mLimitFlags |= joblimits::kLimitWorkingSet;
+    plan.mMinimumWorkingSetSize = aLimits.mMinWorkingSet.value();
+    plan.mMaximumWorkingSetSize = aLimits.mMaxWorkingSet.value();
+  }
+
+  if (aLimits.mProcessCpuTimeLimitMs) {
+    const uint64_t kTicksPerMs = 10000ULL;
+    const uint64_t ms = aLimits.mProcessCpuTimeLimitMs.value();
+    if (!ms || ms > INT64_MAX / kTicksPerMs) {
+      return false;
+    }
+    plan.mLimitFlags |= joblimits::kLimitProcessTime;
+    plan.mPerProcessUserTimeLimit = static_cast<int64_t>(ms * kTicksPerMs);
+  }
+
+  if (aLimits.mCpuRateCap && aLimits.mCpuWeight) {
+    return false;
+  }
+  if (aLimits.mCpuRateCap) {
+    uint32_t rate = aLimits.mCpuRateCap.value();
+    if (!rate || rate > joblimits::kMaxCpuRate) {
+      return false;
+    }
+    plan.mCpuRateControlFlags = joblimits::kCpuRateControlEnable |
+                                joblimits::kCpuRateControlHardCap;
+    plan.mCpuRateOrWeight = rate;
+  } else if (aLimits.mCpuWeight) {
+    uint32_t weight = aLimits.mCpuWeight.value();
+    if (weight < joblimits::kMinCpuWeight ||
+        weight > joblimits::kMaxCpuWeight) {
+      return false;
+    }
+    plan.mCpuRateControlFlags = joblimits::kCpuRateControlEnable |
+                                joblimits::kCpuRateControlWeightBased;
+    plan.mCpuRateOrWeight = weight;
+  }
+
+  if (aLimits.mIoMaxIops || aLimits.mIoMaxBandwidth) {
+    if (aLimits.mIoMaxIops.value_or(0) < 0 ||
+        aLimits.mIoMaxBandwidth.value_or(0) < 0) {
+      return false;
+    }
+    plan.mIoRateControlFlags = joblimits::kIoRateControlEnable;
+    plan.mIoMaxIops = aLimits.mIoMaxIops.value_or(0);
+    plan.mIoMaxBandwidth = aLimits.mIoMaxBandwidth.value_or(0);
+  }
+
+  if (aLimits.mNotifyJobMemory) {
+    plan.mNotificationLimitFlags |= joblimits::kLimitJobMemory;
+    plan.mNotifyJobMemoryLimit = aLimits.mNotifyJobMemory.value();
+  }
+  if (aLimits.mNotifyIoReadBytes) {
+    plan.mNotificationLimitFlags |= joblimits::kLimitJobReadBytes;
+    plan.mNotifyIoReadBytesLimit = aLimits.mNotifyIoReadBytes.value();
+  }
+  if (aLimits.mNotifyIoWriteBytes) {
+    plan.mNotificationLimitFlags |= joblimits::kLimitJobWriteBytes;
+    plan.mNotifyIoWriteBytesLimit = aLimits.mNotifyIoWriteBytes.value();
+  }
+
+  if (aLimits.mKillOnJobClose) {
+    plan.mLimitFlags |= joblimits::kLimitKillOnJobClose;
+  }
+
+  if (aLimits.mUiRestrictions & ~joblimits::kUiLimitAll) {
+    return false;
+  }
+  plan.mUiRestrictions = aLimits.mUiRestrictions;
+
+  aPlan = plan;
+  return true;
+}
+
+/**
+ * Maps a JOB_OBJECT_MSG_* completion port message to the violation that it
+ * reports. Messages that are not limit violations map to eViolationNone.
+ */
+JobLimitViolation TranslateJobMessage(uint32_t aMessage);
+
+} // namespace mozilla
+
+#endif // __JOBLIMITS_H
+
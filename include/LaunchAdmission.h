@@ -0,0 +1,161 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __LAUNCHADMISSION_H
+#define __LAUNCHADMISSION_H
+
+#include "CpuRateControl.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+namespace mozilla {
+
+enum AdmissionResult
+{
+  eAdmissionAdmitted = 0,
+  eAdmissionQueued,
+  // The request would miss its deadline or the queue is full
+  eAdmissionShed
+};
+
+struct AdmissionStats
+{
+  uint32_t  mLimit;
+  uint32_t  mInFlight;
+  size_t    mQueueDepth[ePriorityCount];
+  size_t    mPeakQueueDepth;
+  uint64_t  mAdmitted;
+  // Shed by Submit without being queued
+  uint64_t  mShedOnArrival;
+  // Shed from the queue once their deadline could no longer be met
+  uint64_t  mShedQueued;
+  uint64_t  mLatencyEstimateNs;
+  uint64_t  mBaselineLatencyNs;
+};
+
+/**
+ * Decides when launches may start. At most a limited number of launches run
+ * at once; the rest wait in one FIFO queue per priority class and are started
+ * highest priority first.
+ *
+ * The limit adapts to observed launch latency. Once per window of as many
+ * completions as the current limit, the smoothed latency is compared against
+ * the baseline, which tracks the fastest recent launches: if it exceeds the
+ * baseline by more than the tolerance the host is congested and the limit is
+ * cut multiplicatively, and if the limit was reached while requests were
+ * waiting it grows by one.
+ *
+ * Requests whose deadline cannot be met are shed rather than queued: on
+ * arrival, from the expected time until a slot frees up for them, and while
+ * queued, once even starting immediately would be too late.
+ *
+ * Times are in nanoseconds on any monotonic clock. Not thread-safe; see
+ * LaunchAdmissionGate.
+ */
+class LaunchAdmissionController final
+{
+public:
+  struct Config
+  {
+    uint32_t  mInitialLimit = 4;
+    uint32_t  mMinLimit = 1;
+    uint32_t  mMaxLimit = 256;
+    // Latency above this multiple of the baseline means congestion
+    double    mTolerance = 2.0;
+    // Weight of each sample in the smoothed latency
+    double    mSmoothing = 0.2;
+    // Applied to the limit on congestion
+    double    mBackoff = 0.75;
+    // Requests beyond this many queued are shed
+    size_t    mMaxQueueDepth = 4096;
+  };
+
+  LaunchAdmissionController() : LaunchAdmissionController(Config()) {}
+  explicit LaunchAdmissionController(const Config& aConfig);
+
+  // aDeadlineNs of zero means that the request never expires
+  AdmissionResult Submit(uint64_t aId, SandboxPriority aPriority,
+                         uint64_t aNowNs, uint64_t aDeadlineNs);
+  // Reports that an admitted launch finished after aLatencyNs
+  void Complete(uint64_t aLatencyNs);
+  // Sheds expired requests and admits queued ones while below the limit.
+  // Should be called after Complete and periodically while requests wait.
+  void Dispatch(uint64_t aNowNs, std::vector<uint64_t>& aAdmitted,
+                std::vector<uint64_t>& aShed);
+  // Withdraws a queued request. Returns false if it is not queued.
+  bool Cancel(uint64_t aId);
+
+  AdmissionStats GetStats() const;
+
+private:
+  struct Request
+  {
+    uint64_t  mId;
+    uint64_t  mDeadlineNs;
+  };
+
+  size_t QueuedAtOrAbove(SandboxPriority aPriority) const;
+  void Adapt();
+
+  Config              mConfig;
+  std::deque<Request> mQueues[ePriorityCount];
+  size_t              mQueued;
+  uint32_t            mLimit;
+  uint32_t            mInFlight;
+  double              mLatencyNs;
+  double              mBaselineNs;
+  // The current adaptation window
+  uint32_t            mWindowCompletions;
+  bool                mWindowSaturated;
+  AdmissionStats      mStats;
+};
+
+/**
+ * A thread-safe, blocking front end to LaunchAdmissionController for callers
+ * that launch on their own threads.
+ */
+class LaunchAdmissionGate final
+{
+public:
+  typedef LaunchAdmissionController::Config Config;
+
+  LaunchAdmissionGate() : LaunchAdmissionGate(Config()) {}
+  explicit LaunchAdmissionGate(const Config& aConfig);
+
+  // Blocks until the launch may start. Returns false if it was shed or
+  // aTimeoutMs (zero for none) elapsed first, in which case Leave must not be
+  // called.
+  bool Enter(SandboxPriority aPriority, uint32_t aTimeoutMs);
+  void Leave(uint64_t aLatencyNs);
+
+  AdmissionStats GetStats() const;
+
+  LaunchAdmissionGate(const LaunchAdmissionGate&) = delete;
+  LaunchAdmissionGate& operator=(const LaunchAdmissionGate&) = delete;
+
+private:
+  void DispatchLocked(uint64_t aNowNs);
+
+  mutable std::mutex            mMutex;
+  std::condition_variable       mCondVar;
+  LaunchAdmissionController     mController;
+  uint64_t                      mNextId;
+  std::unordered_set<uint64_t>  mAdmitted;
+  std::unordered_set<uint64_t>  mShed;
+  std::vector<uint64_t>         mAdmittedScratch;
+  std::vector<uint64_t>         mShedScratch;
+};
+
+} // namespace mozilla
+
+#endif // __LAUNCHADMISSION_H
+
@@ -0,0 +1,61 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __LAUNCHBACKEND_H
+#define __LAUNCHBACKEND_H
+
+namespace mozilla {
+
+/**
+ * The operations that a sandbox launch is made of. A backend holds the
+ * objects of one launch: WindowsSandboxLauncher's Win32 backend creates real
+ * tokens, desktops and jobs, while SimulatedLaunchBackend creates stand-ins
+ * so that the launch can be exercised anywhere.
+ *
+ * Steps that return true without doing anything are fine, e.g. when a group
+ * member reuses its group's window station.
+ */
+class LaunchBackend
+{
+public:
+  virtual ~LaunchBackend() {}
+
+  // Run as a task graph; see RunLaunchSequence for their dependencies
+  virtual bool ResolveExecutable() = 0;
+  virtual bool CreateCustomSid() = 0;
+  virtual bool CreateTokens() = 0;
+  virtual bool CreateWindowStation() = 0;
+  // Also denies the custom SID access to the launching thread's desktop
+  virtual bool CreateDesktop() = 0;
+  virtual bool CreateJob() = 0;
+  virtual bool CreateStartupTrace() = 0;
+  virtual bool CreateStartupBlock() = 0;
+  virtual bool ResolveWorkingDirectory() = 0;
+
+  // Run in order once the graph has succeeded
+  virtual bool CreateSuspendedProcess() = 0;
+  virtual bool SetThreadToken() = 0;
+  virtual bool PreResume() = 0;
+  virtual bool ResumeProcess() = 0;
+  // Called if a step after CreateSuspendedProcess fails
+  virtual void TerminateProcess() = 0;
+
+  // Called last. On success the backend hands the sandbox over to its owner;
+  // otherwise it releases whatever the launch created.
+  virtual void Finish(bool aSucceeded) = 0;
+};
+
+/**
+ * Runs a launch against aBackend. If it fails and aFailedStep is given, it
+ * receives the name of the step that failed.
+ */
+bool RunLaunchSequence(LaunchBackend& aBackend, unsigned int aMaxThreads,
+                       const char** aFailedStep = nullptr);
+
+} // namespace mozilla
+
+#endif // __LAUNCHBACKEND_H
+
@@ -0,0 +1,181 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __LINUXSANDBOX_H
+#define __LINUXSANDBOX_H
+
+#if defined(__linux__)
+
+#include "SeccompFilter.h"
+#include "StartupBlock.h"
+#include "UniqueHandle.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace mozilla {
+
+/**
+ * The sandboxed side, with the same life cycle as WindowsSandbox: OnPrivInit
+ * runs while the process still holds every capability in its user namespace,
+ * then the process locks itself down and OnInit runs.
+ */
+class LinuxSandbox
+{
+public:
+  LinuxSandbox() {}
+  virtual ~LinuxSandbox();
+
+  bool Init(int aArgc, char* aArgv[]);
+  void Fini();
+
+  static const std::string_view SWITCH_STARTUP_BLOCK;
+
+protected:
+  virtual bool OnPrivInit() = 0;
+  virtual bool OnInit() = 0;
+  virtual void OnFini() = 0;
+
+  const StartupBlock* GetStartupBlock() const { return mStartupBlock; }
+  // Returns -1 if the launcher passed no such channel
+  int GetChannelFd(uint32_t aKind, uint32_t aNth = 0) const;
+
+private:
+  bool MapStartupBlock(int aFd);
+  bool DropCapabilities();
+  bool InstallSyscallFilter();
+
+  const StartupBlock* mStartupBlock = nullptr;
+};
+
+/**
+ * A user namespace, along with mount and network namespaces owned by it,
+ * that sandboxes join instead of creating their own. Creating namespaces,
+ * mapping IDs into them and tearing them down again dominates launch time,
+ * so sandboxes that may share these namespaces should share a template.
+ * Every sandbox still gets its own PID namespace.
+ */
+class LinuxNamespaceTemplate final
+{
+public:
+  // aInitFlags are LinuxSandboxLauncher::InitFlags
+  static std::shared_ptr<LinuxNamespaceTemplate> Create(uint32_t aInitFlags);
+
+  LinuxNamespaceTemplate(const LinuxNamespaceTemplate&) = delete;
+  LinuxNamespaceTemplate& operator=(const LinuxNamespaceTemplate&) = delete;
+
+private:
+  friend class LinuxSandboxLauncher;
+
+  LinuxNamespaceTemplate() {}
+
+  uint32_t  mInitFlags = 0;
+  UniqueFd  mUserNs;
+  UniqueFd  mMountNs;
+  // Empty if the template shares the launcher's network
+  UniqueFd  mNetNs;
+};
+
+/**
+ * A compiled seccomp filter in a sealed memfd, which any number of sandboxes
+ * install during lockdown without copying or compiling it again.
+ */
+class LinuxSyscallFilter final
+{
+public:
+  static std::shared_ptr<LinuxSyscallFilter> Create(
+    const SeccompProgram& aProgram);
+
+  LinuxSyscallFilter(const LinuxSyscallFilter&) = delete;
+  LinuxSyscallFilter& operator=(const LinuxSyscallFilter&) = delete;
+
+private:
+  friend class LinuxSandboxLauncher;
+
+  LinuxSyscallFilter() {}
+
+  UniqueFd  mProgram;
+  uint64_t  mSize = 0;
+};
+
+/**
+ * Launches a LinuxSandbox with clone3 into fresh user, PID, mount and network
+ * namespaces, or into a LinuxNamespaceTemplate's. The sandbox starts with no
+ * new privileges, no environment and only the descriptors that it was given
+ * through AddChannel, and is killed when the launcher is destroyed.
+ *
+ * Requires Linux 5.11 and unprivileged user namespaces.
+ */
+class LinuxSandboxLauncher
+{
+public:
+  LinuxSandboxLauncher();
+  virtual ~LinuxSandboxLauncher();
+
+  enum InitFlags
+  {
+    eInitNone = 0,
+    // The sandbox keeps the launcher's network namespace
+    eInitShareNetwork = 1,
+  };
+
+  bool Init(uint32_t aInitFlags = eInitNone);
+  // Must be called before Launch, with a template created with the same
+  // flags
+  bool SetNamespaceTemplate(
+    const std::shared_ptr<LinuxNamespaceTemplate>& aTemplate);
+  // The sandbox starts in the cgroup v2 directory aPath, which must already
+  // exist and be delegated to the launcher's user
+  bool SetCgroup(const std::string_view aPath);
+  // The sandbox installs aFilter once it has dropped its capabilities, just
+  // before OnInit
+  bool SetSyscallFilter(const std::shared_ptr<LinuxSyscallFilter>& aFilter);
+  // aFd stays open in the sandbox under the same number
+  bool AddChannel(uint32_t aKind, int aFd, uint64_t aSize);
+  bool Launch(const std::string_view aExecutablePath,
+              const std::vector<std::string>& aArgs);
+  // Returns false if the sandbox is still running after aTimeoutMs
+  bool Wait(unsigned int aTimeoutMs);
+  // The sandbox's exit status once Wait has succeeded: its exit code, or 128
+  // plus the signal that killed it
+  std::optional<int> GetExitStatus() const { return mExitStatus; }
+  bool IsSandboxRunning();
+  bool Kill();
+  pid_t GetPid() const { return mPid; }
+  int GetPidFd() const { return mPidFd.get(); }
+
+  static bool AreUserNamespacesAvailable();
+
+protected:
+  // Called before the sandbox is allowed to run its executable
+  virtual bool PreResume() { return true; }
+
+private:
+  bool CreateStartupBlock(UniqueFd& aBlock);
+  bool Reap(int aOptions);
+
+  uint32_t mInitFlags;
+  std::shared_ptr<LinuxNamespaceTemplate> mTemplate;
+  std::shared_ptr<LinuxSyscallFilter> mSyscallFilter;
+  UniqueFd mCgroup;
+  std::vector<StartupChannel> mChannels;
+  UniqueFd mPidFd;
+  pid_t mPid;
+  std::optional<int> mExitStatus;
+};
+
+} // namespace mozilla
+
+#endif // defined(__linux__)
+
+#endif // __LINUXSANDBOX_H
+
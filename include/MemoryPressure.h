@@ -0,0 +1,133 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __MEMORYPRESSURE_H
+#define __MEMORYPRESSURE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mozilla {
+
+struct HostMemory
+{
+  uint64_t  mTotal;
+  uint64_t  mAvailable;
+};
+
+/**
+ * One sample of a sandbox's memory usage. The CPU time and page fault counters
+ * are cumulative and only serve to detect activity between samples.
+ */
+struct MemoryTelemetry
+{
+  uint32_t  mId;
+  uint64_t  mCommit;
+  uint64_t  mWorkingSet;
+  uint64_t  mCpuTime;
+  uint64_t  mPageFaults;
+};
+
+enum MemoryPressureLevel
+{
+  eMemoryPressureNone = 0,
+  eMemoryPressureLow,
+  eMemoryPressureCritical
+};
+
+enum MemoryActionKind
+{
+  // Empty the sandbox's working set once
+  eMemoryActionTrim = 0,
+  // Cap the sandbox's working set at mWorkingSetLimit
+  eMemoryActionLimit,
+  // Remove a cap that was set by eMemoryActionLimit
+  eMemoryActionRestore
+};
+
+struct MemoryAction
+{
+  uint32_t          mId;
+  MemoryActionKind  mKind;
+  uint64_t          mWorkingSetLimit;
+};
+
+/**
+ * Decides which sandboxes should give up memory when the host runs low.
+ *
+ * Under low pressure, sandboxes that have been idle the longest are trimmed
+ * first, largest working set first among equally idle ones, until the
+ * expected reclaim covers the shortfall. Under critical pressure, the working
+ * sets of the largest sandboxes are also capped, idle ones first. Once
+ * pressure subsides, every cap is removed again.
+ *
+ * Not thread-safe; expected to be driven from a single sampling thread.
+ */
+class MemoryPressurePolicy final
+{
+public:
+  struct Config
+  {
+    // Fractions of total memory that remain available
+    double    mLowWatermark = 0.15;
+    double    mCriticalWatermark = 0.05;
+    double    mReleaseWatermark = 0.25;
+    // A sandbox that has neither run nor faulted for this long is idle
+    uint64_t  mIdleNs = 5000000000ULL;
+    // A trimmed sandbox is not trimmed again for this long
+    uint64_t  mTrimCooldownNs = 10000000000ULL;
+    // Working sets are never capped below this size
+    uint64_t  mMinWorkingSet = 4ULL * 1024 * 1024;
+    // Caps are set to this fraction of the current working set
+    double    mLimitFactor = 0.5;
+  };
+
+  MemoryPressurePolicy() = default;
+  explicit MemoryPressurePolicy(const Config& aConfig)
+    : mConfig(aConfig)
+  {}
+
+  bool Add(uint32_t aId, uint64_t aNowNs);
+  void Remove(uint32_t aId);
+
+  /**
+   * Records aTelemetry and appends the actions to take to aActions. Sandboxes
+   * that are missing from aTelemetry keep their previous state.
+   */
+  void Update(uint64_t aNowNs, const HostMemory& aHost,
+              const std::vector<MemoryTelemetry>& aTelemetry,
+              std::vector<MemoryAction>& aActions);
+
+  MemoryPressureLevel GetLevel() const { return mLevel; }
+  bool IsIdle(uint32_t aId, uint64_t aNowNs) const;
+  size_t Count() const { return mEntries.size(); }
+
+private:
+  struct Entry
+  {
+    uint32_t  mId;
+    uint64_t  mLastActiveNs;
+    uint64_t  mLastTrimNs;
+    uint64_t  mWorkingSet;
+    uint64_t  mCpuTime;
+    uint64_t  mPageFaults;
+    uint64_t  mWorkingSetLimit;
+    bool      mHasSample;
+  };
+
+  MemoryPressureLevel ComputeLevel(const HostMemory& aHost) const;
+  Entry* Find(uint32_t aId);
+
+  Config              mConfig;
+  std::vector<Entry>  mEntries;
+  MemoryPressureLevel mLevel = eMemoryPressureNone;
+};
+
+} // namespace mozilla
+
+#endif // __MEMORYPRESSURE_H
+
@@ -0,0 +1,151 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __METRICSRING_H
+#define __METRICSRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace mozilla {
+
+/**
+ * A fixed-capacity ring of the N most recent values of T. There may only be
+ * one writer, but any number of readers may take snapshots concurrently
+ * without blocking the writer. Each slot is protected by a sequence number;
+ * readers retry (or skip) slots that are overwritten while being copied.
+ *
+ * T is copied word by word through relaxed atomics, so it must be trivially
+ * copyable and a multiple of 8 bytes in size.
+ */
+template <typename T, size_t N>
+class MetricsRing final
+{
+  static_assert(N && !(N & (N - 1)), "N must be a power of two");
+  static_assert(std::is_trivially_copyable<T>::value,
+                "T must be trivially copyable");
+  static_assert(sizeof(T) % sizeof(uint64_t) == 0,
+                "T must be a multiple of 8 bytes");
+
+public:
+  static const size_t kCapacity = N;
+
+  MetricsRing()
+    : mWriteIndex(0)
+  {
+    for (auto&& slot : mSlots) {
+      slot.mSeq.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void Push(const T& aValue)
+  {
+    uint64_t index = mWriteIndex.load(std::memory_order_relaxed);
+    Slot& slot = mSlots[index & (N - 1)];
+
+    // An odd sequence number marks the slot as being written. A completed
+    // write of logical index i leaves (i + 1) * 2 in the slot.
+    slot.mSeq.store(index * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint64_t words[kWords];
+    ::memcpy(words, &aValue, sizeof(T));
+    for (size_t i = 0; i < kWords; ++i) {
+      slot.mWords[i].store(words[i], std::memory_order_relaxed);
+    }
+
+    slot.mSeq.store((index + 1) * 2, std::memory_order_release);
+    mWriteIndex.store(index + 1, std::memory_order_release);
+  }
+
+  // Total number of values ever pushed
+  uint64_t Count() const
+  {
+    return mWriteIndex.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Reads the value that was pushed aAgo pushes before the most recent one.
+   * Returns false if that value is not (or no longer) available.
+   */
+  bool Read(size_t aAgo, T& aOut) const
+  {
+    uint64_t count = Count();
+    if (aAgo >= N || aAgo >= count) {
+      return false;
+    }
+
+    return ReadIndex(count - 1 - aAgo, aOut);
+  }
+
+  /**
+   * Copies up to aMax of the most recent values into aOut, oldest first, and
+   * returns how many were copied.
+   */
+  size_t Snapshot(T* aOut, size_t aMax) const
+  {
+    uint64_t count = Count();
+    uint64_t avail = count < N ? count : N;
+    if (aMax > avail) {
+      aMax = static_cast<size_t>(avail);
+    }
+
+    size_t copied = 0;
+    for (uint64_t index = count - aMax; index < count; ++index) {
+      if (ReadIndex(index, aOut[copied])) {
+        ++copied;
+      }
+    }
+    return copied;
+  }
+
+  MetricsRing(const MetricsRing&) = delete;
+  MetricsRing& operator=(const MetricsRing&) = delete;
+
+private:
+  static const size_t kWords = sizeof(T) / sizeof(uint64_t);
+
+  bool ReadIndex(uint64_t aIndex, T& aOut) const
+  {
+    const Slot& slot = mSlots[aIndex & (N - 1)];
+    const uint64_t expected = (aIndex + 1) * 2;
+
+    if (slot.mSeq.load(std::memory_order_acquire) != expected) {
+      return false;
+    }
+
+    uint64_t words[kWords];
+    for (size_t i = 0; i < kWords; ++i) {
+      words[i] = slot.mWords[i].load(std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.mSeq.load(std::memory_order_relaxed) != expected) {
+      // The writer lapped us while we were copying
+      return false;
+    }
+
+    ::memcpy(&aOut, words, sizeof(T));
+    return true;
+  }
+
+  struct Slot
+  {
+    std::atomic<uint64_t> mSeq;
+    std::atomic<uint64_t> mWords[kWords];
+  };
+
+  std::atomic<uint64_t> mWriteIndex;
+  Slot                  mSlots[N];
+};
+
+} // namespace mozilla
+
+#endif // __METRICSRING_H
+
@@ -0,0 +1,95 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __MITIGATIONFLAGS_H
+#define __MITIGATIONFLAGS_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mozilla {
+
+/**
+ * Portable copies of the PROCESS_CREATION_MITIGATION_POLICY_* and
+ * PROCESS_CREATION_MITIGATION_POLICY2_* flags. The first group lives in the
+ * first DWORD64 of the mitigation policy attribute, the second group in the
+ * second. WindowsSandbox.cpp asserts that these match the SDK.
+ */
+namespace mitigation {
+
+const uint64_t kDepEnable                     = 0x01ULL;
+const uint64_t kDepAtlThunkEnable             = 0x02ULL;
+const uint64_t kSehopEnable                   = 0x04ULL;
+const uint64_t kForceRelocateImages           = 0x01ULL << 8;
+const uint64_t kForceRelocateImagesReqRelocs  = 0x03ULL << 8;
+const uint64_t kHeapTerminate                 = 0x01ULL << 12;
+const uint64_t kBottomUpAslr                  = 0x01ULL << 16;
+const uint64_t kHighEntropyAslr               = 0x01ULL << 20;
+const uint64_t kStrictHandleChecks            = 0x01ULL << 24;
+const uint64_t kWin32kSystemCallDisable       = 0x01ULL << 28;
+const uint64_t kExtensionPointDisable         = 0x01ULL << 32;
+const uint64_t kProhibitDynamicCode           = 0x01ULL << 36;
+const uint64_t kControlFlowGuard              = 0x01ULL << 40;
+const uint64_t kBlockNonMicrosoftBinaries     = 0x01ULL << 44;
+const uint64_t kFontDisable                   = 0x01ULL << 48;
+const uint64_t kImageLoadNoRemote             = 0x01ULL << 52;
+const uint64_t kImageLoadNoLowLabel           = 0x01ULL << 56;
+const uint64_t kImageLoadPreferSystem32       = 0x01ULL << 60;
+
+// Second word
+const uint64_t kLoaderIntegrityContinuity     = 0x01ULL << 4;
+const uint64_t kStrictControlFlowGuard        = 0x01ULL << 8;
+const uint64_t kModuleTamperingProtection     = 0x01ULL << 12;
+const uint64_t kRestrictIndirectBranchPrediction = 0x01ULL << 16;
+const uint64_t kAllowDowngradeDynamicCode     = 0x01ULL << 20;
+const uint64_t kSpeculativeStoreBypassDisable = 0x01ULL << 24;
+const uint64_t kCetUserShadowStacks           = 0x01ULL << 28;
+
+struct Name
+{
+  const char* mName;
+  uint32_t    mWord;
+  uint64_t    mValue;
+};
+
+// Names as they appear in textual policies, i.e. without the
+// PROCESS_CREATION_MITIGATION_POLICY(2)_ prefix and _ALWAYS_ON suffix.
+constexpr Name kNames[] = {
+  {"DEP_ENABLE",                            0, kDepEnable},
+  {"DEP_ATL_THUNK_ENABLE",                  0, kDepAtlThunkEnable},
+  {"SEHOP_ENABLE",                          0, kSehopEnable},
+  {"FORCE_RELOCATE_IMAGES",                 0, kForceRelocateImages},
+  {"FORCE_RELOCATE_IMAGES_REQ_RELOCS",      0, kForceRelocateImagesReqRelocs},
+  {"HEAP_TERMINATE",                        0, kHeapTerminate},
+  {"BOTTOM_UP_ASLR",                        0, kBottomUpAslr},
+  {"HIGH_ENTROPY_ASLR",                     0, kHighEntropyAslr},
+  {"STRICT_HANDLE_CHECKS",                  0, kStrictHandleChecks},
+  {"WIN32K_SYSTEM_CALL_DISABLE",            0, kWin32kSystemCallDisable},
+  {"EXTENSION_POINT_DISABLE",               0, kExtensionPointDisable},
+  {"PROHIBIT_DYNAMIC_CODE",                 0, kProhibitDynamicCode},
+  {"CONTROL_FLOW_GUARD",                    0, kControlFlowGuard},
+  {"BLOCK_NON_MICROSOFT_BINARIES",          0, kBlockNonMicrosoftBinaries},
+  {"FONT_DISABLE",                          0, kFontDisable},
+  {"IMAGE_LOAD_NO_REMOTE",                  0, kImageLoadNoRemote},
+  {"IMAGE_LOAD_NO_LOW_LABEL",               0, kImageLoadNoLowLabel},
+  {"IMAGE_LOAD_PREFER_SYSTEM32",            0, kImageLoadPreferSystem32},
+  {"LOADER_INTEGRITY_CONTINUITY",           1, kLoaderIntegrityContinuity},
+  {"STRICT_CONTROL_FLOW_GUARD",             1, kStrictControlFlowGuard},
+  {"MODULE_TAMPERING_PROTECTION",           1, kModuleTamperingProtection},
+  {"RESTRICT_INDIRECT_BRANCH_PREDICTION",   1, kRestrictIndirectBranchPrediction},
+  {"ALLOW_DOWNGRADE_DYNAMIC_CODE_POLICY",   1, kAllowDowngradeDynamicCode},
+  {"SPECULATIVE_STORE_BYPASS_DISABLE",      1, kSpeculativeStoreBypassDisable},
+  {"CET_USER_SHADOW_STACKS",                1, kCetUserShadowStacks},
+};
+
+constexpr size_t kNameCount = sizeof(kNames) / sizeof(kNames[0]);
+
+} // namespace mitigation
+
+} // namespace mozilla
+
+#endif // __MITIGATIONFLAGS_H
+
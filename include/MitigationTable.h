@@ -0,0 +1,192 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __MITIGATIONTABLE_H
+#define __MITIGATIONTABLE_H
+
+#include "MitigationFlags.h"
+
+#include <cstdint>
+
+namespace mozilla {
+
+// Portable copy of the PROCESS_MITIGATION_POLICY values that we apply at
+// runtime. WindowsSandbox.cpp asserts that these match the SDK.
+enum MitigationPolicyKind : uint32_t
+{
+  eMitigationDep                    = 0,
+  eMitigationAslr                   = 1,
+  eMitigationDynamicCode            = 2,
+  eMitigationStrictHandleCheck      = 3,
+  eMitigationSystemCallDisable      = 4,
+  eMitigationExtensionPointDisable  = 6,
+  eMitigationControlFlowGuard       = 7,
+  eMitigationSignature              = 8,
+  eMitigationFontDisable            = 9,
+  eMitigationImageLoad              = 10,
+  eMitigationSideChannelIsolation   = 14,
+  eMitigationKindCount              = 16,
+  // The creation flag may only be specified when the process is created
+  eMitigationCreationOnly           = 0xFFFFFFFF
+};
+
+enum MitigationMappingAttribute : uint32_t
+{
+  // The flag is meaningless in 32-bit processes
+  eMitigationRequires64Bit          = 0x1,
+  // The flag is implicitly enforced in 64-bit processes
+  eMitigationImplicitIn64Bit        = 0x2
+};
+
+/**
+ * Maps a set of PROCESS_CREATION_MITIGATION_POLICY(2)_* flags onto the bits
+ * of the corresponding PROCESS_MITIGATION_*_POLICY structure. Every bit of
+ * mCreationFlags must be set for the mapping to apply.
+ */
+struct MitigationMapping
+{
+  uint32_t  mWord;
+  uint64_t  mCreationFlags;
+  uint32_t  mKind;
+  uint32_t  mRuntimeFlags;
+  uint32_t  mAttributes;
+};
+
+constexpr MitigationMapping kMitigationMappings[] = {
+  // PROCESS_MITIGATION_DEP_POLICY: Enable, DisableAtlThunkEmulation
+  {0, mitigation::kDepEnable, eMitigationDep, 0x1, eMitigationImplicitIn64Bit},
+  {0, mitigation::kDepAtlThunkEnable, eMitigationDep, 0x2,
+   eMitigationImplicitIn64Bit},
+  {0, mitigation::kSehopEnable, eMitigationCreationOnly, 0, 0},
+  // PROCESS_MITIGATION_ASLR_POLICY: EnableBottomUpRandomization,
+  // EnableForceRelocateImages, EnableHighEntropy, DisallowStrippedImages
+  {0, mitigation::kForceRelocateImages, eMitigationAslr, 0x2, 0},
+  {0, mitigation::kForceRelocateImagesReqRelocs, eMitigationAslr, 0x8, 0},
+  {0, mitigation::kHeapTerminate, eMitigationCreationOnly, 0, 0},
+  {0, mitigation::kBottomUpAslr, eMitigationAslr, 0x1, 0},
+  // High entropy ASLR comes from the 64-bit image itself
+  {0, mitigation::kHighEntropyAslr, eMitigationAslr, 0x4,
+   eMitigationRequires64Bit | eMitigationImplicitIn64Bit},
+  // PROCESS_MITIGATION_STRICT_HANDLE_CHECK_POLICY:
+  // RaiseExceptionOnInvalidHandleReference, HandleExceptionsPermanentlyEnabled
+  {0, mitigation::kStrictHandleChecks, eMitigationStrictHandleCheck, 0x3, 0},
+  // PROCESS_MITIGATION_SYSTEM_CALL_DISABLE_POLICY: DisallowWin32kSystemCalls
+  {0, mitigation::kWin32kSystemCallDisable, eMitigationSystemCallDisable, 0x1,
+   0},
+  // PROCESS_MITIGATION_EXTENSION_POINT_DISABLE_POLICY: DisableExtensionPoints
+  {0, mitigation::kExtensionPointDisable, eMitigationExtensionPointDisable,
+   0x1, 0},
+  // PROCESS_MITIGATION_DYNAMIC_CODE_POLICY: ProhibitDynamicCode
+  {0, mitigation::kProhibitDynamicCode, eMitigationDynamicCode, 0x1, 0},
+  // Control flow guard can only be enabled for images loaded at creation
+  {0, mitigation::kControlFlowGuard, eMitigationCreationOnly, 0, 0},
+  // PROCESS_MITIGATION_BINARY_SIGNATURE_POLICY: MicrosoftSignedOnly
+  {0, mitigation::kBlockNonMicrosoftBinaries, eMitigationSignature, 0x1, 0},
+  // PROCESS_MITIGATION_FONT_DISABLE_POLICY: DisableNonSystemFonts
+  {0, mitigation::kFontDisable, eMitigationFontDisable, 0x1, 0},
+  // PROCESS_MITIGATION_IMAGE_LOAD_POLICY: NoRemoteImages,
+  // NoLowMandatoryLabelImages, PreferSystem32Images
+  {0, mitigation::kImageLoadNoRemote, eMitigationImageLoad, 0x1, 0},
+  {0, mitigation::kImageLoadNoLowLabel, eMitigationImageLoad, 0x2, 0},
+  {0, mitigation::kImageLoadPreferSystem32, eMitigationImageLoad, 0x4, 0},
+  {1, mitigation::kLoaderIntegrityContinuity, eMitigationCreationOnly, 0, 0},
+  {1, mitigation::kStrictControlFlowGuard, eMitigationCreationOnly, 0, 0},
+  {1, mitigation::kModuleTamperingProtection, eMitigationCreationOnly, 0, 0},
+  {1, mitigation::kRestrictIndirectBranchPrediction, eMitigationCreationOnly,
+   0, 0},
+  // PROCESS_MITIGATION_DYNAMIC_CODE_POLICY: AllowRemoteDowngrade
+  {1, mitigation::kAllowDowngradeDynamicCode, eMitigationDynamicCode, 0x4, 0},
+  // PROCESS_MITIGATION_SIDE_CHANNEL_ISOLATION_POLICY:
+  // SpeculativeStoreBypassDisable
+  {1, mitigation::kSpeculativeStoreBypassDisable,
+   eMitigationSideChannelIsolation, 0x8, 0},
+  {1, mitigation::kCetUserShadowStacks, eMitigationCreationOnly, 0, 0},
+};
+
+constexpr size_t kMitigationMappingCount =
+  sizeof(kMitigationMappings) / sizeof(kMitigationMappings[0]);
+
+// Size of the PROCESS_MITIGATION_*_POLICY structure for aKind. Only the DEP
+// policy carries anything beyond its DWORD of flags.
+constexpr uint32_t
+GetMitigationPolicySize(uint32_t aKind)
+{
+  return aKind == eMitigationDep ? 8 : 4;
+}
+
+/**
+ * The runtime policies needed to apply a pair of creation flag words, one
+ * entry per MitigationPolicyKind that is present in mKinds.
+ */
+struct MitigationPlan
+{
+  uint32_t  mKinds;
+  uint32_t  mRuntimeFlags[eMitigationKindCount];
+  // Creation flags that cannot be applied to a running process
+  uint64_t  mUnsupported[2];
+};
+
+/**
+ * Builds the plan for aFlags. Returns false if any flag cannot be applied at
+ * runtime, in which case aPlan.mUnsupported identifies the offending flags.
+ */
+constexpr bool
+PlanMitigations(const uint64_t (&aFlags)[2], bool aIs64Bit,
+                MitigationPlan& aPlan)
+{
+  aPlan = MitigationPlan{};
+
+  uint64_t handled[2] = {};
+  for (auto&& mapping : kMitigationMappings) {
+    const uint64_t flags = aFlags[mapping.mWord];
+    if ((flags & mapping.mCreationFlags) != mapping.mCreationFlags) {
+      continue;
+    }
+
+    if (mapping.mKind == eMitigationCreationOnly ||
+        (!aIs64Bit && (mapping.mAttributes & eMitigationRequires64Bit))) {
+      continue;
+    }
+
+    handled[mapping.mWord] |= mapping.mCreationFlags;
+    if (aIs64Bit && (mapping.mAttributes & eMitigationImplicitIn64Bit)) {
+      // Nothing to do, and the OS rejects attempts to set it anyway
+      continue;
+    }
+
+    aPlan.mKinds |= 1U << mapping.mKind;
+    aPlan.mRuntimeFlags[mapping.mKind] |= mapping.mRuntimeFlags;
+  }
+
+  aPlan.mUnsupported[0] = aFlags[0] & ~handled[0];
+  aPlan.mUnsupported[1] = aFlags[1] & ~handled[1];
+  return !aPlan.mUnsupported[0] && !aPlan.mUnsupported[1];
+}
+
+struct MitigationResult
+{
+  uint32_t  mKind;
+  uint32_t  mRuntimeFlags;
+  // Win32 error code, or zero on success
+  uint32_t  mError;
+  // The OS does not support this policy, so it was not attempted
+  bool      mSkipped;
+  uint64_t  mDurationNs;
+};
+
+struct MitigationReport
+{
+  uint32_t          mCount;
+  uint32_t          mFailures;
+  uint64_t          mProbeNs;
+  uint64_t          mTotalNs;
+  MitigationResult  mResults[eMitigationKindCount];
+};
+
+} // namespace mozilla
+
+#endif // __MITIGATIONTABLE_H
+
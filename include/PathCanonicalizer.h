@@ -0,0 +1,92 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __PATHCANONICALIZER_H
+#define __PATHCANONICALIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace mozilla {
+
+namespace pathcanon {
+
+// Paths at least this long need the \\?\ prefix to be used with Win32 APIs
+const size_t kMaxPath     = 260;
+// The longest path that the object manager accepts
+const size_t kMaxLongPath = 32767;
+
+} // namespace pathcanon
+
+enum PathKind
+{
+  ePathInvalid = 0,
+  // C:\dir
+  ePathDriveAbsolute,
+  // C:dir, relative to the current directory of drive C:
+  ePathDriveRelative,
+  // \dir, relative to the root of the current drive or share
+  ePathRooted,
+  // dir
+  ePathRelative,
+  // \\server\share\dir
+  ePathUnc,
+  // \\?\C:\dir, passed to the file system verbatim
+  ePathLongDrive,
+  // \\?\UNC\server\share\dir, passed to the file system verbatim
+  ePathLongUnc,
+  // \\.\device and any other \\?\ form
+  ePathDevice
+};
+
+PathKind ClassifyPath(std::wstring_view aPath);
+
+struct PathContext
+{
+  // Must be absolute: a drive, UNC or long path
+  std::wstring_view mCurrentDirectory;
+  // Returns the current directory of a drive other than the current one. If
+  // this is empty or returns nothing, the root of that drive is used.
+  std::function<std::optional<std::wstring>(wchar_t aDrive)> mDriveDirectory;
+};
+
+enum CanonicalizeFlags : uint32_t
+{
+  eCanonNormal = 0,
+  // Append the default extension if the last component has none
+  eCanonDefaultExtension = 1,
+  // Use the \\?\ form for results that are too long for MAX_PATH
+  eCanonLongPathPrefix = 2
+};
+
+/**
+ * Resolves aPath against aContext the way that GetFullPathName does: forward
+ * slashes become backslashes, repeated separators, "." and ".." segments are
+ * collapsed (never above the drive or share root), and trailing dots and
+ * spaces are stripped from the last component. Long (\\?\) paths are left
+ * verbatim, but may not contain "." or ".." segments.
+ *
+ * Unlike GetFullPathName, this rejects anything that would be ambiguous when
+ * it reaches the file system: device paths, empty UNC server or share names,
+ * wildcards and other characters that are invalid in file names, alternate
+ * data streams, and intermediate components with trailing dots or spaces.
+ *
+ * The result is composed and normalized in place in aOut, whose capacity is
+ * reused, so a caller that keeps aOut around does not allocate. Returns false
+ * and leaves aOut unspecified if aPath cannot be canonicalized.
+ */
+bool CanonicalizePath(std::wstring_view aPath, const PathContext& aContext,
+                      std::wstring& aOut, uint32_t aFlags = eCanonNormal,
+                      std::wstring_view aDefaultExtension = L"exe");
+
+} // namespace mozilla
+
+#endif // __PATHCANONICALIZER_H
+
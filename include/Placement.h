@@ -0,0 +1,119 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __PLACEMENT_H
+#define __PLACEMENT_H
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace mozilla {
+
+struct LogicalProcessor
+{
+  // Processor group, and this processor's bit within the group's affinity
+  uint16_t  mGroup;
+  uint8_t   mNumber;
+  uint32_t  mNode;
+  // SMT siblings share the same mCore
+  uint32_t  mCore;
+};
+
+typedef std::vector<LogicalProcessor> PlacementTopology;
+
+enum PlacementPolicy : uint32_t
+{
+  // Use the least loaded NUMA node
+  ePlacementSpread = 0,
+  // Fill partially loaded nodes first so that others may stay idle
+  ePlacementPack,
+  // Take idle processors for the sandbox's exclusive use
+  ePlacementDedicated
+};
+
+struct PlacementRequest
+{
+  PlacementPolicy mPolicy = ePlacementSpread;
+  uint32_t        mProcessors = 1;
+};
+
+/**
+ * Where a sandbox should run: a set of logical processors that all belong to
+ * the same processor group and NUMA node.
+ */
+struct Placement
+{
+  uint32_t        mId = 0;
+  PlacementPolicy mPolicy = ePlacementSpread;
+  uint16_t        mGroup = 0;
+  uint32_t        mNode = 0;
+  uint64_t        mAffinity = 0;
+};
+
+/**
+ * Assigns sandboxes to processors based on how many sandboxes already share
+ * each processor and on its most recently reported load. Placements never
+ * span NUMA nodes or processor groups, so that a sandbox's memory stays local
+ * and its affinity fits in a single job object limit. Thread-safe.
+ */
+class PlacementScheduler final
+{
+public:
+  explicit PlacementScheduler(const PlacementTopology& aTopology);
+
+  bool Place(const PlacementRequest& aRequest, Placement& aPlacement);
+  bool Release(const Placement& aPlacement);
+
+  // aLoad is the fraction of time that processor aIndex (an index into the
+  // topology) was busy, from 0.0 to 1.0.
+  void SetLoad(size_t aIndex, double aLoad);
+
+  size_t GetProcessorCount() const { return mTopology.size(); }
+  uint32_t GetAssignedCount(size_t aIndex) const;
+  size_t GetPlacementCount() const;
+
+  PlacementScheduler(const PlacementScheduler&) = delete;
+  PlacementScheduler& operator=(const PlacementScheduler&) = delete;
+
+private:
+  struct ProcessorState
+  {
+    double    mLoad = 0.0;
+    uint32_t  mAssigned = 0;
+    uint32_t  mCore = 0;
+    bool      mDedicated = false;
+  };
+
+  // The processors of one NUMA node within one processor group
+  struct Domain
+  {
+    uint16_t            mGroup;
+    uint32_t            mNode;
+    std::vector<size_t> mProcessors;
+  };
+
+  double GetCost(size_t aIndex) const;
+  bool IsAvailable(size_t aIndex, PlacementPolicy aPolicy) const;
+  bool Choose(const Domain& aDomain, const PlacementRequest& aRequest,
+              std::vector<size_t>& aChosen) const;
+  const Domain* ChooseDomain(const PlacementRequest& aRequest,
+                             std::vector<size_t>& aChosen) const;
+
+  const PlacementTopology mTopology;
+  std::vector<Domain>     mDomains;
+  mutable std::mutex      mMutex;
+  std::vector<ProcessorState> mState;
+  std::vector<uint32_t>   mCoreAssigned;
+  std::unordered_map<uint32_t, std::vector<size_t>> mPlacements;
+  uint32_t                mNextId = 1;
+};
+
+} // namespace mozilla
+
+#endif // __PLACEMENT_H
+
@@ -0,0 +1,41 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __POLICYCOMPILER_H
+#define __POLICYCOMPILER_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mozilla {
+
+/**
+ * Compiles textual sandbox policies into the binary format described in
+ * SandboxPolicy.h. The source consists of one or more sections:
+ *
+ *   # Comment
+ *   [gmp]
+ *   init_flags = no_separate_window_station
+ *   mitigations = DEP_ENABLE | BOTTOM_UP_ASLR | STRICT_HANDLE_CHECKS
+ *   deferred_mitigations = WIN32K_SYSTEM_CALL_DISABLE
+ *   restricting_sids = everyone, users, restricted, logon, custom
+ *   ui_restrictions = all
+ *   job_memory_limit = 512M
+ *   cpu_weight = 5
+ *   init_function = INITIALIZE_CDM_MODULE
+ *
+ * Mitigation names are those in MitigationFlags.h. Sizes accept K, M and G
+ * suffixes. On failure, aError describes the first problem encountered.
+ */
+bool CompilePolicies(std::string_view aSource, std::vector<uint8_t>& aOutput,
+                     std::string& aError);
+
+} // namespace mozilla
+
+#endif // __POLICYCOMPILER_H
+
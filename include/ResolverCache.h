@@ -0,0 +1,75 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __RESOLVERCACHE_H
+#define __RESOLVERCACHE_H
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+namespace mozilla {
+
+/**
+ * Remembers the results of path lookups that do not change for the lifetime
+ * of a user's session: the sandbox working directory for each user SID, and
+ * the absolute form of each executable path.
+ *
+ * Lookups are performed by the caller's resolver outside of the cache's lock,
+ * so two threads that miss on the same key may both resolve it. Failures are
+ * never cached. A result that was being resolved while the cache was
+ * invalidated is returned but not stored.
+ */
+class ResolverCache final
+{
+public:
+  typedef std::function<std::optional<std::wstring>()> Resolver;
+
+  struct Stats
+  {
+    uint64_t  mHits;
+    uint64_t  mMisses;
+    size_t    mEntries;
+  };
+
+  ResolverCache() = default;
+
+  std::optional<std::wstring> GetWorkingDirectory(const std::wstring& aUserSid,
+                                                  const Resolver& aResolver);
+  // aKey must identify everything that the result depends upon, e.g. the
+  // current directory for a relative path.
+  std::optional<std::wstring> GetAbsolutePath(const std::wstring& aKey,
+                                              const Resolver& aResolver);
+
+  void InvalidateUser(const std::wstring& aUserSid);
+  void InvalidateAll();
+
+  Stats GetStats() const;
+
+  ResolverCache(const ResolverCache&) = delete;
+  ResolverCache& operator=(const ResolverCache&) = delete;
+
+private:
+  typedef std::unordered_map<std::wstring, std::wstring> Map;
+
+  std::optional<std::wstring> Lookup(Map& aMap, const std::wstring& aKey,
+                                     const Resolver& aResolver);
+
+  mutable std::mutex  mMutex;
+  Map                 mWorkingDirectories;
+  Map                 mAbsolutePaths;
+  uint64_t            mGeneration = 0;
+  uint64_t            mHits = 0;
+  uint64_t            mMisses = 0;
+};
+
+} // namespace mozilla
+
+#endif // __RESOLVERCACHE_H
+
@@ -0,0 +1,341 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __RINGCHANNEL_H
+#define __RINGCHANNEL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace mozilla {
+
+/**
+ * The indices of one single-producer/single-consumer ring. Each index is
+ * only ever written by one side, and sits on a cache line of its own so that
+ * the two sides do not contend for it. Both count bytes since the ring was
+ * laid out, and never wrap.
+ */
+struct RingControl
+{
+  static constexpr size_t kCacheLine = 64;
+
+  alignas(kCacheLine) std::atomic<uint64_t> mWritten;
+  alignas(kCacheLine) std::atomic<uint64_t> mRead;
+};
+
+enum RingDirection : uint32_t
+{
+  eRingToSandbox = 0,
+  eRingToLauncher,
+  eRingDirectionCount
+};
+
+/**
+ * The start of a section that holds a RingChannel: one ring per direction,
+ * whose data follows the header back to back.
+ */
+struct RingChannelHeader
+{
+  static constexpr uint32_t kMagic = 0x47524253; // "SBRG"
+  static constexpr uint32_t kVersion = 1;
+
+  uint32_t    mMagic;
+  uint32_t    mVersion;
+  // Of each ring's data, in bytes
+  uint32_t    mRingSize;
+  uint32_t    mReserved;
+  RingControl mRings[eRingDirectionCount];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+              std::is_standard_layout<RingChannelHeader>::value,
+              "RingChannelHeader must be usable in place from shared memory");
+static_assert(sizeof(RingChannelHeader) % RingControl::kCacheLine == 0,
+              "Ring data must start on a cache line");
+
+/**
+ * Each message is a 32-bit length followed by its payload, padded to 8
+ * bytes. A message never straddles the end of a ring; the rest of the ring
+ * is skipped with kRingWrap instead.
+ */
+const uint32_t kRingWrap = UINT32_MAX;
+const uint32_t kRingRecordAlignment = 8;
+
+inline uint64_t
+GetRingRecordSize(uint32_t aLength)
+{
+  return (uint64_t(aLength) + sizeof(uint32_t) + kRingRecordAlignment - 1) &
+         ~uint64_t(kRingRecordAlignment - 1);
+}
+
+/**
+ * Appends messages to one ring. Messages are staged until Flush publishes
+ * them all with a single store, and the consumer's index is only read when
+ * the ring looks full.
+ */
+class RingWriter final
+{
+public:
+  RingWriter()
+    : mControl(nullptr)
+    , mData(nullptr)
+    , mSize(0)
+    , mWritten(0)
+    , mPublished(0)
+    , mReadCache(0)
+    , mBroken(true)
+  {
+  }
+
+  void Init(RingControl* aControl, uint8_t* aData, uint32_t aSize)
+  {
+    mControl = aControl;
+    mData = aData;
+    mSize = aSize;
+    mWritten = mPublished = aControl->mWritten.load(std::memory_order_relaxed);
+    mReadCache = mWritten;
+    mBroken = false;
+  }
+
+  // Large enough to always fit once the consumer has caught up
+  uint32_t GetMaxMessageSize() const
+  {
+    return mSize / 2 - sizeof(uint32_t);
+  }
+
+  /**
+   * Stages a message. Returns false if the ring has no room for it, in which
+   * case the caller should Flush and try again once the consumer has read,
+   * or if it is larger than GetMaxMessageSize or the ring is broken.
+   */
+  bool Write(const void* aData, uint32_t aLength)
+  {
+    if (mBroken || aLength > GetMaxMessageSize()) {
+      return false;
+    }
+
+    const uint64_t record = GetRingRecordSize(aLength);
+    const uint32_t offset = static_cast<uint32_t>(mWritten & (mSize - 1));
+    const uint32_t tail = mSize - offset;
+    const uint64_t needed = record + (record > tail ? tail : 0);
+    if (mWritten + needed - mReadCache > mSize && !RefreshReadCache(needed)) {
+      return false;
+    }
+
+    uint8_t* dest = mData + offset;
+    if (record > tail) {
+      ::memcpy(dest, &kRingWrap, sizeof(kRingWrap));
+      mWritten += tail;
+      dest = mData;
+    }
+    ::memcpy(dest, &aLength, sizeof(aLength));
+    ::memcpy(dest + sizeof(aLength), aData, aLength);
+    mWritten += record;
+    return true;
+  }
+
+  // Makes every staged message visible to the consumer
+  void Flush()
+  {
+    if (mWritten != mPublished) {
+      mControl->mWritten.store(mWritten, std::memory_order_release);
+      mPublished = mWritten;
+    }
+  }
+
+  // Bytes staged or published but not yet read, as of the last refresh
+  uint64_t GetPendingBytes() const { return mWritten - mReadCache; }
+  // The consumer moved its index somewhere impossible
+  bool IsBroken() const { return mBroken; }
+
+  RingWriter(const RingWriter&) = delete;
+  RingWriter& operator=(const RingWriter&) = delete;
+
+private:
+  bool RefreshReadCache(uint64_t aNeeded)
+  {
+    uint64_t read = mControl->mRead.load(std::memory_order_acquire);
+    // The other side is untrusted
+    if (read < mReadCache || read > mPublished) {
+      mBroken = true;
+      return false;
+    }
+    mReadCache = read;
+    return mWritten + aNeeded - mReadCache <= mSize;
+  }
+
+  RingControl*  mControl;
+  uint8_t*      mData;
+  uint32_t      mSize;
+  // Including staged messages
+  uint64_t      mWritten;
+  uint64_t      mPublished;
+  uint64_t      mReadCache;
+  bool          mBroken;
+};
+
+/**
+ * Takes messages from one ring. The producer's index is only read once
+ * everything up to the last known one has been consumed, and the consumer's
+ * index is published once per batch.
+ */
+class RingReader final
+{
+public:
+  RingReader()
+    : mControl(nullptr)
+    , mData(nullptr)
+    , mSize(0)
+    , mRead(0)
+    , mWrittenCache(0)
+    , mBroken(true)
+  {
+  }
+
+  void Init(RingControl* aControl, uint8_t* aData, uint32_t aSize)
+  {
+    mControl = aControl;
+    mData = aData;
+    mSize = aSize;
+    mRead = mWrittenCache = aControl->mRead.load(std::memory_order_relaxed);
+    mBroken = false;
+  }
+
+  /**
+   * Passes up to aMaxMessages published messages, or all of them if zero, to
+   * aHandler(const uint8_t* aPayload, uint32_t aLength) in place, and returns
+   * how many there were. Payloads live in shared memory that the other side
+   * may still scribble over, so aHandler must copy anything that it
+   * validates before using it. A malformed ring breaks the reader.
+   */
+  template <typename Handler>
+  size_t Read(Handler&& aHandler, size_t aMaxMessages = 0)
+  {
+    if (mBroken) {
+      return 0;
+    }
+    if (mRead == mWrittenCache && !RefreshWrittenCache()) {
+      return 0;
+    }
+
+    const uint64_t start = mRead;
+    size_t count = 0;
+    while (mRead != mWrittenCache && (!aMaxMessages || count < aMaxMessages)) {
+      const uint32_t offset = static_cast<uint32_t>(mRead & (mSize - 1));
+      uint32_t length;
+      ::memcpy(&length, mData + offset, sizeof(length));
+      if (length == kRingWrap) {
+        if (mWrittenCache - mRead < mSize - offset) {
+          mBroken = true;
+          break;
+        }
+        mRead += mSize - offset;
+        continue;
+      }
+
+      const uint64_t record = GetRingRecordSize(length);
+      if (length > mSize / 2 - sizeof(uint32_t) ||
+          offset + record > mSize || mWrittenCache - mRead < record) {
+        mBroken = true;
+        break;
+      }
+      aHandler(mData + offset + sizeof(length), length);
+      mRead += record;
+      ++count;
+    }
+
+    if (mRead != start) {
+      mControl->mRead.store(mRead, std::memory_order_release);
+    }
+    return count;
+  }
+
+  // Whether a Read would find anything, without consuming it
+  bool HasMessages()
+  {
+    return !mBroken && (mRead != mWrittenCache || RefreshWrittenCache());
+  }
+  // The producer moved its index somewhere impossible or wrote a bad record
+  bool IsBroken() const { return mBroken; }
+
+  RingReader(const RingReader&) = delete;
+  RingReader& operator=(const RingReader&) = delete;
+
+private:
+  // Returns whether there is anything new
+  bool RefreshWrittenCache()
+  {
+    uint64_t written = mControl->mWritten.load(std::memory_order_acquire);
+    // The other side is untrusted
+    if (written < mWrittenCache || written - mRead > mSize ||
+        written % kRingRecordAlignment) {
+      mBroken = true;
+      return false;
+    }
+    mWrittenCache = written;
+    return mRead != mWrittenCache;
+  }
+
+  RingControl*  mControl;
+  uint8_t*      mData;
+  uint32_t      mSize;
+  uint64_t      mRead;
+  uint64_t      mWrittenCache;
+  bool          mBroken;
+};
+
+enum RingChannelSide
+{
+  eRingSideLauncher = 0,
+  eRingSideSandbox
+};
+
+/**
+ * A bidirectional channel over one shared section, made of two rings. The
+ * launcher lays the section out with Init before handing it to the sandbox,
+ * and each side then Attaches to its own end: the launcher writes to
+ * eRingToSandbox and reads from eRingToLauncher, and the sandbox the other
+ * way around.
+ *
+ * Neither end is thread-safe, but the two ends may be used concurrently from
+ * different threads or processes. Only polling is provided; callers that
+ * need to sleep pair the channel with an event of their own.
+ */
+class RingChannel final
+{
+public:
+  // Rings are a power of two bytes, at least this large
+  static constexpr uint32_t kMinRingSize = 256;
+
+  // Of a section that holds two rings of aRingSize bytes
+  static size_t GetSectionSize(uint32_t aRingSize);
+  // Lays out a channel in aSection. Fails if aRingSize is not a power of two
+  // of at least kMinRingSize or the channel does not fit.
+  static bool Init(void* aSection, size_t aSectionSize, uint32_t aRingSize);
+
+  RingChannel() {}
+
+  // Fails if aSection does not hold a channel that fits in aSectionSize
+  bool Attach(void* aSection, size_t aSectionSize, RingChannelSide aSide);
+
+  RingWriter& GetWriter() { return mWriter; }
+  RingReader& GetReader() { return mReader; }
+
+  RingChannel(const RingChannel&) = delete;
+  RingChannel& operator=(const RingChannel&) = delete;
+
+private:
+  RingWriter  mWriter;
+  RingReader  mReader;
+};
+
+} // namespace mozilla
+
+#endif // __RINGCHANNEL_H
+
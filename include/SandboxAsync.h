@@ -0,0 +1,380 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __SANDBOXASYNC_H
+#define __SANDBOXASYNC_H
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace mozilla {
+
+/**
+ * Where coroutines that were suspended on an AsyncOperation resume. Post may
+ * be called from any thread.
+ */
+class AsyncExecutor
+{
+public:
+  virtual ~AsyncExecutor() {}
+
+  virtual void Post(std::coroutine_handle<> aHandle) = 0;
+};
+
+/**
+ * An executor that resumes coroutines on whichever thread runs it, such as a
+ * broker's event loop.
+ */
+class QueueExecutor final : public AsyncExecutor
+{
+public:
+  QueueExecutor() {}
+
+  void Post(std::coroutine_handle<> aHandle) override;
+  // Waits up to aTimeoutMs for work, then resumes everything that is queued,
+  // including coroutines posted while doing so. Returns how many resumed.
+  size_t Run(uint32_t aTimeoutMs);
+  size_t GetPendingCount() const;
+
+  QueueExecutor(const QueueExecutor&) = delete;
+  QueueExecutor& operator=(const QueueExecutor&) = delete;
+
+private:
+  mutable std::mutex                  mMutex;
+  std::condition_variable             mCondVar;
+  std::deque<std::coroutine_handle<>> mQueue;
+};
+
+struct CancellationState;
+
+/**
+ * The receiving end of a CancellationSource. A default-constructed token is
+ * never cancelled.
+ */
+class CancellationToken
+{
+public:
+  CancellationToken() {}
+
+  bool IsCancelled() const;
+  // Runs aCallback on the cancelling thread once cancellation is requested,
+  // or right away if it already was. Returns an id for Unregister, or zero if
+  // aCallback has already run or never will.
+  uint64_t Register(std::function<void()>&& aCallback) const;
+  // Returns false if the callback has already run or is running
+  bool Unregister(uint64_t aId) const;
+
+private:
+  friend class CancellationSource;
+
+  explicit CancellationToken(const std::shared_ptr<CancellationState>& aState)
+    : mState(aState)
+  {}
+
+  std::shared_ptr<CancellationState> mState;
+};
+
+class CancellationSource final
+{
+public:
+  CancellationSource();
+
+  CancellationToken GetToken() const { return CancellationToken(mState); }
+  bool IsCancelled() const { return GetToken().IsCancelled(); }
+  // Runs every registered callback. Later calls do nothing.
+  void Cancel();
+
+private:
+  std::shared_ptr<CancellationState> mState;
+};
+
+/**
+ * A single asynchronous result that a backend produces on any thread and one
+ * coroutine awaits. The awaiting coroutine resumes on the operation's
+ * executor, with the result, or with nothing if the operation was cancelled
+ * first. Copies share the same operation.
+ */
+template <typename T>
+class AsyncOperation final
+{
+public:
+  explicit AsyncOperation(AsyncExecutor& aExecutor,
+                          const CancellationToken& aToken = CancellationToken())
+    : mState(std::make_shared<State>(aExecutor, aToken))
+  {
+    std::weak_ptr<State> weak = mState;
+    uint64_t registration = aToken.Register([weak]() -> void {
+      if (std::shared_ptr<State> state = weak.lock()) {
+        state->Cancel();
+      }
+    });
+    std::lock_guard<std::mutex> lock(mState->mMutex);
+    mState->mRegistration = registration;
+  }
+
+  // Backend side. Only the first completion or cancellation counts; returns
+  // false if this was not it.
+  bool Complete(T aValue) const
+  {
+    std::coroutine_handle<> waiter;
+    uint64_t registration;
+    {
+      std::lock_guard<std::mutex> lock(mState->mMutex);
+      if (mState->mDone) {
+        return false;
+      }
+      mState->mDone = true;
+      mState->mValue.emplace(std::move(aValue));
+      mState->mCancelHandler = nullptr;
+      waiter = std::exchange(mState->mWaiter, nullptr);
+      registration = mState->mRegistration;
+    }
+    mState->mToken.Unregister(registration);
+    if (waiter) {
+      mState->mExecutor.Post(waiter);
+    }
+    return true;
+  }
+
+  // Backend side. aHandler runs, on the cancelling thread, if the operation
+  // is cancelled before it completes, and must release whatever the backend
+  // holds for it. If the operation was already cancelled, aHandler runs now.
+  void SetCancelHandler(std::function<void()>&& aHandler) const
+  {
+    {
+      std::lock_guard<std::mutex> lock(mState->mMutex);
+      if (!mState->mDone) {
+        mState->mCancelHandler = std::move(aHandler);
+        return;
+      }
+      if (!std::exchange(mState->mCancelPending, false)) {
+        return;
+      }
+    }
+    aHandler();
+  }
+
+  bool IsDone() const
+  {
+    std::lock_guard<std::mutex> lock(mState->mMutex);
+    return mState->mDone;
+  }
+
+  // Awaitable by at most one coroutine
+  bool await_ready() const { return IsDone(); }
+  bool await_suspend(std::coroutine_handle<> aHandle) const
+  {
+    std::lock_guard<std::mutex> lock(mState->mMutex);
+    if (mState->mDone) {
+      return false;
+    }
+    mState->mWaiter = aHandle;
+    return true;
+  }
+  std::optional<T> await_resume() const
+  {
+    std::lock_guard<std::mutex> lock(mState->mMutex);
+    return std::move(mState->mValue);
+  }
+
+private:
+  struct State
+  {
+    State(AsyncExecutor& aExecutor, const CancellationToken& aToken)
+      : mExecutor(aExecutor)
+      , mToken(aToken)
+      , mRegistration(0)
+      , mDone(false)
+      , mCancelPending(false)
+    {}
+
+    void Cancel()
+    {
+      std::function<void()> handler;
+      std::coroutine_handle<> waiter;
+      {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mDone) {
+          return;
+        }
+        mDone = true;
+        handler = std::move(mCancelHandler);
+        mCancelPending = !handler;
+        waiter = std::exchange(mWaiter, nullptr);
+      }
+      if (handler) {
+        handler();
+      }
+      if (waiter) {
+        mExecutor.Post(waiter);
+      }
+    }
+
+    std::mutex              mMutex;
+    AsyncExecutor&          mExecutor;
+    CancellationToken       mToken;
+    uint64_t                mRegistration;
+    bool                    mDone;
+    // Cancelled before the backend set its cancel handler
+    bool                    mCancelPending;
+    std::optional<T>        mValue;
+    std::coroutine_handle<> mWaiter;
+    std::function<void()>   mCancelHandler;
+  };
+
+  std::shared_ptr<State>  mState;
+};
+
+/**
+ * A lazily started coroutine that produces a T. Awaiting it runs it on the
+ * awaiting thread until it first suspends; the awaiting coroutine resumes
+ * wherever the task finishes.
+ *
+ * Continuations are resumed directly rather than by symmetric transfer, which
+ * only bounds the stack when the compiler turns it into a tail call; a task
+ * that finishes without suspending just lets its awaiter carry on instead.
+ */
+template <typename T>
+class AsyncTask final
+{
+public:
+  struct promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  struct FinalAwaiter
+  {
+    bool await_ready() noexcept { return false; }
+    void await_suspend(Handle aHandle) noexcept
+    {
+      promise_type& promise = aHandle.promise();
+      // Only the second of the task and its awaiter to get here resumes the
+      // awaiter
+      if (promise.mReady.exchange(true, std::memory_order_acq_rel) &&
+          promise.mContinuation) {
+        promise.mContinuation.resume();
+      }
+    }
+    void await_resume() noexcept {}
+  };
+
+  struct promise_type
+  {
+    std::optional<T>        mValue;
+    std::coroutine_handle<> mContinuation;
+    std::atomic<bool>       mReady{false};
+
+    AsyncTask get_return_object()
+    {
+      return AsyncTask(Handle::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_value(T aValue) { mValue.emplace(std::move(aValue)); }
+    // Nothing in this tree throws
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  AsyncTask(AsyncTask&& aOther)
+    : mHandle(std::exchange(aOther.mHandle, nullptr))
+  {}
+  ~AsyncTask()
+  {
+    if (mHandle) {
+      mHandle.destroy();
+    }
+  }
+
+  bool await_ready() const { return false; }
+  bool await_suspend(std::coroutine_handle<> aHandle)
+  {
+    promise_type& promise = mHandle.promise();
+    promise.mContinuation = aHandle;
+    mHandle.resume();
+    // Stay suspended unless the task has already finished
+    return !promise.mReady.exchange(true, std::memory_order_acq_rel);
+  }
+  T await_resume() { return std::move(*mHandle.promise().mValue); }
+
+  AsyncTask(const AsyncTask&) = delete;
+  AsyncTask& operator=(const AsyncTask&) = delete;
+
+private:
+  explicit AsyncTask(Handle aHandle)
+    : mHandle(aHandle)
+  {}
+
+  Handle  mHandle;
+};
+
+// co_await ResumeOn(aExecutor) continues the coroutine on aExecutor
+struct ResumeOn
+{
+  explicit ResumeOn(AsyncExecutor& aExecutor)
+    : mExecutor(aExecutor)
+  {}
+
+  bool await_ready() const { return false; }
+  void await_suspend(std::coroutine_handle<> aHandle) const
+  {
+    mExecutor.Post(aHandle);
+  }
+  void await_resume() const {}
+
+  AsyncExecutor&  mExecutor;
+};
+
+namespace detail {
+
+// A coroutine that nothing awaits; it frees itself when it finishes
+struct DetachedCoroutine
+{
+  struct promise_type
+  {
+    DetachedCoroutine get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+template <typename T, typename Callback>
+DetachedCoroutine
+RunDetached(AsyncExecutor& aExecutor, AsyncTask<T> aTask, Callback aOnDone)
+{
+  co_await ResumeOn(aExecutor);
+  aOnDone(co_await aTask);
+}
+
+} // namespace detail
+
+/**
+ * Starts aTask on aExecutor without awaiting it, and passes its result to
+ * aOnDone wherever it finishes. This is how an event loop enters coroutine
+ * code.
+ */
+template <typename T, typename Callback>
+void
+Spawn(AsyncExecutor& aExecutor, AsyncTask<T>&& aTask, Callback&& aOnDone)
+{
+  detail::RunDetached(aExecutor, std::move(aTask),
+                      std::forward<Callback>(aOnDone));
+}
+
+} // namespace mozilla
+
+#endif // __SANDBOXASYNC_H
+
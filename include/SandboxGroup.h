@@ -0,0 +1,78 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __SANDBOXGROUP_H
+#define __SANDBOXGROUP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace mozilla {
+
+enum SandboxGroupMemberState
+{
+  eMemberFree = 0,
+  // A slot has been reserved but the process does not exist yet
+  eMemberLaunching,
+  eMemberRunning
+};
+
+/**
+ * Tracks which of a sandbox group's member slots are in use. A slot is
+ * reserved before a member launches, so that the group never has more
+ * members than its job's active process limit allows, and freed again when
+ * the launch fails or the member's process exits.
+ *
+ * The objects that the members share may be released once the group is
+ * closed and drained.
+ *
+ * Not thread-safe; WindowsSandboxGroup serializes access.
+ */
+class SandboxGroupMembers final
+{
+public:
+  explicit SandboxGroupMembers(uint32_t aCapacity = 1);
+
+  // Fails if the group is full or closed
+  std::optional<uint32_t> Reserve();
+  // The launch in aSlot created the process aProcessId
+  bool Commit(uint32_t aSlot, uint32_t aProcessId);
+  // The launch in aSlot failed
+  bool Cancel(uint32_t aSlot);
+  // Returns the slot of the member whose process exited, if it was one
+  std::optional<uint32_t> OnProcessExit(uint32_t aProcessId);
+  // No further members may join
+  void Close() { mClosed = true; }
+
+  uint32_t GetCapacity() const
+  {
+    return static_cast<uint32_t>(mSlots.size());
+  }
+  uint32_t GetCount(SandboxGroupMemberState aState) const;
+  std::optional<uint32_t> GetProcessId(uint32_t aSlot) const;
+  bool IsClosed() const { return mClosed; }
+  bool IsDrained() const
+  {
+    return mClosed && GetCount(eMemberFree) == GetCapacity();
+  }
+
+private:
+  struct Slot
+  {
+    SandboxGroupMemberState mState;
+    uint32_t                mProcessId;
+  };
+
+  std::vector<Slot> mSlots;
+  bool              mClosed;
+};
+
+} // namespace mozilla
+
+#endif // __SANDBOXGROUP_H
+
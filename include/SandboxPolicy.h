@@ -0,0 +1,165 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __SANDBOXPOLICY_H
+#define __SANDBOXPOLICY_H
+
+#include "JobLimits.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+namespace mozilla {
+
+// SIDs that may be placed in the restricted token's restricting SID list
+enum RestrictingSid : uint32_t
+{
+  eRestrictEveryone   = 0x01,
+  eRestrictUsers      = 0x02,
+  eRestrictRestricted = 0x04,
+  eRestrictLogon      = 0x08,
+  eRestrictCustom     = 0x10,
+  // The restricted SID is required by CreateRestrictedToken and the custom
+  // SID guards against the SetThreadDesktop() security hole.
+  eRestrictRequired   = eRestrictRestricted | eRestrictCustom,
+  eRestrictAll        = 0x1F
+};
+
+// Mirrors WindowsSandboxLauncher::InitFlags
+enum PolicyInitFlag : uint32_t
+{
+  ePolicyInitNoSeparateWindowStation = 0x1,
+  ePolicyInitAll                     = 0x1
+};
+
+// Which of the optional JobLimits fields are present in a PolicyRecord
+enum PolicyJobLimitField : uint32_t
+{
+  eFieldProcessMemory       = 0x0001,
+  eFieldJobMemory           = 0x0002,
+  eFieldWorkingSet          = 0x0004,
+  eFieldProcessCpuTime      = 0x0008,
+  eFieldCpuRateCap          = 0x0010,
+  eFieldCpuWeight           = 0x0020,
+  eFieldIoMaxIops           = 0x0040,
+  eFieldIoMaxBandwidth      = 0x0080,
+  eFieldNotifyJobMemory     = 0x0100,
+  eFieldNotifyIoReadBytes   = 0x0200,
+  eFieldNotifyIoWriteBytes  = 0x0400,
+  eFieldKillOnJobClose      = 0x0800,
+  eFieldAll                 = 0x0FFF
+};
+
+struct PolicyString
+{
+  uint32_t  mOffset;
+  uint32_t  mLength;
+};
+
+/**
+ * A single named sandbox policy. Records are stored back to back in a
+ * PolicyFile and are used in place; string fields refer to the file's string
+ * table and are null-terminated.
+ */
+struct PolicyRecord
+{
+  PolicyString  mName;
+  uint32_t      mNameHash;
+  uint32_t      mInitFlags;
+  uint64_t      mMitigationPolicies[2];
+  uint64_t      mDeferredMitigationPolicies[2];
+  uint32_t      mRestrictingSids;
+  uint32_t      mUiRestrictions;
+  uint32_t      mJobLimitFields;
+  uint32_t      mActiveProcessLimit;
+  uint64_t      mProcessMemoryLimit;
+  uint64_t      mJobMemoryLimit;
+  uint64_t      mMinWorkingSet;
+  uint64_t      mMaxWorkingSet;
+  uint64_t      mProcessCpuTimeLimitMs;
+  uint32_t      mCpuRateCap;
+  uint32_t      mCpuWeight;
+  int64_t       mIoMaxIops;
+  int64_t       mIoMaxBandwidth;
+  uint64_t      mNotifyJobMemory;
+  uint64_t      mNotifyIoReadBytes;
+  uint64_t      mNotifyIoWriteBytes;
+  PolicyString  mInitFunction;
+  PolicyString  mDeinitFunction;
+
+  void GetJobLimits(JobLimits& aLimits) const;
+};
+
+struct PolicyFileHeader
+{
+  static const uint32_t kMagic = 0x4C504253; // "SBPL"
+  static const uint16_t kVersion = 1;
+
+  uint32_t  mMagic;
+  uint16_t  mVersion;
+  uint16_t  mReserved;
+  uint32_t  mFileSize;
+  uint32_t  mChecksum;
+  uint32_t  mPolicyCount;
+  // Open-addressed hash table of 1-based record indices, each in exactly one
+  // bucket; 0 marks a free bucket. mBucketCount is a power of two and always
+  // exceeds mPolicyCount.
+  uint32_t  mBucketCount;
+  uint32_t  mBucketsOffset;
+  uint32_t  mRecordsOffset;
+  uint32_t  mStringsOffset;
+  uint32_t  mStringsSize;
+};
+
+static_assert(std::is_standard_layout<PolicyRecord>::value &&
+              std::is_standard_layout<PolicyFileHeader>::value,
+              "Policy file structures must be usable in place");
+static_assert(sizeof(PolicyRecord) == 168 && sizeof(PolicyFileHeader) == 40,
+              "Changing the policy file layout requires a version bump");
+
+uint32_t HashPolicyName(std::string_view aName);
+uint32_t ComputePolicyFileChecksum(const void* aData, size_t aDataLen);
+
+/**
+ * A read-only view of a compiled policy file. The file is validated once by
+ * Init, after which lookups are O(1) and do not copy anything out of the
+ * underlying buffer, which must outlive the PolicyFile.
+ */
+class PolicyFile
+{
+public:
+  PolicyFile();
+
+  bool Init(const void* aData, size_t aDataLen);
+
+  uint32_t Count() const { return mHeader ? mHeader->mPolicyCount : 0; }
+  const PolicyRecord* Find(std::string_view aName) const;
+  const PolicyRecord* GetRecord(uint32_t aIndex) const;
+  std::string_view GetString(const PolicyString& aString) const;
+
+  PolicyFile(const PolicyFile&) = delete;
+  PolicyFile& operator=(const PolicyFile&) = delete;
+
+private:
+  const PolicyFileHeader* mHeader;
+  const uint32_t*         mBuckets;
+  const PolicyRecord*     mRecords;
+  const char*             mStrings;
+};
+
+/**
+ * Checks the structure of a policy file and the consistency of every record
+ * in it. On failure, if aError is non-null it receives a description.
+ */
+bool ValidatePolicyFile(const void* aData, size_t aDataLen,
+                        const char** aError = nullptr);
+
+} // namespace mozilla
+
+#endif // __SANDBOXPOLICY_H
+
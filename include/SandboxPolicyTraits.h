@@ -0,0 +1,102 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __SANDBOXPOLICYTRAITS_H
+#define __SANDBOXPOLICYTRAITS_H
+
+#include "JobLimits.h"
+#include "MitigationTable.h"
+#include "SandboxPolicy.h"
+
+#include <cstdint>
+
+namespace mozilla {
+
+/**
+ * A sandbox policy that has been validated and flattened while compiling,
+ * leaving nothing to check or translate at launch.
+ */
+struct CompiledSandboxPolicy
+{
+  // PolicyInitFlag
+  uint32_t      mInitFlags;
+  uint64_t      mMitigationPolicies[2];
+  uint64_t      mDeferredMitigationPolicies[2];
+  // RestrictingSid
+  uint32_t      mRestrictingSids;
+  JobLimitPlan  mJobLimitPlan;
+};
+
+// The sandboxed executable's bitness is not known until it is launched, so
+// deferred mitigations must be applicable to either.
+constexpr bool
+CanDeferMitigations(const uint64_t (&aFlags)[2])
+{
+  MitigationPlan plan{};
+  return PlanMitigations(aFlags, false, plan) &&
+         PlanMitigations(aFlags, true, plan);
+}
+
+constexpr bool
+AreValidJobLimits(const JobLimits& aLimits)
+{
+  JobLimitPlan plan;
+  return TranslateJobLimits(aLimits, plan);
+}
+
+/**
+ * Compiles a policy type of the form:
+ *
+ *   struct ContentPolicy
+ *   {
+ *     static constexpr uint32_t kInitFlags = 0;
+ *     static constexpr uint64_t kMitigationPolicies[2] = {...};
+ *     static constexpr uint64_t kDeferredMitigationPolicies[2] = {...};
+ *     static constexpr uint32_t kRestrictingSids = eRestrictAll;
+ *     static constexpr JobLimits GetJobLimits() { ... }
+ *   };
+ *
+ * Combinations that the runtime path would only reject at launch, or that
+ * WindowsSandbox::SetMitigations would reject in the sandboxed process, fail
+ * to compile instead.
+ */
+template <typename Policy>
+constexpr CompiledSandboxPolicy
+CompileSandboxPolicy()
+{
+  static_assert(!(Policy::kInitFlags & ~ePolicyInitAll),
+                "Unknown init flags");
+  static_assert(!(Policy::kRestrictingSids & ~eRestrictAll),
+                "Unknown restricting SIDs");
+  static_assert((Policy::kRestrictingSids & eRestrictRequired) ==
+                eRestrictRequired,
+                "The restricted and custom SIDs must be restricting SIDs");
+  static_assert(CanDeferMitigations(Policy::kDeferredMitigationPolicies),
+                "Deferred mitigations must be applicable at runtime");
+  static_assert(AreValidJobLimits(Policy::GetJobLimits()),
+                "Job limits are inconsistent or out of range");
+
+  CompiledSandboxPolicy compiled{};
+  compiled.mInitFlags = Policy::kInitFlags;
+  compiled.mMitigationPolicies[0] = Policy::kMitigationPolicies[0];
+  compiled.mMitigationPolicies[1] = Policy::kMitigationPolicies[1];
+  compiled.mDeferredMitigationPolicies[0] =
+    Policy::kDeferredMitigationPolicies[0];
+  compiled.mDeferredMitigationPolicies[1] =
+    Policy::kDeferredMitigationPolicies[1];
+  compiled.mRestrictingSids = Policy::kRestrictingSids;
+  TranslateJobLimits(Policy::GetJobLimits(), compiled.mJobLimitPlan);
+  return compiled;
+}
+
+template <typename Policy>
+constexpr CompiledSandboxPolicy kCompiledSandboxPolicy =
+  CompileSandboxPolicy<Policy>();
+
+} // namespace mozilla
+
+#endif // __SANDBOXPOLICYTRAITS_H
+
@@ -0,0 +1,159 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __SECCOMPFILTER_H
+#define __SECCOMPFILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mozilla {
+
+/**
+ * What a seccomp filter does with a system call. These are the kernel's
+ * SECCOMP_RET_* values, so that compiling a policy does not need the Linux
+ * headers.
+ */
+enum SyscallAction : uint32_t
+{
+  eSyscallKill = 0x80000000,
+  eSyscallTrap = 0x00030000,
+  // Or'd with the errno that the call fails with
+  eSyscallErrno = 0x00050000,
+  eSyscallAllow = 0x7FFF0000
+};
+
+// AUDIT_ARCH_* values, which a filter checks before anything else
+enum SyscallArch : uint32_t
+{
+  eSyscallArchX86 = 0x40000003,
+  eSyscallArchX86_64 = 0xC000003E,
+  eSyscallArchAArch64 = 0xC00000B7
+};
+
+#if defined(__x86_64__)
+const SyscallArch kNativeSyscallArch = eSyscallArchX86_64;
+#elif defined(__aarch64__)
+const SyscallArch kNativeSyscallArch = eSyscallArchAArch64;
+#elif defined(__i386__)
+const SyscallArch kNativeSyscallArch = eSyscallArchX86;
+#endif
+
+struct SyscallRule
+{
+  uint32_t  mSyscall;
+  // SyscallAction
+  uint32_t  mAction;
+  // How often the sandbox makes this call relative to the others, e.g. calls
+  // per second in a profile. Zero if unknown.
+  uint32_t  mWeight;
+};
+
+/**
+ * A system call policy: an action for each listed call, and a default action
+ * for the rest. Calls from any other architecture than mArch, including the
+ * x32 ABI on x86-64, are killed.
+ */
+struct SyscallPolicy
+{
+  uint32_t                  mArch;
+  uint32_t                  mDefaultAction;
+  std::vector<SyscallRule>  mRules;
+};
+
+enum SeccompLayout : uint32_t
+{
+  // One comparison per rule, in the policy's order
+  eSeccompLinear,
+  // A binary search over ranges of calls that share an action, split by
+  // weight so that frequent calls are decided in fewer comparisons
+  eSeccompTree
+};
+
+// Laid out like the kernel's struct sock_filter
+struct BpfInstruction
+{
+  uint16_t  mCode;
+  uint8_t   mJumpTrue;
+  uint8_t   mJumpFalse;
+  uint32_t  mK;
+};
+
+/**
+ * A compiled classic BPF program, ready for SECCOMP_SET_MODE_FILTER.
+ */
+class SeccompProgram final
+{
+public:
+  // Returns null if the policy lists a call twice or does not fit in a
+  // filter
+  static std::shared_ptr<const SeccompProgram> Compile(
+    const SyscallPolicy& aPolicy, SeccompLayout aLayout);
+
+  const BpfInstruction* GetInstructions() const { return mCode.data(); }
+  size_t GetLength() const { return mCode.size(); }
+
+  // Runs the program the way the kernel would for a call, and returns its
+  // action. aSteps receives the number of instructions executed.
+  uint32_t Evaluate(uint32_t aArch, uint32_t aSyscall,
+                    uint32_t* aSteps = nullptr) const;
+
+  // The kernel's limit on the length of a filter
+  static const size_t kMaxLength = 4096;
+
+  SeccompProgram(const SeccompProgram&) = delete;
+  SeccompProgram& operator=(const SeccompProgram&) = delete;
+
+private:
+  SeccompProgram() {}
+
+  std::vector<BpfInstruction> mCode;
+};
+
+/**
+ * Compiled programs by policy, so that launching many sandboxes with one
+ * policy compiles it once.
+ */
+class SeccompProgramCache final
+{
+public:
+  struct Stats
+  {
+    uint64_t  mHits;
+    uint64_t  mMisses;
+    size_t    mEntries;
+  };
+
+  SeccompProgramCache() = default;
+
+  std::shared_ptr<const SeccompProgram> Get(const SyscallPolicy& aPolicy,
+                                            SeccompLayout aLayout);
+  void InvalidateAll();
+
+  Stats GetStats() const;
+
+  SeccompProgramCache(const SeccompProgramCache&) = delete;
+  SeccompProgramCache& operator=(const SeccompProgramCache&) = delete;
+
+private:
+  typedef std::unordered_map<std::string,
+                             std::shared_ptr<const SeccompProgram>> Map;
+
+  mutable std::mutex  mMutex;
+  Map                 mPrograms;
+  uint64_t            mHits = 0;
+  uint64_t            mMisses = 0;
+};
+
+} // namespace mozilla
+
+#endif // __SECCOMPFILTER_H
+
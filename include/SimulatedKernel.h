@@ -0,0 +1,213 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __SIMULATEDKERNEL_H
+#define __SIMULATEDKERNEL_H
+
+#include "LaunchBackend.h"
+#include "ResolverCache.h"
+#include "Teardown.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace mozilla {
+
+// The Win32 calls that a launch makes, as far as the simulation is concerned
+enum SimulatedCall : uint32_t
+{
+  eSimResolvePath = 0,
+  eSimCreateSid,
+  eSimCreateToken,
+  eSimCreateWindowStation,
+  eSimCreateDesktop,
+  eSimSetObjectSecurity,
+  eSimCreateJob,
+  eSimSetJobInformation,
+  eSimCreateSection,
+  eSimResolveWorkingDirectory,
+  eSimCreateProcess,
+  eSimSetThreadToken,
+  eSimResumeThread,
+  eSimTerminateProcess,
+  eSimWaitForExit,
+  eSimCloseHandle,
+  eSimCallCount
+};
+
+/**
+ * An in-memory stand-in for the parts of Win32 that a launch uses. Calls
+ * take a configurable time and fail deterministically, and the kernel keeps
+ * count of the objects that are open and of the deny ACEs on the launching
+ * thread's desktop, so that leaks show up without Windows.
+ *
+ * Thread-safe, and allocation-free so that it does not skew measurements of
+ * its callers' allocations.
+ */
+class SimulatedKernel final
+{
+public:
+  struct Config
+  {
+    // Spent busy-waiting in each call of a kind
+    uint32_t  mLatencyNs[eSimCallCount] = {};
+    // Every Nth call of a kind fails; zero for never
+    uint32_t  mFailEvery[eSimCallCount] = {};
+  };
+
+  // Zero is never a valid object. Ids fit in a handle on any platform.
+  typedef uint32_t ObjectId;
+
+  // Stands in for the launching thread's desktop
+  static const uintptr_t kParentDesktop = 1;
+
+  SimulatedKernel() : SimulatedKernel(Config()) {}
+  explicit SimulatedKernel(const Config& aConfig);
+
+  // Makes a call that creates nothing. Returns false if it fails.
+  bool Call(SimulatedCall aCall);
+  // Makes a call that creates an object. Returns zero if it fails.
+  ObjectId Create(SimulatedCall aCall);
+  bool Close(ObjectId aObject);
+  // Add or remove a deny ACE for aSid on the launching thread's desktop
+  bool DenyDesktopAccess(ObjectId aSid);
+  // Removes the ACEs of all of aSids with one update
+  bool RevertDesktopAccess(const ObjectId* aSids, size_t aCount);
+
+  uint64_t GetCallCount(SimulatedCall aCall) const;
+  // Of the objects that calls of kind aCall created
+  int64_t GetOpenObjectCount(SimulatedCall aCall) const;
+  int64_t GetOpenObjectCount() const;
+  // Since the kernel was created or ResetPeakOpenObjectCount was last called
+  int64_t GetPeakOpenObjectCount() const;
+  void ResetPeakOpenObjectCount();
+  int64_t GetDeniedAceCount() const;
+
+  static const char* GetCallName(SimulatedCall aCall);
+
+  SimulatedKernel(const SimulatedKernel&) = delete;
+  SimulatedKernel& operator=(const SimulatedKernel&) = delete;
+
+private:
+  static const unsigned int kKindShift = 24;
+  static const ObjectId kSerialMask = (1U << kKindShift) - 1;
+
+  static bool IsKind(ObjectId aObject, SimulatedCall aCall);
+
+  Config                mConfig;
+  std::atomic<uint64_t> mCalls[eSimCallCount];
+  std::atomic<int64_t>  mOpenObjects[eSimCallCount];
+  std::atomic<int64_t>  mOpenTotal;
+  std::atomic<int64_t>  mPeakOpenTotal;
+  std::atomic<ObjectId> mNextObject;
+  std::atomic<int64_t>  mDeniedAces;
+};
+
+/**
+ * Tears sandboxes down against a SimulatedKernel. Simulated processes exit as
+ * soon as their job is terminated.
+ */
+class SimulatedKernelTeardown final : public TeardownBackend
+{
+public:
+  explicit SimulatedKernelTeardown(SimulatedKernel& aKernel)
+    : mKernel(aKernel)
+  {}
+
+  bool TerminateJob(uintptr_t aJob) override;
+  size_t WaitForExit(const std::vector<uintptr_t>& aProcesses,
+                     uint32_t aTimeoutMs) override;
+  bool RevertDesktopAces(uintptr_t aDesktop,
+                         const std::vector<const SidBytes*>& aSids) override;
+  size_t CloseHandles(const TeardownHandle* aHandles, size_t aCount) override;
+
+private:
+  SimulatedKernel&  mKernel;
+};
+
+/**
+ * Launches a sandbox against a SimulatedKernel, making the same calls in the
+ * same order as WindowsSandboxLauncher. A successful launch keeps the
+ * sandbox's process, job, desktop, window station and custom SID open until
+ * the backend is destroyed or releases them for teardown.
+ *
+ * Like the launcher, it looks paths up through aCache if one is given; the
+ * kernel only resolves them on a miss.
+ */
+class SimulatedLaunchBackend final : public LaunchBackend
+{
+public:
+  SimulatedLaunchBackend(SimulatedKernel& aKernel,
+                         const std::wstring_view aExecutablePath,
+                         const std::wstring_view aBaseCmdLine,
+                         ResolverCache* aCache = nullptr);
+  ~SimulatedLaunchBackend();
+
+  // As WindowsSandboxLauncher::WarmResolverCache
+  static bool WarmResolverCache(SimulatedKernel& aKernel,
+                                ResolverCache& aCache,
+                                const std::wstring_view aExecutablePath);
+
+  bool ResolveExecutable() override;
+  bool CreateCustomSid() override;
+  bool CreateTokens() override;
+  bool CreateWindowStation() override;
+  bool CreateDesktop() override;
+  bool CreateJob() override;
+  bool CreateStartupTrace() override;
+  bool CreateStartupBlock() override;
+  bool ResolveWorkingDirectory() override;
+  bool CreateSuspendedProcess() override;
+  bool SetThreadToken() override;
+  bool PreResume() override { return true; }
+  bool ResumeProcess() override;
+  void TerminateProcess() override;
+  void Finish(bool aSucceeded) override;
+
+  bool IsLaunched() const { return mLaunched; }
+  // As WindowsSandboxLauncher::ReleaseForTeardown. The custom SID stays with
+  // the backend.
+  void ReleaseForTeardown(SandboxTeardown& aTeardown);
+
+  SimulatedLaunchBackend(const SimulatedLaunchBackend&) = delete;
+  SimulatedLaunchBackend& operator=(const SimulatedLaunchBackend&) = delete;
+
+private:
+  enum Slot
+  {
+    eSlotCustomSid = 0,
+    eSlotRestrictedToken,
+    eSlotImpersonationToken,
+    eSlotWindowStation,
+    eSlotDesktop,
+    eSlotJob,
+    eSlotTraceSection,
+    eSlotStartupSection,
+    eSlotProcess,
+    eSlotCount
+  };
+
+  void Release(Slot aSlot);
+  void ReleaseAll();
+
+  SimulatedKernel&          mKernel;
+  ResolverCache*            mCache;
+  std::wstring_view         mExecutablePath;
+  std::wstring_view         mBaseCmdLine;
+  std::wstring              mAbsExePath;
+  std::wstring              mWorkingDir;
+  SimulatedKernel::ObjectId mObjects[eSlotCount];
+  bool                      mDeniedDesktopAccess;
+  bool                      mLaunched;
+};
+
+} // namespace mozilla
+
+#endif // __SIMULATEDKERNEL_H
+
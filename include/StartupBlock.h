@@ -0,0 +1,131 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __STARTUPBLOCK_H
+#define __STARTUPBLOCK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+namespace mozilla {
+
+enum StartupChannelKind : uint32_t
+{
+  eChannelNone = 0,
+  // A writable section holding a StartupTrace
+  eChannelStartupTrace = 1,
+  // A writable section holding a WorkerMailbox
+  eChannelWorkerMailbox = 2,
+  // Events that the launcher sets when it posts a task, and that the worker
+  // sets when it posts a result
+  eChannelWorkerTaskEvent = 3,
+  eChannelWorkerResultEvent = 4,
+  // A sealed memfd holding a seccomp filter's instructions (Linux)
+  eChannelSyscallFilter = 5,
+  // Kinds at or above eChannelUser are free for use by WindowsSandbox
+  // subclasses and their launchers.
+  eChannelUser = 0x100
+};
+
+/**
+ * Describes an IPC object (section, event, pipe...) that the launcher has
+ * made inheritable by the sandboxed process. Handles are stored as 64-bit
+ * values so that the layout does not depend on the bitness of either side.
+ */
+struct StartupChannel
+{
+  uint32_t  mKind;
+  uint32_t  mFlags;
+  uint64_t  mHandle;
+  uint64_t  mSize;
+};
+
+struct StartupString
+{
+  uint32_t  mOffset;
+  uint32_t  mLength;
+};
+
+/**
+ * StartupBlock is written by WindowsSandboxLauncher into a pagefile-backed
+ * section which is then inherited read-only by the sandboxed process. The
+ * layout is fixed so that the child may use it in place once Validate() has
+ * succeeded; nothing in here needs to be parsed.
+ */
+struct StartupBlock
+{
+  static const uint32_t kMagic = 0x4B4C4253; // "SBLK"
+  static const uint16_t kVersion = 1;
+  static const uint32_t kMaxPreloads = 16;
+  static const uint32_t kMaxChannels = 16;
+  static const uint32_t kStringPoolLength = 4096;
+
+  uint32_t        mMagic;
+  uint16_t        mVersion;
+  uint16_t        mReserved;
+  uint32_t        mSize;
+  uint32_t        mChecksum;
+
+  uint64_t        mJobHandle;
+  uint64_t        mMitigationPolicies[2];
+  uint64_t        mDeferredMitigationPolicies[2];
+  uint32_t        mInitFlags;
+
+  uint32_t        mPreloadCount;
+  uint32_t        mChannelCount;
+  uint32_t        mStringPoolUsed;
+  StartupString   mPreloads[kMaxPreloads];
+  StartupChannel  mChannels[kMaxChannels];
+  char16_t        mStringPool[kStringPoolLength];
+
+  /**
+   * Returns aData reinterpreted as a StartupBlock if and only if it is
+   * internally consistent, otherwise nullptr.
+   */
+  static const StartupBlock* Validate(const void* aData, size_t aDataLen);
+
+  std::u16string_view GetPreload(uint32_t aIndex) const;
+  const StartupChannel* FindChannel(uint32_t aKind, uint32_t aNth = 0) const;
+
+  uint32_t ComputeChecksum() const;
+};
+
+static_assert(std::is_trivially_copyable<StartupBlock>::value &&
+              std::is_standard_layout<StartupBlock>::value,
+              "StartupBlock must be usable in place from shared memory");
+static_assert(sizeof(StartupBlock) == 8776,
+              "Changing the StartupBlock layout requires a version bump");
+
+class StartupBlockBuilder final
+{
+public:
+  explicit StartupBlockBuilder(StartupBlock& aBlock);
+
+  void SetJobHandle(uint64_t aJob) { mBlock.mJobHandle = aJob; }
+  void SetInitFlags(uint32_t aInitFlags) { mBlock.mInitFlags = aInitFlags; }
+  void SetMitigationPolicies(uint64_t aPolicies, uint64_t aPolicies2 = 0);
+  void SetDeferredMitigationPolicies(uint64_t aPolicies,
+                                     uint64_t aPolicies2 = 0);
+  bool AddPreload(std::u16string_view aPath);
+  bool AddChannel(uint32_t aKind, uint64_t aHandle, uint64_t aSize,
+                  uint32_t aFlags = 0);
+
+  // Must be called once all fields have been written
+  void Finish();
+
+  StartupBlockBuilder(const StartupBlockBuilder&) = delete;
+  StartupBlockBuilder& operator=(const StartupBlockBuilder&) = delete;
+
+private:
+  StartupBlock& mBlock;
+};
+
+} // namespace mozilla
+
+#endif // __STARTUPBLOCK_H
+
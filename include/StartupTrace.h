@@ -0,0 +1,92 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __STARTUPTRACE_H
+#define __STARTUPTRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace mozilla {
+
+// Phases are listed in the order in which they complete
+enum StartupPhase : uint32_t
+{
+  // Written by the launcher
+  ePhaseProcessCreating = 0,
+  ePhaseProcessResumed,
+  // Written by the sandboxed process
+  ePhaseEntered,
+  ePhaseJobValidated,
+  ePhasePreloadsLoaded,
+  ePhasePrivInit,
+  ePhaseRevertedToSelf,
+  ePhaseIntegrityDropped,
+  ePhaseJobAssigned,
+  ePhaseMitigationsApplied,
+  ePhaseReady,
+  ePhaseCount,
+  ePhaseNone = ePhaseCount
+};
+
+const char* GetStartupPhaseName(uint32_t aPhase);
+
+/**
+ * A page shared between the launcher and the sandboxed process in which each
+ * side records when it completes each StartupPhase. Timestamps are in ticks
+ * of a clock that is common to both processes (QueryPerformanceCounter on
+ * Windows) and are published by setting the phase's bit in mCompleted, so
+ * the launcher may read the trace at any time without further coordination.
+ */
+struct StartupTrace
+{
+  static const uint32_t kMagic = 0x52544253; // "SBTR"
+  static const uint32_t kVersion = 1;
+
+  uint32_t              mMagic;
+  uint32_t              mVersion;
+  uint64_t              mTicksPerSecond;
+  std::atomic<uint32_t> mCompleted;
+  std::atomic<uint32_t> mFailedPhase;
+  std::atomic<uint64_t> mTimestamps[ePhaseCount];
+
+  void Init(uint64_t aTicksPerSecond);
+  void Mark(StartupPhase aPhase, uint64_t aTicks);
+  // Records that the earliest incomplete phase failed
+  void MarkFailed();
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+              std::atomic<uint64_t>::is_always_lock_free &&
+              std::is_standard_layout<StartupTrace>::value,
+              "StartupTrace must be usable in place from shared memory");
+static_assert(sizeof(StartupTrace) == 112,
+              "Changing the StartupTrace layout requires a version bump");
+
+struct StartupTraceSummary
+{
+  uint32_t  mCompleted;
+  uint32_t  mFailedPhase;
+  bool      mReady;
+  // Time spent in each phase, i.e. since the previous completed phase
+  uint64_t  mPhaseNs[ePhaseCount];
+  // From ePhaseProcessCreating to the last completed phase
+  uint64_t  mElapsedNs;
+};
+
+/**
+ * Converts a snapshot of aTrace into per-phase durations. Returns false if
+ * aTrace is not initialized or its timestamps are inconsistent.
+ */
+bool SummarizeStartupTrace(const StartupTrace& aTrace,
+                           StartupTraceSummary& aSummary);
+
+} // namespace mozilla
+
+#endif // __STARTUPTRACE_H
+
@@ -0,0 +1,92 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __TASKGRAPH_H
+#define __TASKGRAPH_H
+
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+namespace mozilla {
+
+/**
+ * A small dependency graph of fallible tasks. Run() executes every task whose
+ * dependencies have succeeded, using up to the requested number of threads
+ * (the calling thread included). As soon as any task fails, no further tasks
+ * are started; Run() waits for those already running and returns false.
+ *
+ * The other threads come from a pool that every graph in the process shares,
+ * which grows on demand and keeps its threads for later runs.
+ *
+ * Dependencies may only refer to tasks that were added earlier, so the graph
+ * is acyclic by construction.
+ */
+class TaskGraph final
+{
+public:
+  typedef uint32_t TaskId;
+  typedef std::function<bool()> TaskFunc;
+
+  static const TaskId kInvalidTask = UINT32_MAX;
+
+  enum TaskFlags : uint32_t
+  {
+    eTaskNormal = 0,
+    // The task must run on the thread that called Run(), e.g. because it
+    // depends upon that thread's desktop.
+    eTaskCallingThread = 1
+  };
+
+  TaskGraph() = default;
+
+  TaskId Add(const char* aName, TaskFunc&& aFunc,
+             std::initializer_list<TaskId> aDeps = {},
+             uint32_t aFlags = eTaskNormal);
+
+  // May only be called once
+  bool Run(unsigned int aMaxThreads);
+
+  // Starts enough pool threads for a Run(aMaxThreads) ahead of time
+  static void WarmUp(unsigned int aMaxThreads);
+
+  size_t Count() const { return mTasks.size(); }
+  // Valid after Run() returns false; kInvalidTask if the graph was malformed
+  TaskId GetFailedTask() const { return mFailedTask; }
+  const char* GetName(TaskId aTask) const;
+  // Zero for tasks that did not run
+  uint64_t GetDurationNs(TaskId aTask) const;
+  // Wall-clock time of the last Run()
+  uint64_t GetElapsedNs() const { return mElapsedNs; }
+
+  TaskGraph(const TaskGraph&) = delete;
+  TaskGraph& operator=(const TaskGraph&) = delete;
+
+private:
+  struct Task
+  {
+    const char*         mName;
+    TaskFunc            mFunc;
+    uint32_t            mFlags;
+    uint32_t            mPendingDeps;
+    std::vector<TaskId> mDependents;
+    uint64_t            mDurationNs;
+  };
+
+  class Scheduler;
+
+  std::vector<Task> mTasks;
+  TaskId            mFailedTask = kInvalidTask;
+  uint64_t          mElapsedNs = 0;
+  bool              mMalformed = false;
+  bool              mHasRun = false;
+};
+
+} // namespace mozilla
+
+#endif // __TASKGRAPH_H
+
@@ -0,0 +1,125 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __TEARDOWN_H
+#define __TEARDOWN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mozilla {
+
+// A SID in its binary form
+typedef std::vector<uint8_t> SidBytes;
+
+enum TeardownPhase
+{
+  eTeardownTerminate = 0,
+  eTeardownWait,
+  eTeardownRevertDesktop,
+  eTeardownCloseHandles,
+  eTeardownPhaseCount
+};
+
+const char* GetTeardownPhaseName(TeardownPhase aPhase);
+
+// Handles are closed in this order, since a window station may not be closed
+// while one of its desktops is still open.
+enum TeardownHandleKind
+{
+  eTeardownHandleKernel = 0,
+  eTeardownHandleDesktop,
+  eTeardownHandleWindowStation,
+  eTeardownHandleKindCount
+};
+
+struct TeardownHandle
+{
+  uintptr_t           mValue;
+  TeardownHandleKind  mKind;
+};
+
+/**
+ * Everything that is left of one sandbox. The teardown owns the handles.
+ */
+struct TeardownTarget
+{
+  uintptr_t                   mJob = 0;
+  uintptr_t                   mProcess = 0;
+  // The desktop that denies mDesktopAceSid access, if any
+  uintptr_t                   mParentDesktop = 0;
+  SidBytes                    mDesktopAceSid;
+  std::vector<TeardownHandle> mHandles;
+};
+
+/**
+ * The platform operations that a teardown is made of. Implementations must
+ * allow CloseHandles to be called from several threads at once.
+ */
+class TeardownBackend
+{
+public:
+  virtual ~TeardownBackend() {}
+
+  virtual bool TerminateJob(uintptr_t aJob) = 0;
+  // Returns how many of aProcesses were still running after aTimeoutMs
+  virtual size_t WaitForExit(const std::vector<uintptr_t>& aProcesses,
+                             uint32_t aTimeoutMs) = 0;
+  // Removes the deny ACEs for every SID in aSids with a single update
+  virtual bool RevertDesktopAces(uintptr_t aDesktop,
+                                 const std::vector<const SidBytes*>& aSids) = 0;
+  // Returns how many handles failed to close
+  virtual size_t CloseHandles(const TeardownHandle* aHandles,
+                              size_t aCount) = 0;
+};
+
+struct TeardownReport
+{
+  uint64_t  mPhaseNs[eTeardownPhaseCount];
+  uint64_t  mTotalNs;
+  size_t    mSandboxes;
+  size_t    mTerminateFailures;
+  size_t    mStillRunning;
+  size_t    mDesktopFailures;
+  size_t    mHandlesClosed;
+  size_t    mCloseFailures;
+};
+
+/**
+ * Tears down a set of sandboxes as a group rather than one by one. Every job
+ * is terminated before any of them is waited upon, so that stuck sandboxes
+ * die concurrently; the desktop deny ACEs of all sandboxes are removed with
+ * one security update per desktop; and handles are closed in batches on up to
+ * kCloseThreads threads.
+ */
+class SandboxTeardown final
+{
+public:
+  static constexpr size_t       kCloseBatch = 64;
+  static constexpr unsigned int kCloseThreads = 4;
+
+  SandboxTeardown() = default;
+
+  void Add(TeardownTarget&& aTarget) { mTargets.push_back(std::move(aTarget)); }
+  size_t Count() const { return mTargets.size(); }
+
+  // Handles are closed even if earlier phases fail. May only be called once.
+  bool Run(TeardownBackend& aBackend, uint32_t aTimeoutMs,
+           TeardownReport& aReport);
+
+  SandboxTeardown(const SandboxTeardown&) = delete;
+  SandboxTeardown& operator=(const SandboxTeardown&) = delete;
+
+private:
+  std::vector<TeardownTarget> mTargets;
+  bool                        mHasRun = false;
+};
+
+} // namespace mozilla
+
+#endif // __TEARDOWN_H
+
@@ -49,5 +49,45 @@ using UniqueProcAttributeList = std::unique_ptr<std::remove_pointer<LPPROC_THREA
 
 #endif // _WIN32_WINNT
 
+#if defined(__linux__)
+
+#include <unistd.h>
+#include <utility>
+
+// Owns a file descriptor; -1 when empty
+class UniqueFd
+{
+public:
+  UniqueFd() : mFd(-1) {}
+  explicit UniqueFd(int aFd) : mFd(aFd) {}
+  UniqueFd(UniqueFd&& aOther) : mFd(aOther.release()) {}
+  ~UniqueFd() { reset(); }
+
+  UniqueFd& operator=(UniqueFd&& aOther)
+  {
+    reset(aOther.release());
+    return *this;
+  }
+
+  int get() const { return mFd; }
+  int release() { return std::exchange(mFd, -1); }
+  void reset(int aFd = -1)
+  {
+    if (mFd >= 0) {
+      ::close(mFd);
+    }
+    mFd = aFd;
+  }
+  explicit operator bool() const { return mFd >= 0; }
+
+  UniqueFd(const UniqueFd&) = delete;
+  UniqueFd& operator=(const UniqueFd&) = delete;
+
+private:
+  int mFd;
+};
+
+#endif // defined(__linux__)
+
 #endif // __ASPK_UNIQUEHANDLE_H
 
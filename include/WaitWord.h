@@ -0,0 +1,85 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __WAITWORD_H
+#define __WAITWORD_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace mozilla {
+
+enum WaitWordScope
+{
+  // Every waiter and notifier is in this process
+  eWaitWordProcess = 0,
+  // The word is in a section shared with another process
+  eWaitWordShared
+};
+
+const uint32_t kWaitWordInfinite = UINT32_MAX;
+
+/**
+ * A 32-bit value that threads or processes can wait on until it changes.
+ * Waiters spin for a while, then park in the kernel on the word itself
+ * (futex, or WaitOnAddress within a process). Notifiers only make a system
+ * call when somebody is parked, so a handshake in which the waiter arrives
+ * late, or is still spinning, never enters the kernel at all.
+ *
+ * How long waiters spin adapts to how long they have recently had to wait
+ * for this word: waits that a somewhat longer spin would have covered extend
+ * it, and longer ones cut it back. Waiters never spin on a machine with one
+ * CPU.
+ *
+ * WaitOnAddress does not work across processes, so shared words on Windows
+ * park on an auto-reset event that the caller supplies instead, which only
+ * suits one waiter at a time. The event is still only signalled when the
+ * waiter is parked.
+ */
+struct WaitWord
+{
+  static constexpr uint32_t kDefaultMaxSpinNs = 20000;
+  // Caps whatever mMaxSpinNs the other side of a shared word wrote
+  static constexpr uint32_t kMaxSpinNs = 1000000;
+
+  std::atomic<uint32_t> mValue;
+  std::atomic<uint32_t> mParked;
+  // How long the next waiter spins. Only a hint, so neither side of a shared
+  // word trusts it.
+  std::atomic<uint32_t> mSpinNs;
+  // Zero to park right away
+  uint32_t              mMaxSpinNs;
+
+  void Init(uint32_t aValue = 0, uint32_t aMaxSpinNs = kDefaultMaxSpinNs);
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+              sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) &&
+              std::is_standard_layout<WaitWord>::value,
+              "WaitWord must be usable in place from shared memory");
+
+/**
+ * Waits until aWord's value is no longer aOldValue. Returns false if it
+ * still was after aTimeoutMs. aParkEvent is the auto-reset event to park on
+ * for shared words on Windows, and is ignored everywhere else.
+ */
+bool WaitForWordChange(WaitWord& aWord, uint32_t aOldValue,
+                       uint32_t aTimeoutMs, WaitWordScope aScope,
+                       uintptr_t aParkEvent = 0);
+
+/**
+ * Stores aValue into aWord and wakes everybody that is parked on it. Returns
+ * whether that took a system call.
+ */
+bool StoreWordAndNotify(WaitWord& aWord, uint32_t aValue,
+                        WaitWordScope aScope, uintptr_t aParkEvent = 0);
+
+} // namespace mozilla
+
+#endif // __WAITWORD_H
+
@@ -8,10 +8,29 @@
 #define __WINDOWSSANDBOX_H
 
 #include <windows.h>
+#include "CpuRateControl.h"
 #include "Dacl.h"
+#include "JobAccounting.h"
+#include "JobLimits.h"
+#include "LaunchAdmission.h"
+#include "MemoryPressure.h"
+#include "MitigationTable.h"
+#include "Placement.h"
+#include "RingChannel.h"
+#include "SandboxAsync.h"
+#include "SandboxGroup.h"
+#include "SandboxPolicy.h"
+#include "SandboxPolicyTraits.h"
 #include "Sid.h"
+#include "StartupBlock.h"
+#include "StartupTrace.h"
+#include "Teardown.h"
 #include "UniqueHandle.h"
+#include "WorkerProtocol.h"
 
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
@@ -26,24 +45,61 @@ public:
   virtual ~WindowsSandbox() {}
 
   bool Init(int aArgc, wchar_t* aArgv[]);
+  // In worker mode, serves tasks through OnTask after a successful Init until
+  // the launcher shuts the worker down. Returns false if the sandbox was not
+  // launched in worker mode or the launcher went away.
+  bool RunWorker();
   void Fini();
 
   static const std::wstring DESKTOP_NAME;
-  static const std::wstring_view SWITCH_JOB_HANDLE;
+  static const std::wstring_view SWITCH_STARTUP_BLOCK;
 
 protected:
   virtual DWORD64 GetDeferredMitigationPolicies() { return 0; }
+  virtual DWORD64 GetDeferredMitigationPolicies2() { return 0; }
   virtual bool OnPrivInit() = 0;
   virtual bool OnInit() = 0;
   virtual void OnFini() = 0;
+  virtual WorkerTaskStatus OnTask(uint32_t aKind, const uint8_t* aInput,
+                                  uint32_t aInputSize,
+                                  std::vector<uint8_t>& aOutput)
+  {
+    return eTaskUnknownKind;
+  }
+
+  const StartupBlock* GetStartupBlock() const { return mStartupBlock.get(); }
+  HANDLE GetChannelHandle(uint32_t aKind, uint32_t aNth = 0) const;
+  // Maps the section that the launcher passed as channel aKind and attaches
+  // to the sandbox's end of the RingChannel in it. The section stays mapped
+  // until the sandbox is destroyed.
+  bool AttachRingChannel(uint32_t aKind, RingChannel& aChannel,
+                         uint32_t aNth = 0);
+  // Describes the outcome of applying the deferred mitigation policies
+  const MitigationReport& GetMitigationReport() const
+  {
+    return mMitigationReport;
+  }
 
 private:
+  bool MapStartupBlock(HANDLE aSection);
+  void MapStartupTrace();
+  bool TracePhase(StartupPhase aPhase);
+  bool LoadPreloads();
   bool ValidateJobHandle(HANDLE aJob);
-  bool SetMitigations(const DWORD64 aMitigations);
+  bool SetMitigations(const DWORD64 aMitigations, const DWORD64 aMitigations2);
   bool DropProcessIntegrityLevel();
+
+  UniqueKernelHandle                        mStartupSection;
+  UniqueMappedFileView<const StartupBlock>  mStartupBlock;
+  MitigationReport                          mMitigationReport = {};
+  UniqueMappedFileView<StartupTrace>        mStartupTrace;
+  std::vector<UniqueMappedFileView<void>>   mRingViews;
 };
 
-class WindowsSandboxLauncher
+class Win32LaunchBackend;
+class WindowsSandboxGroup;
+
+class WindowsSandboxLauncher : public JobAccountingSource
 {
 public:
   WindowsSandboxLauncher();
@@ -56,7 +112,10 @@ public:
   };
 
   bool Init(InitFlags aInitFlags = eInitNormal,
-            DWORD64 aMitigationPolicies = DEFAULT_MITIGATION_POLICIES);
+            DWORD64 aMitigationPolicies = DEFAULT_MITIGATION_POLICIES,
+            DWORD64 aMitigationPolicies2 = 0);
+  // Initializes from a compiled policy. Also applies the policy's job limits.
+  bool Init(const PolicyRecord& aPolicy);
 
   inline void AddHandleToInherit(HANDLE aHandle)
   {
@@ -64,40 +123,282 @@ public:
       mHandlesToInherit.push_back(aHandle);
     }
   }
+  // aHandle is also added to the list of handles to inherit
+  bool AddChannel(uint32_t aKind, HANDLE aHandle, uint64_t aSize,
+                  uint32_t aFlags = 0);
+  bool AddPreload(const std::wstring_view aLibPath);
+  void SetDeferredMitigationPolicies(DWORD64 aPolicies, DWORD64 aPolicies2 = 0)
+  {
+    mDeferredMitigationPolicies[0] = aPolicies;
+    mDeferredMitigationPolicies[1] = aPolicies2;
+  }
+  // Must be called before Launch
+  bool SetJobLimits(const JobLimits& aLimits);
+  // Confines the sandbox to the placement's processors and prefers its NUMA
+  // node for the initial allocations. Must be called before Launch.
+  void SetPlacement(const Placement& aPlacement) { mPlacement = aPlacement; }
+  // Weights the sandbox's CPU time by its priority class, unless the job
+  // limits already control the CPU rate. Must be called before Launch.
+  void SetPriority(SandboxPriority aPriority) { mPriority = aPriority; }
+  // Caps the running sandbox's CPU rate, e.g. as decided by a
+  // CpuRateController, but never above the job limits' own cap.
+  // joblimits::kMaxCpuRate restores the job limits' cap or weight, or else
+  // the priority weight.
+  bool SetCpuRateCap(uint32_t aCpuRate);
+  // Fills in everything except aTelemetry.mId
+  bool QueryMemoryTelemetry(MemoryTelemetry& aTelemetry) const;
+  // Carries out a MemoryPressurePolicy decision for the running sandbox
+  bool ApplyMemoryAction(const MemoryAction& aAction);
+  // Makes Launch wait for aGate, and fail if the gate sheds it or it has not
+  // been admitted within aTimeoutMs (zero for no limit). aGate must outlive
+  // the launch.
+  void SetAdmission(LaunchAdmissionGate* aGate, uint32_t aTimeoutMs = 0)
+  {
+    mAdmission = aGate;
+    mAdmissionTimeoutMs = aTimeoutMs;
+  }
+  // Makes the sandbox a member of aGroup, sharing its job, desktop and custom
+  // SID. The group's job limits replace the launcher's, and its job
+  // notifications are delivered to the group rather than to the launcher.
+  // Must be called before Launch.
+  bool SetGroup(const std::shared_ptr<WindowsSandboxGroup>& aGroup);
+  // Passes a WorkerMailbox and its events to the sandbox, which is expected
+  // to call WindowsSandbox::RunWorker. Must be called before Launch.
+  bool EnableWorkerMode();
+  WorkerMailbox* GetWorkerMailbox() const { return mWorkerMailbox.get(); }
+  bool SignalWorkerTask();
+  // Returns false if the worker did not post a result within aTimeoutMs or
+  // exited
+  bool WaitForWorkerResult(uint32_t aTimeoutMs);
+  // Asks the worker to exit, and terminates it if it has not within
+  // aTimeoutMs
+  void ShutdownWorker(uint32_t aTimeoutMs);
   bool Launch(const std::wstring_view aExecutablePath, const std::wstring_view aBaseCmdLine);
   bool Wait(unsigned int aTimeoutMs) const;
+  // Awaitable versions of Launch, Wait and WaitForWorkerResult for event
+  // driven callers; the awaiting coroutine resumes on aExecutor. The launcher
+  // must outlive LaunchAsync. Cancelling a launch that has already started
+  // only stops waiting for it.
+  AsyncOperation<bool> LaunchAsync(AsyncExecutor& aExecutor,
+                                   const std::wstring_view aExecutablePath,
+                                   const std::wstring_view aBaseCmdLine,
+                                   const CancellationToken& aToken =
+                                     CancellationToken());
+  // Yields the sandbox's exit code
+  AsyncOperation<uint32_t> Exited(AsyncExecutor& aExecutor,
+                                  const CancellationToken& aToken =
+                                    CancellationToken());
+  AsyncOperation<bool> ReceiveWorkerResult(AsyncExecutor& aExecutor,
+                                           uint32_t aTimeoutMs,
+                                           const CancellationToken& aToken =
+                                             CancellationToken());
+  // Dispatches any pending job limit violations to OnJobLimitViolation.
+  // Returns true if at least one violation was dispatched.
+  bool ProcessJobNotifications(unsigned int aTimeoutMs);
+  // JobAccountingSource
+  bool QueryAccounting(JobAccountingSample& aSample) override;
+  // Reports how far the sandboxed process has progressed through
+  // WindowsSandbox::Init and how long each phase took. May be called at any
+  // time after Launch.
+  bool GetStartupTrace(StartupTraceSummary& aSummary) const;
   bool IsSandboxRunning() const;
+  // Hands the sandbox's job, process, desktop and window station over to
+  // aTeardown. Afterwards the launcher may only be destroyed. For a group
+  // member, this terminates the whole group's job.
+  void ReleaseForTeardown(SandboxTeardown& aTeardown);
+  // Kills and cleans up after every sandbox in aLaunchers as a group
+  static bool Teardown(const std::vector<WindowsSandboxLauncher*>& aLaunchers,
+                       uint32_t aTimeoutMs, TeardownReport& aReport);
   bool GetInheritableSecurityDescriptor(SECURITY_ATTRIBUTES& aSa,
                                         const BOOL aInheritable = TRUE);
 
+  // Describes this machine's logical processors for a PlacementScheduler
+  static bool GetPlacementTopology(PlacementTopology& aTopology);
+  static bool GetHostMemory(HostMemory& aHost);
+  // Launches look up the sandbox's working directory and the executable's
+  // absolute path in a process-wide cache. Warming it at startup takes the
+  // shell out of the first launch; invalidate it after the user's profile or
+  // the current directory changes.
+  static bool WarmResolverCache(const std::wstring_view aExecutablePath = {});
+  static void InvalidateResolverCache();
+
   static const DWORD64 DEFAULT_MITIGATION_POLICIES;
+  static const unsigned int kLaunchThreads;
 
 protected:
+  // Initializes from a policy that was validated while compiling; see
+  // WindowsSandboxLauncherT
+  bool Init(const CompiledSandboxPolicy& aPolicy);
+
   virtual bool PreResume() { return true; }
+  virtual void OnJobLimitViolation(const JobLimitNotification& aNotification) {}
 
 private:
+  friend class Win32LaunchBackend;
+
   bool CreateTokens(const Sid& aCustomSid, UniqueKernelHandle& aRestrictedToken,
                     UniqueKernelHandle& aImpersonationToken, Sid& aLogonSid);
   HWINSTA CreateWindowStation();
   std::optional<std::wstring> GetWindowStationName(HWINSTA aWinsta);
   HDESK CreateDesktop(HWINSTA aWinsta, const Sid& aCustomSid);
+  bool LaunchGroupMember(const std::wstring_view aExecutablePath,
+                         const std::wstring_view aBaseCmdLine);
+  // aJoinGroup is the group whose shared objects the sandbox joins, if they
+  // have already been created
+  bool LaunchAdmitted(const std::wstring_view aExecutablePath,
+                      const std::wstring_view aBaseCmdLine,
+                      const WindowsSandboxGroup* aJoinGroup = nullptr);
   bool CreateJob(UniqueKernelHandle& aJob);
+  bool ApplyJobLimits(HANDLE aJob);
+  bool ApplyPlacement(HANDLE aJob);
   std::optional<std::wstring> GetWorkingDirectory(UniqueKernelHandle& aToken);
   std::optional<std::wstring> CreateAbsolutePath(const std::wstring_view aInputPath);
+  // aTraceSection, if any, is passed along with the persistent channels
+  bool CreateStartupBlock(HANDLE aJob, HANDLE aTraceSection,
+                          UniqueKernelHandle& aSection);
+  bool CreateStartupTrace(UniqueKernelHandle& aSection);
+  void TracePhase(StartupPhase aPhase);
   bool BuildInheritableSecurityDescriptor(const Sid& aLogonSid);
 
+  // One startup block slot is kept for each launch's startup trace
+  static const uint32_t kMaxPersistentChannels = StartupBlock::kMaxChannels - 1;
+
   InitFlags mInitFlags;
   std::vector<HANDLE> mHandlesToInherit;
+  std::vector<StartupChannel> mChannels;
+  std::vector<std::wstring> mPreloads;
   bool    mHasWin8APIs;
   bool    mHasWin10APIs;
-  DWORD64 mMitigationPolicies;
+  DWORD64 mMitigationPolicies[2];
+  DWORD64 mDeferredMitigationPolicies[2];
+  uint32_t mRestrictingSids;
+  JobLimitPlan mJobLimitPlan;
+  std::optional<Placement> mPlacement;
+  std::optional<SandboxPriority> mPriority;
+  LaunchAdmissionGate* mAdmission;
+  uint32_t mAdmissionTimeoutMs;
+  std::shared_ptr<WindowsSandboxGroup> mGroup;
+  UniqueMappedFileView<WorkerMailbox> mWorkerMailbox;
+  UniqueKernelHandle mWorkerTaskEvent;
+  UniqueKernelHandle mWorkerResultEvent;
+  // The sandbox's inheritable duplicates of the worker objects
+  std::vector<UniqueKernelHandle> mWorkerChildHandles;
+  UniqueKernelHandle mJob;
+  UniqueKernelHandle mJobPort;
+  UniqueMappedFileView<StartupTrace> mStartupTrace;
   HANDLE  mProcess;
   HWINSTA mWinsta;
   HDESK   mDesktop;
+  // The desktop that CreateDesktop denied mCustomSid access to
+  HDESK   mParentDesktop;
+  Sid     mCustomSid;
   Dacl    mInheritableDacl;
   SECURITY_DESCRIPTOR mInheritableSd;
 };
 
+/**
+ * Resumes coroutines on the process's default thread pool.
+ */
+class WindowsThreadpoolExecutor final : public AsyncExecutor
+{
+public:
+  void Post(std::coroutine_handle<> aHandle) override;
+};
+
+/**
+ * A launcher whose policy is fixed at compile time; see CompileSandboxPolicy
+ * for the form that Policy takes. Invalid policies fail to compile, and Init
+ * copies the precomputed configuration without validating or translating
+ * anything.
+ */
+template <typename Policy>
+class WindowsSandboxLauncherT : public WindowsSandboxLauncher
+{
+public:
+  typedef Policy PolicyType;
+
+  bool Init()
+  {
+    return WindowsSandboxLauncher::Init(kCompiledSandboxPolicy<Policy>);
+  }
+};
+
+/**
+ * Runs a worker sandbox for a WorkerTaskQueue, launching a fresh one from
+ * aFactory whenever the queue recycles it.
+ */
+class WindowsWorkerChannel final : public WorkerChannel
+{
+public:
+  typedef std::function<std::unique_ptr<WindowsSandboxLauncher>()>
+    LauncherFactory;
+
+  static const uint32_t kShutdownTimeoutMs;
+
+  WindowsWorkerChannel(LauncherFactory&& aFactory,
+                       const std::wstring_view aExecutablePath,
+                       const std::wstring_view aBaseCmdLine);
+  ~WindowsWorkerChannel();
+
+  bool Start();
+  WindowsSandboxLauncher* GetLauncher() const { return mLauncher.get(); }
+
+  // WorkerChannel
+  WorkerMailbox* GetMailbox() override;
+  void SignalTask() override;
+  bool WaitForResult(uint32_t aTimeoutMs) override;
+  bool Recycle() override;
+
+private:
+  LauncherFactory                         mFactory;
+  std::wstring                            mExecutablePath;
+  std::wstring                            mBaseCmdLine;
+  std::unique_ptr<WindowsSandboxLauncher> mLauncher;
+};
+
+/**
+ * A family of sandboxes that share one job, window station, desktop and
+ * custom SID, while each member keeps its own restricted token. The job's
+ * limits apply to the group as a whole; their active process limit is the
+ * maximum number of members. The first member to launch creates the shared
+ * objects, which live until the group and all of its members are destroyed.
+ */
+class WindowsSandboxGroup final
+{
+public:
+  WindowsSandboxGroup();
+  ~WindowsSandboxGroup();
+
+  // Must be called before any member is launched
+  bool Init(const JobLimits& aLimits);
+  // No further members may be launched
+  void Close();
+  // Tracks member exits and appends any pending job limit violations to
+  // aViolations. Returns true if at least one violation was appended. Members
+  // may be launched while this waits.
+  bool ProcessJobNotifications(unsigned int aTimeoutMs,
+                               std::vector<JobLimitNotification>& aViolations);
+  uint32_t GetMemberCount() const;
+
+  WindowsSandboxGroup(const WindowsSandboxGroup&) = delete;
+  WindowsSandboxGroup& operator=(const WindowsSandboxGroup&) = delete;
+
+private:
+  friend class Win32LaunchBackend;
+  friend class WindowsSandboxLauncher;
+
+  mutable std::mutex  mMutex;
+  bool                mInitialized;
+  JobLimitPlan        mJobLimitPlan;
+  SandboxGroupMembers mMembers;
+  UniqueKernelHandle  mJob;
+  UniqueKernelHandle  mJobPort;
+  HWINSTA             mWinsta;
+  HDESK               mDesktop;
+  HDESK               mParentDesktop;
+  Sid                 mCustomSid;
+};
+
 } // namespace mozilla
 
 #endif // __WINDOWSSANDBOX_H
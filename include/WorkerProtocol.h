@@ -0,0 +1,208 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __WORKERPROTOCOL_H
+#define __WORKERPROTOCOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+namespace mozilla {
+
+enum WorkerMailboxState : uint32_t
+{
+  eWorkerIdle = 0,
+  // Written by the launcher
+  eWorkerTaskPosted,
+  // Written by the worker
+  eWorkerResultPosted,
+  // Written by the launcher; the worker exits once it sees this
+  eWorkerShutdown
+};
+
+enum WorkerTaskStatus : uint32_t
+{
+  eTaskOk = 0,
+  eTaskFailed,
+  eTaskUnknownKind,
+  eTaskOutputTooLarge,
+  // Set by the launcher when the worker did not answer in time or died
+  eTaskTimedOut,
+  eTaskWorkerLost
+};
+
+/**
+ * A section shared between the launcher and a worker sandbox through which
+ * one task at a time is passed down and its result passed back up. Ownership
+ * of everything but mState and mWorkingSet passes back and forth with mState:
+ * the launcher may only write while the mailbox is idle, and the worker may
+ * only write while a task is posted.
+ */
+struct WorkerMailbox
+{
+  static constexpr uint32_t kMagic = 0x4B574253; // "SBWK"
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint32_t kSize = 64 * 1024;
+  static constexpr uint32_t kHeaderSize = 48;
+  static constexpr uint32_t kPayloadSize = kSize - kHeaderSize;
+
+  uint32_t              mMagic;
+  uint32_t              mVersion;
+  std::atomic<uint32_t> mState;
+  uint32_t              mKind;
+  uint64_t              mTaskId;
+  // Of the task's input or the result's output
+  uint32_t              mPayloadSize;
+  uint32_t              mStatus;
+  // The worker's working set after its last task, in bytes
+  std::atomic<uint64_t> mWorkingSet;
+  uint64_t              mTasksServed;
+  uint8_t               mPayload[kPayloadSize];
+
+  void Init();
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+              std::atomic<uint64_t>::is_always_lock_free &&
+              std::is_standard_layout<WorkerMailbox>::value,
+              "WorkerMailbox must be usable in place from shared memory");
+static_assert(offsetof(WorkerMailbox, mPayload) == WorkerMailbox::kHeaderSize &&
+              sizeof(WorkerMailbox) == WorkerMailbox::kSize,
+              "Changing the WorkerMailbox layout requires a version bump");
+
+// Launcher side. Fails unless the mailbox is idle and aInput fits.
+bool PostWorkerTask(WorkerMailbox& aMailbox, uint64_t aTaskId, uint32_t aKind,
+                    const uint8_t* aInput, uint32_t aInputSize);
+// Launcher side. Fails unless a result has been posted; the mailbox is idle
+// again afterwards.
+bool TakeWorkerResult(WorkerMailbox& aMailbox, uint64_t& aTaskId,
+                      WorkerTaskStatus& aStatus, std::vector<uint8_t>& aOutput);
+// Launcher side. Fails if a task is still outstanding.
+bool RequestWorkerShutdown(WorkerMailbox& aMailbox);
+
+typedef std::function<WorkerTaskStatus(uint32_t aKind, const uint8_t* aInput,
+                                       uint32_t aInputSize,
+                                       std::vector<uint8_t>& aOutput)>
+  WorkerTaskHandler;
+
+enum WorkerServeResult
+{
+  eServeNothing = 0,
+  eServeRan,
+  eServeShutdown
+};
+
+/**
+ * Worker side. Runs the posted task, if any, through aHandler and posts its
+ * result along with aWorkingSet.
+ */
+WorkerServeResult ServeWorkerTask(WorkerMailbox& aMailbox,
+                                  const WorkerTaskHandler& aHandler,
+                                  uint64_t aWorkingSet);
+
+/**
+ * When to replace a worker process with a fresh one. Working set growth is
+ * measured from the working set reported after the worker's first task, so
+ * that one-time initialization does not count against it.
+ */
+struct WorkerRecyclePolicy
+{
+  // Zero for no limit
+  uint32_t  mMaxTasks = 0;
+  uint64_t  mMaxWorkingSetGrowth = 0;
+
+  bool ShouldRecycle(uint32_t aTasksServed, uint64_t aBaselineWorkingSet,
+                     uint64_t aWorkingSet) const;
+};
+
+/**
+ * The platform side of a worker: where its mailbox lives, how it is woken
+ * up, and how it is replaced.
+ */
+class WorkerChannel
+{
+public:
+  virtual ~WorkerChannel() {}
+
+  // May change after Recycle
+  virtual WorkerMailbox* GetMailbox() = 0;
+  virtual void SignalTask() = 0;
+  // Returns false if no result was posted within aTimeoutMs or the worker
+  // died
+  virtual bool WaitForResult(uint32_t aTimeoutMs) = 0;
+  // Shuts the current worker down, killing it if need be, and starts a new
+  // one with an idle mailbox
+  virtual bool Recycle() = 0;
+};
+
+struct WorkerResult
+{
+  uint64_t              mTaskId;
+  WorkerTaskStatus      mStatus;
+  std::vector<uint8_t>  mOutput;
+};
+
+/**
+ * Queues tasks for a worker and runs them one at a time, recycling the
+ * worker according to a WorkerRecyclePolicy and whenever it fails to answer.
+ *
+ * Not thread-safe.
+ */
+class WorkerTaskQueue final
+{
+public:
+  struct Stats
+  {
+    uint64_t  mSubmitted;
+    uint64_t  mCompleted;
+    uint64_t  mFailed;
+    uint64_t  mRecycles;
+    size_t    mQueueDepth;
+    size_t    mPeakQueueDepth;
+  };
+
+  WorkerTaskQueue(WorkerChannel& aChannel, const WorkerRecyclePolicy& aPolicy);
+
+  // Returns the task's id, or nothing if aInput does not fit in the mailbox
+  std::optional<uint64_t> Submit(uint32_t aKind, std::vector<uint8_t>&& aInput);
+  // Runs up to aMaxTasks queued tasks, or all of them if zero, appending
+  // their results to aResults in submission order. Returns how many ran.
+  size_t Run(size_t aMaxTasks, uint32_t aTimeoutMs,
+             std::vector<WorkerResult>& aResults);
+
+  Stats GetStats() const;
+
+private:
+  struct Task
+  {
+    uint64_t              mId;
+    uint32_t              mKind;
+    std::vector<uint8_t>  mInput;
+  };
+
+  bool RunOne(const Task& aTask, uint32_t aTimeoutMs, WorkerResult& aResult);
+  bool Recycle();
+
+  WorkerChannel&      mChannel;
+  WorkerRecyclePolicy mPolicy;
+  std::deque<Task>    mQueue;
+  uint64_t            mNextId;
+  // Of the current worker
+  uint32_t            mTasksServed;
+  uint64_t            mBaselineWorkingSet;
+  Stats               mStats;
+};
+
+} // namespace mozilla
+
+#endif // __WORKERPROTOCOL_H
+
@@ -0,0 +1,90 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global allocator so that benchmarks can count allocations and
+// the bytes that they hold. It lives apart from the benchmarks so that the
+// compiler cannot see both sides of an allocation at once.
+
+namespace {
+
+// Each allocation is preceded by its size, padded to keep the alignment that
+// malloc guarantees
+const size_t kHeaderSize = alignof(std::max_align_t);
+
+std::atomic<uint64_t> gAllocations(0);
+std::atomic<int64_t>  gAllocatedBytes(0);
+std::atomic<int64_t>  gPeakAllocatedBytes(0);
+
+} // anonymous namespace
+
+uint64_t
+GetAllocationCount()
+{
+  return gAllocations.load(std::memory_order_relaxed);
+}
+
+int64_t
+GetAllocatedBytes()
+{
+  return gAllocatedBytes.load(std::memory_order_relaxed);
+}
+
+int64_t
+GetPeakAllocatedBytes()
+{
+  return gPeakAllocatedBytes.load(std::memory_order_relaxed);
+}
+
+void
+ResetPeakAllocatedBytes()
+{
+  gPeakAllocatedBytes.store(GetAllocatedBytes(), std::memory_order_relaxed);
+}
+
+void*
+operator new(size_t aSize)
+{
+  gAllocations.fetch_add(1, std::memory_order_relaxed);
+  void* block = malloc(kHeaderSize + aSize);
+  if (!block) {
+    throw std::bad_alloc();
+  }
+  *static_cast<size_t*>(block) = aSize;
+
+  int64_t bytes = gAllocatedBytes.fetch_add(aSize, std::memory_order_relaxed) +
+                  aSize;
+  int64_t peak = gPeakAllocatedBytes.load(std::memory_order_relaxed);
+  while (bytes > peak &&
+         !gPeakAllocatedBytes.compare_exchange_weak(
+           peak, bytes, std::memory_order_relaxed)) {
+  }
+  return static_cast<uint8_t*>(block) + kHeaderSize;
+}
+
+void
+operator delete(void* aPtr) noexcept
+{
+  if (!aPtr) {
+    return;
+  }
+  void* block = static_cast<uint8_t*>(aPtr) - kHeaderSize;
+  gAllocatedBytes.fetch_sub(*static_cast<size_t*>(block),
+                            std::memory_order_relaxed);
+  free(block);
+}
+
+void
+operator delete(void* aPtr, size_t) noexcept
+{
+  operator delete(aPtr);
+}
+
@@ -0,0 +1,4812 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "ChannelRegistry.h"
+#include "CpuRateControl.h"
+#include "JobAccounting.h"
+#include "JobLimits.h"
+#include "LaunchAdmission.h"
+#include "LaunchBackend.h"
+#include "MemoryPressure.h"
+#include "MitigationTable.h"
+#include "PathCanonicalizer.h"
+#include "Placement.h"
+#include "PolicyCompiler.h"
+#include "ResolverCache.h"
+#include "RingChannel.h"
+#include "SandboxAsync.h"
+#include "SandboxGroup.h"
+#include "SandboxPolicy.h"
+#include "SandboxPolicyTraits.h"
+#include "SeccompFilter.h"
+#include "SimulatedKernel.h"
+#include "StartupBlock.h"
+#include "StartupTrace.h"
+#include "TaskGraph.h"
+#include "Teardown.h"
+#include "WaitWord.h"
+#include "WorkerProtocol.h"
+
+#if defined(__linux__)
+#include "LinuxSandbox.h"
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <linux/capability.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace ::std::literals::string_view_literals;
+using std::cout;
+using std::cerr;
+using std::endl;
+using mozilla::AsyncOperation;
+using mozilla::AsyncTask;
+using mozilla::CancellationSource;
+using mozilla::CancellationToken;
+using mozilla::ChannelObject;
+using mozilla::ChannelRegistry;
+using mozilla::CpuRateController;
+using mozilla::CpuRateDecision;
+using mozilla::CompiledSandboxPolicy;
+using mozilla::CpuUsage;
+using mozilla::LaunchAdmissionController;
+using mozilla::MemoryAction;
+using mozilla::MemoryPressurePolicy;
+using mozilla::MemoryTelemetry;
+using mozilla::Placement;
+using mozilla::PlacementRequest;
+using mozilla::PlacementScheduler;
+using mozilla::PolicyRecord;
+using mozilla::QueueExecutor;
+using mozilla::ResolverCache;
+using mozilla::RingChannel;
+using mozilla::RingChannelHeader;
+using mozilla::RingControl;
+using mozilla::RingReader;
+using mozilla::RingWriter;
+using mozilla::SeccompProgram;
+using mozilla::SeccompProgramCache;
+using mozilla::SandboxGroupMembers;
+using mozilla::SandboxTeardown;
+using mozilla::SimulatedCall;
+using mozilla::SimulatedKernel;
+using mozilla::SimulatedLaunchBackend;
+using mozilla::SimulatedKernelTeardown;
+using mozilla::SyscallPolicy;
+using mozilla::SyscallRule;
+using mozilla::TaskGraph;
+using mozilla::TeardownBackend;
+using mozilla::TeardownHandle;
+using mozilla::TeardownReport;
+using mozilla::TeardownTarget;
+using mozilla::WorkerMailbox;
+using mozilla::WorkerRecyclePolicy;
+using mozilla::WorkerResult;
+using mozilla::WorkerTaskQueue;
+using mozilla::WorkerTaskStatus;
+
+// See AllocationCount.cpp
+uint64_t GetAllocationCount();
+int64_t GetAllocatedBytes();
+int64_t GetPeakAllocatedBytes();
+void ResetPeakAllocatedBytes();
+
+namespace {
+
+typedef std::chrono::microseconds Microseconds;
+
+/**
+ * Percentiles of a set of samples in nanoseconds, printed as a JSON object.
+ */
+void
+PrintPercentiles(const char* aName, std::vector<uint64_t>& aSamples)
+{
+  std::sort(aSamples.begin(), aSamples.end());
+  auto at = [&](double aFraction) -> uint64_t {
+    if (aSamples.empty()) {
+      return 0;
+    }
+    size_t index = static_cast<size_t>(aFraction * (aSamples.size() - 1));
+    return aSamples[index];
+  };
+  cout << "\"" << aName << "\": {\"count\": " << aSamples.size()
+       << ", \"p50_ns\": " << at(0.5)
+       << ", \"p90_ns\": " << at(0.9)
+       << ", \"p99_ns\": " << at(0.99)
+       << ", \"max_ns\": " << at(1.0) << "}";
+}
+
+/**
+ * The independent steps of WindowsSandboxLauncher::Launch, with latencies
+ * typical of a cold launch on a desktop machine.
+ */
+struct SimulatedStep
+{
+  const char*   mName;
+  Microseconds  mLatency;
+};
+
+const SimulatedStep kLaunchSteps[] = {
+  {"AbsolutePath",      Microseconds(40)},
+  {"CustomSid",         Microseconds(20)},
+  {"Tokens",            Microseconds(700)},
+  {"WindowStation",     Microseconds(300)},
+  {"Desktop",           Microseconds(1500)},
+  {"Job",               Microseconds(200)},
+  {"StartupTrace",      Microseconds(60)},
+  {"StartupBlock",      Microseconds(80)},
+  {"WorkingDirectory",  Microseconds(1200)},
+};
+
+enum LaunchStep
+{
+  eAbsolutePath, eCustomSid, eTokens, eWindowStation, eDesktop, eJob,
+  eStartupTrace, eStartupBlock, eWorkingDirectory
+};
+
+/**
+ * Builds the same graph as WindowsSandboxLauncher::Launch. If aFailStep is a
+ * valid step, that step fails.
+ */
+void
+BuildLaunchGraph(TaskGraph& aGraph, int aFailStep)
+{
+  auto step = [aFailStep](int aStep) -> TaskGraph::TaskFunc {
+    return [aStep, aFailStep]() -> bool {
+      std::this_thread::sleep_for(kLaunchSteps[aStep].mLatency);
+      return aStep != aFailStep;
+    };
+  };
+
+  aGraph.Add("AbsolutePath", step(eAbsolutePath));
+  auto sid = aGraph.Add("CustomSid", step(eCustomSid));
+  auto tokens = aGraph.Add("Tokens", step(eTokens), {sid});
+  auto winsta = aGraph.Add("WindowStation", step(eWindowStation), {},
+                           TaskGraph::eTaskCallingThread);
+  aGraph.Add("Desktop", step(eDesktop), {sid, winsta},
+             TaskGraph::eTaskCallingThread);
+  auto job = aGraph.Add("Job", step(eJob), {tokens});
+  auto trace = aGraph.Add("StartupTrace", step(eStartupTrace));
+  aGraph.Add("StartupBlock", step(eStartupBlock), {job, trace});
+  aGraph.Add("WorkingDirectory", step(eWorkingDirectory), {tokens});
+}
+
+/**
+ * What Run() used to pay for its helpers on every launch: starting threads
+ * and joining them again.
+ */
+uint64_t
+SpawnAndJoinNs(size_t aThreads)
+{
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < aThreads; ++i) {
+    threads.emplace_back([]() {});
+  }
+  for (auto&& thread : threads) {
+    thread.join();
+  }
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now() - start).count();
+}
+
+// Eight tasks that do nothing, so that only scheduling is measured
+void
+BuildEmptyGraph(TaskGraph& aGraph)
+{
+  auto root = aGraph.Add("Root", []() { return true; });
+  for (int i = 0; i < 6; ++i) {
+    aGraph.Add("Leaf", []() { return true; }, {root});
+  }
+  aGraph.Add("CallingThread", []() { return true; }, {root},
+             TaskGraph::eTaskCallingThread);
+}
+
+int
+BenchTaskGraph(unsigned long aIterations)
+{
+  const unsigned int kThreads = 4;
+  std::vector<uint64_t> serial;
+  std::vector<uint64_t> concurrent;
+  std::vector<uint64_t> cancelled;
+  std::vector<uint64_t> dispatch;
+  std::vector<uint64_t> spawnJoin;
+
+  // Whatever the first launch would otherwise pay to start the pool
+  auto warmUpStart = std::chrono::steady_clock::now();
+  TaskGraph::WarmUp(kThreads);
+  uint64_t warmUpNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - warmUpStart).count();
+
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    TaskGraph serialGraph;
+    BuildLaunchGraph(serialGraph, -1);
+    if (!serialGraph.Run(1)) {
+      cerr << "Serial run failed" << endl;
+      return EXIT_FAILURE;
+    }
+    serial.push_back(serialGraph.GetElapsedNs());
+
+    TaskGraph concurrentGraph;
+    BuildLaunchGraph(concurrentGraph, -1);
+    if (!concurrentGraph.Run(kThreads)) {
+      cerr << "Concurrent run failed" << endl;
+      return EXIT_FAILURE;
+    }
+    concurrent.push_back(concurrentGraph.GetElapsedNs());
+
+    // Token creation failing should cancel everything that depends on it
+    TaskGraph failingGraph;
+    BuildLaunchGraph(failingGraph, eTokens);
+    if (failingGraph.Run(kThreads) ||
+        strcmp(failingGraph.GetName(failingGraph.GetFailedTask()), "Tokens")) {
+      cerr << "Failure was not reported correctly" << endl;
+      return EXIT_FAILURE;
+    }
+    cancelled.push_back(failingGraph.GetElapsedNs());
+
+    TaskGraph emptyGraph;
+    BuildEmptyGraph(emptyGraph);
+    if (!emptyGraph.Run(kThreads)) {
+      cerr << "Empty run failed" << endl;
+      return EXIT_FAILURE;
+    }
+    dispatch.push_back(emptyGraph.GetElapsedNs());
+    spawnJoin.push_back(SpawnAndJoinNs(kThreads - 1));
+  }
+
+  cout << "{\"benchmark\": \"taskgraph\", \"pool_warm_up_ns\": " << warmUpNs
+       << ", ";
+  PrintPercentiles("serial", serial);
+  cout << ", ";
+  PrintPercentiles("concurrent", concurrent);
+  cout << ", ";
+  PrintPercentiles("cancelled", cancelled);
+  cout << ", ";
+  PrintPercentiles("empty_graph", dispatch);
+  cout << ", ";
+  PrintPercentiles("spawn_and_join", spawnJoin);
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * A two socket host with SMT, one processor group per socket.
+ */
+mozilla::PlacementTopology
+MakeSyntheticTopology(uint32_t aSockets, uint32_t aCoresPerSocket)
+{
+  mozilla::PlacementTopology topology;
+  for (uint32_t socket = 0; socket < aSockets; ++socket) {
+    for (uint32_t core = 0; core < aCoresPerSocket; ++core) {
+      for (uint32_t thread = 0; thread < 2; ++thread) {
+        mozilla::LogicalProcessor processor;
+        processor.mGroup = static_cast<uint16_t>(socket);
+        processor.mNumber = static_cast<uint8_t>(core * 2 + thread);
+        processor.mNode = socket;
+        processor.mCore = socket * aCoresPerSocket + core;
+        topology.push_back(processor);
+      }
+    }
+  }
+  return topology;
+}
+
+int
+BenchPlacement(unsigned long aIterations)
+{
+  const uint32_t kSockets = 2;
+  const uint32_t kCoresPerSocket = 32;
+  const size_t kMaxLive = 256;
+  auto topology = MakeSyntheticTopology(kSockets, kCoresPerSocket);
+
+  // Quality check: on an idle host, spreading single-processor sandboxes
+  // should balance the nodes and avoid SMT siblings.
+  uint32_t perNode[kSockets] = {};
+  uint32_t siblingsShared = 0;
+  {
+    PlacementScheduler scheduler(topology);
+    std::vector<uint32_t> coreUse(kSockets * kCoresPerSocket);
+    for (uint32_t i = 0; i < kSockets * kCoresPerSocket; ++i) {
+      Placement placement;
+      if (!scheduler.Place(PlacementRequest(), placement)) {
+        cerr << "Placement failed on an idle host" << endl;
+        return EXIT_FAILURE;
+      }
+      ++perNode[placement.mNode];
+      for (uint32_t bit = 0; bit < 64; ++bit) {
+        if (placement.mAffinity & (1ULL << bit)) {
+          siblingsShared += coreUse[placement.mGroup * kCoresPerSocket +
+                                    bit / 2]++ > 0;
+        }
+      }
+    }
+  }
+
+  PlacementScheduler scheduler(topology);
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<uint32_t> sizeDist(1, 4);
+  std::uniform_int_distribution<uint32_t> policyDist(0, 9);
+  std::uniform_real_distribution<double> loadDist(0.0, 1.0);
+
+  std::vector<Placement> live;
+  std::vector<uint64_t> placeNs;
+  std::vector<uint64_t> releaseNs;
+  unsigned long failures = 0;
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    if (live.size() >= kMaxLive || (!live.empty() && rng() % 3 == 0)) {
+      size_t victim = rng() % live.size();
+      auto start = std::chrono::steady_clock::now();
+      scheduler.Release(live[victim]);
+      releaseNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start).count());
+      live[victim] = live.back();
+      live.pop_back();
+      continue;
+    }
+
+    // Mostly spread, some packed, a few dedicated
+    PlacementRequest request;
+    uint32_t policy = policyDist(rng);
+    request.mPolicy = policy < 7 ? mozilla::ePlacementSpread :
+                      policy < 9 ? mozilla::ePlacementPack :
+                                   mozilla::ePlacementDedicated;
+    request.mProcessors = sizeDist(rng);
+    scheduler.SetLoad(rng() % topology.size(), loadDist(rng));
+
+    Placement placement;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = scheduler.Place(request, placement);
+    placeNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count());
+    if (ok) {
+      live.push_back(placement);
+    } else {
+      ++failures;
+    }
+  }
+
+  cout << "{\"benchmark\": \"placement\", \"processors\": "
+       << topology.size() << ", \"idle_spread_per_node\": [" << perNode[0]
+       << ", " << perNode[1] << "], \"idle_spread_siblings_shared\": "
+       << siblingsShared << ", \"failed_placements\": " << failures << ", ";
+  PrintPercentiles("place", placeNs);
+  cout << ", ";
+  PrintPercentiles("release", releaseNs);
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * A sandbox in the simulated CPU load trace. Foreground sandboxes are
+ * interactive and bursty, background ones would happily use a whole socket.
+ */
+struct SimulatedSandbox
+{
+  mozilla::SandboxPriority  mPriority;
+  double                    mBaseDemand;
+  double                    mBurstDemand;
+};
+
+const SimulatedSandbox kCpuSandboxes[] = {
+  {mozilla::ePriorityForeground, 0.02, 0.30},
+  {mozilla::ePriorityForeground, 0.02, 0.20},
+  {mozilla::ePriorityNormal,     0.08, 0.08},
+  {mozilla::ePriorityNormal,     0.08, 0.08},
+  {mozilla::ePriorityNormal,     0.08, 0.08},
+  {mozilla::ePriorityBackground, 0.25, 0.25},
+  {mozilla::ePriorityBackground, 0.25, 0.25},
+  {mozilla::ePriorityBackground, 0.25, 0.25},
+  {mozilla::ePriorityBackground, 0.25, 0.25},
+};
+
+const size_t kCpuSandboxCount = sizeof(kCpuSandboxes) /
+                                sizeof(kCpuSandboxes[0]);
+
+/**
+ * Runs the load trace for aTicks sampling intervals, with or without a
+ * controller, and returns how much of their demand the foreground sandboxes
+ * received while bursting.
+ */
+double
+SimulateCpuTrace(unsigned long aTicks, CpuRateController* aController,
+                 std::vector<uint64_t>& aUpdateNs, bool& aMinRateHonoured)
+{
+  const double kExternalLoad = 0.1;
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<uint32_t> burstDist(0, 9);
+
+  std::vector<uint32_t> caps(kCpuSandboxCount, mozilla::joblimits::kMaxCpuRate);
+  std::vector<CpuUsage> usage(kCpuSandboxCount);
+  std::vector<CpuRateDecision> decisions;
+  double burstGranted = 0.0;
+  double burstDemanded = 0.0;
+
+  for (unsigned long tick = 0; tick < aTicks; ++tick) {
+    // Foreground sandboxes burst for a few intervals at a time
+    bool burst = (tick / 4) % 3 == 0 || burstDist(rng) == 0;
+
+    double demand[kCpuSandboxCount];
+    double granted[kCpuSandboxCount];
+    double total = 0.0;
+    for (size_t i = 0; i < kCpuSandboxCount; ++i) {
+      const SimulatedSandbox& sandbox = kCpuSandboxes[i];
+      demand[i] = burst ? sandbox.mBurstDemand : sandbox.mBaseDemand;
+      granted[i] = std::min(demand[i],
+                            caps[i] / double(mozilla::joblimits::kMaxCpuRate));
+      total += granted[i];
+    }
+
+    // Contention: without caps, everybody slows down proportionally
+    if (total + kExternalLoad > 1.0) {
+      double scale = (1.0 - kExternalLoad) / total;
+      for (size_t i = 0; i < kCpuSandboxCount; ++i) {
+        granted[i] *= scale;
+      }
+      total = 1.0 - kExternalLoad;
+    }
+
+    for (size_t i = 0; i < kCpuSandboxCount; ++i) {
+      if (burst && kCpuSandboxes[i].mPriority == mozilla::ePriorityForeground) {
+        burstGranted += granted[i];
+        burstDemanded += demand[i];
+      }
+      usage[i] = CpuUsage{static_cast<uint32_t>(i), granted[i]};
+    }
+
+    if (!aController) {
+      continue;
+    }
+
+    decisions.clear();
+    auto start = std::chrono::steady_clock::now();
+    aController->Update(total + kExternalLoad, usage, decisions);
+    aUpdateNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start).count());
+    for (auto&& decision : decisions) {
+      caps[decision.mId] = decision.mCpuRate;
+    }
+    for (size_t i = 0; i < kCpuSandboxCount; ++i) {
+      if (caps[i] < mozilla::GetCpuShare(kCpuSandboxes[i].mPriority).mMinRate) {
+        aMinRateHonoured = false;
+      }
+    }
+  }
+
+  return burstDemanded > 0.0 ? burstGranted / burstDemanded : 1.0;
+}
+
+int
+BenchCpuRate(unsigned long aIterations)
+{
+  const unsigned long ticks = std::max(aIterations, 100UL);
+
+  std::vector<uint64_t> unused;
+  bool minRateHonoured = true;
+  double uncontrolled = SimulateCpuTrace(ticks, nullptr, unused,
+                                         minRateHonoured);
+
+  CpuRateController controller;
+  for (size_t i = 0; i < kCpuSandboxCount; ++i) {
+    controller.Add(static_cast<uint32_t>(i), kCpuSandboxes[i].mPriority);
+  }
+  std::vector<uint64_t> updateNs;
+  double controlled = SimulateCpuTrace(ticks, &controller, updateNs,
+                                       minRateHonoured);
+
+  if (!minRateHonoured) {
+    cerr << "A sandbox was capped below its minimum rate" << endl;
+    return EXIT_FAILURE;
+  }
+
+  cout << "{\"benchmark\": \"cpurate\", \"sandboxes\": " << kCpuSandboxCount
+       << ", \"ticks\": " << ticks
+       << ", \"foreground_burst_satisfaction\": {\"uncontrolled\": "
+       << uncontrolled << ", \"controlled\": " << controlled << "}, ";
+  PrintPercentiles("update", updateNs);
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Simulated memory telemetry: a fixed population of sandboxes, a few of which
+ * are busy at any time, on a host whose other workloads ramp up until memory
+ * runs short and then back down again.
+ */
+int
+BenchMemoryPressure(unsigned long aIterations)
+{
+  const uint64_t kMiB = 1024 * 1024;
+  const uint64_t kTotal = 16384 * kMiB;
+  const uint64_t kTickNs = 1000000000ULL;
+  const size_t kSandboxes = 64;
+  const unsigned long ticks = std::max(aIterations, 200UL);
+
+  struct SimulatedMemory
+  {
+    uint64_t  mNaturalWorkingSet;
+    uint64_t  mWorkingSet;
+    uint64_t  mLimit;
+    uint64_t  mCpuTime;
+    uint64_t  mLastActiveNs;
+  };
+
+  std::mt19937 rng(11);
+  std::uniform_int_distribution<uint64_t> sizeDist(64, 256);
+  std::vector<SimulatedMemory> sandboxes(kSandboxes);
+  MemoryPressurePolicy policy;
+  for (size_t i = 0; i < kSandboxes; ++i) {
+    uint64_t size = sizeDist(rng) * kMiB;
+    sandboxes[i] = SimulatedMemory{size, size, 0, 0, 0};
+    policy.Add(static_cast<uint32_t>(i), 0);
+  }
+
+  std::vector<MemoryTelemetry> telemetry(kSandboxes);
+  std::vector<MemoryAction> actions;
+  std::vector<uint64_t> updateNs;
+  unsigned long trims = 0;
+  unsigned long activeTrims = 0;
+  unsigned long limits = 0;
+  double minAvailable = 1.0;
+  double minAvailableUnmanaged = 1.0;
+
+  for (unsigned long tick = 0; tick < ticks; ++tick) {
+    const uint64_t now = (tick + 1) * kTickNs;
+
+    // Other workloads grow to 14GiB over the first half of the run
+    double phase = static_cast<double>(tick) / ticks;
+    double ramp = phase < 0.5 ? phase * 2.0 : (1.0 - phase) * 2.0;
+    uint64_t external = static_cast<uint64_t>((2048 + 12288 * ramp) * kMiB);
+
+    uint64_t used = external;
+    uint64_t unmanaged = external;
+    for (size_t i = 0; i < kSandboxes; ++i) {
+      SimulatedMemory& sandbox = sandboxes[i];
+      // The first eight sandboxes are always busy, the rest wake up rarely
+      bool active = i < 8 || rng() % 50 == 0;
+      if (active) {
+        sandbox.mCpuTime += 10000;
+        sandbox.mLastActiveNs = now;
+        // Busy sandboxes fault their working set back in
+        sandbox.mWorkingSet = std::min(sandbox.mNaturalWorkingSet,
+                                       sandbox.mWorkingSet + 32 * kMiB);
+      }
+      if (sandbox.mLimit) {
+        sandbox.mWorkingSet = std::min(sandbox.mWorkingSet, sandbox.mLimit);
+      }
+      used += sandbox.mWorkingSet;
+      unmanaged += sandbox.mNaturalWorkingSet;
+      telemetry[i] = MemoryTelemetry{static_cast<uint32_t>(i),
+                                     sandbox.mNaturalWorkingSet,
+                                     sandbox.mWorkingSet, sandbox.mCpuTime, 0};
+    }
+
+    mozilla::HostMemory host = {kTotal, used < kTotal ? kTotal - used : 0};
+    minAvailable = std::min(minAvailable,
+                            static_cast<double>(host.mAvailable) / kTotal);
+    minAvailableUnmanaged = std::min(minAvailableUnmanaged,
+      unmanaged < kTotal ? static_cast<double>(kTotal - unmanaged) / kTotal
+                         : 0.0);
+
+    actions.clear();
+    auto start = std::chrono::steady_clock::now();
+    policy.Update(now, host, telemetry, actions);
+    updateNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start).count());
+
+    for (auto&& action : actions) {
+      SimulatedMemory& sandbox = sandboxes[action.mId];
+      switch (action.mKind) {
+        case mozilla::eMemoryActionTrim:
+          ++trims;
+          activeTrims += sandbox.mLastActiveNs == now;
+          sandbox.mWorkingSet = 2 * kMiB;
+          break;
+        case mozilla::eMemoryActionLimit:
+          ++limits;
+          sandbox.mLimit = action.mWorkingSetLimit;
+          break;
+        case mozilla::eMemoryActionRestore:
+          sandbox.mLimit = 0;
+          break;
+      }
+    }
+  }
+
+  if (activeTrims) {
+    cerr << "Sandboxes were trimmed while active" << endl;
+    return EXIT_FAILURE;
+  }
+
+  cout << "{\"benchmark\": \"memory\", \"sandboxes\": " << kSandboxes
+       << ", \"ticks\": " << ticks << ", \"trims\": " << trims
+       << ", \"limits\": " << limits
+       << ", \"min_available_fraction\": {\"unmanaged\": "
+       << minAvailableUnmanaged << ", \"managed\": " << minAvailable << "}, ";
+  PrintPercentiles("update", updateNs);
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Compares launches that resolve the working directory and executable path
+ * every time against launches that go through a ResolverCache. The fake
+ * resolvers stand in for SHGetKnownFolderPath, which loads shell32 and reads
+ * the user's profile, and for _wfullpath.
+ */
+int
+BenchResolverCache(unsigned long aIterations)
+{
+  const Microseconds kKnownFolderLatency(250);
+  const Microseconds kFullPathLatency(5);
+  const std::wstring kUsers[] = {L"S-1-5-21-1-1000", L"S-1-5-21-1-1001"};
+
+  std::atomic<uint64_t> resolves(0);
+  auto knownFolder = [&](const std::wstring& aUser) -> ResolverCache::Resolver {
+    return [&, aUser]() -> std::optional<std::wstring> {
+      ++resolves;
+      std::this_thread::sleep_for(kKnownFolderLatency);
+      return L"C:\\Users\\" + aUser + L"\\AppData\\LocalLow";
+    };
+  };
+  auto fullPath = [&]() -> std::optional<std::wstring> {
+    ++resolves;
+    std::this_thread::sleep_for(kFullPathLatency);
+    return std::wstring(L"C:\\Program Files\\sandbox\\child.exe");
+  };
+
+  std::vector<uint64_t> uncached;
+  std::vector<uint64_t> cached;
+  ResolverCache cache;
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    const std::wstring& user = kUsers[i % 2];
+
+    auto start = std::chrono::steady_clock::now();
+    auto dir = knownFolder(user)();
+    auto path = fullPath();
+    uncached.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start).count());
+
+    start = std::chrono::steady_clock::now();
+    auto cachedDir = cache.GetWorkingDirectory(user, knownFolder(user));
+    auto cachedPath = cache.GetAbsolutePath(L"C:\\|child", fullPath);
+    cached.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start).count());
+
+    if (cachedDir != dir || cachedPath != path) {
+      cerr << "Cached resolution differs" << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Invalidating one user must only force that user's folder to be resolved
+  resolves = 0;
+  cache.InvalidateUser(kUsers[0]);
+  cache.GetWorkingDirectory(kUsers[0], knownFolder(kUsers[0]));
+  cache.GetWorkingDirectory(kUsers[1], knownFolder(kUsers[1]));
+  cache.GetAbsolutePath(L"C:\\|child", fullPath);
+  if (resolves != 1) {
+    cerr << "Invalidation did not behave as expected" << endl;
+    return EXIT_FAILURE;
+  }
+
+  // Failures are not remembered
+  resolves = 0;
+  auto failing = [&]() -> std::optional<std::wstring> {
+    ++resolves;
+    return {};
+  };
+  cache.GetAbsolutePath(L"C:\\|missing", failing);
+  cache.GetAbsolutePath(L"C:\\|missing", failing);
+  if (resolves != 2) {
+    cerr << "A failed resolution was cached" << endl;
+    return EXIT_FAILURE;
+  }
+
+  ResolverCache::Stats stats = cache.GetStats();
+  cout << "{\"benchmark\": \"resolver\", \"hits\": " << stats.mHits
+       << ", \"misses\": " << stats.mMisses << ", ";
+  PrintPercentiles("uncached", uncached);
+  cout << ", ";
+  PrintPercentiles("cached", cached);
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+struct PathCase
+{
+  const wchar_t*  mInput;
+  uint32_t        mFlags;
+  // nullptr if canonicalization should fail
+  const wchar_t*  mExpected;
+};
+
+const wchar_t kBenchCurrentDirectory[] = L"C:\\Users\\sandbox\\work";
+
+const PathCase kPathCases[] = {
+  {L"child", mozilla::eCanonDefaultExtension,
+   L"C:\\Users\\sandbox\\work\\child.exe"},
+  {L"child.dll", mozilla::eCanonDefaultExtension,
+   L"C:\\Users\\sandbox\\work\\child.dll"},
+  {L"..\\..\\bin/./child", mozilla::eCanonNormal, L"C:\\Users\\bin\\child"},
+  {L"C:\\..\\..\\child", mozilla::eCanonNormal, L"C:\\child"},
+  {L"C:", mozilla::eCanonNormal, L"C:\\Users\\sandbox\\work"},
+  {L"C:child", mozilla::eCanonNormal, L"C:\\Users\\sandbox\\work\\child"},
+  {L"D:child", mozilla::eCanonNormal, L"D:\\child"},
+  {L"\\child", mozilla::eCanonNormal, L"C:\\child"},
+  {L"C:\\a\\\\b//c\\", mozilla::eCanonNormal, L"C:\\a\\b\\c"},
+  {L"C:\\a\\child. . ", mozilla::eCanonNormal, L"C:\\a\\child"},
+  {L"C:\\a.\\child", mozilla::eCanonNormal, nullptr},
+  {L"//server/share/../x", mozilla::eCanonNormal, L"\\\\server\\share\\x"},
+  {L"\\\\server", mozilla::eCanonNormal, nullptr},
+  {L"\\\\?\\C:\\a\\child", mozilla::eCanonDefaultExtension,
+   L"\\\\?\\C:\\a\\child.exe"},
+  {L"\\\\?\\C:\\a\\..\\child", mozilla::eCanonNormal, nullptr},
+  {L"\\\\?\\UNC\\server\\share\\x", mozilla::eCanonNormal,
+   L"\\\\?\\UNC\\server\\share\\x"},
+  {L"\\\\.\\pipe\\x", mozilla::eCanonNormal, nullptr},
+  {L"C:\\a\\child.exe:stream", mozilla::eCanonNormal, nullptr},
+  {L"C:\\a\\*.exe", mozilla::eCanonNormal, nullptr},
+  {L"", mozilla::eCanonNormal, nullptr},
+};
+
+bool
+CheckPathCases(const mozilla::PathContext& aContext)
+{
+  std::wstring out;
+  bool ok = true;
+  for (auto&& testCase : kPathCases) {
+    bool result = mozilla::CanonicalizePath(testCase.mInput, aContext, out,
+                                            testCase.mFlags);
+    if (result != !!testCase.mExpected ||
+        (result && out != testCase.mExpected)) {
+      std::wcerr << L"Canonicalizing \"" << testCase.mInput << L"\" gave "
+                 << (result ? L"\"" + out + L"\"" : std::wstring(L"failure"))
+                 << std::endl;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+/**
+ * Checks properties of the canonicalizer that must hold for any input: it
+ * terminates, its output is absolute, contains no dot segments or repeated
+ * separators, and canonicalizing the output again does not change it.
+ */
+int
+FuzzPathCanonicalizer(unsigned long aIterations)
+{
+  const wchar_t* const kFragments[] = {
+    L"a", L"bc", L".", L"..", L"...", L"\\", L"/", L"\\\\", L":", L"C:",
+    L"d:", L"?", L"\\\\?\\", L"\\\\.\\", L"UNC\\", L" ", L"x.exe", L"*",
+    L"\\\\server\\share", L"\x263A", L"\t",
+  };
+  const size_t kFragmentCount = sizeof(kFragments) / sizeof(kFragments[0]);
+
+  mozilla::PathContext context;
+  context.mCurrentDirectory = kBenchCurrentDirectory;
+  std::mt19937 rng(1234);
+  std::uniform_int_distribution<size_t> fragmentDist(0, kFragmentCount - 1);
+  std::uniform_int_distribution<size_t> lengthDist(1, 12);
+
+  std::wstring input;
+  std::wstring out;
+  std::wstring again;
+  unsigned long accepted = 0;
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    input.clear();
+    for (size_t n = lengthDist(rng); n; --n) {
+      input += kFragments[fragmentDist(rng)];
+    }
+    // Occasionally exercise the long path limits
+    if (rng() % 64 == 0) {
+      for (size_t n = rng() % 300; n; --n) {
+        input += L"\\abcdefgh";
+      }
+    }
+    uint32_t flags = rng() % 4;
+
+    if (!mozilla::CanonicalizePath(input, context, out, flags)) {
+      continue;
+    }
+    ++accepted;
+
+    mozilla::PathKind kind = mozilla::ClassifyPath(out);
+    bool verbatim = kind == mozilla::ePathLongDrive ||
+                    kind == mozilla::ePathLongUnc;
+    bool absolute = verbatim || kind == mozilla::ePathDriveAbsolute ||
+                    kind == mozilla::ePathUnc;
+    size_t tail = kind == mozilla::ePathUnc ? 2 : 0;
+    bool clean = out.find(L'/') == std::wstring::npos &&
+                 out.find(L"\\.\\") == std::wstring::npos &&
+                 out.find(L"\\..\\") == std::wstring::npos &&
+                 out.find(L"\\\\", tail) == std::wstring::npos;
+    bool stable = mozilla::CanonicalizePath(out, context, again, flags) &&
+                  again == out;
+    if (!absolute || (!verbatim && !clean) || !stable ||
+        out.size() > mozilla::pathcanon::kMaxLongPath) {
+      std::wcerr << L"Canonicalizing \"" << input << L"\" gave \"" << out
+                 << L"\", then \"" << again << L"\"" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  cout << "{\"benchmark\": \"pathfuzz\", \"inputs\": " << aIterations
+       << ", \"accepted\": " << accepted << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+int
+BenchPathCanonicalizer(unsigned long aIterations)
+{
+  mozilla::PathContext context;
+  context.mCurrentDirectory = kBenchCurrentDirectory;
+  if (!CheckPathCases(context)) {
+    return EXIT_FAILURE;
+  }
+
+  std::wstring deep = L"deploy";
+  for (int i = 0; i < 40; ++i) {
+    deep += L"\\component";
+  }
+  deep += L"\\..\\child";
+
+  const std::wstring inputs[] = {
+    L"child", L"..\\bin\\child", L"C:\\Program Files\\sandbox\\child.exe",
+    deep,
+  };
+  const char* const names[] = {"relative", "dotdot", "absolute", "long"};
+
+  cout << "{\"benchmark\": \"path\"";
+  std::wstring out;
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i) {
+    std::vector<uint64_t> samples;
+    for (unsigned long n = 0; n < aIterations; ++n) {
+      auto start = std::chrono::steady_clock::now();
+      bool ok = mozilla::CanonicalizePath(inputs[i], context, out,
+                                          mozilla::eCanonDefaultExtension |
+                                          mozilla::eCanonLongPathPrefix);
+      samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start).count());
+      if (!ok) {
+        cerr << "Canonicalization failed" << endl;
+        return EXIT_FAILURE;
+      }
+    }
+    cout << ", ";
+    PrintPercentiles(names[i], samples);
+  }
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Stands in for the Win32 calls that tear a sandbox down. Processes exit a
+ * little while after their job is terminated, a desktop DACL update costs as
+ * much as a read-modify-write of the desktop's security descriptor, and
+ * closing a handle costs a few microseconds of kernel time. Also checks that
+ * every handle is closed exactly once and that no window station is closed
+ * while a desktop is still open.
+ */
+class SimulatedTeardownBackend final : public TeardownBackend
+{
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  explicit SimulatedTeardownBackend(size_t aHandleCount)
+    : mCloseCounts(aHandleCount)
+  {
+  }
+
+  void AddProcess(uintptr_t aJob, uintptr_t aProcess, Microseconds aExitDelay)
+  {
+    mJobs.push_back(SimulatedJob{aJob, aProcess, aExitDelay, Clock::time_point()});
+  }
+
+  void AddDesktop() { ++mOpenDesktops; }
+
+  bool TerminateJob(uintptr_t aJob) override
+  {
+    Spin(Microseconds(20));
+    for (auto&& job : mJobs) {
+      if (job.mJob == aJob) {
+        job.mExitTime = Clock::now() + job.mExitDelay;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t WaitForExit(const std::vector<uintptr_t>& aProcesses,
+                     uint32_t aTimeoutMs) override
+  {
+    Clock::time_point deadline = Clock::now() +
+                                 std::chrono::milliseconds(aTimeoutMs);
+    Clock::time_point lastExit = Clock::now();
+    for (uintptr_t process : aProcesses) {
+      for (auto&& job : mJobs) {
+        if (job.mProcess == process) {
+          lastExit = std::max(lastExit, job.mExitTime);
+        }
+      }
+    }
+    std::this_thread::sleep_until(std::min(lastExit, deadline));
+    return lastExit > deadline ? 1 : 0;
+  }
+
+  bool RevertDesktopAces(uintptr_t aDesktop,
+                         const std::vector<const mozilla::SidBytes*>& aSids) override
+  {
+    Spin(Microseconds(300));
+    ++mDesktopUpdates;
+    mRevertedSids += aSids.size();
+    return true;
+  }
+
+  size_t CloseHandles(const TeardownHandle* aHandles, size_t aCount) override
+  {
+    size_t failures = 0;
+    for (size_t i = 0; i < aCount; ++i) {
+      Spin(Microseconds(5));
+      const TeardownHandle& handle = aHandles[i];
+      if (!handle.mValue || handle.mValue > mCloseCounts.size() ||
+          mCloseCounts[handle.mValue - 1]++) {
+        ++failures;
+        continue;
+      }
+      if (handle.mKind == mozilla::eTeardownHandleDesktop) {
+        --mOpenDesktops;
+      } else if (handle.mKind == mozilla::eTeardownHandleWindowStation &&
+                 mOpenDesktops) {
+        ++mOrderViolations;
+      }
+    }
+    return failures;
+  }
+
+  bool AllClosedOnce() const
+  {
+    return std::all_of(mCloseCounts.begin(), mCloseCounts.end(),
+                       [](const std::atomic<int>& aCount) -> bool {
+      return aCount == 1;
+    });
+  }
+
+  size_t                    mDesktopUpdates = 0;
+  size_t                    mRevertedSids = 0;
+  std::atomic<size_t>       mOrderViolations{0};
+
+private:
+  static void Spin(Microseconds aDuration)
+  {
+    Clock::time_point end = Clock::now() + aDuration;
+    while (Clock::now() < end) {
+    }
+  }
+
+  struct SimulatedJob
+  {
+    uintptr_t         mJob;
+    uintptr_t         mProcess;
+    Microseconds      mExitDelay;
+    Clock::time_point mExitTime;
+  };
+
+  std::vector<SimulatedJob>       mJobs;
+  std::vector<std::atomic<int>>   mCloseCounts;
+  std::atomic<size_t>             mOpenDesktops{0};
+};
+
+/**
+ * Builds aCount sandboxes that share one parent desktop, each with a job, a
+ * job completion port, a process, a desktop and a window station. Handle
+ * values are 1-based indices into the backend's close counts.
+ */
+std::vector<TeardownTarget>
+BuildTeardownTargets(size_t aCount, SimulatedTeardownBackend& aBackend,
+                     std::mt19937& aRng)
+{
+  const uintptr_t kParentDesktop = 0x1000000;
+  std::uniform_int_distribution<int> exitDelay(1000, 3000);
+  std::vector<TeardownTarget> targets(aCount);
+  uintptr_t nextHandle = 1;
+  for (size_t i = 0; i < aCount; ++i) {
+    TeardownTarget& target = targets[i];
+    target.mJob = nextHandle++;
+    target.mProcess = nextHandle++;
+    uintptr_t jobPort = nextHandle++;
+    target.mHandles = {
+      {target.mJob, mozilla::eTeardownHandleKernel},
+      {jobPort, mozilla::eTeardownHandleKernel},
+      {target.mProcess, mozilla::eTeardownHandleKernel},
+      {nextHandle++, mozilla::eTeardownHandleDesktop},
+      {nextHandle++, mozilla::eTeardownHandleWindowStation},
+    };
+    target.mParentDesktop = kParentDesktop;
+    target.mDesktopAceSid.assign(12, static_cast<uint8_t>(i));
+    aBackend.AddProcess(target.mJob, target.mProcess,
+                        Microseconds(exitDelay(aRng)));
+    aBackend.AddDesktop();
+  }
+  return targets;
+}
+
+/**
+ * Compares SandboxTeardown against tearing each sandbox down on its own, the
+ * way that ~WindowsSandboxLauncher and the desktop cleanup would: terminate,
+ * wait, revert one ACE, then close each handle.
+ */
+int
+BenchTeardown(unsigned long aIterations)
+{
+  const size_t kSandboxCounts[] = {1, 10, 100};
+  const size_t kCountCount = sizeof(kSandboxCounts) / sizeof(kSandboxCounts[0]);
+  const size_t kHandlesPerSandbox = 5;
+  const uint32_t kTimeoutMs = 5000;
+  const unsigned long runs = std::max(3UL, aIterations / 10);
+
+  std::mt19937 rng(38);
+  cout << "{\"benchmark\": \"teardown\", \"runs\": " << runs
+       << ", \"results\": [";
+  for (size_t c = 0; c < kCountCount; ++c) {
+    const size_t count = kSandboxCounts[c];
+    std::vector<uint64_t> sequentialNs;
+    std::vector<uint64_t> bulkNs;
+    std::vector<uint64_t> phaseNs[mozilla::eTeardownPhaseCount];
+
+    for (unsigned long run = 0; run < runs; ++run) {
+      {
+        SimulatedTeardownBackend backend(count * kHandlesPerSandbox);
+        std::vector<TeardownTarget> targets =
+          BuildTeardownTargets(count, backend, rng);
+        auto start = std::chrono::steady_clock::now();
+        for (auto&& target : targets) {
+          backend.TerminateJob(target.mJob);
+          backend.WaitForExit({target.mProcess}, kTimeoutMs);
+          backend.RevertDesktopAces(target.mParentDesktop,
+                                    {&target.mDesktopAceSid});
+          for (auto&& handle : target.mHandles) {
+            backend.CloseHandles(&handle, 1);
+          }
+        }
+        sequentialNs.push_back(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+      }
+
+      SimulatedTeardownBackend backend(count * kHandlesPerSandbox);
+      SandboxTeardown teardown;
+      for (auto&& target : BuildTeardownTargets(count, backend, rng)) {
+        teardown.Add(std::move(target));
+      }
+      TeardownReport report;
+      if (!teardown.Run(backend, kTimeoutMs, report)) {
+        cerr << "Teardown of " << count << " sandboxes failed" << endl;
+        return EXIT_FAILURE;
+      }
+      if (!backend.AllClosedOnce() ||
+          report.mHandlesClosed != count * kHandlesPerSandbox) {
+        cerr << "Handles were not closed exactly once" << endl;
+        return EXIT_FAILURE;
+      }
+      if (backend.mOrderViolations) {
+        cerr << "A window station was closed before its desktop" << endl;
+        return EXIT_FAILURE;
+      }
+      if (backend.mDesktopUpdates != 1 || backend.mRevertedSids != count) {
+        cerr << "Expected one desktop update for " << count << " SIDs, got "
+             << backend.mDesktopUpdates << " for " << backend.mRevertedSids
+             << endl;
+        return EXIT_FAILURE;
+      }
+      bulkNs.push_back(report.mTotalNs);
+      for (int phase = 0; phase < mozilla::eTeardownPhaseCount; ++phase) {
+        phaseNs[phase].push_back(report.mPhaseNs[phase]);
+      }
+    }
+
+    cout << (c ? ", " : "") << "{\"sandboxes\": " << count << ", ";
+    PrintPercentiles("sequential", sequentialNs);
+    cout << ", ";
+    PrintPercentiles("bulk", bulkNs);
+    cout << ", \"phases\": {";
+    for (int phase = 0; phase < mozilla::eTeardownPhaseCount; ++phase) {
+      cout << (phase ? ", " : "");
+      PrintPercentiles(mozilla::GetTeardownPhaseName(
+                         static_cast<mozilla::TeardownPhase>(phase)),
+                       phaseNs[phase]);
+    }
+    cout << "}}";
+  }
+  cout << "]}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * A launch storm: every request arrives within the first 100ms. Launch
+ * latency grows superlinearly once more than a handful of launches contend
+ * for the desktop heap and the token APIs.
+ */
+struct AdmissionRequest
+{
+  uint64_t                  mArrivalNs;
+  mozilla::SandboxPriority  mPriority;
+  uint64_t                  mDeadlineNs;
+};
+
+struct AdmissionOutcome
+{
+  std::vector<uint64_t>     mEndToEndNs[mozilla::ePriorityCount];
+  std::vector<uint64_t>     mLaunchNs;
+  unsigned long             mMetDeadline = 0;
+  unsigned long             mShed = 0;
+  unsigned long             mAccounted = 0;
+  uint32_t                  mPeakInFlight = 0;
+  mozilla::AdmissionStats   mStats = {};
+};
+
+uint64_t
+SimulatedLaunchNs(uint32_t aConcurrency, std::mt19937& aRng)
+{
+  const double kBaseNs = 30e6;
+  const double kKnee = 6.0;
+  std::uniform_real_distribution<double> jitter(0.8, 1.2);
+  double contention = std::max(1.0, aConcurrency / kKnee);
+  return static_cast<uint64_t>(kBaseNs * std::pow(contention, 1.5) *
+                               jitter(aRng));
+}
+
+/**
+ * Discrete event simulation of a storm. Without aController every request
+ * launches as soon as it arrives.
+ */
+void
+SimulateAdmission(const std::vector<AdmissionRequest>& aRequests,
+                  LaunchAdmissionController* aController,
+                  AdmissionOutcome& aOutcome)
+{
+  enum EventKind { eArrival, eCompletion, eTick };
+  struct Event
+  {
+    uint64_t  mTimeNs;
+    EventKind mKind;
+    uint64_t  mId;
+    uint64_t  mLatencyNs;
+    bool operator>(const Event& aOther) const
+    {
+      return mTimeNs > aOther.mTimeNs;
+    }
+  };
+  const uint64_t kTickNs = 5000000;
+
+  std::mt19937 rng(39);
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+  for (size_t i = 0; i < aRequests.size(); ++i) {
+    events.push(Event{aRequests[i].mArrivalNs, eArrival, i, 0});
+  }
+
+  uint32_t inFlight = 0;
+  auto start = [&](uint64_t aId, uint64_t aNowNs) -> void {
+    ++inFlight;
+    aOutcome.mPeakInFlight = std::max(aOutcome.mPeakInFlight, inFlight);
+    uint64_t latency = SimulatedLaunchNs(inFlight, rng);
+    events.push(Event{aNowNs + latency, eCompletion, aId, latency});
+  };
+
+  std::vector<uint64_t> admitted;
+  std::vector<uint64_t> shed;
+  auto dispatch = [&](uint64_t aNowNs) -> void {
+    admitted.clear();
+    shed.clear();
+    aController->Dispatch(aNowNs, admitted, shed);
+    for (uint64_t id : admitted) {
+      start(id, aNowNs);
+    }
+    aOutcome.mShed += shed.size();
+    aOutcome.mAccounted += shed.size();
+  };
+
+  bool ticking = false;
+  while (!events.empty()) {
+    Event event = events.top();
+    events.pop();
+    const AdmissionRequest* request = event.mKind == eTick ? nullptr :
+                                      &aRequests[event.mId];
+    switch (event.mKind) {
+      case eArrival:
+        if (!aController) {
+          start(event.mId, event.mTimeNs);
+          break;
+        }
+        switch (aController->Submit(event.mId, request->mPriority,
+                                    event.mTimeNs, request->mDeadlineNs)) {
+          case mozilla::eAdmissionAdmitted:
+            start(event.mId, event.mTimeNs);
+            break;
+          case mozilla::eAdmissionShed:
+            ++aOutcome.mShed;
+            ++aOutcome.mAccounted;
+            break;
+          case mozilla::eAdmissionQueued:
+            if (!ticking) {
+              ticking = true;
+              events.push(Event{event.mTimeNs + kTickNs, eTick, 0, 0});
+            }
+            break;
+        }
+        break;
+      case eCompletion:
+        --inFlight;
+        ++aOutcome.mAccounted;
+        aOutcome.mLaunchNs.push_back(event.mLatencyNs);
+        aOutcome.mEndToEndNs[request->mPriority].push_back(
+          event.mTimeNs - request->mArrivalNs);
+        if (!request->mDeadlineNs || event.mTimeNs <= request->mDeadlineNs) {
+          ++aOutcome.mMetDeadline;
+        }
+        if (aController) {
+          aController->Complete(event.mLatencyNs);
+          dispatch(event.mTimeNs);
+        }
+        break;
+      case eTick: {
+        dispatch(event.mTimeNs);
+        mozilla::AdmissionStats stats = aController->GetStats();
+        size_t queued = 0;
+        for (size_t depth : stats.mQueueDepth) {
+          queued += depth;
+        }
+        ticking = queued > 0;
+        if (ticking) {
+          events.push(Event{event.mTimeNs + kTickNs, eTick, 0, 0});
+        }
+        break;
+      }
+    }
+  }
+
+  if (aController) {
+    aOutcome.mStats = aController->GetStats();
+  }
+}
+
+void
+PrintAdmissionOutcome(const char* aName, AdmissionOutcome& aOutcome)
+{
+  static const char* const kPriorityNames[] = {
+    "background", "normal", "foreground"
+  };
+  cout << "\"" << aName << "\": {\"met_deadline\": " << aOutcome.mMetDeadline
+       << ", \"shed\": " << aOutcome.mShed
+       << ", \"peak_in_flight\": " << aOutcome.mPeakInFlight
+       << ", \"peak_queue_depth\": " << aOutcome.mStats.mPeakQueueDepth
+       << ", \"final_limit\": " << aOutcome.mStats.mLimit << ", ";
+  PrintPercentiles("launch", aOutcome.mLaunchNs);
+  for (int priority = mozilla::ePriorityCount - 1; priority >= 0; --priority) {
+    cout << ", ";
+    PrintPercentiles(kPriorityNames[priority], aOutcome.mEndToEndNs[priority]);
+  }
+  cout << "}";
+}
+
+int
+BenchAdmission(unsigned long aIterations)
+{
+  const size_t requestCount = std::max(500UL, aIterations * 5);
+  const uint64_t kMs = 1000000;
+
+  std::mt19937 rng(390);
+  std::uniform_int_distribution<uint64_t> arrival(0, 100 * kMs);
+  std::vector<AdmissionRequest> requests(requestCount);
+  for (size_t i = 0; i < requestCount; ++i) {
+    AdmissionRequest& request = requests[i];
+    request.mArrivalNs = arrival(rng);
+    if (i % 10 == 0) {
+      request.mPriority = mozilla::ePriorityForeground;
+      request.mDeadlineNs = request.mArrivalNs + 1000 * kMs;
+    } else if (i % 10 < 7) {
+      request.mPriority = mozilla::ePriorityNormal;
+      request.mDeadlineNs = request.mArrivalNs + 5000 * kMs;
+    } else {
+      request.mPriority = mozilla::ePriorityBackground;
+      request.mDeadlineNs = 0;
+    }
+  }
+
+  AdmissionOutcome unbounded;
+  SimulateAdmission(requests, nullptr, unbounded);
+  AdmissionOutcome controlled;
+  LaunchAdmissionController controller;
+  SimulateAdmission(requests, &controller, controlled);
+
+  if (unbounded.mAccounted != requestCount ||
+      controlled.mAccounted != requestCount) {
+    cerr << "Requests were lost" << endl;
+    return EXIT_FAILURE;
+  }
+  if (controlled.mMetDeadline < unbounded.mMetDeadline) {
+    cerr << "Admission control made fewer launches meet their deadline"
+         << endl;
+    return EXIT_FAILURE;
+  }
+
+  cout << "{\"benchmark\": \"admission\", \"requests\": " << requestCount
+       << ", ";
+  PrintAdmissionOutcome("unbounded", unbounded);
+  cout << ", ";
+  PrintAdmissionOutcome("admission", controlled);
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Drives SandboxGroupMembers with random launches, failed launches, exits
+ * and closes, and checks it against a straightforward model of the group.
+ */
+int
+BenchSandboxGroup(unsigned long aIterations)
+{
+  const uint32_t kCapacities[] = {1, 4, 32};
+  const unsigned long opsPerGroup = std::max(aIterations * 10, 1000UL);
+
+  std::mt19937 rng(40);
+  std::vector<uint64_t> opNs;
+  unsigned long launches = 0;
+  unsigned long rejected = 0;
+  unsigned long exits = 0;
+
+  for (uint32_t capacity : kCapacities) {
+    SandboxGroupMembers members(capacity);
+    // Slots launching, and running processes by slot
+    std::vector<uint32_t> launching;
+    std::vector<std::pair<uint32_t, uint32_t>> running;
+    uint32_t nextProcessId = 4;
+    bool closed = false;
+
+    for (unsigned long op = 0; op < opsPerGroup; ++op) {
+      unsigned int choice = rng() % 100;
+      auto start = std::chrono::steady_clock::now();
+      if (choice < 40) {
+        std::optional<uint32_t> slot = members.Reserve();
+        bool expected = !closed && launching.size() + running.size() < capacity;
+        if (slot.has_value() != expected) {
+          cerr << "Reserve " << (expected ? "failed" : "succeeded")
+               << " unexpectedly" << endl;
+          return EXIT_FAILURE;
+        }
+        if (slot) {
+          launching.push_back(slot.value());
+        } else {
+          ++rejected;
+        }
+      } else if (choice < 70 && !launching.empty()) {
+        size_t index = rng() % launching.size();
+        uint32_t slot = launching[index];
+        launching.erase(launching.begin() + index);
+        // One launch in five fails
+        if (rng() % 5) {
+          uint32_t processId = nextProcessId += 4;
+          if (!members.Commit(slot, processId) ||
+              members.GetProcessId(slot) != processId) {
+            cerr << "Commit of slot " << slot << " failed" << endl;
+            return EXIT_FAILURE;
+          }
+          running.emplace_back(slot, processId);
+          ++launches;
+        } else if (!members.Cancel(slot)) {
+          cerr << "Cancel of slot " << slot << " failed" << endl;
+          return EXIT_FAILURE;
+        }
+      } else if (choice < 98 && !running.empty()) {
+        size_t index = rng() % running.size();
+        auto member = running[index];
+        running.erase(running.begin() + index);
+        if (members.OnProcessExit(member.second) != member.first) {
+          cerr << "Exit of process " << member.second
+               << " freed the wrong slot" << endl;
+          return EXIT_FAILURE;
+        }
+        ++exits;
+      } else if (choice >= 98) {
+        // Processes outside of the group exit, too
+        if (members.OnProcessExit(1)) {
+          cerr << "A non-member's exit freed a slot" << endl;
+          return EXIT_FAILURE;
+        }
+        if (op > opsPerGroup / 2) {
+          members.Close();
+          closed = true;
+        }
+      }
+      opNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start).count());
+
+      if (members.GetCount(mozilla::eMemberLaunching) != launching.size() ||
+          members.GetCount(mozilla::eMemberRunning) != running.size() ||
+          members.GetCount(mozilla::eMemberFree) !=
+            capacity - launching.size() - running.size()) {
+        cerr << "Member counts diverged from the model" << endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    // Drain the group
+    members.Close();
+    for (uint32_t slot : launching) {
+      members.Cancel(slot);
+    }
+    for (auto&& member : running) {
+      if (members.IsDrained()) {
+        cerr << "Group drained with members still running" << endl;
+        return EXIT_FAILURE;
+      }
+      members.OnProcessExit(member.second);
+    }
+    if (!members.IsDrained() || members.Reserve()) {
+      cerr << "Closed group did not drain" << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Each separate sandbox has its own job, job completion port, window
+  // station and desktop; a group has one of each.
+  cout << "{\"benchmark\": \"group\", \"launches\": " << launches
+       << ", \"rejected\": " << rejected << ", \"exits\": " << exits
+       << ", \"kernel_objects\": [";
+  for (size_t i = 0; i < sizeof(kCapacities) / sizeof(kCapacities[0]); ++i) {
+    cout << (i ? ", " : "") << "{\"members\": " << kCapacities[i]
+         << ", \"separate\": " << 4 * kCapacities[i]
+         << ", \"grouped\": " << 4 << "}";
+  }
+  cout << "], ";
+  PrintPercentiles("op", opNs);
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * An auto-reset event, standing in for the worker's Win32 events.
+ */
+class SimulatedEvent final
+{
+public:
+  void Set()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSignaled = true;
+    mCondVar.notify_one();
+  }
+
+  bool Wait(std::chrono::milliseconds aTimeout)
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (!mCondVar.wait_for(lock, aTimeout, [this]() { return mSignaled; })) {
+      return false;
+    }
+    mSignaled = false;
+    return true;
+  }
+
+private:
+  std::mutex              mMutex;
+  std::condition_variable mCondVar;
+  bool                    mSignaled = false;
+};
+
+enum SimulatedTaskKind : uint32_t
+{
+  eSimTaskChecksum = 1,
+  eSimTaskLeak,
+  eSimTaskHang,
+  eSimTaskHuge
+};
+
+const uint32_t kWorkerTimeoutMs = 50;
+
+/**
+ * Runs the worker side of the protocol on a thread instead of in a sandboxed
+ * process. Starting a worker costs as much as a sandbox launch. Each worker
+ * has its own mailbox, so a recycled worker that finishes a task late cannot
+ * confuse its successor.
+ */
+class InProcessWorkerChannel final : public mozilla::WorkerChannel
+{
+public:
+  explicit InProcessWorkerChannel(Microseconds aLaunchLatency)
+    : mLaunchLatency(aLaunchLatency)
+    , mLaunches(0)
+  {
+    Start();
+  }
+
+  ~InProcessWorkerChannel() { Stop(); }
+
+  WorkerMailbox* GetMailbox() override { return mWorker->mMailbox.get(); }
+  void SignalTask() override { mWorker->mTaskEvent.Set(); }
+  bool WaitForResult(uint32_t aTimeoutMs) override
+  {
+    return mWorker->mResultEvent.Wait(std::chrono::milliseconds(aTimeoutMs));
+  }
+  bool Recycle() override
+  {
+    Stop();
+    Start();
+    return true;
+  }
+
+  unsigned long GetLaunches() const { return mLaunches; }
+
+private:
+  struct Worker
+  {
+    std::unique_ptr<WorkerMailbox>  mMailbox;
+    SimulatedEvent                  mTaskEvent;
+    SimulatedEvent                  mResultEvent;
+    std::atomic<bool>               mStopping{false};
+    std::thread                     mThread;
+  };
+
+  static void WorkerMain(Worker* aWorker)
+  {
+    const uint64_t kBaseWorkingSet = 8 * 1024 * 1024;
+    uint64_t leaked = 0;
+    mozilla::WorkerTaskHandler handler =
+      [&leaked](uint32_t aKind, const uint8_t* aInput, uint32_t aInputSize,
+                std::vector<uint8_t>& aOutput) -> WorkerTaskStatus {
+      switch (aKind) {
+        case eSimTaskChecksum: {
+          uint32_t sum = 0;
+          for (uint32_t i = 0; i < aInputSize; ++i) {
+            sum = sum * 31 + aInput[i];
+          }
+          aOutput.resize(sizeof(sum));
+          memcpy(aOutput.data(), &sum, sizeof(sum));
+          return mozilla::eTaskOk;
+        }
+        case eSimTaskLeak:
+          leaked += 16 * 1024 * 1024;
+          return mozilla::eTaskOk;
+        case eSimTaskHang:
+          std::this_thread::sleep_for(
+            std::chrono::milliseconds(kWorkerTimeoutMs * 3));
+          return mozilla::eTaskOk;
+        case eSimTaskHuge:
+          aOutput.resize(WorkerMailbox::kPayloadSize + 1);
+          return mozilla::eTaskOk;
+        default:
+          return mozilla::eTaskUnknownKind;
+      }
+    };
+
+    while (true) {
+      aWorker->mTaskEvent.Wait(std::chrono::hours(1));
+      if (aWorker->mStopping) {
+        return;
+      }
+      switch (mozilla::ServeWorkerTask(*aWorker->mMailbox, handler,
+                                       kBaseWorkingSet + leaked)) {
+        case mozilla::eServeShutdown:
+          return;
+        case mozilla::eServeRan:
+          aWorker->mResultEvent.Set();
+          break;
+        case mozilla::eServeNothing:
+          break;
+      }
+    }
+  }
+
+  void Start()
+  {
+    std::this_thread::sleep_for(mLaunchLatency);
+    mWorker = std::make_unique<Worker>();
+    mWorker->mMailbox = std::make_unique<WorkerMailbox>();
+    mWorker->mMailbox->Init();
+    mWorker->mThread = std::thread(WorkerMain, mWorker.get());
+    ++mLaunches;
+  }
+
+  void Stop()
+  {
+    // A worker that is stuck in a task stops once it is done with it
+    if (!mozilla::RequestWorkerShutdown(*mWorker->mMailbox)) {
+      mWorker->mStopping = true;
+    }
+    mWorker->mTaskEvent.Set();
+    mWorker->mThread.join();
+    mWorker.reset();
+  }
+
+  Microseconds            mLaunchLatency;
+  unsigned long           mLaunches;
+  std::unique_ptr<Worker> mWorker;
+};
+
+/**
+ * Checks the protocol's edge cases: results come back in order and intact,
+ * a hung worker is replaced, oversized output is refused, and the recycle
+ * policy fires on task count and on working set growth.
+ */
+int
+CheckWorkerProtocol()
+{
+  InProcessWorkerChannel channel(Microseconds(0));
+  WorkerRecyclePolicy policy;
+  policy.mMaxTasks = 10;
+  policy.mMaxWorkingSetGrowth = 40 * 1024 * 1024;
+  WorkerTaskQueue queue(channel, policy);
+
+  std::vector<uint64_t> ids;
+  ids.push_back(queue.Submit(eSimTaskChecksum, {1, 2, 3}).value());
+  ids.push_back(queue.Submit(eSimTaskHang, {}).value());
+  ids.push_back(queue.Submit(eSimTaskChecksum, {1, 2, 3}).value());
+  ids.push_back(queue.Submit(eSimTaskHuge, {}).value());
+  ids.push_back(queue.Submit(99, {}).value());
+  if (queue.Submit(eSimTaskChecksum,
+                   std::vector<uint8_t>(WorkerMailbox::kPayloadSize + 1))) {
+    cerr << "An oversized task was accepted" << endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<WorkerResult> results;
+  while (queue.Run(0, kWorkerTimeoutMs, results)) {
+  }
+  const WorkerTaskStatus expected[] = {
+    mozilla::eTaskOk, mozilla::eTaskTimedOut, mozilla::eTaskOk,
+    mozilla::eTaskOutputTooLarge, mozilla::eTaskUnknownKind
+  };
+  uint32_t checksum = (1 * 31 + 2) * 31 + 3;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    if (results.size() != ids.size() || results[i].mTaskId != ids[i] ||
+        results[i].mStatus != expected[i]) {
+      cerr << "Unexpected result for task " << ids[i] << endl;
+      return EXIT_FAILURE;
+    }
+    if (expected[i] == mozilla::eTaskOk &&
+        (results[i].mOutput.size() != sizeof(checksum) ||
+         memcmp(results[i].mOutput.data(), &checksum, sizeof(checksum)))) {
+      cerr << "Wrong output for task " << ids[i] << endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (queue.GetStats().mRecycles != 1) {
+    cerr << "The hung worker was not recycled exactly once" << endl;
+    return EXIT_FAILURE;
+  }
+
+  // After 10 tasks, and after the working set grows by more than 40MiB
+  unsigned long recycles = queue.GetStats().mRecycles;
+  for (int i = 0; i < 10; ++i) {
+    queue.Submit(eSimTaskChecksum, {0});
+  }
+  for (int i = 0; i < 4; ++i) {
+    queue.Submit(eSimTaskLeak, {});
+  }
+  results.clear();
+  queue.Run(0, kWorkerTimeoutMs, results);
+  // The worker has served 3 tasks since the hang; the 10th task comes first
+  // and the 3rd leak exceeds the growth limit
+  if (queue.GetStats().mRecycles - recycles != 2) {
+    cerr << "Expected 2 recycles, got "
+         << queue.GetStats().mRecycles - recycles << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Compares launching a sandbox per task against reusing worker sandboxes
+ * for a stream of small tasks, some of which leak.
+ */
+int
+BenchWorker(unsigned long aIterations)
+{
+  if (CheckWorkerProtocol() != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  const unsigned long taskCount = std::max(aIterations, 20UL);
+  const Microseconds kLaunchLatency(5000);
+  struct Mode
+  {
+    const char* mName;
+    uint32_t    mMaxTasks;
+    uint64_t    mMaxGrowth;
+  } const modes[] = {
+    {"per_task_launch", 1, 0},
+    {"worker", 100, 64 * 1024 * 1024},
+  };
+
+  cout << "{\"benchmark\": \"worker\", \"tasks\": " << taskCount;
+  for (auto&& mode : modes) {
+    InProcessWorkerChannel channel(kLaunchLatency);
+    WorkerRecyclePolicy policy;
+    policy.mMaxTasks = mode.mMaxTasks;
+    policy.mMaxWorkingSetGrowth = mode.mMaxGrowth;
+    WorkerTaskQueue queue(channel, policy);
+
+    std::vector<uint64_t> taskNs;
+    std::vector<WorkerResult> results;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < taskCount; ++i) {
+      // One task in ten leaks 16MiB
+      if (i % 10 == 9) {
+        queue.Submit(eSimTaskLeak, {});
+      } else {
+        queue.Submit(eSimTaskChecksum, std::vector<uint8_t>(4096, uint8_t(i)));
+      }
+      auto taskStart = std::chrono::steady_clock::now();
+      queue.Run(1, kWorkerTimeoutMs, results);
+      taskNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - taskStart).count());
+    }
+    double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start).count();
+
+    WorkerTaskQueue::Stats stats = queue.GetStats();
+    if (stats.mCompleted != taskCount) {
+      cerr << mode.mName << ": " << stats.mFailed << " tasks failed" << endl;
+      return EXIT_FAILURE;
+    }
+    cout << ", \"" << mode.mName << "\": {\"tasks_per_sec\": "
+         << taskCount / seconds << ", \"launches\": " << channel.GetLaunches()
+         << ", \"recycles\": " << stats.mRecycles << ", ";
+    PrintPercentiles("task", taskNs);
+    cout << "}";
+  }
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Stands in for the thread pool that completes a WindowsSandboxLauncher's
+ * asynchronous operations: completions run on one thread once due.
+ */
+class SimulatedAsyncBackend
+{
+public:
+  SimulatedAsyncBackend()
+    : mStopping(false)
+    , mThread([this]() -> void { Loop(); })
+  {}
+
+  ~SimulatedAsyncBackend()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStopping = true;
+    }
+    mCondVar.notify_one();
+    mThread.join();
+  }
+
+  void Schedule(Microseconds aDelay, std::function<void()>&& aCompletion)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mPending.push(Pending{std::chrono::steady_clock::now() + aDelay,
+                            mNextSequence++, std::move(aCompletion)});
+    }
+    mCondVar.notify_one();
+  }
+
+  // Completes with the time of completion, so that the awaiting coroutine
+  // can tell how long it took to resume
+  AsyncOperation<uint64_t> Simulate(QueueExecutor& aExecutor,
+                                    Microseconds aDelay,
+                                    const CancellationToken& aToken)
+  {
+    AsyncOperation<uint64_t> operation(aExecutor, aToken);
+    Schedule(aDelay, [operation]() -> void {
+      operation.Complete(NowNs());
+    });
+    return operation;
+  }
+
+  static uint64_t NowNs()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+private:
+  struct Pending
+  {
+    std::chrono::steady_clock::time_point mDue;
+    uint64_t                              mSequence;
+    std::function<void()>                 mCompletion;
+
+    bool operator<(const Pending& aOther) const
+    {
+      // Earliest first out of std::priority_queue
+      return mDue != aOther.mDue ? mDue > aOther.mDue :
+                                   mSequence > aOther.mSequence;
+    }
+  };
+
+  void Loop()
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (!mStopping) {
+      if (mPending.empty()) {
+        mCondVar.wait(lock);
+        continue;
+      }
+      auto due = mPending.top().mDue;
+      if (std::chrono::steady_clock::now() < due) {
+        mCondVar.wait_until(lock, due);
+        continue;
+      }
+      std::function<void()> completion =
+        std::move(const_cast<Pending&>(mPending.top()).mCompletion);
+      mPending.pop();
+      lock.unlock();
+      completion();
+      lock.lock();
+    }
+  }
+
+  std::mutex                    mMutex;
+  std::condition_variable       mCondVar;
+  std::priority_queue<Pending>  mPending;
+  uint64_t                      mNextSequence = 0;
+  bool                          mStopping;
+  std::thread                   mThread;
+};
+
+const uint32_t kAsyncMessages = 4;
+
+struct AsyncSandboxStats
+{
+  std::vector<uint64_t> mResumeNs;
+  unsigned long         mFinished = 0;
+  unsigned long         mCancelled = 0;
+};
+
+/**
+ * A broker's view of one sandbox: launch it, receive its messages and wait
+ * for it to exit, all on the executor's thread.
+ */
+AsyncTask<bool>
+RunSimulatedSandbox(QueueExecutor& aExecutor, SimulatedAsyncBackend& aBackend,
+                    Microseconds aLaunchLatency, CancellationToken aToken,
+                    AsyncSandboxStats& aStats)
+{
+  std::optional<uint64_t> launched =
+    co_await aBackend.Simulate(aExecutor, aLaunchLatency, aToken);
+  if (!launched) {
+    co_return false;
+  }
+  aStats.mResumeNs.push_back(SimulatedAsyncBackend::NowNs() - *launched);
+
+  for (uint32_t i = 0; i < kAsyncMessages; ++i) {
+    std::optional<uint64_t> received =
+      co_await aBackend.Simulate(aExecutor, Microseconds(100),
+                                           aToken);
+    if (!received) {
+      co_return false;
+    }
+    aStats.mResumeNs.push_back(SimulatedAsyncBackend::NowNs() - *received);
+  }
+
+  std::optional<uint64_t> exited =
+    co_await aBackend.Simulate(aExecutor, Microseconds(200), aToken);
+  co_return exited.has_value();
+}
+
+AsyncTask<uint64_t>
+AddOne(uint64_t aValue)
+{
+  co_return aValue + 1;
+}
+
+// Awaits aCount subtasks that never suspend, and as many completed operations
+AsyncTask<uint64_t>
+AwaitReady(QueueExecutor& aExecutor, unsigned long aCount)
+{
+  uint64_t total = 0;
+  for (unsigned long i = 0; i < aCount; ++i) {
+    total = co_await AddOne(total);
+    AsyncOperation<uint64_t> operation(aExecutor);
+    operation.Complete(1);
+    total += (co_await operation).value_or(0);
+  }
+  co_return total;
+}
+
+/**
+ * Measures what the coroutine plumbing costs a broker that drives many
+ * sandboxes from one thread: the latency from a simulated completion to the
+ * awaiting coroutine resuming, the cost of awaits that need not suspend, and
+ * how promptly cancellation unblocks coroutines.
+ */
+int
+BenchAsync(unsigned long aIterations)
+{
+  const unsigned long sandboxCount = std::max(aIterations, 10UL);
+  QueueExecutor executor;
+
+  // Awaits that complete synchronously
+  const unsigned long kReadyAwaits = 100000;
+  uint64_t readyTotal = 0;
+  bool readyDone = false;
+  auto readyStart = std::chrono::steady_clock::now();
+  mozilla::Spawn(executor, AwaitReady(executor, kReadyAwaits),
+                 [&](uint64_t aTotal) -> void {
+    readyTotal = aTotal;
+    readyDone = true;
+  });
+  while (!readyDone) {
+    executor.Run(10);
+  }
+  double readyNs = std::chrono::duration<double, std::nano>(
+                     std::chrono::steady_clock::now() - readyStart).count() /
+                   (2 * kReadyAwaits);
+  if (readyTotal != 2 * kReadyAwaits) {
+    cerr << "Ready awaits produced " << readyTotal << endl;
+    return EXIT_FAILURE;
+  }
+
+  cout << "{\"benchmark\": \"async\", \"sandboxes\": " << sandboxCount
+       << ", \"ready_await_ns\": " << readyNs;
+
+  // Half of the sandboxes are cancelled while their launch is outstanding
+  for (bool cancel : {false, true}) {
+    SimulatedAsyncBackend backend;
+    AsyncSandboxStats stats;
+    CancellationSource cancelSource;
+    std::mt19937 rng(43);
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < sandboxCount; ++i) {
+      bool cancellable = cancel && i % 2;
+      Microseconds latency(cancellable ? 1000000 : 2000 + rng() % 3000);
+      CancellationToken token =
+        cancellable ? cancelSource.GetToken() : CancellationToken();
+      mozilla::Spawn(executor,
+                     RunSimulatedSandbox(executor, backend, latency, token,
+                                         stats),
+                     [&](bool aOk) -> void {
+        ++(aOk ? stats.mFinished : stats.mCancelled);
+      });
+    }
+    if (cancel) {
+      executor.Run(0);
+      cancelSource.Cancel();
+    }
+    while (stats.mFinished + stats.mCancelled < sandboxCount) {
+      executor.Run(10);
+    }
+    double wallMs = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - start).count();
+
+    unsigned long expectedCancelled = cancel ? sandboxCount / 2 : 0;
+    // The cancelled launches would otherwise take a second
+    if (stats.mCancelled != expectedCancelled || wallMs > 900) {
+      cerr << "Expected " << expectedCancelled << " cancelled sandboxes, got "
+           << stats.mCancelled << " after " << wallMs << "ms" << endl;
+      return EXIT_FAILURE;
+    }
+
+    cout << ", \"" << (cancel ? "half_cancelled" : "all") << "\": {"
+         << "\"wall_ms\": " << wallMs << ", \"finished\": " << stats.mFinished
+         << ", \"cancelled\": " << stats.mCancelled << ", ";
+    PrintPercentiles("resume", stats.mResumeNs);
+    cout << "}";
+  }
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * A content process policy, as it would be written for
+ * WindowsSandboxLauncherT.
+ */
+struct BenchContentPolicy
+{
+  static constexpr uint32_t kInitFlags = 0;
+  static constexpr uint64_t kMitigationPolicies[2] = {
+    mozilla::mitigation::kDepEnable | mozilla::mitigation::kSehopEnable |
+    mozilla::mitigation::kBottomUpAslr | mozilla::mitigation::kHeapTerminate,
+    mozilla::mitigation::kCetUserShadowStacks
+  };
+  static constexpr uint64_t kDeferredMitigationPolicies[2] = {
+    mozilla::mitigation::kWin32kSystemCallDisable |
+    mozilla::mitigation::kProhibitDynamicCode |
+    mozilla::mitigation::kImageLoadNoRemote,
+    0
+  };
+  static constexpr uint32_t kRestrictingSids = mozilla::eRestrictAll;
+
+  static constexpr mozilla::JobLimits GetJobLimits()
+  {
+    // Until C++20, only std::optional's trivial assignments are constexpr
+    mozilla::JobLimits limits;
+    limits.mJobMemoryLimit = std::make_optional<uint64_t>(2048ULL << 20);
+    limits.mMinWorkingSet = std::make_optional<uint64_t>(16ULL << 20);
+    limits.mMaxWorkingSet = std::make_optional<uint64_t>(512ULL << 20);
+    limits.mCpuWeight = std::make_optional<uint32_t>(5);
+    limits.mNotifyJobMemory = std::make_optional<uint64_t>(1536ULL << 20);
+    limits.mKillOnJobClose = true;
+    return limits;
+  }
+};
+
+constexpr CompiledSandboxPolicy kBenchContentPolicy =
+  mozilla::kCompiledSandboxPolicy<BenchContentPolicy>;
+
+static_assert(kBenchContentPolicy.mJobLimitPlan.mCpuRateOrWeight == 5 &&
+              (kBenchContentPolicy.mJobLimitPlan.mLimitFlags &
+               mozilla::joblimits::kLimitWorkingSet),
+              "Job limits must be translated while compiling");
+// What CompileSandboxPolicy rejects
+static_assert(!mozilla::CanDeferMitigations(
+                {0, mozilla::mitigation::kCetUserShadowStacks}) &&
+              !mozilla::CanDeferMitigations(
+                {mozilla::mitigation::kControlFlowGuard, 0}) &&
+              !mozilla::CanDeferMitigations(
+                {mozilla::mitigation::kHighEntropyAslr, 0}),
+              "Creation-only and 64-bit only mitigations cannot be deferred");
+static_assert(mozilla::CanDeferMitigations(
+                BenchContentPolicy::kDeferredMitigationPolicies),
+              "Win32k, dynamic code and image load policies can be deferred");
+
+PolicyRecord
+MakeBenchContentRecord()
+{
+  PolicyRecord record = {};
+  record.mInitFlags = BenchContentPolicy::kInitFlags;
+  for (int i = 0; i < 2; ++i) {
+    record.mMitigationPolicies[i] = BenchContentPolicy::kMitigationPolicies[i];
+    record.mDeferredMitigationPolicies[i] =
+      BenchContentPolicy::kDeferredMitigationPolicies[i];
+  }
+  record.mRestrictingSids = BenchContentPolicy::kRestrictingSids;
+  record.mUiRestrictions = mozilla::joblimits::kUiLimitAll;
+  record.mJobLimitFields = mozilla::eFieldJobMemory |
+                           mozilla::eFieldWorkingSet |
+                           mozilla::eFieldCpuWeight |
+                           mozilla::eFieldNotifyJobMemory |
+                           mozilla::eFieldKillOnJobClose;
+  record.mActiveProcessLimit = 1;
+  record.mJobMemoryLimit = 2048ULL << 20;
+  record.mMinWorkingSet = 16ULL << 20;
+  record.mMaxWorkingSet = 512ULL << 20;
+  record.mCpuWeight = 5;
+  record.mNotifyJobMemory = 1536ULL << 20;
+  return record;
+}
+
+/**
+ * The launcher side of WindowsSandboxLauncher::Init(const PolicyRecord&):
+ * everything that a compile-time policy does not need to do at launch.
+ */
+bool
+ConfigureAtRuntime(const PolicyRecord& aRecord,
+                   CompiledSandboxPolicy& aPolicy)
+{
+  using namespace mozilla;
+
+  if ((aRecord.mRestrictingSids & eRestrictRequired) != eRestrictRequired) {
+    return false;
+  }
+
+  JobLimits limits;
+  aRecord.GetJobLimits(limits);
+  if (!TranslateJobLimits(limits, aPolicy.mJobLimitPlan)) {
+    return false;
+  }
+
+  aPolicy.mInitFlags = aRecord.mInitFlags & ePolicyInitNoSeparateWindowStation;
+  aPolicy.mMitigationPolicies[0] = aRecord.mMitigationPolicies[0];
+  aPolicy.mMitigationPolicies[1] = aRecord.mMitigationPolicies[1];
+  aPolicy.mDeferredMitigationPolicies[0] =
+    aRecord.mDeferredMitigationPolicies[0];
+  aPolicy.mDeferredMitigationPolicies[1] =
+    aRecord.mDeferredMitigationPolicies[1];
+  aPolicy.mRestrictingSids = aRecord.mRestrictingSids;
+  return true;
+}
+
+/**
+ * Compares configuring a launcher from a runtime policy against a policy
+ * compiled by CompileSandboxPolicy. Each sample times a batch of
+ * configurations, since a single one is too quick to time on its own.
+ */
+int
+BenchCompiledPolicy(unsigned long aIterations)
+{
+  const unsigned long kBatch = 1000;
+  const PolicyRecord record = MakeBenchContentRecord();
+
+  // Both paths must arrive at the same configuration
+  CompiledSandboxPolicy runtime = {};
+  if (!ConfigureAtRuntime(record, runtime) ||
+      memcmp(&runtime.mJobLimitPlan, &kBenchContentPolicy.mJobLimitPlan,
+             sizeof(runtime.mJobLimitPlan)) ||
+      runtime.mRestrictingSids != kBenchContentPolicy.mRestrictingSids ||
+      runtime.mDeferredMitigationPolicies[0] !=
+        kBenchContentPolicy.mDeferredMitigationPolicies[0]) {
+    cerr << "The runtime and compiled policies differ" << endl;
+    return EXIT_FAILURE;
+  }
+
+  // Keeps the compiler from discarding either loop
+  volatile uint32_t sink = 0;
+  // Keeps the compiler from folding the runtime record
+  const PolicyRecord* volatile recordPtr = &record;
+
+  std::vector<uint64_t> runtimeNs;
+  std::vector<uint64_t> compiledNs;
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long j = 0; j < kBatch; ++j) {
+      CompiledSandboxPolicy policy;
+      if (!ConfigureAtRuntime(*recordPtr, policy)) {
+        return EXIT_FAILURE;
+      }
+      sink = sink + policy.mJobLimitPlan.mLimitFlags;
+    }
+    auto mid = std::chrono::steady_clock::now();
+    for (unsigned long j = 0; j < kBatch; ++j) {
+      CompiledSandboxPolicy policy = kBenchContentPolicy;
+      sink = sink + policy.mJobLimitPlan.mLimitFlags;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    runtimeNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          mid - start).count());
+    compiledNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           end - mid).count());
+  }
+
+  cout << "{\"benchmark\": \"policy\", \"batch\": " << kBatch << ", ";
+  PrintPercentiles("runtime", runtimeNs);
+  cout << ", ";
+  PrintPercentiles("compiled", compiledNs);
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Latencies for SimulatedKernel that add up to those of kLaunchSteps
+ */
+SimulatedKernel::Config
+MakeRealisticKernelConfig()
+{
+  using namespace mozilla;
+
+  SimulatedKernel::Config config;
+  config.mLatencyNs[eSimResolvePath] = 40000;
+  config.mLatencyNs[eSimCreateSid] = 20000;
+  config.mLatencyNs[eSimCreateToken] = 350000;
+  config.mLatencyNs[eSimCreateWindowStation] = 300000;
+  config.mLatencyNs[eSimSetObjectSecurity] = 200000;
+  config.mLatencyNs[eSimCreateDesktop] = 1300000;
+  config.mLatencyNs[eSimCreateJob] = 150000;
+  config.mLatencyNs[eSimSetJobInformation] = 50000;
+  config.mLatencyNs[eSimCreateSection] = 70000;
+  config.mLatencyNs[eSimResolveWorkingDirectory] = 1200000;
+  config.mLatencyNs[eSimCreateProcess] = 2500000;
+  config.mLatencyNs[eSimSetThreadToken] = 20000;
+  config.mLatencyNs[eSimResumeThread] = 30000;
+  config.mLatencyNs[eSimTerminateProcess] = 100000;
+  config.mLatencyNs[eSimCloseHandle] = 2000;
+  return config;
+}
+
+// As WindowsSandboxLauncher::kLaunchThreads
+const unsigned int kBackendLaunchThreads = 4;
+
+/**
+ * Fails each kind of call in turn and checks that the launch fails without
+ * leaking objects or leaving the launching desktop's DACL modified, then
+ * checks what a successful launch keeps open.
+ */
+bool
+CheckLaunchBackendCleanup()
+{
+  using namespace mozilla;
+
+  for (uint32_t call = 0; call < eSimTerminateProcess; ++call) {
+    SimulatedKernel::Config config;
+    config.mFailEvery[call] = 1;
+    SimulatedKernel kernel(config);
+    SimulatedLaunchBackend backend(kernel, L"child.exe"sv, L"-content"sv);
+    const char* failedStep = nullptr;
+    if (RunLaunchSequence(backend, kBackendLaunchThreads, &failedStep) ||
+        !failedStep || kernel.GetOpenObjectCount() ||
+        kernel.GetDeniedAceCount()) {
+      cerr << "Failing " << SimulatedKernel::GetCallName(
+                              static_cast<SimulatedCall>(call))
+           << " leaked " << kernel.GetOpenObjectCount() << " objects and "
+           << kernel.GetDeniedAceCount() << " ACEs" << endl;
+      return false;
+    }
+  }
+
+  SimulatedKernel kernel;
+  {
+    SimulatedLaunchBackend backend(kernel, L"child.exe"sv, L"-content"sv);
+    // The custom SID, window station, desktop, job and process
+    if (!RunLaunchSequence(backend, kBackendLaunchThreads) ||
+        !backend.IsLaunched() || kernel.GetOpenObjectCount() != 5 ||
+        kernel.GetDeniedAceCount() != 1) {
+      cerr << "A launched sandbox holds " << kernel.GetOpenObjectCount()
+           << " objects" << endl;
+      return false;
+    }
+  }
+  if (kernel.GetOpenObjectCount() || kernel.GetDeniedAceCount()) {
+    cerr << "Releasing a sandbox leaked " << kernel.GetOpenObjectCount()
+         << " objects" << endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Runs launches through the shared launch sequence against a simulated
+ * kernel: once with free calls, to measure the sequence's own overhead and
+ * allocations, and once with realistic latencies, to measure throughput.
+ */
+int
+BenchLaunchBackend(unsigned long aIterations)
+{
+  if (!CheckLaunchBackendCleanup()) {
+    return EXIT_FAILURE;
+  }
+
+  cout << "{\"benchmark\": \"backend\"";
+  const unsigned long realisticLaunches = std::min(aIterations, 200UL);
+  for (bool realistic : {false, true}) {
+    SimulatedKernel kernel(realistic ? MakeRealisticKernelConfig() :
+                                       SimulatedKernel::Config());
+    const unsigned long launches = realistic ? realisticLaunches :
+                                               aIterations * 10;
+    std::vector<uint64_t> launchNs;
+    launchNs.reserve(launches);
+
+    uint64_t allocations = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < launches; ++i) {
+      uint64_t allocationsBefore = GetAllocationCount();
+      auto launchStart = std::chrono::steady_clock::now();
+      bool ok;
+      {
+        SimulatedLaunchBackend backend(kernel, L"child.exe"sv,
+                                       L"-content"sv);
+        ok = mozilla::RunLaunchSequence(backend, kBackendLaunchThreads);
+      }
+      launchNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() -
+                           launchStart).count());
+      allocations += GetAllocationCount() - allocationsBefore;
+      if (!ok) {
+        cerr << "Simulated launch " << i << " failed" << endl;
+        return EXIT_FAILURE;
+      }
+    }
+    double wallS = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start).count();
+
+    if (kernel.GetOpenObjectCount() || kernel.GetDeniedAceCount()) {
+      cerr << "Simulated launches leaked " << kernel.GetOpenObjectCount()
+           << " objects" << endl;
+      return EXIT_FAILURE;
+    }
+
+    cout << ", \"" << (realistic ? "realistic" : "overhead") << "\": {"
+         << "\"launches_per_s\": " << launches / wallS
+         << ", \"allocations_per_launch\": "
+         << static_cast<double>(allocations) / launches << ", ";
+    PrintPercentiles("launch", launchNs);
+    cout << "}";
+  }
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+enum LaunchScenario
+{
+  // Every launch resolves its paths
+  eLaunchCold = 0,
+  // The resolver cache was warmed beforehand
+  eLaunchWarm,
+  // Warm launches from several threads at once
+  eLaunchParallel,
+  eLaunchScenarioCount
+};
+
+const char* const kLaunchScenarioNames[eLaunchScenarioCount] = {
+  "cold", "warm", "parallel"
+};
+
+/**
+ * Launches aCount sandboxes against a simulated kernel with realistic
+ * latencies, keeps them all running, then tears them down as a group, and
+ * prints what that cost as a JSON object.
+ */
+bool
+RunLaunchScenario(LaunchScenario aScenario, size_t aCount)
+{
+  const std::wstring_view kExecutable = L"child.exe"sv;
+  const uint32_t kTeardownTimeoutMs = 5000;
+
+  SimulatedKernel kernel(MakeRealisticKernelConfig());
+  ResolverCache cache;
+  if (aScenario != eLaunchCold &&
+      !SimulatedLaunchBackend::WarmResolverCache(kernel, cache, kExecutable)) {
+    return false;
+  }
+
+  const unsigned int threadCount = aScenario != eLaunchParallel ? 1 :
+    static_cast<unsigned int>(std::min<size_t>(
+      aCount, std::max(2U, std::thread::hardware_concurrency())));
+  std::vector<std::unique_ptr<SimulatedLaunchBackend>> sandboxes(aCount);
+  std::vector<std::vector<uint64_t>> threadLaunchNs(threadCount);
+  std::atomic<size_t> failures(0);
+
+  // Sandbox i is launched by thread i % threadCount
+  auto launchShare = [&](unsigned int aThread) -> void {
+    for (size_t i = aThread; i < aCount; i += threadCount) {
+      if (aScenario == eLaunchCold) {
+        cache.InvalidateAll();
+      }
+      auto start = std::chrono::steady_clock::now();
+      auto sandbox = std::make_unique<SimulatedLaunchBackend>(
+                       kernel, kExecutable, L"-content"sv, &cache);
+      if (!mozilla::RunLaunchSequence(*sandbox, kBackendLaunchThreads)) {
+        ++failures;
+      }
+      threadLaunchNs[aThread].push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start).count());
+      sandboxes[i] = std::move(sandbox);
+    }
+  };
+
+  kernel.ResetPeakOpenObjectCount();
+  ResetPeakAllocatedBytes();
+  const int64_t bytesBefore = GetAllocatedBytes();
+  const uint64_t allocationsBefore = GetAllocationCount();
+  const uint64_t handlesBefore = kernel.GetCallCount(mozilla::eSimCloseHandle) +
+                                 static_cast<uint64_t>(
+                                   kernel.GetOpenObjectCount());
+
+  auto start = std::chrono::steady_clock::now();
+  if (threadCount == 1) {
+    launchShare(0);
+  } else {
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < threadCount; ++t) {
+      threads.emplace_back(launchShare, t);
+    }
+    for (auto&& thread : threads) {
+      thread.join();
+    }
+  }
+  double launchWallMs = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start).count();
+
+  const uint64_t allocations = GetAllocationCount() - allocationsBefore;
+  // Every object that was created has either been closed or is still open
+  const uint64_t handles = kernel.GetCallCount(mozilla::eSimCloseHandle) +
+                           static_cast<uint64_t>(kernel.GetOpenObjectCount()) -
+                           handlesBefore;
+  const int64_t openHandles = kernel.GetOpenObjectCount();
+
+  SandboxTeardown teardown;
+  for (auto&& sandbox : sandboxes) {
+    sandbox->ReleaseForTeardown(teardown);
+  }
+  SimulatedKernelTeardown teardownBackend(kernel);
+  TeardownReport report;
+  bool tornDown = teardown.Run(teardownBackend, kTeardownTimeoutMs, report);
+  const int64_t peakBytes = GetPeakAllocatedBytes() - bytesBefore;
+  const int64_t peakHandles = kernel.GetPeakOpenObjectCount();
+  sandboxes.clear();
+
+  if (failures || !tornDown || kernel.GetOpenObjectCount() ||
+      kernel.GetDeniedAceCount()) {
+    cerr << kLaunchScenarioNames[aScenario] << " launch of " << aCount
+         << " sandboxes: " << failures << " failed, "
+         << kernel.GetOpenObjectCount() << " objects leaked" << endl;
+    return false;
+  }
+
+  std::vector<uint64_t> launchNs;
+  for (auto&& samples : threadLaunchNs) {
+    launchNs.insert(launchNs.end(), samples.begin(), samples.end());
+  }
+
+  cout << "\"" << kLaunchScenarioNames[aScenario] << "\": {"
+       << "\"threads\": " << threadCount
+       << ", \"launch_wall_ms\": " << launchWallMs
+       << ", \"launches_per_s\": " << aCount / (launchWallMs / 1000.0)
+       << ", \"allocations_per_launch\": "
+       << static_cast<double>(allocations) / aCount
+       << ", \"handles_per_launch\": " << static_cast<double>(handles) / aCount
+       << ", \"open_handles\": " << openHandles
+       << ", \"peak_handles\": " << peakHandles
+       << ", \"peak_heap_bytes\": " << peakBytes
+       << ", \"teardown_ns\": " << report.mTotalNs
+       << ", \"teardown_per_sandbox_ns\": " << report.mTotalNs / aCount
+       << ", ";
+  PrintPercentiles("launch", launchNs);
+  cout << "}";
+  return true;
+}
+
+/**
+ * The launch cost regression suite: cold, warm and parallel launches followed
+ * by a group teardown, at 1 to 1,000 concurrent sandboxes. aIterations caps
+ * the number of sandboxes.
+ */
+int
+BenchLaunchSuite(unsigned long aIterations)
+{
+  const size_t kSandboxCounts[] = {1, 10, 100, 1000};
+  const size_t maxCount = std::max(aIterations, 1UL);
+
+  cout << "{\"benchmark\": \"launch\", \"results\": [";
+  bool first = true;
+  for (size_t count : kSandboxCounts) {
+    if (count > maxCount) {
+      break;
+    }
+    cout << (first ? "" : ", ") << "{\"sandboxes\": " << count;
+    first = false;
+    for (int scenario = 0; scenario < eLaunchScenarioCount; ++scenario) {
+      cout << ", ";
+      if (!RunLaunchScenario(static_cast<LaunchScenario>(scenario), count)) {
+        return EXIT_FAILURE;
+      }
+    }
+    cout << "}";
+  }
+  cout << "]}" << endl;
+  return EXIT_SUCCESS;
+}
+
+#if defined(_WIN32) || defined(__linux__)
+
+const std::string_view kChannelPrefix = "sandboxbench"sv;
+const uint64_t kChannelSectionSize = 0x4000;
+
+// What a launcher sets up for each sandbox that it talks to
+enum BenchChannel : uint32_t
+{
+  eBenchChannelNamed = mozilla::eChannelUser,
+  eBenchChannelBuffer,
+  eBenchChannelReady
+};
+const size_t kObjectsPerPair = 4;
+
+bool
+CreateChannelPair(ChannelRegistry& aRegistry,
+                  ChannelRegistry::InstanceId aInstance)
+{
+  return aRegistry.CreateSection(aInstance, eBenchChannelNamed,
+                                 kChannelSectionSize, true) &&
+         aRegistry.CreateSection(aInstance, eBenchChannelBuffer,
+                                 kChannelSectionSize) &&
+         aRegistry.CreateAutoResetEvent(aInstance, eBenchChannelReady) &&
+         aRegistry.CopyForSandbox(aInstance, eBenchChannelBuffer, 0);
+}
+
+#if defined(__linux__)
+
+// Opens a named section the way a sandbox that was given its name would
+bool
+CheckNamedSection(ChannelRegistry& aRegistry,
+                  ChannelRegistry::InstanceId aInstance)
+{
+  std::optional<ChannelObject> section =
+    aRegistry.Find(aInstance, eBenchChannelNamed);
+  std::string name = "/" + aRegistry.GetName(aInstance, eBenchChannelNamed);
+  if (!section || name.size() == 1) {
+    return false;
+  }
+
+  UniqueFd opened(shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0));
+  if (!opened) {
+    return false;
+  }
+  void* launcherView = mmap(nullptr, kChannelSectionSize,
+                            PROT_READ | PROT_WRITE, MAP_SHARED,
+                            static_cast<int>(section->mHandle), 0);
+  void* sandboxView = mmap(nullptr, kChannelSectionSize, PROT_READ,
+                           MAP_SHARED, opened.get(), 0);
+  bool ok = launcherView != MAP_FAILED && sandboxView != MAP_FAILED;
+  if (ok) {
+    *static_cast<uint64_t*>(launcherView) = aInstance;
+    ok = *static_cast<volatile uint64_t*>(sandboxView) == aInstance;
+  }
+  if (launcherView != MAP_FAILED) {
+    munmap(launcherView, kChannelSectionSize);
+  }
+  if (sandboxView != MAP_FAILED) {
+    munmap(sandboxView, kChannelSectionSize);
+  }
+  return ok;
+}
+
+size_t
+CountSharedMemoryNames(const std::string_view aPrefix)
+{
+  size_t count = 0;
+  if (DIR* dir = opendir("/dev/shm")) {
+    while (dirent* entry = readdir(dir)) {
+      count += std::string_view(entry->d_name).substr(0, aPrefix.size()) ==
+               aPrefix;
+    }
+    closedir(dir);
+  }
+  return count;
+}
+
+#endif // defined(__linux__)
+
+/**
+ * Sets up channels for thousands of launcher/sandbox pairs at once from
+ * several threads, checks that every pair got objects of its own, then
+ * releases them all. On Linux, named sections are POSIX shared memory, and
+ * are opened by name and checked for leaks.
+ */
+int
+BenchChannelRegistry(unsigned long aIterations)
+{
+  size_t pairs = aIterations;
+#if defined(__linux__)
+  // Every object is a descriptor
+  struct rlimit limit;
+  if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur != RLIM_INFINITY) {
+    pairs = std::min<size_t>(pairs, (limit.rlim_cur - 256) / kObjectsPerPair);
+  }
+  const size_t leftovers = CountSharedMemoryNames(kChannelPrefix);
+#endif
+  const unsigned int threadCount =
+    std::max(2U, std::min(8U, std::thread::hardware_concurrency()));
+
+  mozilla::PlatformChannelBackend backend;
+  ChannelRegistry registry(backend, kChannelPrefix);
+  std::vector<ChannelRegistry::InstanceId> instances(pairs);
+  std::vector<std::vector<uint64_t>> createNs(threadCount);
+  std::vector<std::vector<uint64_t>> releaseNs(threadCount);
+  std::atomic<size_t> failures(0);
+
+  auto runThreads = [&](auto&& aWork) -> void {
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < threadCount; ++t) {
+      threads.emplace_back([&, t]() -> void {
+        for (size_t i = t; i < pairs; i += threadCount) {
+          aWork(t, i);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  };
+
+  runThreads([&](unsigned int aThread, size_t aPair) -> void {
+    auto start = std::chrono::steady_clock::now();
+    ChannelRegistry::InstanceId instance = registry.CreateInstance();
+    if (!CreateChannelPair(registry, instance)) {
+      ++failures;
+    }
+    createNs[aThread].push_back(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+    instances[aPair] = instance;
+  });
+
+  const size_t peakObjects = registry.GetObjectCount();
+  std::vector<std::string> names;
+  for (ChannelRegistry::InstanceId instance : instances) {
+    names.push_back(registry.GetName(instance, eBenchChannelNamed));
+#if defined(__linux__)
+    if (!CheckNamedSection(registry, instance)) {
+      ++failures;
+    }
+#endif
+  }
+  std::sort(names.begin(), names.end());
+  const bool uniqueNames =
+    std::adjacent_find(names.begin(), names.end()) == names.end();
+#if defined(__linux__)
+  const size_t namedWhileLive = CountSharedMemoryNames(kChannelPrefix) -
+                                leftovers;
+#endif
+
+  runThreads([&](unsigned int aThread, size_t aPair) -> void {
+    auto start = std::chrono::steady_clock::now();
+    if (registry.ReleaseInstance(instances[aPair]) != kObjectsPerPair) {
+      ++failures;
+    }
+    releaseNs[aThread].push_back(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+  });
+
+  // Objects for released instances are destroyed rather than leaked
+  const bool rejectsReleased =
+    !registry.CreateSection(instances.front(), eBenchChannelBuffer,
+                            kChannelSectionSize);
+
+  // Registries in other launchers may share the prefix, but not the names
+  ChannelRegistry other(backend, kChannelPrefix);
+  ChannelRegistry::InstanceId mine = registry.CreateInstance();
+  ChannelRegistry::InstanceId theirs = other.CreateInstance();
+  const bool distinctRegistries =
+    registry.CreateSection(mine, eBenchChannelNamed, kChannelSectionSize,
+                           true) &&
+    other.CreateSection(theirs, eBenchChannelNamed, kChannelSectionSize,
+                        true) &&
+    registry.GetName(mine, eBenchChannelNamed) !=
+      other.GetName(theirs, eBenchChannelNamed);
+  registry.ReleaseInstance(mine);
+  other.ReleaseInstance(theirs);
+
+  if (failures || !uniqueNames || !rejectsReleased || !distinctRegistries ||
+      peakObjects != pairs * kObjectsPerPair ||
+      registry.GetInstanceCount() || registry.GetObjectCount()) {
+    cerr << "Channel registry check failed" << endl;
+    return EXIT_FAILURE;
+  }
+#if defined(__linux__)
+  if (namedWhileLive != pairs ||
+      CountSharedMemoryNames(kChannelPrefix) != leftovers) {
+    cerr << "POSIX shared memory names leaked or went missing" << endl;
+    return EXIT_FAILURE;
+  }
+#endif
+
+  std::vector<uint64_t> allCreateNs, allReleaseNs;
+  for (unsigned int t = 0; t < threadCount; ++t) {
+    allCreateNs.insert(allCreateNs.end(), createNs[t].begin(),
+                       createNs[t].end());
+    allReleaseNs.insert(allReleaseNs.end(), releaseNs[t].begin(),
+                        releaseNs[t].end());
+  }
+  cout << "{\"benchmark\": \"channels\", \"pairs\": " << pairs
+       << ", \"threads\": " << threadCount
+       << ", \"peak_objects\": " << peakObjects << ", ";
+  PrintPercentiles("create_pair", allCreateNs);
+  cout << ", ";
+  PrintPercentiles("release_pair", allReleaseNs);
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+#endif // defined(_WIN32) || defined(__linux__)
+
+enum RingBenchType : uint32_t
+{
+  eRingBenchData = 0,
+  // Asks for a RingBenchMessage with the number received and mangled
+  eRingBenchEnd,
+  eRingBenchPing,
+  eRingBenchQuit
+};
+
+struct RingBenchMessage
+{
+  uint32_t  mType;
+  uint32_t  mLength;
+  uint64_t  mSeq;
+};
+
+// Sizes that keep wrapping at different offsets
+uint32_t
+GetRingBenchLength(uint64_t aSeq, uint32_t aMaxLength)
+{
+  return sizeof(RingBenchMessage) +
+         static_cast<uint32_t>((aSeq * 7919) %
+                               (aMaxLength - sizeof(RingBenchMessage) + 1));
+}
+
+void
+FillRingBenchMessage(uint8_t* aBuffer, uint32_t aType, uint64_t aSeq,
+                     uint32_t aLength)
+{
+  RingBenchMessage message = {aType, aLength, aSeq};
+  ::memcpy(aBuffer, &message, sizeof(message));
+  for (uint32_t i = sizeof(message); i < aLength; ++i) {
+    aBuffer[i] = static_cast<uint8_t>(aSeq + i);
+  }
+}
+
+bool
+CheckRingBenchMessage(const uint8_t* aPayload, uint32_t aLength,
+                      uint64_t aSeq, RingBenchMessage& aMessage)
+{
+  if (aLength < sizeof(aMessage)) {
+    return false;
+  }
+  ::memcpy(&aMessage, aPayload, sizeof(aMessage));
+  if (aMessage.mLength != aLength || aMessage.mSeq != aSeq) {
+    return false;
+  }
+  for (uint32_t i = sizeof(aMessage); i < aLength; ++i) {
+    if (aPayload[i] != static_cast<uint8_t>(aSeq + i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Runs variable-length messages through the smallest rings in one thread,
+ * so that every wraparound offset is hit, and checks that both ends refuse
+ * to go on once the other end corrupts its index or a record.
+ */
+bool
+CheckRingChannel()
+{
+  const uint32_t ringSize = RingChannel::kMinRingSize;
+  const size_t sectionSize = RingChannel::GetSectionSize(ringSize);
+  std::unique_ptr<uint8_t[]> storage(
+    new uint8_t[sectionSize + RingControl::kCacheLine]);
+  void* section = reinterpret_cast<void*>(
+    (reinterpret_cast<uintptr_t>(storage.get()) + RingControl::kCacheLine -
+     1) & ~uintptr_t(RingControl::kCacheLine - 1));
+
+  RingChannel launcher, sandbox;
+  if (RingChannel::Init(section, sectionSize, ringSize + 1) ||
+      RingChannel::Init(section, sectionSize - 1, ringSize) ||
+      sandbox.Attach(section, sectionSize, mozilla::eRingSideSandbox) ||
+      !RingChannel::Init(section, sectionSize, ringSize) ||
+      !launcher.Attach(section, sectionSize, mozilla::eRingSideLauncher) ||
+      !sandbox.Attach(section, sectionSize, mozilla::eRingSideSandbox)) {
+    return false;
+  }
+
+  RingWriter& writer = launcher.GetWriter();
+  RingReader& reader = sandbox.GetReader();
+  const uint32_t maxLength = writer.GetMaxMessageSize();
+  std::vector<uint8_t> buffer(maxLength);
+  if (writer.Write(buffer.data(), maxLength + 1)) {
+    return false;
+  }
+
+  uint64_t sent = 0, received = 0;
+  bool ok = true;
+  auto check = [&](const uint8_t* aPayload, uint32_t aLength) -> void {
+    RingBenchMessage message;
+    ok = ok && CheckRingBenchMessage(aPayload, aLength, received++, message);
+  };
+  for (int round = 0; round < 2000 && ok; ++round) {
+    // Fill the ring, then drain it in uneven batches
+    while (true) {
+      uint32_t length = GetRingBenchLength(sent, maxLength);
+      FillRingBenchMessage(buffer.data(), eRingBenchData, sent, length);
+      if (!writer.Write(buffer.data(), length)) {
+        break;
+      }
+      ++sent;
+    }
+    if (reader.HasMessages()) {
+      return false;
+    }
+    writer.Flush();
+    while (reader.Read(check, round % 3 + 1)) {
+    }
+  }
+  if (!ok || sent != received || reader.IsBroken() || writer.IsBroken()) {
+    return false;
+  }
+
+  auto header = reinterpret_cast<RingChannelHeader*>(section);
+  RingControl& toSandbox = header->mRings[mozilla::eRingToSandbox];
+  auto ignore = [](const uint8_t*, uint32_t) -> void {};
+
+  // A consumer that claims to have read more than was written
+  toSandbox.mRead.store(toSandbox.mWritten.load() + 8);
+  while (writer.Write(buffer.data(), maxLength)) {
+  }
+  if (!writer.IsBroken()) {
+    return false;
+  }
+
+  // A producer that claims to have written more than fits, and one that
+  // writes a record that runs past its index
+  if (!RingChannel::Init(section, sectionSize, ringSize) ||
+      !launcher.Attach(section, sectionSize, mozilla::eRingSideLauncher) ||
+      !sandbox.Attach(section, sectionSize, mozilla::eRingSideSandbox)) {
+    return false;
+  }
+  toSandbox.mWritten.store(ringSize + 8);
+  if (reader.Read(ignore) || !reader.IsBroken()) {
+    return false;
+  }
+  if (!RingChannel::Init(section, sectionSize, ringSize) ||
+      !sandbox.Attach(section, sectionSize, mozilla::eRingSideSandbox)) {
+    return false;
+  }
+  uint8_t* data = reinterpret_cast<uint8_t*>(section) +
+                  sizeof(RingChannelHeader);
+  uint32_t badLength = 64;
+  ::memcpy(data, &badLength, sizeof(badLength));
+  toSandbox.mWritten.store(16);
+  return !reader.Read(ignore) && reader.IsBroken();
+}
+
+#if defined(__linux__)
+
+const uint32_t kRingBenchRingSize = 64 * 1024;
+const uint32_t kRingBenchFlushEvery = 64;
+const uint32_t kRingBenchMaxLength = 256;
+const unsigned long kRingBenchPings = 20000;
+
+// Polls aReader until it yields a message
+template <typename Handler>
+bool
+SpinRead(RingReader& aReader, Handler&& aHandler)
+{
+  for (uint32_t spins = 0; !aReader.Read(aHandler, 1); ++spins) {
+    if (aReader.IsBroken()) {
+      return false;
+    }
+    if (spins > 64) {
+      std::this_thread::yield();
+    }
+  }
+  return true;
+}
+
+bool
+SpinWrite(RingWriter& aWriter, const void* aData, uint32_t aLength)
+{
+  for (uint32_t spins = 0; !aWriter.Write(aData, aLength); ++spins) {
+    if (aWriter.IsBroken()) {
+      return false;
+    }
+    aWriter.Flush();
+    if (spins > 64) {
+      std::this_thread::yield();
+    }
+  }
+  return true;
+}
+
+/**
+ * The sandbox end: checks data messages as they arrive, echoes pings, and
+ * reports how many data messages it got when asked.
+ */
+int
+RunRingBenchChild(const std::string& aName, size_t aSectionSize)
+{
+  UniqueFd fd(shm_open(aName.c_str(), O_RDWR | O_CLOEXEC, 0));
+  void* section = fd ? mmap(nullptr, aSectionSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd.get(), 0) : MAP_FAILED;
+  RingChannel channel;
+  if (section == MAP_FAILED ||
+      !channel.Attach(section, aSectionSize, mozilla::eRingSideSandbox)) {
+    return EXIT_FAILURE;
+  }
+
+  RingReader& reader = channel.GetReader();
+  RingWriter& writer = channel.GetWriter();
+  uint64_t received = 0, mangled = 0;
+  bool quit = false, reply = false;
+  RingBenchMessage answer = {};
+  auto handle = [&](const uint8_t* aPayload, uint32_t aLength) -> void {
+    RingBenchMessage message = {};
+    if (aLength >= sizeof(message)) {
+      ::memcpy(&message, aPayload, sizeof(message));
+    }
+    switch (message.mType) {
+      case eRingBenchData:
+        mangled += !CheckRingBenchMessage(aPayload, aLength, received,
+                                          message);
+        ++received;
+        break;
+      case eRingBenchEnd:
+        answer = RingBenchMessage{eRingBenchEnd, 0, received};
+        answer.mLength = static_cast<uint32_t>(mangled);
+        received = mangled = 0;
+        reply = true;
+        break;
+      case eRingBenchPing:
+        answer = message;
+        reply = true;
+        break;
+      default:
+        quit = true;
+        break;
+    }
+  };
+
+  while (!quit) {
+    for (uint32_t spins = 0; !reader.Read(handle); ++spins) {
+      if (reader.IsBroken()) {
+        return EXIT_FAILURE;
+      }
+      if (spins > 64) {
+        std::this_thread::yield();
+      }
+    }
+    if (reply) {
+      if (!SpinWrite(writer, &answer, sizeof(answer))) {
+        return EXIT_FAILURE;
+      }
+      writer.Flush();
+      reply = false;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Streams aCount data messages to the child, flushing in batches, and
+ * returns how long it took until the child confirmed that all of them
+ * arrived intact.
+ */
+std::optional<uint64_t>
+StreamRingMessages(RingChannel& aChannel, unsigned long aCount,
+                   bool aVariable)
+{
+  RingWriter& writer = aChannel.GetWriter();
+  uint8_t buffer[kRingBenchMaxLength];
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long seq = 0; seq < aCount; ++seq) {
+    uint32_t length = aVariable ?
+                      GetRingBenchLength(seq, kRingBenchMaxLength) :
+                      sizeof(RingBenchMessage);
+    FillRingBenchMessage(buffer, eRingBenchData, seq, length);
+    if (!SpinWrite(writer, buffer, length)) {
+      return std::nullopt;
+    }
+    if (!((seq + 1) % kRingBenchFlushEvery)) {
+      writer.Flush();
+    }
+  }
+
+  RingBenchMessage end = {eRingBenchEnd, sizeof(end), 0};
+  if (!SpinWrite(writer, &end, sizeof(end))) {
+    return std::nullopt;
+  }
+  writer.Flush();
+
+  RingBenchMessage answer = {};
+  if (!SpinRead(aChannel.GetReader(),
+                [&](const uint8_t* aPayload, uint32_t aLength) -> void {
+                  ::memcpy(&answer, aPayload,
+                           std::min<size_t>(aLength, sizeof(answer)));
+                })) {
+    return std::nullopt;
+  }
+  if (answer.mType != eRingBenchEnd || answer.mSeq != aCount ||
+      answer.mLength) {
+    return std::nullopt;
+  }
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now() - start).count();
+}
+
+#endif // defined(__linux__)
+
+/**
+ * Checks the ring channel in one process, then, on Linux, streams aIterations
+ * small messages and as many variable-length ones through a channel in POSIX
+ * shared memory to a child process, and times round trips.
+ */
+int
+BenchRingChannel(unsigned long aIterations)
+{
+  if (!CheckRingChannel()) {
+    cerr << "Ring channel check failed" << endl;
+    return EXIT_FAILURE;
+  }
+
+#if defined(__linux__)
+  mozilla::PosixChannelBackend backend;
+  ChannelRegistry registry(backend, kChannelPrefix);
+  ChannelRegistry::InstanceId instance = registry.CreateInstance();
+  const size_t sectionSize = RingChannel::GetSectionSize(kRingBenchRingSize);
+  std::optional<ChannelObject> object =
+    registry.CreateSection(instance, eBenchChannelNamed, sectionSize, true);
+  void* section = object ? mmap(nullptr, sectionSize, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, static_cast<int>(object->mHandle),
+                                0) : MAP_FAILED;
+  RingChannel channel;
+  if (section == MAP_FAILED ||
+      !RingChannel::Init(section, sectionSize, kRingBenchRingSize) ||
+      !channel.Attach(section, sectionSize, mozilla::eRingSideLauncher)) {
+    cerr << "Could not set up a ring channel" << endl;
+    return EXIT_FAILURE;
+  }
+
+  std::string name = "/" + registry.GetName(instance, eBenchChannelNamed);
+  pid_t pid = fork();
+  if (!pid) {
+    _exit(RunRingBenchChild(name, sectionSize));
+  }
+  if (pid < 0) {
+    return EXIT_FAILURE;
+  }
+
+  std::optional<uint64_t> fixedNs = StreamRingMessages(channel, aIterations,
+                                                       false);
+  std::optional<uint64_t> variableNs = fixedNs ?
+    StreamRingMessages(channel, aIterations, true) : std::nullopt;
+
+  std::vector<uint64_t> roundTripNs;
+  RingWriter& writer = channel.GetWriter();
+  for (uint64_t seq = 0; variableNs && seq < kRingBenchPings; ++seq) {
+    RingBenchMessage ping = {eRingBenchPing, sizeof(ping), seq};
+    RingBenchMessage pong = {};
+    auto start = std::chrono::steady_clock::now();
+    if (!SpinWrite(writer, &ping, sizeof(ping))) {
+      break;
+    }
+    writer.Flush();
+    if (!SpinRead(channel.GetReader(),
+                  [&](const uint8_t* aPayload, uint32_t aLength) -> void {
+                    ::memcpy(&pong, aPayload,
+                             std::min<size_t>(aLength, sizeof(pong)));
+                  }) || pong.mSeq != seq) {
+      break;
+    }
+    roundTripNs.push_back(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+  }
+
+  RingBenchMessage quit = {eRingBenchQuit, sizeof(quit), 0};
+  SpinWrite(writer, &quit, sizeof(quit));
+  writer.Flush();
+  int status = 0;
+  waitpid(pid, &status, 0);
+  munmap(section, sectionSize);
+
+  if (!variableNs || roundTripNs.size() != kRingBenchPings ||
+      !WIFEXITED(status) || WEXITSTATUS(status)) {
+    cerr << "Ring channel messages were lost or mangled" << endl;
+    return EXIT_FAILURE;
+  }
+
+  auto perSecond = [aIterations](uint64_t aNs) -> double {
+    return double(aIterations) * 1e9 / std::max<uint64_t>(aNs, 1);
+  };
+  cout << "{\"benchmark\": \"ring\", \"ring_size\": " << kRingBenchRingSize
+       << ", \"messages\": " << aIterations
+       << ", \"fixed_16b_per_sec\": " << perSecond(*fixedNs)
+       << ", \"variable_16_256b_per_sec\": " << perSecond(*variableNs)
+       << ", ";
+  PrintPercentiles("round_trip", roundTripNs);
+  cout << "}" << endl;
+#else
+  cout << "{\"benchmark\": \"ring\", \"checked\": true}" << endl;
+#endif
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Checks WaitWord's contract between two threads: timeouts, values that
+ * changed before the wait, notifies that need no system call, and waiters
+ * that park right away and have to be woken.
+ */
+bool
+CheckWaitWord()
+{
+  using mozilla::WaitWord;
+  WaitWord word;
+  word.Init(0, 0);
+  auto start = std::chrono::steady_clock::now();
+  if (mozilla::WaitForWordChange(word, 0, 20, mozilla::eWaitWordProcess) ||
+      std::chrono::steady_clock::now() - start < std::chrono::milliseconds(20)) {
+    return false;
+  }
+  if (mozilla::StoreWordAndNotify(word, 1, mozilla::eWaitWordProcess) ||
+      !mozilla::WaitForWordChange(word, 0, 0, mozilla::eWaitWordProcess)) {
+    return false;
+  }
+
+  const uint32_t kRounds = 200;
+  std::atomic<uint32_t> woken(0);
+  std::thread waiter([&]() -> void {
+    for (uint32_t round = 1; round <= kRounds; ++round) {
+      if (mozilla::WaitForWordChange(word, round, 10000,
+                                     mozilla::eWaitWordProcess)) {
+        woken.fetch_add(1);
+      }
+    }
+  });
+  uint32_t syscalls = 0;
+  for (uint32_t round = 1; round <= kRounds; ++round) {
+    // Give the waiter time to park
+    while (!word.mParked.load()) {
+      std::this_thread::yield();
+    }
+    syscalls += mozilla::StoreWordAndNotify(word, round + 1,
+                                            mozilla::eWaitWordProcess);
+  }
+  waiter.join();
+  return woken.load() == kRounds && syscalls == kRounds;
+}
+
+#if defined(__linux__)
+
+enum WaitBenchMechanism
+{
+  eWaitBenchWord,
+  eWaitBenchEventFd
+};
+
+struct WaitBenchScenario
+{
+  const char*         mName;
+  WaitBenchMechanism  mMechanism;
+  uint32_t            mMaxSpinNs;
+  // How long the other side works before it answers
+  uint32_t            mDelayUs;
+};
+
+struct WaitBenchPage
+{
+  mozilla::WaitWord     mPing;
+  mozilla::WaitWord     mPong;
+  std::atomic<uint64_t> mChildCpuNs;
+};
+
+uint64_t
+GetProcessCpuNs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+void
+SleepUs(uint32_t aUs)
+{
+  if (aUs) {
+    struct timespec delay = {0, long(aUs) * 1000};
+    nanosleep(&delay, nullptr);
+  }
+}
+
+/**
+ * Bounces a counter between this process and a child aRoundTrips times.
+ * Prints the round trips' percentiles, the CPU time that both processes
+ * spent per round trip, and how many notifies had to enter the kernel.
+ */
+bool
+RunWaitBenchScenario(const WaitBenchScenario& aScenario,
+                     unsigned long aRoundTrips)
+{
+  using mozilla::eWaitWordShared;
+  void* mapping = mmap(nullptr, sizeof(WaitBenchPage), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  auto page = new (mapping) WaitBenchPage();
+  page->mPing.Init(0, aScenario.mMaxSpinNs);
+  page->mPong.Init(0, aScenario.mMaxSpinNs);
+  UniqueFd ping(eventfd(0, EFD_CLOEXEC));
+  UniqueFd pong(eventfd(0, EFD_CLOEXEC));
+  uint64_t one = 1, count;
+
+  pid_t pid = fork();
+  if (!pid) {
+    uint64_t startCpu = GetProcessCpuNs();
+    for (uint32_t seq = 1; seq <= aRoundTrips; ++seq) {
+      if (aScenario.mMechanism == eWaitBenchEventFd) {
+        if (read(ping.get(), &count, sizeof(count)) != sizeof(count)) {
+          _exit(1);
+        }
+        SleepUs(aScenario.mDelayUs);
+        if (write(pong.get(), &one, sizeof(one)) != sizeof(one)) {
+          _exit(1);
+        }
+        continue;
+      }
+      mozilla::WaitForWordChange(page->mPing, seq - 1,
+                                 mozilla::kWaitWordInfinite, eWaitWordShared);
+      SleepUs(aScenario.mDelayUs);
+      mozilla::StoreWordAndNotify(page->mPong, seq, eWaitWordShared);
+    }
+    page->mChildCpuNs.store(GetProcessCpuNs() - startCpu);
+    _exit(0);
+  }
+  if (pid < 0) {
+    munmap(mapping, sizeof(WaitBenchPage));
+    return false;
+  }
+
+  std::vector<uint64_t> roundTripNs;
+  roundTripNs.reserve(aRoundTrips);
+  uint64_t syscalls = 0;
+  bool ok = true;
+  uint64_t startCpu = GetProcessCpuNs();
+  for (uint32_t seq = 1; ok && seq <= aRoundTrips; ++seq) {
+    auto start = std::chrono::steady_clock::now();
+    if (aScenario.mMechanism == eWaitBenchEventFd) {
+      ok = write(ping.get(), &one, sizeof(one)) == sizeof(one) &&
+           read(pong.get(), &count, sizeof(count)) == sizeof(count);
+    } else {
+      syscalls += mozilla::StoreWordAndNotify(page->mPing, seq,
+                                              eWaitWordShared);
+      ok = mozilla::WaitForWordChange(page->mPong, seq - 1, 10000,
+                                      eWaitWordShared);
+    }
+    roundTripNs.push_back(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+  }
+  uint64_t parentCpuNs = GetProcessCpuNs() - startCpu;
+
+  int status = 0;
+  if (!ok) {
+    kill(pid, SIGKILL);
+  }
+  waitpid(pid, &status, 0);
+  ok = ok && WIFEXITED(status) && !WEXITSTATUS(status);
+  if (ok) {
+    cout << "\"" << aScenario.mName << "\": {\"cpu_ns_per_round_trip\": "
+         << (parentCpuNs + page->mChildCpuNs.load()) / aRoundTrips;
+    if (aScenario.mMechanism == eWaitBenchWord) {
+      cout << ", \"notify_syscalls\": " << syscalls;
+    }
+    cout << ", ";
+    PrintPercentiles("round_trip", roundTripNs);
+    cout << "}";
+  }
+  munmap(mapping, sizeof(WaitBenchPage));
+  return ok;
+}
+
+#endif // defined(__linux__)
+
+/**
+ * Checks WaitWord between threads, then, on Linux, compares it with eventfd
+ * across processes, both when the other side answers at once and when it
+ * works for a while first.
+ */
+int
+BenchWaitWord(unsigned long aIterations)
+{
+  if (!CheckWaitWord()) {
+    cerr << "WaitWord check failed" << endl;
+    return EXIT_FAILURE;
+  }
+
+#if defined(__linux__)
+  const uint32_t kDelayUs = 100;
+  const WaitBenchScenario kScenarios[] = {
+    {"adaptive", eWaitBenchWord, mozilla::WaitWord::kDefaultMaxSpinNs, 0},
+    {"park_only", eWaitBenchWord, 0, 0},
+    {"eventfd", eWaitBenchEventFd, 0, 0},
+    {"adaptive_delayed", eWaitBenchWord, mozilla::WaitWord::kDefaultMaxSpinNs,
+     kDelayUs},
+    {"park_only_delayed", eWaitBenchWord, 0, kDelayUs},
+    {"eventfd_delayed", eWaitBenchEventFd, 0, kDelayUs},
+  };
+
+  // Notifying when nobody waits, which is what most handshakes come down to
+  mozilla::WaitWord idle;
+  idle.Init();
+  UniqueFd idleFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  uint64_t one = 1;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    mozilla::StoreWordAndNotify(idle, i, mozilla::eWaitWordShared);
+  }
+  auto wordNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start).count();
+  start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    if (write(idleFd.get(), &one, sizeof(one)) != sizeof(one)) {
+      return EXIT_FAILURE;
+    }
+  }
+  auto eventFdNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start).count();
+
+  cout << "{\"benchmark\": \"wait\", \"cpus\": "
+       << std::thread::hardware_concurrency()
+       << ", \"round_trips\": " << aIterations
+       << ", \"delay_us\": " << kDelayUs
+       << ", \"idle_notify_ns\": {\"word\": " << double(wordNs) / aIterations
+       << ", \"eventfd\": " << double(eventFdNs) / aIterations << "}";
+  for (const WaitBenchScenario& scenario : kScenarios) {
+    cout << ", ";
+    // Delayed answers take a while; fewer of them tell as much
+    unsigned long roundTrips = scenario.mDelayUs ?
+                               std::min(aIterations, 2000UL) : aIterations;
+    if (!RunWaitBenchScenario(scenario, roundTrips)) {
+      cout << endl;
+      cerr << "Wait scenario " << scenario.mName << " failed" << endl;
+      return EXIT_FAILURE;
+    }
+  }
+  cout << "}" << endl;
+#else
+  cout << "{\"benchmark\": \"wait\", \"checked\": true}" << endl;
+#endif
+  return EXIT_SUCCESS;
+}
+
+/**
+ * An allow-list shaped like a real one: fragmented, with a few hot calls.
+ * aHot is made by far the most frequent call and aCold the least.
+ */
+SyscallPolicy
+MakeBenchSyscallPolicy(uint32_t aArch, const std::vector<uint32_t>& aNeeded,
+                       uint32_t aHot, uint32_t aCold)
+{
+  const uint32_t kSyscallSpan = 450;
+  std::vector<uint32_t> allowed(aNeeded);
+  allowed.push_back(aHot);
+  allowed.push_back(aCold);
+  for (uint32_t nr = 0; nr < kSyscallSpan; nr += 3) {
+    allowed.push_back(nr);
+  }
+  std::sort(allowed.begin(), allowed.end());
+  allowed.erase(std::unique(allowed.begin(), allowed.end()), allowed.end());
+
+  SyscallPolicy policy;
+  policy.mArch = aArch;
+  policy.mDefaultAction = mozilla::eSyscallErrno | EPERM;
+  for (uint32_t nr : allowed) {
+    uint32_t weight = nr == aHot ? 1000000 : nr == aCold ? 0 : 100;
+    policy.mRules.push_back(SyscallRule{nr, mozilla::eSyscallAllow, weight});
+  }
+  return policy;
+}
+
+uint32_t
+ReferenceAction(const SyscallPolicy& aPolicy, uint32_t aArch, uint32_t aNr)
+{
+  if (aArch != aPolicy.mArch ||
+      (aArch == mozilla::eSyscallArchX86_64 && aNr >= 0x40000000)) {
+    return mozilla::eSyscallKill;
+  }
+  for (const SyscallRule& rule : aPolicy.mRules) {
+    if (rule.mSyscall == aNr) {
+      return rule.mAction;
+    }
+  }
+  return aPolicy.mDefaultAction;
+}
+
+// Checks both layouts against the policy itself
+bool
+CheckSeccompLayouts(const SyscallPolicy& aPolicy, std::mt19937& aRng)
+{
+  auto linear = SeccompProgram::Compile(aPolicy, mozilla::eSeccompLinear);
+  auto tree = SeccompProgram::Compile(aPolicy, mozilla::eSeccompTree);
+  if (!linear || !tree) {
+    return false;
+  }
+
+  std::vector<uint32_t> syscalls;
+  for (uint32_t nr = 0; nr < 4096; ++nr) {
+    syscalls.push_back(nr);
+  }
+  for (int i = 0; i < 4096; ++i) {
+    syscalls.push_back(static_cast<uint32_t>(aRng()));
+  }
+  syscalls.push_back(0x40000000);
+  syscalls.push_back(UINT32_MAX);
+
+  const uint32_t arches[] = {aPolicy.mArch, mozilla::eSyscallArchX86};
+  for (uint32_t arch : arches) {
+    for (uint32_t nr : syscalls) {
+      uint32_t expected = ReferenceAction(aPolicy, arch, nr);
+      if (linear->Evaluate(arch, nr) != expected ||
+          tree->Evaluate(arch, nr) != expected) {
+        cerr << "Seccomp filters disagree for call " << nr << endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void
+PrintSeccompSteps(const char* aName, const SeccompProgram& aProgram,
+                  const SyscallPolicy& aPolicy)
+{
+  uint64_t total = 0;
+  uint64_t weighted = 0;
+  uint64_t totalWeight = 0;
+  uint32_t maxSteps = 0;
+  for (const SyscallRule& rule : aPolicy.mRules) {
+    uint32_t steps = 0;
+    aProgram.Evaluate(aPolicy.mArch, rule.mSyscall, &steps);
+    total += steps;
+    weighted += uint64_t(steps) * rule.mWeight;
+    totalWeight += rule.mWeight;
+    maxSteps = std::max(maxSteps, steps);
+  }
+  cout << "\"" << aName << "\": {\"instructions\": " << aProgram.GetLength()
+       << ", \"mean_steps\": "
+       << double(total) / std::max<size_t>(aPolicy.mRules.size(), 1)
+       << ", \"weighted_steps\": "
+       << double(weighted) / std::max<uint64_t>(totalWeight, 1)
+       << ", \"max_steps\": " << maxSteps << "}";
+}
+
+#if defined(__linux__)
+
+/**
+ * Times aIterations calls of each of aSyscalls in a child that has installed
+ * aProgram, or no filter at all.
+ */
+bool
+TimeFilteredSyscalls(const SeccompProgram* aProgram,
+                     const uint32_t (&aSyscalls)[3], unsigned long aIterations,
+                     double (&aNs)[3])
+{
+  int resultPipe[2];
+  if (pipe2(resultPipe, O_CLOEXEC)) {
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (!pid) {
+    close(resultPipe[0]);
+    if (aProgram) {
+      struct sock_fprog program;
+      program.len = static_cast<unsigned short>(aProgram->GetLength());
+      program.filter = reinterpret_cast<sock_filter*>(
+        const_cast<mozilla::BpfInstruction*>(aProgram->GetInstructions()));
+      if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) ||
+          syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, 0, &program)) {
+        _exit(1);
+      }
+    }
+    double ns[3];
+    for (int i = 0; i < 3; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      for (unsigned long j = 0; j < aIterations; ++j) {
+        syscall(aSyscalls[i]);
+      }
+      ns[i] = double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count()) /
+              aIterations;
+    }
+    _exit(write(resultPipe[1], ns, sizeof(ns)) == sizeof(ns) ? 0 : 1);
+  }
+
+  close(resultPipe[1]);
+  bool ok = pid > 0 && read(resultPipe[0], aNs, sizeof(aNs)) == sizeof(aNs);
+  close(resultPipe[0]);
+  int status = 0;
+  if (pid > 0) {
+    waitpid(pid, &status, 0);
+  }
+  return ok && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+#endif // defined(__linux__)
+
+/**
+ * Compiles one allow-list both ways, checks that the filters agree, and
+ * compares how many instructions each runs per call. On Linux, it also
+ * times calls through each filter installed for real.
+ */
+int
+BenchSeccomp(unsigned long aIterations)
+{
+  std::mt19937 rng(47);
+#if defined(__linux__)
+  const uint32_t arch = mozilla::kNativeSyscallArch;
+  const uint32_t hot = SYS_getppid;
+  const uint32_t cold = SYS_getuid;
+  // What the timing child, and any sanitizer runtime, calls once its filter
+  // is installed
+  const std::vector<uint32_t> needed = {SYS_write, SYS_exit_group,
+                                        SYS_clock_gettime, SYS_sigaltstack,
+                                        SYS_munmap};
+#else
+  const uint32_t arch = mozilla::eSyscallArchX86_64;
+  const uint32_t hot = 110;
+  const uint32_t cold = 102;
+  const std::vector<uint32_t> needed;
+#endif
+  SyscallPolicy policy = MakeBenchSyscallPolicy(arch, needed, hot, cold);
+
+  // A long alternating policy makes subtrees too long for conditional jumps
+  SyscallPolicy alternating;
+  alternating.mArch = mozilla::eSyscallArchX86_64;
+  alternating.mDefaultAction = mozilla::eSyscallKill;
+  for (uint32_t nr = 0; nr < 1000; ++nr) {
+    alternating.mRules.push_back(SyscallRule{
+      nr * 2, nr % 3 ? mozilla::eSyscallAllow : mozilla::eSyscallErrno | nr,
+      nr});
+  }
+
+  SyscallPolicy duplicate = policy;
+  duplicate.mRules.push_back(policy.mRules.front());
+  if (!CheckSeccompLayouts(policy, rng) ||
+      !CheckSeccompLayouts(alternating, rng) ||
+      SeccompProgram::Compile(duplicate, mozilla::eSeccompTree)) {
+    cerr << "Seccomp filter check failed" << endl;
+    return EXIT_FAILURE;
+  }
+
+  SeccompProgramCache cache;
+  std::vector<uint64_t> compileNs;
+  std::vector<uint64_t> cachedNs;
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    auto compiled = SeccompProgram::Compile(policy, mozilla::eSeccompTree);
+    compileNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start).count());
+    start = std::chrono::steady_clock::now();
+    auto cached = cache.Get(policy, mozilla::eSeccompTree);
+    cachedNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start).count());
+    if (!compiled || !cached || cached != cache.Get(policy,
+                                                    mozilla::eSeccompTree)) {
+      cerr << "Seccomp program cache check failed" << endl;
+      return EXIT_FAILURE;
+    }
+  }
+  SeccompProgramCache::Stats stats = cache.GetStats();
+  if (stats.mMisses != 1 || stats.mEntries != 1) {
+    cerr << "Seccomp program cache compiled more than once" << endl;
+    return EXIT_FAILURE;
+  }
+
+  auto linear = cache.Get(policy, mozilla::eSeccompLinear);
+  auto tree = cache.Get(policy, mozilla::eSeccompTree);
+  cout << "{\"benchmark\": \"seccomp\", \"rules\": " << policy.mRules.size()
+       << ", ";
+  PrintSeccompSteps("linear", *linear, policy);
+  cout << ", ";
+  PrintSeccompSteps("tree", *tree, policy);
+  cout << ", ";
+  PrintPercentiles("compile", compileNs);
+  cout << ", ";
+  PrintPercentiles("cached", cachedNs);
+
+#if defined(__linux__)
+  // Since Linux 5.11 the kernel skips filters for calls that they always
+  // allow, so only denied calls show what a filter really costs
+  const uint32_t kUnassignedSyscall = 1000;
+  const uint32_t syscalls[] = {hot, cold, kUnassignedSyscall};
+  const unsigned long kSyscallsPerRun = aIterations * 1000;
+  const char* names[] = {"none", "linear", "tree"};
+  const SeccompProgram* programs[] = {nullptr, linear.get(), tree.get()};
+  cout << ", \"syscall_ns\": {";
+  for (int i = 0; i < 3; ++i) {
+    double ns[3];
+    if (!TimeFilteredSyscalls(programs[i], syscalls, kSyscallsPerRun, ns)) {
+      cout << "}}" << endl;
+      cerr << "Cannot install the " << names[i] << " seccomp filter" << endl;
+      return EXIT_FAILURE;
+    }
+    cout << (i ? ", " : "") << "\"" << names[i] << "\": {\"hot\": " << ns[0]
+         << ", \"cold\": " << ns[1] << ", \"denied\": " << ns[2] << "}";
+  }
+  cout << "}";
+#endif
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+#if defined(__linux__)
+
+const uint32_t kLinuxReadyChannel = 1;
+const char kLinuxReady = 'R';
+// The filter that the linux benchmark's sandboxes install makes this call
+// fail with kLinuxDeniedErrno
+const uint32_t kLinuxDeniedSyscall = SYS_sched_yield;
+const int kLinuxDeniedErrno = ENOTSUP;
+
+/**
+ * What sandboxbench runs as when launched by the linux benchmark. It reports
+ * on its ready channel once it has checked that it really is sandboxed.
+ */
+class BenchLinuxSandbox final : public mozilla::LinuxSandbox
+{
+protected:
+  bool OnPrivInit() override
+  {
+    // Root in its own user namespace, so only until it locks itself down
+    return !getuid() && !getgid();
+  }
+
+  bool OnInit() override
+  {
+    __user_cap_header_struct header = {_LINUX_CAPABILITY_VERSION_3, 0};
+    __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3] = {};
+    if (syscall(SYS_capget, &header, data)) {
+      return false;
+    }
+    for (const __user_cap_data_struct& caps : data) {
+      if (caps.effective || caps.permitted || caps.inheritable) {
+        return false;
+      }
+    }
+
+    if (syscall(kLinuxDeniedSyscall) != -1 || errno != kLinuxDeniedErrno) {
+      return false;
+    }
+
+    int ready = GetChannelFd(kLinuxReadyChannel);
+    return getpid() == 1 && prctl(PR_GET_NO_NEW_PRIVS, 0, 0, 0, 0) == 1 &&
+           ready >= 0 && write(ready, &kLinuxReady, 1) == 1;
+  }
+
+  void OnFini() override {}
+};
+
+int
+RunLinuxSandbox(int aArgc, char* aArgv[])
+{
+  BenchLinuxSandbox sandbox;
+  if (!sandbox.Init(aArgc, aArgv)) {
+    return EXIT_FAILURE;
+  }
+  sandbox.Fini();
+  return EXIT_SUCCESS;
+}
+
+/**
+ * The baseline that the sandbox launcher is measured against: fork and exec
+ * with no namespaces, timed until the exec has happened.
+ */
+bool
+ForkExec(const std::string& aPath, uint64_t& aLaunchNs)
+{
+  int errorPipe[2];
+  if (pipe2(errorPipe, O_CLOEXEC)) {
+    return false;
+  }
+
+  char* argv[] = {const_cast<char*>(aPath.c_str()),
+                  const_cast<char*>("linuxbaseline"), nullptr};
+  char* envp[] = {nullptr};
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (!pid) {
+    execve(argv[0], argv, envp);
+    int error = errno;
+    (void)!write(errorPipe[1], &error, sizeof(error));
+    _exit(127);
+  }
+  close(errorPipe[1]);
+  int error;
+  bool execed = pid > 0 && read(errorPipe[0], &error, sizeof(error)) == 0;
+  aLaunchNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+  close(errorPipe[0]);
+
+  int status = 0;
+  if (pid > 0) {
+    waitpid(pid, &status, 0);
+  }
+  return execed && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+bool
+LaunchLinuxSandbox(const std::string& aPath,
+                   const std::shared_ptr<mozilla::LinuxNamespaceTemplate>&
+                     aTemplate,
+                   const std::shared_ptr<mozilla::LinuxSyscallFilter>& aFilter,
+                   uint64_t& aLaunchNs)
+{
+  int readyPipe[2];
+  if (pipe2(readyPipe, O_CLOEXEC)) {
+    return false;
+  }
+  UniqueFd readyRead(readyPipe[0]);
+  UniqueFd readyWrite(readyPipe[1]);
+
+  auto start = std::chrono::steady_clock::now();
+  mozilla::LinuxSandboxLauncher launcher;
+  if (!launcher.Init() ||
+      (aTemplate && !launcher.SetNamespaceTemplate(aTemplate)) ||
+      !launcher.SetSyscallFilter(aFilter) ||
+      !launcher.AddChannel(kLinuxReadyChannel, readyWrite.get(), 0) ||
+      !launcher.Launch(aPath, {"linuxchild"})) {
+    return false;
+  }
+  aLaunchNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+  readyWrite.reset();
+
+  char ready = 0;
+  const unsigned int kExitTimeoutMs = 10000;
+  return read(readyRead.get(), &ready, 1) == 1 && ready == kLinuxReady &&
+         launcher.Wait(kExitTimeoutMs) && launcher.GetExitStatus() == 0;
+}
+
+/**
+ * Launches sandboxbench itself with fork and exec, into fresh namespaces, and
+ * into a namespace template, and checks that each sandbox locked itself down
+ * and installed its syscall filter.
+ */
+int
+BenchLinuxLaunch(unsigned long aIterations)
+{
+  if (!mozilla::LinuxSandboxLauncher::AreUserNamespacesAvailable()) {
+    cout << "{\"benchmark\": \"linux\", \"skipped\": "
+         << "\"user namespaces are unavailable\"}" << endl;
+    return EXIT_SUCCESS;
+  }
+
+  char path[4096];
+  ssize_t pathLen = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (pathLen <= 0) {
+    cerr << "Cannot find sandboxbench" << endl;
+    return EXIT_FAILURE;
+  }
+  const std::string self(path, pathLen);
+
+  auto sharedTemplate = mozilla::LinuxNamespaceTemplate::Create(
+                          mozilla::LinuxSandboxLauncher::eInitNone);
+  if (!sharedTemplate) {
+    cerr << "Cannot create a namespace template" << endl;
+    return EXIT_FAILURE;
+  }
+
+  SyscallPolicy policy;
+  policy.mArch = mozilla::kNativeSyscallArch;
+  policy.mDefaultAction = mozilla::eSyscallAllow;
+  policy.mRules.push_back(SyscallRule{
+    kLinuxDeniedSyscall, mozilla::eSyscallErrno | kLinuxDeniedErrno, 0});
+  auto program = SeccompProgram::Compile(policy, mozilla::eSeccompTree);
+  auto filter = program ? mozilla::LinuxSyscallFilter::Create(*program) :
+                          nullptr;
+  if (!filter) {
+    cerr << "Cannot create a syscall filter" << endl;
+    return EXIT_FAILURE;
+  }
+
+  // Each kind of launch runs on its own, since the kernel tears namespaces
+  // down asynchronously and would slow whatever ran next
+  std::vector<uint64_t> forkExecNs, freshNs, templateNs;
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    uint64_t ns;
+    if (!ForkExec(self, ns)) {
+      cerr << "fork and exec failed" << endl;
+      return EXIT_FAILURE;
+    }
+    forkExecNs.push_back(ns);
+  }
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    uint64_t ns;
+    if (!LaunchLinuxSandbox(self, nullptr, filter, ns)) {
+      cerr << "Fresh namespace launch failed: " << strerror(errno) << endl;
+      return EXIT_FAILURE;
+    }
+    freshNs.push_back(ns);
+  }
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    uint64_t ns;
+    if (!LaunchLinuxSandbox(self, sharedTemplate, filter, ns)) {
+      cerr << "Template launch failed: " << strerror(errno) << endl;
+      return EXIT_FAILURE;
+    }
+    templateNs.push_back(ns);
+  }
+
+  cout << "{\"benchmark\": \"linux\", ";
+  PrintPercentiles("fork_exec", forkExecNs);
+  cout << ", ";
+  PrintPercentiles("fresh_namespaces", freshNs);
+  cout << ", ";
+  PrintPercentiles("namespace_template", templateNs);
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+#endif // defined(__linux__)
+
+/**
+ * Stands in for a launcher's job object, whose counters advance by the same
+ * amounts on every query.
+ */
+class SimulatedAccountingSource final : public mozilla::JobAccountingSource
+{
+public:
+  explicit SimulatedAccountingSource(uint32_t aSeed,
+                                     Microseconds aLatency = Microseconds(0))
+    : mSeed(aSeed)
+    , mLatency(aLatency)
+    , mQueries(0)
+    , mInQuery(false)
+  {
+  }
+
+  // CPU time, in 100ns units, that each query adds
+  uint64_t GetCpuTicksPerQuery() const { return (mSeed % 7 + 1) * 100000; }
+  uint64_t GetQueries() const { return mQueries.load(); }
+  bool IsInQuery() const { return mInQuery.load(); }
+
+  bool QueryAccounting(mozilla::JobAccountingSample& aSample) override
+  {
+    mInQuery.store(true);
+    if (mLatency.count()) {
+      std::this_thread::sleep_for(mLatency);
+    }
+    uint64_t queries = mQueries.fetch_add(1) + 1;
+    aSample.mTotalUserTime = queries * GetCpuTicksPerQuery();
+    aSample.mTotalKernelTime = queries * GetCpuTicksPerQuery() / 4;
+    aSample.mPageFaults = queries * 10;
+    aSample.mReadBytes = queries * 4096;
+    aSample.mWriteBytes = queries * 512;
+    aSample.mPeakProcessMemory = 1000000 + mSeed;
+    aSample.mPeakJobMemory = 2000000 + mSeed;
+    aSample.mActiveProcesses = 1;
+    mInQuery.store(false);
+    return true;
+  }
+
+private:
+  uint32_t              mSeed;
+  Microseconds          mLatency;
+  std::atomic<uint64_t> mQueries;
+  std::atomic<bool>     mInQuery;
+};
+
+uint64_t
+GetThreadCpuNs()
+{
+#if defined(__linux__)
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * MetricsRing keeps the most recent values once it wraps, and readers reject
+ * values that the writer overwrites while they copy them, so that retrying
+ * never yields a torn one.
+ */
+bool
+CheckMetricsRing()
+{
+  using mozilla::JobAccountingSample;
+  const size_t kCapacity = 8;
+  mozilla::MetricsRing<JobAccountingSample, kCapacity> ring;
+  JobAccountingSample sample = {};
+  if (ring.Read(0, sample)) {
+    return false;
+  }
+
+  const uint64_t kPushes = kCapacity * 2 + 4;
+  for (uint64_t i = 0; i < kPushes; ++i) {
+    sample.mTimestampNs = i;
+    ring.Push(sample);
+  }
+  if (ring.Count() != kPushes ||
+      !ring.Read(0, sample) || sample.mTimestampNs != kPushes - 1 ||
+      !ring.Read(kCapacity - 1, sample) ||
+      sample.mTimestampNs != kPushes - kCapacity ||
+      ring.Read(kCapacity, sample)) {
+    return false;
+  }
+  JobAccountingSample snapshot[kCapacity * 2];
+  if (ring.Snapshot(snapshot, kCapacity * 2) != kCapacity) {
+    return false;
+  }
+  for (size_t i = 0; i < kCapacity; ++i) {
+    if (snapshot[i].mTimestampNs != kPushes - kCapacity + i) {
+      return false;
+    }
+  }
+
+  // Wide values in a tiny ring give the writer plenty of chances to lap a
+  // reader mid-copy. Every word of a value is the same, so a torn one shows.
+  struct WideValue
+  {
+    uint64_t mWords[64];
+  };
+  mozilla::MetricsRing<WideValue, 2> wide;
+  std::atomic<bool> stop(false);
+  std::thread writer([&]() -> void {
+    WideValue value;
+    for (uint64_t i = 1; !stop.load(std::memory_order_relaxed); ++i) {
+      std::fill(std::begin(value.mWords), std::end(value.mWords), i);
+      wide.Push(value);
+    }
+  });
+
+  const uint32_t kReads = 200000;
+  uint64_t last = 0;
+  bool ok = true;
+  WideValue value;
+  for (uint32_t i = 0; i < kReads && ok; ++i) {
+    // Retry until a read is consistent
+    while (!wide.Read(0, value)) {
+    }
+    ok = value.mWords[0] && value.mWords[0] >= last &&
+         std::all_of(std::begin(value.mWords), std::end(value.mWords),
+                     [&value](uint64_t aWord) -> bool {
+                       return aWord == value.mWords[0];
+                     });
+    last = value.mWords[0];
+  }
+  stop.store(true);
+  writer.join();
+  return ok;
+}
+
+/**
+ * The sampler's rates are the deltas between the samples in a source's ring,
+ * and once Remove returns the source is no longer being queried, even though
+ * sweeps run without the sampler's lock.
+ */
+bool
+CheckJobAccounting()
+{
+  using mozilla::JobAccountingSample;
+  using mozilla::JobAccountingSampler;
+  JobAccountingSampler sampler(std::chrono::milliseconds(1000));
+  SimulatedAccountingSource source(3);
+  mozilla::JobAccountingRates rates;
+  if (!sampler.Add(1, &source) || sampler.Add(1, &source)) {
+    return false;
+  }
+
+  const size_t kSpan = 3;
+  for (size_t i = 0; i <= kSpan; ++i) {
+    sampler.SampleAll();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  auto ring = sampler.GetRing(1);
+  JobAccountingSample newer, older;
+  if (!ring || !ring->Read(0, newer) || !ring->Read(kSpan, older) ||
+      !sampler.GetRates(1, rates, kSpan)) {
+    return false;
+  }
+
+  // Relative, since the samples' timestamps are real
+  auto near = [](double aValue, double aExpected) -> bool {
+    return std::abs(aValue - aExpected) <= std::abs(aExpected) * 1e-9;
+  };
+  double intervalSec = (newer.mTimestampNs - older.mTimestampNs) / 1.0e9;
+  double cpuSec = kSpan * source.GetCpuTicksPerQuery() * 5 / 4 / 1.0e7;
+  if (!near(rates.mIntervalSec, intervalSec) ||
+      !near(rates.mCpuUtilization, cpuSec / intervalSec) ||
+      !near(rates.mPageFaultsPerSec, kSpan * 10 / intervalSec) ||
+      !near(rates.mReadBytesPerSec, kSpan * 4096 / intervalSec) ||
+      !near(rates.mWriteBytesPerSec, kSpan * 512 / intervalSec) ||
+      rates.mOtherBytesPerSec != 0.0 ||
+      rates.mPeakJobMemory != newer.mPeakJobMemory) {
+    return false;
+  }
+  // Too far back, no span at all, or nobody registered
+  if (sampler.GetRates(1, rates, kSpan + 1) ||
+      sampler.GetRates(1, rates, 0) || sampler.GetRates(2, rates, 1)) {
+    return false;
+  }
+  // Samples out of order
+  if (mozilla::ComputeJobAccountingRates(newer, older, rates)) {
+    return false;
+  }
+  sampler.Remove(1);
+
+  // Slow queries on the sampler's own thread, to catch Remove returning
+  // while one of them is in progress
+  JobAccountingSampler background(std::chrono::milliseconds(1));
+  SimulatedAccountingSource slow(5, Microseconds(200));
+  for (uint32_t round = 0; round < 20; ++round) {
+    if (!background.Add(round, &slow)) {
+      return false;
+    }
+    if (round == 0 && !background.Start()) {
+      return false;
+    }
+    uint64_t queries = slow.GetQueries();
+    while (slow.GetQueries() == queries) {
+      std::this_thread::yield();
+    }
+    background.Remove(round);
+    if (slow.IsInQuery()) {
+      return false;
+    }
+    queries = slow.GetQueries();
+    std::this_thread::sleep_for(std::chrono::milliseconds(3));
+    if (slow.GetQueries() != queries) {
+      return false;
+    }
+  }
+  background.Stop();
+  return !background.GetRing(0);
+}
+
+/**
+ * One sampler sweeping a thousand sources: how long each sweep takes and
+ * how much CPU it uses, and how long GetRates takes while sweeps run.
+ */
+int
+BenchJobAccounting(unsigned long aIterations)
+{
+  if (!CheckMetricsRing() || !CheckJobAccounting()) {
+    cerr << "Job accounting check failed" << endl;
+    return EXIT_FAILURE;
+  }
+
+  const uint32_t kSources = 1000;
+  std::vector<std::unique_ptr<SimulatedAccountingSource>> sources;
+  mozilla::JobAccountingSampler sampler(std::chrono::milliseconds(1));
+  for (uint32_t id = 0; id < kSources; ++id) {
+    sources.push_back(std::make_unique<SimulatedAccountingSource>(id));
+    sampler.Add(id, sources.back().get());
+  }
+
+  std::vector<uint64_t> sweepNs, sweepCpuNs;
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    uint64_t cpuStart = GetThreadCpuNs();
+    auto start = std::chrono::steady_clock::now();
+    sampler.SampleAll();
+    sweepNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count());
+    sweepCpuNs.push_back(GetThreadCpuNs() - cpuStart);
+  }
+
+  // Scrapes while the sampler's thread sweeps every millisecond
+  if (!sampler.Start()) {
+    return EXIT_FAILURE;
+  }
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<uint32_t> pick(0, kSources - 1);
+  std::vector<uint64_t> scrapeNs;
+  mozilla::JobAccountingRates rates;
+  for (unsigned long i = 0; i < aIterations * 10; ++i) {
+    uint32_t id = pick(rng);
+    auto start = std::chrono::steady_clock::now();
+    bool ok = sampler.GetRates(id, rates, 1);
+    scrapeNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start).count());
+    if (!ok) {
+      return EXIT_FAILURE;
+    }
+  }
+  sampler.Stop();
+
+  cout << "{\"benchmark\": \"accounting\", \"sources\": " << kSources << ", ";
+  PrintPercentiles("sweep", sweepNs);
+  cout << ", ";
+  PrintPercentiles("sweep_cpu", sweepCpuNs);
+  cout << ", ";
+  PrintPercentiles("scrape_during_sweeps", scrapeNs);
+  cout << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * PlanMitigations skips what 64-bit processes enforce anyway, maps both
+ * policy words onto the right runtime policies, and refuses flags that only
+ * apply at creation or that it does not know, which policy files may then
+ * not defer.
+ */
+bool
+CheckMitigationTable()
+{
+  using namespace mozilla::mitigation;
+  using mozilla::MitigationPlan;
+  auto kindBit = [](uint32_t aKind) -> uint32_t { return 1U << aKind; };
+  MitigationPlan plan;
+
+  const uint64_t dep[2] = {kDepEnable | kDepAtlThunkEnable, 0};
+  if (!mozilla::PlanMitigations(dep, true, plan) || plan.mKinds ||
+      !mozilla::PlanMitigations(dep, false, plan) ||
+      plan.mKinds != kindBit(mozilla::eMitigationDep) ||
+      plan.mRuntimeFlags[mozilla::eMitigationDep] != 0x3) {
+    return false;
+  }
+  const uint64_t highEntropy[2] = {kHighEntropyAslr | kBottomUpAslr, 0};
+  if (!mozilla::PlanMitigations(highEntropy, true, plan) ||
+      plan.mRuntimeFlags[mozilla::eMitigationAslr] != 0x1 ||
+      mozilla::PlanMitigations(highEntropy, false, plan) ||
+      plan.mUnsupported[0] != kHighEntropyAslr) {
+    return false;
+  }
+
+  // REQ_RELOCS includes the FORCE_RELOCATE_IMAGES bit
+  const uint64_t reqRelocs[2] = {kForceRelocateImagesReqRelocs, 0};
+  const uint64_t forceRelocate[2] = {kForceRelocateImages, 0};
+  if (!mozilla::PlanMitigations(reqRelocs, true, plan) ||
+      plan.mRuntimeFlags[mozilla::eMitigationAslr] != 0xA ||
+      !mozilla::PlanMitigations(forceRelocate, true, plan) ||
+      plan.mRuntimeFlags[mozilla::eMitigationAslr] != 0x2) {
+    return false;
+  }
+
+  const uint64_t sehop[2] = {kSehopEnable | kFontDisable, 0};
+  const uint64_t cfg[2] = {kControlFlowGuard, kStrictControlFlowGuard};
+  if (mozilla::PlanMitigations(sehop, true, plan) ||
+      plan.mUnsupported[0] != kSehopEnable || plan.mUnsupported[1] ||
+      mozilla::PlanMitigations(cfg, true, plan) ||
+      plan.mUnsupported[0] != kControlFlowGuard ||
+      plan.mUnsupported[1] != kStrictControlFlowGuard ||
+      mozilla::CanDeferMitigations(sehop) ||
+      mozilla::CanDeferMitigations(cfg)) {
+    return false;
+  }
+
+  const uint64_t unknown[2] = {kDepEnable | (1ULL << 3), 1ULL};
+  if (mozilla::PlanMitigations(unknown, false, plan) ||
+      plan.mUnsupported[0] != 1ULL << 3 || plan.mUnsupported[1] != 1ULL) {
+    return false;
+  }
+
+  // Both words feed the dynamic code policy
+  const uint64_t second[2] = {kProhibitDynamicCode,
+                              kAllowDowngradeDynamicCode |
+                              kSpeculativeStoreBypassDisable};
+  if (!mozilla::PlanMitigations(second, true, plan) ||
+      plan.mKinds != (kindBit(mozilla::eMitigationDynamicCode) |
+                      kindBit(mozilla::eMitigationSideChannelIsolation)) ||
+      plan.mRuntimeFlags[mozilla::eMitigationDynamicCode] != 0x5 ||
+      plan.mRuntimeFlags[mozilla::eMitigationSideChannelIsolation] != 0x8) {
+    return false;
+  }
+
+  // Creation-only flags are fine as long as they are not deferred
+  std::vector<uint8_t> output;
+  std::string error;
+  return mozilla::CompilePolicies("[a]\nmitigations = SEHOP_ENABLE\n",
+                                  output, error) &&
+         !mozilla::CompilePolicies("[a]\ndeferred_mitigations = SEHOP_ENABLE\n",
+                                   output, error);
+}
+
+const char kCheckPolicySource[] =
+  "[proto]\n"
+  "mitigations = DEP_ENABLE | BOTTOM_UP_ASLR\n"
+  "[comtest]\n"
+  "init_flags = no_separate_window_station\n"
+  "[worker]\n"
+  "job_memory_limit = 64M\n";
+
+/**
+ * Compiled policy files load and find every policy, and validation refuses
+ * bucket tables that would send a probe around the table forever or leave a
+ * record out, even when the checksum matches.
+ */
+bool
+CheckPolicyFile()
+{
+  std::vector<uint8_t> compiled;
+  std::string error;
+  if (!mozilla::CompilePolicies(kCheckPolicySource, compiled, error)) {
+    return false;
+  }
+
+  mozilla::PolicyFile file;
+  if (!file.Init(compiled.data(), compiled.size()) || file.Count() != 3 ||
+      file.Find("missing")) {
+    return false;
+  }
+  for (std::string_view name : {"proto"sv, "comtest"sv, "worker"sv}) {
+    const PolicyRecord* record = file.Find(name);
+    if (!record || file.GetString(record->mName) != name) {
+      return false;
+    }
+  }
+
+  // Rewrites the bucket table, then fixes the checksum up so that only the
+  // table is wrong
+  auto withBuckets = [&compiled](auto&& aRewrite) -> bool {
+    std::vector<uint8_t> data(compiled);
+    auto header = reinterpret_cast<mozilla::PolicyFileHeader*>(data.data());
+    auto buckets = reinterpret_cast<uint32_t*>(data.data() +
+                                               header->mBucketsOffset);
+    aRewrite(buckets, header->mBucketCount);
+    header->mChecksum = mozilla::ComputePolicyFileChecksum(data.data(),
+                                                           data.size());
+    return mozilla::ValidatePolicyFile(data.data(), data.size());
+  };
+
+  return withBuckets([](uint32_t*, uint32_t) {}) &&
+         !withBuckets([](uint32_t* aBuckets, uint32_t aCount) {
+           std::fill(aBuckets, aBuckets + aCount, 1);
+         }) &&
+         // Every record reachable, but one twice
+         !withBuckets([](uint32_t* aBuckets, uint32_t aCount) {
+           uint32_t* free = std::find(aBuckets, aBuckets + aCount, 0);
+           *free = *std::find_if(aBuckets, aBuckets + aCount,
+                                 [](uint32_t aIndex) { return aIndex; });
+         }) &&
+         // A record missing, the same number of buckets in use
+         !withBuckets([](uint32_t* aBuckets, uint32_t aCount) {
+           uint32_t* first = std::find(aBuckets, aBuckets + aCount, 1);
+           uint32_t* second = std::find(aBuckets, aBuckets + aCount, 2);
+           *second = *first;
+         });
+}
+
+struct JobLimitsCase
+{
+  const char* mName;
+  void        (*mSetup)(mozilla::JobLimits& aLimits);
+  // Null if the limits must be rejected
+  bool        (*mExpect)(const mozilla::JobLimitPlan& aPlan);
+};
+
+const JobLimitsCase kJobLimitsCases[] = {
+  {"default",
+   [](mozilla::JobLimits&) {},
+   [](const mozilla::JobLimitPlan& aPlan) {
+     using namespace mozilla::joblimits;
+     return aPlan.mLimitFlags == kLimitActiveProcess &&
+            aPlan.mActiveProcessLimit == 1 &&
+            aPlan.mUiRestrictions == kUiLimitAll &&
+            !aPlan.mCpuRateControlFlags && !aPlan.mIoRateControlFlags &&
+            !aPlan.mNotificationLimitFlags;
+   }},
+  {"no_processes",
+   [](mozilla::JobLimits& aLimits) { aLimits.mActiveProcessLimit = 0; },
+   nullptr},
+  {"min_working_set_only",
+   [](mozilla::JobLimits& aLimits) { aLimits.mMinWorkingSet = 1 << 20; },
+   nullptr},
+  {"max_working_set_only",
+   [](mozilla::JobLimits& aLimits) { aLimits.mMaxWorkingSet = 1 << 20; },
+   nullptr},
+  {"min_above_max_working_set",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mMinWorkingSet = 2 << 20;
+     aLimits.mMaxWorkingSet = 1 << 20;
+   },
+   nullptr},
+  {"zero_min_working_set",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mMinWorkingSet = 0;
+     aLimits.mMaxWorkingSet = 1 << 20;
+   },
+   nullptr},
+  {"working_set",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mMinWorkingSet = 1 << 20;
+     aLimits.mMaxWorkingSet = 1 << 20;
+   },
+   [](const mozilla::JobLimitPlan& aPlan) {
+     return (aPlan.mLimitFlags & mozilla::joblimits::kLimitWorkingSet) &&
+            aPlan.mMinimumWorkingSetSize == 1 << 20 &&
+            aPlan.mMaximumWorkingSetSize == 1 << 20;
+   }},
+  {"cap_and_weight",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mCpuRateCap = 5000;
+     aLimits.mCpuWeight = 5;
+   },
+   nullptr},
+  {"zero_cap",
+   [](mozilla::JobLimits& aLimits) { aLimits.mCpuRateCap = 0; },
+   nullptr},
+  {"cap_above_max",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mCpuRateCap = mozilla::joblimits::kMaxCpuRate + 1;
+   },
+   nullptr},
+  {"max_cap",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mCpuRateCap = mozilla::joblimits::kMaxCpuRate;
+   },
+   [](const mozilla::JobLimitPlan& aPlan) {
+     using namespace mozilla::joblimits;
+     return aPlan.mCpuRateControlFlags ==
+              (kCpuRateControlEnable | kCpuRateControlHardCap) &&
+            aPlan.mCpuRateOrWeight == kMaxCpuRate;
+   }},
+  {"weight_below_min",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mCpuWeight = mozilla::joblimits::kMinCpuWeight - 1;
+   },
+   nullptr},
+  {"weight_above_max",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mCpuWeight = mozilla::joblimits::kMaxCpuWeight + 1;
+   },
+   nullptr},
+  {"max_weight",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mCpuWeight = mozilla::joblimits::kMaxCpuWeight;
+   },
+   [](const mozilla::JobLimitPlan& aPlan) {
+     using namespace mozilla::joblimits;
+     return aPlan.mCpuRateControlFlags ==
+              (kCpuRateControlEnable | kCpuRateControlWeightBased) &&
+            aPlan.mCpuRateOrWeight == kMaxCpuWeight;
+   }},
+  {"negative_iops",
+   [](mozilla::JobLimits& aLimits) { aLimits.mIoMaxIops = -1; },
+   nullptr},
+  {"negative_bandwidth",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mIoMaxIops = 100;
+     aLimits.mIoMaxBandwidth = -1;
+   },
+   nullptr},
+  {"io_bandwidth",
+   [](mozilla::JobLimits& aLimits) { aLimits.mIoMaxBandwidth = 1 << 20; },
+   [](const mozilla::JobLimitPlan& aPlan) {
+     return aPlan.mIoRateControlFlags ==
+              mozilla::joblimits::kIoRateControlEnable &&
+            !aPlan.mIoMaxIops && aPlan.mIoMaxBandwidth == 1 << 20;
+   }},
+  {"zero_cpu_time",
+   [](mozilla::JobLimits& aLimits) { aLimits.mProcessCpuTimeLimitMs = 0; },
+   nullptr},
+  {"cpu_time_overflow",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mProcessCpuTimeLimitMs = INT64_MAX / 10000 + 1;
+   },
+   nullptr},
+  {"max_cpu_time",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mProcessCpuTimeLimitMs = INT64_MAX / 10000;
+   },
+   [](const mozilla::JobLimitPlan& aPlan) {
+     return (aPlan.mLimitFlags & mozilla::joblimits::kLimitProcessTime) &&
+            aPlan.mPerProcessUserTimeLimit == INT64_MAX / 10000 * 10000;
+   }},
+  {"unknown_ui_bits",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mUiRestrictions = mozilla::joblimits::kUiLimitAll + 1;
+   },
+   nullptr},
+  {"no_ui_restrictions",
+   [](mozilla::JobLimits& aLimits) { aLimits.mUiRestrictions = 0; },
+   [](const mozilla::JobLimitPlan& aPlan) {
+     return !aPlan.mUiRestrictions;
+   }},
+  {"notifications",
+   [](mozilla::JobLimits& aLimits) {
+     aLimits.mNotifyJobMemory = 1 << 30;
+     aLimits.mNotifyIoWriteBytes = 1 << 20;
+     aLimits.mKillOnJobClose = true;
+   },
+   [](const mozilla::JobLimitPlan& aPlan) {
+     using namespace mozilla::joblimits;
+     return aPlan.mNotificationLimitFlags ==
+              (kLimitJobMemory | kLimitJobWriteBytes) &&
+            aPlan.mNotifyJobMemoryLimit == 1 << 30 &&
+            aPlan.mNotifyIoWriteBytesLimit == 1 << 20 &&
+            !aPlan.mNotifyIoReadBytesLimit &&
+            (aPlan.mLimitFlags & kLimitKillOnJobClose);
+   }},
+};
+
+// TranslateJobLimits is constexpr so that policies may be checked at compile
+// time, which only helps if the default one holds up there too
+static_assert([]() {
+  mozilla::JobLimitPlan plan;
+  plan.mActiveProcessLimit = 0;
+  return mozilla::TranslateJobLimits(mozilla::JobLimits(), plan) &&
+         plan.mActiveProcessLimit == 1 &&
+         plan.mUiRestrictions == mozilla::joblimits::kUiLimitAll;
+}(), "The default job limits must allow one process and restrict the UI");
+
+/**
+ * Runs kJobLimitsCases through TranslateJobLimits, which must leave the plan
+ * alone when it rejects the limits, and checks the job message mapping.
+ */
+bool
+CheckJobLimits()
+{
+  for (const JobLimitsCase& entry : kJobLimitsCases) {
+    mozilla::JobLimits limits;
+    entry.mSetup(limits);
+    mozilla::JobLimitPlan plan;
+    plan.mActiveProcessLimit = 42;
+    bool translated = mozilla::TranslateJobLimits(limits, plan);
+    if (entry.mExpect ? !translated || !entry.mExpect(plan) :
+                        translated || plan.mActiveProcessLimit != 42) {
+      cerr << "Job limits case " << entry.mName << " failed" << endl;
+      return false;
+    }
+  }
+
+  using namespace mozilla::joblimits;
+  const struct
+  {
+    uint32_t                    mMessage;
+    mozilla::JobLimitViolation  mViolation;
+  } kMessages[] = {
+    {kMsgEndOfProcessTime, mozilla::eViolationProcessTime},
+    {kMsgActiveProcessLimit, mozilla::eViolationActiveProcess},
+    {kMsgProcessMemoryLimit, mozilla::eViolationProcessMemory},
+    {kMsgJobMemoryLimit, mozilla::eViolationJobMemory},
+    {kMsgNotificationLimit, mozilla::eViolationNotificationLimit},
+    // End of job time, new and exiting processes, and so on
+    {0, mozilla::eViolationNone},
+    {1, mozilla::eViolationNone},
+    {4, mozilla::eViolationNone},
+    {6, mozilla::eViolationNone},
+    {8, mozilla::eViolationNone},
+    {12, mozilla::eViolationNone},
+    {UINT32_MAX, mozilla::eViolationNone},
+  };
+  for (auto&& entry : kMessages) {
+    if (mozilla::TranslateJobMessage(entry.mMessage) != entry.mViolation) {
+      cerr << "Job message " << entry.mMessage << " mistranslated" << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * StartupBlock round trips through its builder, the builder refuses what
+ * does not fit, and Validate rejects blocks that are not internally
+ * consistent even when their checksums match.
+ */
+bool
+CheckStartupBlock()
+{
+  using mozilla::StartupBlock;
+  using mozilla::StartupBlockBuilder;
+  auto block = std::make_unique<StartupBlock>();
+  auto copy = std::make_unique<StartupBlock>();
+
+  {
+    StartupBlockBuilder builder(*block);
+    builder.SetJobHandle(0x1234);
+    builder.SetInitFlags(5);
+    builder.SetMitigationPolicies(1, 2);
+    builder.SetDeferredMitigationPolicies(3, 4);
+    if (!builder.AddPreload(u"C:\\a.dll") || !builder.AddPreload(u"b.dll") ||
+        builder.AddPreload(u"") ||
+        !builder.AddChannel(mozilla::eChannelStartupTrace, 10, 4096) ||
+        !builder.AddChannel(mozilla::eChannelUser, 11, 0, 1) ||
+        !builder.AddChannel(mozilla::eChannelUser, 12, 0, 2)) {
+      return false;
+    }
+    builder.Finish();
+  }
+  const StartupBlock* valid = StartupBlock::Validate(block.get(),
+                                                     sizeof(StartupBlock));
+  if (valid != block.get() || valid->mJobHandle != 0x1234 ||
+      valid->mInitFlags != 5 || valid->mMitigationPolicies[1] != 2 ||
+      valid->mDeferredMitigationPolicies[0] != 3 ||
+      valid->GetPreload(0) != u"C:\\a.dll" ||
+      valid->GetPreload(1) != u"b.dll" ||
+      !valid->GetPreload(2).empty() ||
+      valid->FindChannel(mozilla::eChannelStartupTrace)->mSize != 4096 ||
+      valid->FindChannel(mozilla::eChannelUser, 1)->mHandle != 12 ||
+      valid->FindChannel(mozilla::eChannelUser, 2) ||
+      valid->FindChannel(mozilla::eChannelWorkerMailbox)) {
+    return false;
+  }
+  if (StartupBlock::Validate(block.get(), sizeof(StartupBlock) - 1) ||
+      StartupBlock::Validate(nullptr, sizeof(StartupBlock))) {
+    return false;
+  }
+
+  // Each of these is rejected even with a checksum to match, except the last,
+  // which only breaks the checksum
+  auto rejects = [&](auto&& aTamper, bool aResum) -> bool {
+    ::memcpy(copy.get(), block.get(), sizeof(StartupBlock));
+    aTamper(*copy);
+    if (aResum) {
+      copy->mChecksum = copy->ComputeChecksum();
+    }
+    return !StartupBlock::Validate(copy.get(), sizeof(StartupBlock));
+  };
+  if (!rejects([](StartupBlock& aBlock) { aBlock.mMagic = 0; }, true) ||
+      !rejects([](StartupBlock& aBlock) { ++aBlock.mVersion; }, true) ||
+      !rejects([](StartupBlock& aBlock) { --aBlock.mSize; }, true) ||
+      !rejects([](StartupBlock& aBlock) {
+        aBlock.mPreloadCount = StartupBlock::kMaxPreloads + 1;
+      }, true) ||
+      !rejects([](StartupBlock& aBlock) {
+        aBlock.mChannelCount = StartupBlock::kMaxChannels + 1;
+      }, true) ||
+      !rejects([](StartupBlock& aBlock) {
+        aBlock.mStringPoolUsed = StartupBlock::kStringPoolLength + 1;
+      }, true) ||
+      // Past the end of the pool, or with its terminator past it
+      !rejects([](StartupBlock& aBlock) {
+        aBlock.mPreloads[1].mOffset = aBlock.mStringPoolUsed;
+      }, true) ||
+      !rejects([](StartupBlock& aBlock) { ++aBlock.mPreloads[1].mLength; },
+               true) ||
+      !rejects([](StartupBlock& aBlock) {
+        aBlock.mPreloads[1].mOffset = UINT32_MAX;
+        aBlock.mPreloads[1].mLength = 2;
+      }, true) ||
+      // Overlapping the string before it, or missing its terminator
+      !rejects([](StartupBlock& aBlock) {
+        aBlock.mPreloads[1] = aBlock.mPreloads[0];
+      }, true) ||
+      !rejects([](StartupBlock& aBlock) { aBlock.mPreloads[1].mOffset -= 2; },
+               true) ||
+      !rejects([](StartupBlock& aBlock) { --aBlock.mPreloads[0].mLength; },
+               true) ||
+      !rejects([](StartupBlock& aBlock) { aBlock.mJobHandle = 0x4321; },
+               false)) {
+    return false;
+  }
+
+  // Full pools are refused without disturbing what is already there
+  {
+    StartupBlockBuilder builder(*block);
+    for (uint32_t i = 0; i < StartupBlock::kMaxChannels; ++i) {
+      if (!builder.AddChannel(mozilla::eChannelUser + i, i, 0)) {
+        return false;
+      }
+    }
+    for (uint32_t i = 0; i < StartupBlock::kMaxPreloads; ++i) {
+      if (!builder.AddPreload(u"x.dll")) {
+        return false;
+      }
+    }
+    if (builder.AddChannel(mozilla::eChannelUser, 99, 0) ||
+        builder.AddPreload(u"y.dll")) {
+      return false;
+    }
+    builder.Finish();
+  }
+  valid = StartupBlock::Validate(block.get(), sizeof(StartupBlock));
+  if (!valid || valid->mChannelCount != StartupBlock::kMaxChannels ||
+      valid->mPreloadCount != StartupBlock::kMaxPreloads ||
+      valid->FindChannel(mozilla::eChannelUser)->mHandle != 0 ||
+      valid->GetPreload(StartupBlock::kMaxPreloads - 1) != u"x.dll") {
+    return false;
+  }
+
+  // A string pool with no room for another path and its terminator
+  std::u16string path(StartupBlock::kStringPoolLength / 2 - 1, u'p');
+  {
+    StartupBlockBuilder builder(*block);
+    if (!builder.AddPreload(path) || !builder.AddPreload(path) ||
+        builder.AddPreload(u"q")) {
+      return false;
+    }
+    builder.Finish();
+  }
+  valid = StartupBlock::Validate(block.get(), sizeof(StartupBlock));
+  return valid && valid->mStringPoolUsed == StartupBlock::kStringPoolLength &&
+         valid->GetPreload(1) == path;
+}
+
+/**
+ * The layout and summary of the trace that the launcher and the sandbox
+ * share: traces that cannot be trusted are rejected, and phases that were
+ * skipped are attributed to the next completed one.
+ */
+bool
+CheckStartupTrace()
+{
+  using mozilla::StartupTrace;
+  using mozilla::StartupTraceSummary;
+  const uint64_t kTicksPerSecond = 1000000;
+
+  StartupTrace trace;
+  StartupTraceSummary summary;
+  trace.Init(kTicksPerSecond);
+  // Nothing completed yet is not an error
+  if (!SummarizeStartupTrace(trace, summary) || summary.mCompleted ||
+      summary.mReady || summary.mElapsedNs ||
+      summary.mFailedPhase != mozilla::ePhaseNone) {
+    return false;
+  }
+
+  trace.mMagic = 0;
+  if (SummarizeStartupTrace(trace, summary)) {
+    return false;
+  }
+  trace.Init(kTicksPerSecond);
+  trace.mVersion = StartupTrace::kVersion + 1;
+  if (SummarizeStartupTrace(trace, summary)) {
+    return false;
+  }
+  trace.Init(0);
+  if (SummarizeStartupTrace(trace, summary)) {
+    return false;
+  }
+
+  // Phase i completes i milliseconds after the previous one
+  trace.Init(kTicksPerSecond);
+  uint64_t ticks = 5000;
+  for (uint32_t phase = 0; phase < mozilla::ePhaseCount; ++phase) {
+    ticks += phase * 1000;
+    trace.Mark(static_cast<mozilla::StartupPhase>(phase), ticks);
+  }
+  if (!SummarizeStartupTrace(trace, summary) || !summary.mReady ||
+      summary.mCompleted != (1U << mozilla::ePhaseCount) - 1 ||
+      summary.mElapsedNs != (ticks - 5000) * 1000) {
+    return false;
+  }
+  for (uint32_t phase = 0; phase < mozilla::ePhaseCount; ++phase) {
+    if (summary.mPhaseNs[phase] != uint64_t(phase) * 1000000) {
+      return false;
+    }
+  }
+  trace.Mark(mozilla::ePhaseCount, 0);
+  if (trace.mCompleted.load() != (1U << mozilla::ePhaseCount) - 1) {
+    return false;
+  }
+
+  // A skipped phase's time goes to the next phase that completed
+  trace.Init(kTicksPerSecond);
+  trace.Mark(mozilla::ePhaseProcessCreating, 1000);
+  trace.Mark(mozilla::ePhaseProcessResumed, 2000);
+  trace.Mark(mozilla::ePhaseJobValidated, 5000);
+  trace.MarkFailed();
+  if (!SummarizeStartupTrace(trace, summary) || summary.mReady ||
+      summary.mFailedPhase != mozilla::ePhaseEntered ||
+      summary.mPhaseNs[mozilla::ePhaseEntered] ||
+      summary.mPhaseNs[mozilla::ePhaseJobValidated] != 3000000 ||
+      summary.mElapsedNs != 4000000) {
+    return false;
+  }
+
+  // Time never runs backwards
+  trace.Mark(mozilla::ePhasePreloadsLoaded, 4000);
+  if (SummarizeStartupTrace(trace, summary)) {
+    return false;
+  }
+
+  // Ten years' worth of 10MHz ticks, times 10^9, would overflow
+  const uint64_t kTenYearsOfTicks = 10000000ULL * 3600 * 24 * 365 * 10 + 7;
+  trace.Init(10000000);
+  trace.Mark(mozilla::ePhaseProcessCreating, 0);
+  trace.Mark(mozilla::ePhaseReady, kTenYearsOfTicks);
+  return SummarizeStartupTrace(trace, summary) &&
+         summary.mElapsedNs == (kTenYearsOfTicks - 7) * 100 + 700;
+}
+
+/**
+ * Checks of the building blocks that have nothing to time, by name.
+ */
+struct HarnessCheck
+{
+  const char* mName;
+  bool        (*mCheck)();
+};
+
+const HarnessCheck kHarnessChecks[] = {
+  {"job_limits", CheckJobLimits},
+  {"mitigation_table", CheckMitigationTable},
+  {"policy_file", CheckPolicyFile},
+  {"startup_block", CheckStartupBlock},
+  {"startup_trace", CheckStartupTrace},
+  {"metrics_ring", CheckMetricsRing},
+  {"job_accounting", CheckJobAccounting},
+};
+
+int
+RunHarnessChecks()
+{
+  bool ok = true;
+  cout << "{\"benchmark\": \"check\"";
+  for (const HarnessCheck& check : kHarnessChecks) {
+    bool passed = check.mCheck();
+    cout << ", \"" << check.mName << "\": " << (passed ? "true" : "false");
+    ok = ok && passed;
+  }
+  cout << "}" << endl;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+  unsigned long iterations = argc >= 3 ? strtoul(argv[2], nullptr, 10) : 100UL;
+  if (!iterations) {
+    iterations = 1;
+  }
+
+  if (argc >= 2 && !strcmp(argv[1], "taskgraph")) {
+    return BenchTaskGraph(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "placement")) {
+    return BenchPlacement(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "cpurate")) {
+    return BenchCpuRate(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "memory")) {
+    return BenchMemoryPressure(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "resolver")) {
+    return BenchResolverCache(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "path")) {
+    return BenchPathCanonicalizer(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "pathfuzz")) {
+    return FuzzPathCanonicalizer(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "admission")) {
+    return BenchAdmission(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "group")) {
+    return BenchSandboxGroup(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "worker")) {
+    return BenchWorker(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "teardown")) {
+    return BenchTeardown(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "async")) {
+    return BenchAsync(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "policy")) {
+    return BenchCompiledPolicy(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "backend")) {
+    return BenchLaunchBackend(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "launch")) {
+    return BenchLaunchSuite(argc >= 3 ? iterations : 1000UL);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "seccomp")) {
+    return BenchSeccomp(iterations);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "accounting")) {
+    return BenchJobAccounting(argc >= 3 ? iterations : 200UL);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "check")) {
+    return RunHarnessChecks();
+  }
+  if (argc >= 2 && !strcmp(argv[1], "wait")) {
+    return BenchWaitWord(argc >= 3 ? iterations : 20000UL);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "ring")) {
+    return BenchRingChannel(argc >= 3 ? iterations : 2000000UL);
+  }
+#if defined(_WIN32) || defined(__linux__)
+  if (argc >= 2 && !strcmp(argv[1], "channels")) {
+    return BenchChannelRegistry(argc >= 3 ? iterations : 2000UL);
+  }
+#endif
+#if defined(__linux__)
+  if (argc >= 2 && !strcmp(argv[1], "linux")) {
+    return BenchLinuxLaunch(iterations);
+  }
+  // The linux benchmark's children
+  if (argc >= 2 && !strcmp(argv[1], "linuxchild")) {
+    return RunLinuxSandbox(argc, argv);
+  }
+  if (argc >= 2 && !strcmp(argv[1], "linuxbaseline")) {
+    return EXIT_SUCCESS;
+  }
+#endif
+
+  cout << "Usage: " << argv[0] << " <benchmark> [iterations]" << endl;
+  cout << "Benchmarks: taskgraph placement cpurate memory resolver path pathfuzz teardown admission group worker policy async backend launch seccomp channels ring wait accounting check linux" << endl;
+  return EXIT_FAILURE;
+}
+
@@ -13,9 +13,12 @@
 #include <oleacc.h> // For IAccessible
 #include <sddl.h>
 
+#include "ChannelRegistry.h"
 #include "dacl.h"
 #include "sid.h"
+#include "StartupBlock.h"
 #include "UniqueHandle.h"
+#include "WaitWord.h"
 #include "WindowsSandbox.h"
 
 #include "comarshal.h"
@@ -26,6 +29,7 @@ using std::wcout;
 using std::wcerr;
 using std::endl;
 using std::wostringstream;
+using mozilla::ChannelRegistry;
 using mozilla::WindowsSandboxLauncher;
 using mozilla::mscom::Handoff;
 
@@ -33,6 +37,8 @@ namespace {
 
 struct BufDescriptor
 {
+  // Set to 1 by the sandbox once mLen and mData are filled in
+  mozilla::WaitWord mReady;
   int mLen;
   BYTE mData[0];
 };
@@ -291,8 +297,11 @@ TestAccessible::accHitTest(
   return inOk ? S_OK : E_FAIL;
 }
 
-const WCHAR gSectionName[] = L"comtest-shm";
-const WCHAR gEventName[] = L"comtest-evt";
+// Both are anonymous and inherited by the sandbox, so that any number of
+// comtest pairs may run at once
+const uint32_t kBufferChannel = mozilla::eChannelUser;
+const uint32_t kReadyChannel = mozilla::eChannelUser + 1;
+const uint64_t kSharedBufferSize = 0x4000;
 
 class COMTestSandbox : public mozilla::WindowsSandbox
 {
@@ -319,17 +328,18 @@ private:
 bool
 COMTestSandbox::OnPrivInit()
 {
-  mSection.reset(::OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, gSectionName));
+  mSection.reset(GetChannelHandle(kBufferChannel));
   if (!mSection) {
     return false;
   }
   mSharedBuffer.reset(reinterpret_cast<BufDescriptor*>(
-                      ::MapViewOfFile(mSection.get(), FILE_MAP_ALL_ACCESS, 0,
-                                      0, 0)));
+                      ::MapViewOfFile(mSection.get(),
+                                      FILE_MAP_READ | FILE_MAP_WRITE, 0, 0,
+                                      kSharedBufferSize)));
   if (!mSharedBuffer) {
     return false;
   }
-  mEvent.reset(::OpenEvent(EVENT_MODIFY_STATE, FALSE, gEventName));
+  mEvent.reset(GetChannelHandle(kReadyChannel));
   if (!mEvent) {
     return false;
   }
@@ -394,9 +404,16 @@ COMTestSandbox::OnInit()
   }
   int len = 0;
   const char* buf = outStream.GetBuffer(len);
+  if (len < 0 || static_cast<uint64_t>(len) >
+                   kSharedBufferSize - sizeof(BufDescriptor)) {
+    return false;
+  }
   mSharedBuffer->mLen = len;
   memcpy(&mSharedBuffer->mData[0], buf, len);
-  ::SetEvent(mEvent.get());
+  // mEvent is only signalled if the launcher got tired of spinning
+  mozilla::StoreWordAndNotify(mSharedBuffer->mReady, 1,
+                              mozilla::eWaitWordShared,
+                              reinterpret_cast<uintptr_t>(mEvent.get()));
   while (::WaitForSingleObjectEx(callEvent.get(), INFINITE, TRUE) != WAIT_OBJECT_0) {}
   return true;
 }
@@ -409,22 +426,65 @@ COMTestSandbox::OnFini()
 
 }
 
-static UniqueKernelHandle gSection;
-static UniqueKernelHandle gEvent;
+static mozilla::Win32ChannelBackend gChannelBackend;
+static ChannelRegistry gChannels(gChannelBackend, "comtest");
 static const DWORD SHM_TIMEOUT = 10000U;
 
+/**
+ * Creates aInstance's buffer and ready event, and passes the sandbox copies
+ * that may only fill the buffer and signal the event.
+ */
 static BufDescriptor*
-CreateSharedSection()
+CreateSharedSection(WindowsSandboxLauncher& aLauncher,
+                    ChannelRegistry::InstanceId aInstance,
+                    HANDLE& aReadyEvent)
 {
-  SECURITY_ATTRIBUTES sa = {sizeof(sa), nullptr, FALSE};
-  gSection.reset(CreateFileMapping(NULL, &sa, PAGE_READWRITE, 0, 0x4000,
-                                   gSectionName));
-  if (!gSection) {
-    return false;
+  auto section = gChannels.CreateSection(aInstance, kBufferChannel,
+                                         kSharedBufferSize);
+  auto event = gChannels.CreateAutoResetEvent(aInstance, kReadyChannel);
+  if (!section || !event) {
+    return nullptr;
+  }
+
+  auto childSection = gChannels.CopyForSandbox(aInstance, kBufferChannel,
+                                               FILE_MAP_READ | FILE_MAP_WRITE);
+  auto childEvent = gChannels.CopyForSandbox(aInstance, kReadyChannel,
+                                             EVENT_MODIFY_STATE);
+  if (!childSection || !childEvent ||
+      !aLauncher.AddChannel(kBufferChannel,
+                            reinterpret_cast<HANDLE>(childSection->mHandle),
+                            kSharedBufferSize) ||
+      !aLauncher.AddChannel(kReadyChannel,
+                            reinterpret_cast<HANDLE>(childEvent->mHandle),
+                            0)) {
+    return nullptr;
+  }
+
+  aReadyEvent = reinterpret_cast<HANDLE>(event->mHandle);
+  return reinterpret_cast<BufDescriptor*>(
+           ::MapViewOfFile(reinterpret_cast<HANDLE>(section->mHandle),
+                           FILE_MAP_ALL_ACCESS, 0, 0, 0));
+}
+
+static void
+PrintStartupTrace(const WindowsSandboxLauncher& aLauncher)
+{
+  mozilla::StartupTraceSummary summary;
+  if (!aLauncher.GetStartupTrace(summary)) {
+    return;
+  }
+
+  for (uint32_t phase = 0; phase < mozilla::ePhaseCount; ++phase) {
+    if (summary.mCompleted & (1U << phase)) {
+      wcout << mozilla::GetStartupPhaseName(phase) << L": "
+            << summary.mPhaseNs[phase] / 1000 << L"us" << endl;
+    }
+  }
+  if (summary.mFailedPhase != mozilla::ePhaseNone) {
+    wcout << L"Sandbox failed during "
+          << mozilla::GetStartupPhaseName(summary.mFailedPhase) << endl;
   }
-  gEvent.reset(CreateEvent(&sa, FALSE, FALSE, gEventName));
-  return reinterpret_cast<BufDescriptor*>(MapViewOfFile(gSection.get(),
-                                               FILE_MAP_ALL_ACCESS, 0, 0, 0));
+  wcout << L"Time to ready: " << summary.mElapsedNs / 1000 << L"us" << endl;
 }
 
 int wmain(int argc, wchar_t* argv[])
@@ -438,18 +498,26 @@ int wmain(int argc, wchar_t* argv[])
       return EXIT_FAILURE;
     }
 
-    UniqueMappedFileView<BufDescriptor> sharedBuf(CreateSharedSection());
+    ChannelRegistry::InstanceId instance = gChannels.CreateInstance();
+    HANDLE readyEvent = nullptr;
+    UniqueMappedFileView<BufDescriptor> sharedBuf(
+      CreateSharedSection(sboxLauncher, instance, readyEvent));
     if (!sharedBuf) {
       wcout << L"Failed to create shared section data" << endl;
       return EXIT_FAILURE;
     }
+    sharedBuf->mReady.Init();
 
     if (!sboxLauncher.Launch(argv[0], L"")) {
       wcerr << L"Failed to launch" << endl;
       return EXIT_FAILURE;
     }
 
-    if (WaitForSingleObject(gEvent.get(), ::IsDebuggerPresent() ? INFINITE : SHM_TIMEOUT) != WAIT_OBJECT_0) {
+    if (!mozilla::WaitForWordChange(sharedBuf->mReady, 0,
+                                    ::IsDebuggerPresent() ?
+                                      mozilla::kWaitWordInfinite : SHM_TIMEOUT,
+                                    mozilla::eWaitWordShared,
+                                    reinterpret_cast<uintptr_t>(readyEvent))) {
       wcout << L"Failure or timeout waiting for population of shared memory" << endl;
       return EXIT_FAILURE;
     }
@@ -481,6 +549,9 @@ int wmain(int argc, wchar_t* argv[])
       return EXIT_FAILURE;
     }
 
+    // Anything left is destroyed along with gChannels on the way out
+    gChannels.ReleaseInstance(instance);
+    PrintStartupTrace(sboxLauncher);
     return EXIT_SUCCESS;
   }
 
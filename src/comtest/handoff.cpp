@@ -5,6 +5,7 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "handoff.h"
+#include "WaitWord.h"
 
 namespace {
 
@@ -15,27 +16,22 @@ public:
                              IUnknown* aTargetInterface)
     : mCallFrame(aCallFrame)
     , mTargetInterface(aTargetInterface)
-    , mIsDone(::CreateEvent(nullptr, FALSE, FALSE, nullptr))
     , mResult(E_UNEXPECTED)
   {
+    mIsDone.Init();
   }
 
-  ~ThreadHandoffInfo()
+  bool IsDone()
   {
-    if (mIsDone) {
-      ::CloseHandle(mIsDone);
-    }
-  }
-
-  bool IsDone() const
-  {
-    return ::WaitForSingleObject(mIsDone, INFINITE) == WAIT_OBJECT_0;
+    return mozilla::WaitForWordChange(mIsDone, 0, mozilla::kWaitWordInfinite,
+                                      mozilla::eWaitWordProcess);
   }
 
   void Invoke()
   {
     mResult = mCallFrame->Invoke(mTargetInterface);
-    ::SetEvent(mIsDone);
+    // Does not enter the kernel if the caller is still spinning
+    mozilla::StoreWordAndNotify(mIsDone, 1, mozilla::eWaitWordProcess);
   }
 
   HRESULT GetResult() const
@@ -44,10 +40,11 @@ public:
   }
 
 private:
-  ICallFrame* mCallFrame;
-  IUnknown*   mTargetInterface;
-  HANDLE      mIsDone;
-  HRESULT     mResult;
+  ICallFrame*       mCallFrame;
+  IUnknown*         mTargetInterface;
+  // No kernel object per call
+  mozilla::WaitWord mIsDone;
+  HRESULT           mResult;
 };
 
 } // anonymous namespace
@@ -0,0 +1,174 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "PolicyCompiler.h"
+#include "SandboxPolicy.h"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using mozilla::PolicyFile;
+using mozilla::PolicyRecord;
+
+namespace {
+
+bool
+ReadFile(const char* aPath, std::string& aContents)
+{
+  std::ifstream file(aPath, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  aContents.assign(std::istreambuf_iterator<char>(file),
+                   std::istreambuf_iterator<char>());
+  return !file.bad();
+}
+
+/**
+ * Policy files are used in place, so they need to be loaded into suitably
+ * aligned storage.
+ */
+bool
+LoadPolicyFile(const char* aPath, std::vector<uint64_t>& aStorage,
+               size_t& aLen)
+{
+  std::string contents;
+  if (!ReadFile(aPath, contents)) {
+    return false;
+  }
+  aStorage.assign((contents.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t),
+                  0);
+  ::memcpy(aStorage.data(), contents.data(), contents.size());
+  aLen = contents.size();
+  return true;
+}
+
+int
+Compile(const char* aInput, const char* aOutput)
+{
+  std::string source;
+  if (!ReadFile(aInput, source)) {
+    cerr << "Failed to read " << aInput << endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<uint8_t> compiled;
+  std::string error;
+  if (!mozilla::CompilePolicies(source, compiled, error)) {
+    cerr << aInput << ": " << error << endl;
+    return EXIT_FAILURE;
+  }
+
+  std::ofstream out(aOutput, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char*>(compiled.data()), compiled.size());
+  if (!out) {
+    cerr << "Failed to write " << aOutput << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int
+Validate(const char* aPath)
+{
+  std::vector<uint64_t> storage;
+  size_t len;
+  if (!LoadPolicyFile(aPath, storage, len)) {
+    cerr << "Failed to read " << aPath << endl;
+    return EXIT_FAILURE;
+  }
+
+  const char* error = nullptr;
+  if (!mozilla::ValidatePolicyFile(storage.data(), len, &error)) {
+    cerr << aPath << ": " << error << endl;
+    return EXIT_FAILURE;
+  }
+
+  PolicyFile policies;
+  policies.Init(storage.data(), len);
+  for (uint32_t i = 0; i < policies.Count(); ++i) {
+    cout << policies.GetString(policies.GetRecord(i)->mName) << endl;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int
+Bench(const char* aPath, unsigned long aIterations)
+{
+  std::vector<uint64_t> storage;
+  size_t len;
+  if (!LoadPolicyFile(aPath, storage, len)) {
+    cerr << "Failed to read " << aPath << endl;
+    return EXIT_FAILURE;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  PolicyFile policies;
+  if (!policies.Init(storage.data(), len)) {
+    cerr << aPath << ": invalid policy file" << endl;
+    return EXIT_FAILURE;
+  }
+  auto loaded = std::chrono::steady_clock::now();
+
+  std::vector<std::string> names;
+  for (uint32_t i = 0; i < policies.Count(); ++i) {
+    names.emplace_back(policies.GetString(policies.GetRecord(i)->mName));
+  }
+  if (names.empty()) {
+    cerr << aPath << ": no policies" << endl;
+    return EXIT_FAILURE;
+  }
+
+  uint64_t found = 0;
+  auto lookupStart = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < aIterations; ++i) {
+    found += !!policies.Find(names[i % names.size()]);
+  }
+  auto lookupEnd = std::chrono::steady_clock::now();
+
+  typedef std::chrono::duration<double, std::nano> Nanoseconds;
+  cout << "{\"policies\": " << policies.Count()
+       << ", \"bytes\": " << len
+       << ", \"load_ns\": " << Nanoseconds(loaded - start).count()
+       << ", \"lookup_ns\": "
+       << Nanoseconds(lookupEnd - lookupStart).count() / aIterations
+       << ", \"found\": " << found << "}" << endl;
+  return EXIT_SUCCESS;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+  if (argc == 3 && !strcmp(argv[1], "--validate")) {
+    return Validate(argv[2]);
+  }
+  if ((argc == 3 || argc == 4) && !strcmp(argv[1], "--bench")) {
+    unsigned long iterations = argc == 4 ? strtoul(argv[3], nullptr, 10)
+                                         : 1000000UL;
+    return Bench(argv[2], iterations ? iterations : 1);
+  }
+  if (argc == 3) {
+    return Compile(argv[1], argv[2]);
+  }
+
+  cout << "Usage: " << argv[0] << " <input.policy> <output.bin>" << endl;
+  cout << "       " << argv[0] << " --validate <policy.bin>" << endl;
+  cout << "       " << argv[0] << " --bench <policy.bin> [iterations]" << endl;
+  return EXIT_FAILURE;
+}
+
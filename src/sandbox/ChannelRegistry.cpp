@@ -0,0 +1,395 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ChannelRegistry.h"
+
+#include <cstdio>
+#include <random>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#endif
+
+namespace mozilla {
+
+#if defined(_WIN32)
+
+namespace {
+
+std::wstring
+WidenName(const std::string& aName)
+{
+  // Generated names are ASCII
+  return std::wstring(aName.begin(), aName.end());
+}
+
+std::optional<uintptr_t>
+CheckCreated(HANDLE aHandle, bool aNamed)
+{
+  // A name that already exists belongs to somebody else
+  if (aHandle && aNamed && ::GetLastError() == ERROR_ALREADY_EXISTS) {
+    ::CloseHandle(aHandle);
+    return std::nullopt;
+  }
+  if (!aHandle) {
+    return std::nullopt;
+  }
+  return reinterpret_cast<uintptr_t>(aHandle);
+}
+
+} // anonymous namespace
+
+std::optional<uintptr_t>
+Win32ChannelBackend::CreateSection(const std::string& aName, uint64_t aSize)
+{
+  std::wstring name = WidenName(aName);
+  HANDLE section = ::CreateFileMapping(INVALID_HANDLE_VALUE, nullptr,
+                                       PAGE_READWRITE,
+                                       static_cast<DWORD>(aSize >> 32),
+                                       static_cast<DWORD>(aSize),
+                                       aName.empty() ? nullptr : name.c_str());
+  return CheckCreated(section, !aName.empty());
+}
+
+std::optional<uintptr_t>
+Win32ChannelBackend::CreateAutoResetEvent(const std::string& aName)
+{
+  std::wstring name = WidenName(aName);
+  HANDLE event = ::CreateEvent(nullptr, FALSE, FALSE,
+                               aName.empty() ? nullptr : name.c_str());
+  return CheckCreated(event, !aName.empty());
+}
+
+std::optional<uintptr_t>
+Win32ChannelBackend::CopyForSandbox(const ChannelObject& aObject,
+                                    uint32_t aAccess)
+{
+  HANDLE copy = nullptr;
+  if (!::DuplicateHandle(::GetCurrentProcess(),
+                         reinterpret_cast<HANDLE>(aObject.mHandle),
+                         ::GetCurrentProcess(), &copy, aAccess, TRUE, 0)) {
+    return std::nullopt;
+  }
+  return reinterpret_cast<uintptr_t>(copy);
+}
+
+void
+Win32ChannelBackend::Destroy(const ChannelObject& aObject,
+                             const std::string& aName)
+{
+  // Names go away with the last handle
+  ::CloseHandle(reinterpret_cast<HANDLE>(aObject.mHandle));
+}
+
+#else
+
+std::optional<uintptr_t>
+PosixChannelBackend::CreateSection(const std::string& aName, uint64_t aSize)
+{
+  int fd;
+  std::string name;
+  if (aName.empty()) {
+#if defined(__linux__)
+    fd = ::memfd_create("sandbox-channel", MFD_CLOEXEC);
+#else
+    return std::nullopt;
+#endif
+  } else {
+    name = "/" + aName;
+    fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  }
+  if (fd < 0) {
+    return std::nullopt;
+  }
+
+  if (::ftruncate(fd, static_cast<off_t>(aSize))) {
+    ::close(fd);
+    if (!name.empty()) {
+      ::shm_unlink(name.c_str());
+    }
+    return std::nullopt;
+  }
+  return static_cast<uintptr_t>(fd);
+}
+
+std::optional<uintptr_t>
+PosixChannelBackend::CreateAutoResetEvent(const std::string& aName)
+{
+#if defined(__linux__)
+  if (aName.empty()) {
+    int fd = ::eventfd(0, EFD_CLOEXEC);
+    if (fd >= 0) {
+      return static_cast<uintptr_t>(fd);
+    }
+  }
+#endif
+  return std::nullopt;
+}
+
+std::optional<uintptr_t>
+PosixChannelBackend::CopyForSandbox(const ChannelObject& aObject,
+                                    uint32_t aAccess)
+{
+  // The launcher decides which descriptors the sandbox inherits
+  int fd = ::fcntl(static_cast<int>(aObject.mHandle), F_DUPFD_CLOEXEC, 0);
+  if (fd < 0) {
+    return std::nullopt;
+  }
+  return static_cast<uintptr_t>(fd);
+}
+
+void
+PosixChannelBackend::Destroy(const ChannelObject& aObject,
+                             const std::string& aName)
+{
+  ::close(static_cast<int>(aObject.mHandle));
+  if (!aName.empty()) {
+    ::shm_unlink(("/" + aName).c_str());
+  }
+}
+
+#endif // defined(_WIN32)
+
+namespace {
+
+uint64_t
+MakeNonce()
+{
+  std::random_device random;
+  return (uint64_t(random()) << 32) | random();
+}
+
+} // anonymous namespace
+
+ChannelRegistry::ChannelRegistry(ChannelBackend& aBackend,
+                                 const std::string_view aPrefix)
+  : mBackend(aBackend)
+  , mPrefix(aPrefix)
+  , mNonce(MakeNonce())
+  , mNextInstance(1)
+  , mNextName(0)
+{
+}
+
+ChannelRegistry::~ChannelRegistry()
+{
+  for (Shard& shard : mShards) {
+    for (auto& instance : shard.mInstances) {
+      DestroyEntries(instance.second);
+    }
+  }
+}
+
+ChannelRegistry::InstanceId
+ChannelRegistry::CreateInstance()
+{
+  InstanceId instance = mNextInstance.fetch_add(1, std::memory_order_relaxed);
+  Shard& shard = GetShard(instance);
+  std::lock_guard<std::mutex> lock(shard.mMutex);
+  shard.mInstances.emplace(instance, std::vector<Entry>());
+  return instance;
+}
+
+void
+ChannelRegistry::DestroyEntries(std::vector<Entry>& aEntries)
+{
+  // Copies first, since they may refer to the originals
+  for (auto entry = aEntries.rbegin(); entry != aEntries.rend(); ++entry) {
+    mBackend.Destroy(entry->mObject, entry->mName);
+  }
+  aEntries.clear();
+}
+
+size_t
+ChannelRegistry::ReleaseInstance(InstanceId aInstance)
+{
+  std::vector<Entry> entries;
+  {
+    Shard& shard = GetShard(aInstance);
+    std::lock_guard<std::mutex> lock(shard.mMutex);
+    auto instance = shard.mInstances.find(aInstance);
+    if (instance == shard.mInstances.end()) {
+      return 0;
+    }
+    entries.swap(instance->second);
+    shard.mInstances.erase(instance);
+  }
+
+  size_t count = entries.size();
+  DestroyEntries(entries);
+  return count;
+}
+
+/* static */ const ChannelRegistry::Entry*
+ChannelRegistry::FindEntry(const std::vector<Entry>& aEntries,
+                           uint32_t aChannelKind, uint32_t aNth)
+{
+  for (const Entry& entry : aEntries) {
+    if (entry.mChannelKind == aChannelKind && entry.mNth == aNth &&
+        entry.mObject.mKind != eChannelObjectSandboxCopy) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+template <typename CreateFn>
+std::optional<ChannelObject>
+ChannelRegistry::Add(InstanceId aInstance, uint32_t aChannelKind,
+                     ChannelObjectKind aKind, uint64_t aSize, bool aNamed,
+                     CreateFn&& aCreate)
+{
+  std::string name;
+  if (aNamed) {
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), "-%016llx-%llu-%x-%llu",
+             static_cast<unsigned long long>(mNonce),
+             static_cast<unsigned long long>(aInstance), aChannelKind,
+             static_cast<unsigned long long>(
+               mNextName.fetch_add(1, std::memory_order_relaxed)));
+    name = mPrefix + suffix;
+  }
+
+  std::optional<uintptr_t> handle = aCreate(name);
+  if (!handle) {
+    return std::nullopt;
+  }
+  ChannelObject object = {*handle, aKind, aSize};
+
+  {
+    Shard& shard = GetShard(aInstance);
+    std::lock_guard<std::mutex> lock(shard.mMutex);
+    auto instance = shard.mInstances.find(aInstance);
+    if (instance != shard.mInstances.end()) {
+      uint32_t nth = 0;
+      for (const Entry& entry : instance->second) {
+        if (entry.mChannelKind == aChannelKind &&
+            entry.mObject.mKind != eChannelObjectSandboxCopy) {
+          ++nth;
+        }
+      }
+      instance->second.push_back(Entry{aChannelKind, nth, object,
+                                       std::move(name)});
+      return object;
+    }
+  }
+
+  // The instance was released, or never existed
+  mBackend.Destroy(object, name);
+  return std::nullopt;
+}
+
+std::optional<ChannelObject>
+ChannelRegistry::CreateSection(InstanceId aInstance, uint32_t aChannelKind,
+                               uint64_t aSize, bool aNamed)
+{
+  return Add(aInstance, aChannelKind, eChannelObjectSection, aSize, aNamed,
+             [&](const std::string& aName) -> std::optional<uintptr_t> {
+               return mBackend.CreateSection(aName, aSize);
+             });
+}
+
+std::optional<ChannelObject>
+ChannelRegistry::CreateAutoResetEvent(InstanceId aInstance,
+                                      uint32_t aChannelKind, bool aNamed)
+{
+  return Add(aInstance, aChannelKind, eChannelObjectEvent, 0, aNamed,
+             [&](const std::string& aName) -> std::optional<uintptr_t> {
+               return mBackend.CreateAutoResetEvent(aName);
+             });
+}
+
+std::optional<ChannelObject>
+ChannelRegistry::CopyForSandbox(InstanceId aInstance, uint32_t aChannelKind,
+                                uint32_t aAccess, uint32_t aNth)
+{
+  // Copied under the lock, so that the original cannot be released first
+  Shard& shard = GetShard(aInstance);
+  std::lock_guard<std::mutex> lock(shard.mMutex);
+  auto instance = shard.mInstances.find(aInstance);
+  if (instance == shard.mInstances.end()) {
+    return std::nullopt;
+  }
+  const Entry* original = FindEntry(instance->second, aChannelKind, aNth);
+  if (!original) {
+    return std::nullopt;
+  }
+
+  std::optional<uintptr_t> handle = mBackend.CopyForSandbox(original->mObject,
+                                                            aAccess);
+  if (!handle) {
+    return std::nullopt;
+  }
+  ChannelObject copy = {*handle, eChannelObjectSandboxCopy,
+                        original->mObject.mSize};
+  instance->second.push_back(Entry{aChannelKind, aNth, copy, std::string()});
+  return copy;
+}
+
+std::optional<ChannelObject>
+ChannelRegistry::Find(InstanceId aInstance, uint32_t aChannelKind,
+                      uint32_t aNth) const
+{
+  Shard& shard = GetShard(aInstance);
+  std::lock_guard<std::mutex> lock(shard.mMutex);
+  auto instance = shard.mInstances.find(aInstance);
+  if (instance == shard.mInstances.end()) {
+    return std::nullopt;
+  }
+  const Entry* entry = FindEntry(instance->second, aChannelKind, aNth);
+  if (!entry) {
+    return std::nullopt;
+  }
+  return entry->mObject;
+}
+
+std::string
+ChannelRegistry::GetName(InstanceId aInstance, uint32_t aChannelKind,
+                         uint32_t aNth) const
+{
+  Shard& shard = GetShard(aInstance);
+  std::lock_guard<std::mutex> lock(shard.mMutex);
+  auto instance = shard.mInstances.find(aInstance);
+  if (instance == shard.mInstances.end()) {
+    return std::string();
+  }
+  const Entry* entry = FindEntry(instance->second, aChannelKind, aNth);
+  return entry ? entry->mName : std::string();
+}
+
+size_t
+ChannelRegistry::GetInstanceCount() const
+{
+  size_t count = 0;
+  for (const Shard& shard : mShards) {
+    std::lock_guard<std::mutex> lock(shard.mMutex);
+    count += shard.mInstances.size();
+  }
+  return count;
+}
+
+size_t
+ChannelRegistry::GetObjectCount() const
+{
+  size_t count = 0;
+  for (const Shard& shard : mShards) {
+    std::lock_guard<std::mutex> lock(shard.mMutex);
+    for (const auto& instance : shard.mInstances) {
+      count += instance.second.size();
+    }
+  }
+  return count;
+}
+
+} // namespace mozilla
+
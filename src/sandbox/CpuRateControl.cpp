@@ -0,0 +1,190 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "CpuRateControl.h"
+#include "JobLimits.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace mozilla {
+
+using joblimits::kMaxCpuRate;
+
+namespace {
+
+// Indexed by SandboxPriority. Normal uses the job object's default weight.
+const CpuShare kCpuShares[] = {
+  {1, 1, 100},
+  {5, 4, 200},
+  {9, 12, 500},
+};
+
+static_assert(sizeof(kCpuShares) / sizeof(kCpuShares[0]) == ePriorityCount,
+              "Every priority class needs a CpuShare");
+
+} // anonymous namespace
+
+const CpuShare&
+GetCpuShare(SandboxPriority aPriority)
+{
+  return kCpuShares[aPriority < ePriorityCount ? aPriority : ePriorityNormal];
+}
+
+bool
+CpuRateController::Add(uint32_t aId, SandboxPriority aPriority)
+{
+  if (aPriority >= ePriorityCount) {
+    return false;
+  }
+
+  auto entry = std::find_if(mEntries.begin(), mEntries.end(),
+                            [aId](const Entry& aEntry) -> bool {
+    return aEntry.mId == aId;
+  });
+  if (entry != mEntries.end()) {
+    return false;
+  }
+
+  mEntries.push_back(Entry{aId, aPriority, kMaxCpuRate, 0.0});
+  return true;
+}
+
+void
+CpuRateController::Remove(uint32_t aId)
+{
+  mEntries.erase(std::remove_if(mEntries.begin(), mEntries.end(),
+                                [aId](const Entry& aEntry) -> bool {
+                   return aEntry.mId == aId;
+                 }), mEntries.end());
+}
+
+void
+CpuRateController::ComputeTargets(double aCapacity,
+                                  std::vector<double>& aTargets) const
+{
+  const size_t count = mEntries.size();
+  aTargets.assign(count, 0.0);
+
+  // Weighted water-filling: satisfy every sandbox that wants less than its
+  // fair share, then split what is left among the rest. Light users are
+  // capped at their fair share rather than their demand so that they may
+  // burst without waiting for the next update.
+  std::vector<bool> settled(count, false);
+  double remaining = std::max(aCapacity, 0.0);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    double totalShare = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+      if (!settled[i]) {
+        totalShare += GetCpuShare(mEntries[i].mPriority).mShare;
+      }
+    }
+    if (totalShare == 0.0) {
+      break;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      if (settled[i]) {
+        continue;
+      }
+      double fair = remaining * GetCpuShare(mEntries[i].mPriority).mShare /
+                    totalShare;
+      double demand = std::min(mEntries[i].mUsage * mConfig.mDemandHeadroom,
+                               1.0);
+      if (demand <= fair) {
+        aTargets[i] = fair;
+        remaining -= demand;
+        settled[i] = true;
+        changed = true;
+      }
+    }
+  }
+
+  double totalShare = 0.0;
+  for (size_t i = 0; i < count; ++i) {
+    if (!settled[i]) {
+      totalShare += GetCpuShare(mEntries[i].mPriority).mShare;
+    }
+  }
+  for (size_t i = 0; i < count; ++i) {
+    if (!settled[i]) {
+      aTargets[i] = remaining * GetCpuShare(mEntries[i].mPriority).mShare /
+                    totalShare;
+    }
+  }
+}
+
+void
+CpuRateController::Update(double aHostLoad, const std::vector<CpuUsage>& aUsage,
+                          std::vector<CpuRateDecision>& aDecisions)
+{
+  double sandboxLoad = 0.0;
+  for (auto&& entry : mEntries) {
+    auto usage = std::find_if(aUsage.begin(), aUsage.end(),
+                              [&](const CpuUsage& aUsage) -> bool {
+      return aUsage.mId == entry.mId;
+    });
+    entry.mUsage = usage == aUsage.end() ? 0.0 :
+                   std::min(std::max(usage->mUsage, 0.0), 1.0);
+    sandboxLoad += entry.mUsage;
+  }
+
+  // Hysteresis between enforcing and relaxing
+  if (aHostLoad >= mConfig.mSaturation) {
+    mSaturated = true;
+  } else if (aHostLoad <= mConfig.mRelease) {
+    mSaturated = false;
+  }
+
+  std::vector<double> targets;
+  if (mSaturated) {
+    // Whatever runs outside of the sandboxes is not ours to divide
+    double external = std::max(aHostLoad - sandboxLoad, 0.0);
+    ComputeTargets(mConfig.mSaturation - external, targets);
+  } else if (aHostLoad > mConfig.mRelease) {
+    // Between the thresholds, hold the current caps
+    return;
+  }
+
+  for (size_t i = 0; i < mEntries.size(); ++i) {
+    Entry& entry = mEntries[i];
+    const uint32_t minRate = GetCpuShare(entry.mPriority).mMinRate;
+
+    uint32_t rate;
+    if (mSaturated) {
+      double target = std::max(targets[i] * kMaxCpuRate,
+                               static_cast<double>(minRate));
+      // Raise caps at once, but lower them gradually
+      double next = target >= entry.mCpuRate ? target :
+                    entry.mCpuRate + mConfig.mGain * (target - entry.mCpuRate);
+      rate = static_cast<uint32_t>(std::lround(next));
+    } else {
+      rate = entry.mCpuRate + mConfig.mRelaxStep;
+    }
+    rate = std::min(std::max(rate, minRate), kMaxCpuRate);
+
+    if (rate != entry.mCpuRate) {
+      entry.mCpuRate = rate;
+      aDecisions.push_back(CpuRateDecision{entry.mId, rate});
+    }
+  }
+}
+
+uint32_t
+CpuRateController::GetCpuRate(uint32_t aId) const
+{
+  for (auto&& entry : mEntries) {
+    if (entry.mId == aId) {
+      return entry.mCpuRate;
+    }
+  }
+  return kMaxCpuRate;
+}
+
+} // namespace mozilla
+
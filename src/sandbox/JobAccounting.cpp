@@ -0,0 +1,246 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "JobAccounting.h"
+
+#include <algorithm>
+
+namespace mozilla {
+
+namespace {
+
+uint64_t
+NowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline double
+Delta(uint64_t aOlder, uint64_t aNewer)
+{
+  // Counters are cumulative, but guard against a source being reset
+  return aNewer >= aOlder ? static_cast<double>(aNewer - aOlder) : 0.0;
+}
+
+} // anonymous namespace
+
+bool
+ComputeJobAccountingRates(const JobAccountingSample& aOlder,
+                          const JobAccountingSample& aNewer,
+                          JobAccountingRates& aRates)
+{
+  if (aNewer.mTimestampNs <= aOlder.mTimestampNs) {
+    return false;
+  }
+
+  const double kTicksPerSec = 1.0e7;
+  double intervalSec = (aNewer.mTimestampNs - aOlder.mTimestampNs) / 1.0e9;
+  double cpuTicks = Delta(aOlder.mTotalUserTime, aNewer.mTotalUserTime) +
+                    Delta(aOlder.mTotalKernelTime, aNewer.mTotalKernelTime);
+
+  aRates.mIntervalSec = intervalSec;
+  aRates.mCpuUtilization = cpuTicks / kTicksPerSec / intervalSec;
+  aRates.mPageFaultsPerSec =
+    Delta(aOlder.mPageFaults, aNewer.mPageFaults) / intervalSec;
+  aRates.mReadBytesPerSec =
+    Delta(aOlder.mReadBytes, aNewer.mReadBytes) / intervalSec;
+  aRates.mWriteBytesPerSec =
+    Delta(aOlder.mWriteBytes, aNewer.mWriteBytes) / intervalSec;
+  aRates.mOtherBytesPerSec =
+    Delta(aOlder.mOtherBytes, aNewer.mOtherBytes) / intervalSec;
+  aRates.mPeakProcessMemory = aNewer.mPeakProcessMemory;
+  aRates.mPeakJobMemory = aNewer.mPeakJobMemory;
+  return true;
+}
+
+JobAccountingSampler::JobAccountingSampler(std::chrono::milliseconds aInterval)
+  : mSampling(nullptr)
+  , mInterval(aInterval)
+  , mStopping(false)
+{
+}
+
+JobAccountingSampler::~JobAccountingSampler()
+{
+  Stop();
+}
+
+bool
+JobAccountingSampler::Start()
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (mThread.joinable() || mInterval.count() <= 0) {
+    return false;
+  }
+
+  mStopping = false;
+  mThread = std::thread(&JobAccountingSampler::ThreadProc, this);
+  return true;
+}
+
+void
+JobAccountingSampler::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStopping = true;
+  }
+  mCondVar.notify_all();
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+}
+
+void
+JobAccountingSampler::SetInterval(std::chrono::milliseconds aInterval)
+{
+  // Takes effect after the currently scheduled sample
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (aInterval.count() > 0) {
+    mInterval = aInterval;
+  }
+}
+
+bool
+JobAccountingSampler::Add(uint32_t aId, JobAccountingSource* aSource)
+{
+  if (!aSource) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  for (auto&& entry : mEntries) {
+    if (entry.mId == aId) {
+      return false;
+    }
+  }
+
+  auto registration = std::make_shared<Registration>();
+  registration->mSource = aSource;
+  registration->mRing = std::make_shared<Ring>();
+  registration->mRemoved.store(false, std::memory_order_relaxed);
+  mEntries.push_back({aId, std::move(registration)});
+  return true;
+}
+
+void
+JobAccountingSampler::Remove(uint32_t aId)
+{
+  std::shared_ptr<Registration> registration;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto itr = std::find_if(mEntries.begin(), mEntries.end(),
+                            [aId](const Entry& aEntry) -> bool {
+                              return aEntry.mId == aId;
+                            });
+    if (itr == mEntries.end()) {
+      return;
+    }
+
+    registration = std::move(itr->mRegistration);
+    // Order is irrelevant, so avoid shifting the remaining entries
+    std::swap(*itr, mEntries.back());
+    mEntries.pop_back();
+  }
+
+  // Pairs with Sample: either the sampler sees mRemoved before querying the
+  // source, or we see that it is querying it and wait for it to finish
+  registration->mRemoved.store(true, std::memory_order_seq_cst);
+  while (mSampling.load(std::memory_order_seq_cst) == registration.get()) {
+    std::this_thread::yield();
+  }
+}
+
+void
+JobAccountingSampler::SampleAll()
+{
+  std::vector<Entry> entries;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    entries = mEntries;
+  }
+  Sample(entries);
+}
+
+void
+JobAccountingSampler::Sample(const std::vector<Entry>& aEntries)
+{
+  std::lock_guard<std::mutex> lock(mSampleMutex);
+  JobAccountingSample sample;
+  for (auto&& entry : aEntries) {
+    Registration* registration = entry.mRegistration.get();
+    mSampling.store(registration, std::memory_order_seq_cst);
+    if (registration->mRemoved.load(std::memory_order_seq_cst)) {
+      continue;
+    }
+    sample = JobAccountingSample();
+    if (registration->mSource->QueryAccounting(sample)) {
+      sample.mTimestampNs = NowNs();
+      registration->mRing->Push(sample);
+    }
+  }
+  mSampling.store(nullptr, std::memory_order_seq_cst);
+}
+
+void
+JobAccountingSampler::ThreadProc()
+{
+  std::unique_lock<std::mutex> lock(mMutex);
+  auto deadline = std::chrono::steady_clock::now();
+  std::vector<Entry> entries;
+  while (!mStopping) {
+    // The rings are shared, so a copy of the list is enough to sample
+    entries = mEntries;
+    lock.unlock();
+    Sample(entries);
+    entries.clear();
+    lock.lock();
+
+    // Schedule against the previous deadline so that the sampling period
+    // doesn't drift by however long sampling took.
+    deadline += mInterval;
+    auto now = std::chrono::steady_clock::now();
+    if (deadline < now) {
+      deadline = now;
+    }
+    mCondVar.wait_until(lock, deadline, [this]() -> bool {
+      return mStopping;
+    });
+  }
+}
+
+std::shared_ptr<const JobAccountingSampler::Ring>
+JobAccountingSampler::GetRing(uint32_t aId) const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  for (auto&& entry : mEntries) {
+    if (entry.mId == aId) {
+      return entry.mRegistration->mRing;
+    }
+  }
+  return nullptr;
+}
+
+bool
+JobAccountingSampler::GetRates(uint32_t aId, JobAccountingRates& aRates,
+                               size_t aSpan) const
+{
+  auto ring = GetRing(aId);
+  if (!ring || !aSpan) {
+    return false;
+  }
+
+  JobAccountingSample newer, older;
+  if (!ring->Read(0, newer) || !ring->Read(aSpan, older)) {
+    return false;
+  }
+
+  return ComputeJobAccountingRates(older, newer, aRates);
+}
+
+} // namespace mozilla
+
@@ -0,0 +1,33 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "JobLimits.h"
+
+namespace mozilla {
+
+using namespace joblimits;
+
+JobLimitViolation
+TranslateJobMessage(uint32_t aMessage)
+{
+  switch (aMessage) {
+    case kMsgEndOfProcessTime:
+      return eViolationProcessTime;
+    case kMsgActiveProcessLimit:
+      return eViolationActiveProcess;
+    case kMsgProcessMemoryLimit:
+      return eViolationProcessMemory;
+    case kMsgJobMemoryLimit:
+      return eViolationJobMemory;
+    case kMsgNotificationLimit:
+      return eViolationNotificationLimit;
+    default:
+      return eViolationNone;
+  }
+}
+
+} // namespace mozilla
+
@@ -0,0 +1,276 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "LaunchAdmission.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace mozilla {
+
+namespace {
+
+// How quickly the baseline forgets a fast launch
+const double kBaselineDrift = 0.001;
+
+uint64_t
+SteadyNowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // anonymous namespace
+
+LaunchAdmissionController::LaunchAdmissionController(const Config& aConfig)
+  : mConfig(aConfig)
+  , mQueued(0)
+  , mLimit(std::min(std::max(aConfig.mInitialLimit, aConfig.mMinLimit),
+                    aConfig.mMaxLimit))
+  , mInFlight(0)
+  , mLatencyNs(0.0)
+  , mBaselineNs(0.0)
+  , mWindowCompletions(0)
+  , mWindowSaturated(false)
+  , mStats()
+{
+}
+
+size_t
+LaunchAdmissionController::QueuedAtOrAbove(SandboxPriority aPriority) const
+{
+  size_t result = 0;
+  for (uint32_t priority = aPriority; priority < ePriorityCount; ++priority) {
+    result += mQueues[priority].size();
+  }
+  return result;
+}
+
+AdmissionResult
+LaunchAdmissionController::Submit(uint64_t aId, SandboxPriority aPriority,
+                                  uint64_t aNowNs, uint64_t aDeadlineNs)
+{
+  if (aPriority >= ePriorityCount) {
+    aPriority = ePriorityNormal;
+  }
+
+  size_t ahead = QueuedAtOrAbove(aPriority);
+  if (!ahead && mInFlight < mLimit) {
+    ++mInFlight;
+    ++mStats.mAdmitted;
+    return eAdmissionAdmitted;
+  }
+
+  if (mQueued >= mConfig.mMaxQueueDepth) {
+    ++mStats.mShedOnArrival;
+    return eAdmissionShed;
+  }
+
+  // Fast fail: every request ahead of this one, and the launches in flight,
+  // must get through the limit before it can start.
+  if (aDeadlineNs && mLatencyNs > 0.0) {
+    double waves = static_cast<double>(ahead + mInFlight) / mLimit;
+    double finishNs = aNowNs + (std::floor(waves) + 1.0) * mLatencyNs;
+    if (finishNs > static_cast<double>(aDeadlineNs)) {
+      ++mStats.mShedOnArrival;
+      return eAdmissionShed;
+    }
+  }
+
+  mQueues[aPriority].push_back(Request{aId, aDeadlineNs});
+  ++mQueued;
+  mWindowSaturated = true;
+  mStats.mPeakQueueDepth = std::max(mStats.mPeakQueueDepth, mQueued);
+  return eAdmissionQueued;
+}
+
+void
+LaunchAdmissionController::Complete(uint64_t aLatencyNs)
+{
+  if (mInFlight) {
+    --mInFlight;
+  }
+
+  double latency = static_cast<double>(aLatencyNs);
+  if (mLatencyNs <= 0.0) {
+    mLatencyNs = latency;
+    mBaselineNs = latency;
+  } else {
+    mLatencyNs += (latency - mLatencyNs) * mConfig.mSmoothing;
+    if (latency < mBaselineNs) {
+      mBaselineNs = latency;
+    } else {
+      mBaselineNs += (latency - mBaselineNs) * kBaselineDrift;
+    }
+  }
+
+  if (++mWindowCompletions >= mLimit) {
+    Adapt();
+  }
+}
+
+void
+LaunchAdmissionController::Adapt()
+{
+  if (mLatencyNs > mBaselineNs * mConfig.mTolerance) {
+    uint32_t limit = static_cast<uint32_t>(mLimit * mConfig.mBackoff);
+    mLimit = std::max(limit, mConfig.mMinLimit);
+  } else if (mWindowSaturated) {
+    mLimit = std::min(mLimit + 1, mConfig.mMaxLimit);
+  }
+  mWindowCompletions = 0;
+  mWindowSaturated = mQueued > 0;
+}
+
+void
+LaunchAdmissionController::Dispatch(uint64_t aNowNs,
+                                    std::vector<uint64_t>& aAdmitted,
+                                    std::vector<uint64_t>& aShed)
+{
+  // Shed anything that would miss its deadline even if it started now
+  const double finishNs = aNowNs + mLatencyNs;
+  for (auto&& queue : mQueues) {
+    auto expired = [finishNs](const Request& aRequest) -> bool {
+      return aRequest.mDeadlineNs &&
+             finishNs > static_cast<double>(aRequest.mDeadlineNs);
+    };
+    for (auto&& request : queue) {
+      if (expired(request)) {
+        aShed.push_back(request.mId);
+      }
+    }
+    auto newEnd = std::remove_if(queue.begin(), queue.end(), expired);
+    size_t count = queue.end() - newEnd;
+    queue.erase(newEnd, queue.end());
+    mQueued -= count;
+    mStats.mShedQueued += count;
+  }
+
+  for (int priority = ePriorityCount - 1;
+       priority >= 0 && mInFlight < mLimit; --priority) {
+    auto& queue = mQueues[priority];
+    while (!queue.empty() && mInFlight < mLimit) {
+      aAdmitted.push_back(queue.front().mId);
+      queue.pop_front();
+      --mQueued;
+      ++mInFlight;
+      ++mStats.mAdmitted;
+    }
+  }
+}
+
+bool
+LaunchAdmissionController::Cancel(uint64_t aId)
+{
+  for (auto&& queue : mQueues) {
+    auto request = std::find_if(queue.begin(), queue.end(),
+                                [aId](const Request& aRequest) -> bool {
+      return aRequest.mId == aId;
+    });
+    if (request != queue.end()) {
+      queue.erase(request);
+      --mQueued;
+      return true;
+    }
+  }
+  return false;
+}
+
+AdmissionStats
+LaunchAdmissionController::GetStats() const
+{
+  AdmissionStats stats = mStats;
+  stats.mLimit = mLimit;
+  stats.mInFlight = mInFlight;
+  for (uint32_t priority = 0; priority < ePriorityCount; ++priority) {
+    stats.mQueueDepth[priority] = mQueues[priority].size();
+  }
+  stats.mLatencyEstimateNs = static_cast<uint64_t>(mLatencyNs);
+  stats.mBaselineLatencyNs = static_cast<uint64_t>(mBaselineNs);
+  return stats;
+}
+
+LaunchAdmissionGate::LaunchAdmissionGate(const Config& aConfig)
+  : mController(aConfig)
+  , mNextId(0)
+{
+}
+
+void
+LaunchAdmissionGate::DispatchLocked(uint64_t aNowNs)
+{
+  mAdmittedScratch.clear();
+  mShedScratch.clear();
+  mController.Dispatch(aNowNs, mAdmittedScratch, mShedScratch);
+  if (mAdmittedScratch.empty() && mShedScratch.empty()) {
+    return;
+  }
+  mAdmitted.insert(mAdmittedScratch.begin(), mAdmittedScratch.end());
+  mShed.insert(mShedScratch.begin(), mShedScratch.end());
+  mCondVar.notify_all();
+}
+
+bool
+LaunchAdmissionGate::Enter(SandboxPriority aPriority, uint32_t aTimeoutMs)
+{
+  std::unique_lock<std::mutex> lock(mMutex);
+  const uint64_t id = mNextId++;
+  const uint64_t now = SteadyNowNs();
+  const uint64_t deadline = aTimeoutMs ?
+                            now + uint64_t(aTimeoutMs) * 1000000ULL : 0;
+  switch (mController.Submit(id, aPriority, now, deadline)) {
+    case eAdmissionAdmitted:
+      return true;
+    case eAdmissionShed:
+      return false;
+    case eAdmissionQueued:
+      break;
+  }
+
+  const auto timeout = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(aTimeoutMs);
+  while (true) {
+    if (mAdmitted.erase(id)) {
+      return true;
+    }
+    if (mShed.erase(id)) {
+      return false;
+    }
+    if (!aTimeoutMs) {
+      mCondVar.wait(lock);
+      continue;
+    }
+    if (mCondVar.wait_until(lock, timeout) == std::cv_status::timeout) {
+      // Give queued requests behind this one a chance to be shed, too
+      DispatchLocked(SteadyNowNs());
+      if (mAdmitted.erase(id)) {
+        return true;
+      }
+      mShed.erase(id);
+      mController.Cancel(id);
+      return false;
+    }
+  }
+}
+
+void
+LaunchAdmissionGate::Leave(uint64_t aLatencyNs)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mController.Complete(aLatencyNs);
+  DispatchLocked(SteadyNowNs());
+}
+
+AdmissionStats
+LaunchAdmissionGate::GetStats() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mController.GetStats();
+}
+
+} // namespace mozilla
+
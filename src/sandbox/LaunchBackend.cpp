@@ -0,0 +1,96 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "LaunchBackend.h"
+#include "TaskGraph.h"
+
+namespace mozilla {
+
+namespace {
+
+bool
+RunSerialSteps(LaunchBackend& aBackend, const char*& aFailedStep)
+{
+  if (!aBackend.CreateSuspendedProcess()) {
+    aFailedStep = "CreateProcess";
+    return false;
+  }
+
+  if (!aBackend.SetThreadToken()) {
+    aFailedStep = "SetThreadToken";
+  } else if (!aBackend.PreResume()) {
+    aFailedStep = "PreResume";
+  } else if (!aBackend.ResumeProcess()) {
+    aFailedStep = "Resume";
+  } else {
+    return true;
+  }
+
+  aBackend.TerminateProcess();
+  return false;
+}
+
+} // anonymous namespace
+
+bool
+RunLaunchSequence(LaunchBackend& aBackend, unsigned int aMaxThreads,
+                  const char** aFailedStep)
+{
+  // Steps 1-6 mostly do not depend upon each other, so they run
+  // concurrently as a task graph. The window station and desktop are created
+  // on the calling thread since CreateDesktop relies upon its current
+  // desktop.
+  TaskGraph graph;
+  graph.Add("AbsolutePath", [&]() -> bool {
+    return aBackend.ResolveExecutable();
+  });
+  // The custom SID guards against the SetThreadDesktop() security hole
+  auto sidTask = graph.Add("CustomSid", [&]() -> bool {
+    return aBackend.CreateCustomSid();
+  });
+  auto tokensTask = graph.Add("Tokens", [&]() -> bool {
+    return aBackend.CreateTokens();
+  }, {sidTask});
+  auto winstaTask = graph.Add("WindowStation", [&]() -> bool {
+    return aBackend.CreateWindowStation();
+  }, {}, TaskGraph::eTaskCallingThread);
+  graph.Add("Desktop", [&]() -> bool {
+    return aBackend.CreateDesktop();
+  }, {sidTask, winstaTask}, TaskGraph::eTaskCallingThread);
+  // The job's security descriptor is built along with the tokens
+  auto jobTask = graph.Add("Job", [&]() -> bool {
+    return aBackend.CreateJob();
+  }, {tokensTask});
+  // Everything that the sandbox needs at startup, including the startup
+  // trace, is passed through the startup block
+  auto traceTask = graph.Add("StartupTrace", [&]() -> bool {
+    return aBackend.CreateStartupTrace();
+  });
+  graph.Add("StartupBlock", [&]() -> bool {
+    return aBackend.CreateStartupBlock();
+  }, {jobTask, traceTask});
+  graph.Add("WorkingDirectory", [&]() -> bool {
+    return aBackend.ResolveWorkingDirectory();
+  }, {tokensTask});
+
+  const char* failedStep = nullptr;
+  bool ok = graph.Run(aMaxThreads);
+  if (!ok) {
+    failedStep = graph.GetFailedTask() == TaskGraph::kInvalidTask ?
+                 "TaskGraph" : graph.GetName(graph.GetFailedTask());
+  } else {
+    ok = RunSerialSteps(aBackend, failedStep);
+  }
+
+  aBackend.Finish(ok);
+  if (!ok && aFailedStep) {
+    *aFailedStep = failedStep;
+  }
+  return ok;
+}
+
+} // namespace mozilla
+
@@ -0,0 +1,773 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "LinuxSandbox.h"
+
+#if defined(__linux__)
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/capability.h>
+#include <linux/filter.h>
+#include <linux/sched.h>
+#include <linux/seccomp.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace ::std::literals::string_view_literals;
+
+namespace mozilla {
+
+namespace {
+
+/**
+ * Everything that a child needs between clone and exec, prepared beforehand:
+ * the launcher may be multithreaded, so the child may only make system calls.
+ */
+struct ChildLaunch
+{
+  const char*         mPath;
+  char* const*        mArgv;
+  char* const*        mEnvp;
+  const int*          mInheritFds;
+  size_t              mInheritCount;
+  // Unless -1, the launcher writes a byte here once the child may exec
+  int                 mResumeFd;
+  // Receives a ChildFailure if the child fails before exec; closed by exec
+  int                 mErrorFd;
+  // Fresh mount namespaces must stop propagating mounts to the launcher's
+  bool                mMakeMountsPrivate;
+  // Template launches only
+  int                 mUserNs;
+  int                 mMountNs;
+  int                 mNetNs;
+  int                 mCgroup;
+  // Set by the template stub, which shares the launcher's memory
+  pid_t               mSandboxPid;
+};
+
+enum ChildStep : uint32_t
+{
+  eStepResume = 1,
+  eStepMountPrivate,
+  eStepNoNewPrivs,
+  eStepInheritFds,
+  eStepExec,
+  eStepSetNs,
+  eStepClone
+};
+
+// The stub only makes system calls
+const size_t kTemplateStubStackSize = 64 * 1024;
+
+struct ChildFailure
+{
+  uint32_t  mStep;
+  int32_t   mErrno;
+};
+
+pid_t
+Clone3(uint64_t aFlags, int* aPidFd, int aCgroup, int aExitSignal)
+{
+  struct clone_args args;
+  memset(&args, 0, sizeof(args));
+  args.flags = aFlags;
+  args.pidfd = reinterpret_cast<uintptr_t>(aPidFd);
+  args.exit_signal = aExitSignal;
+  if (aCgroup >= 0) {
+    args.flags |= CLONE_INTO_CGROUP;
+    args.cgroup = aCgroup;
+  }
+  return static_cast<pid_t>(::syscall(SYS_clone3, &args, sizeof(args)));
+}
+
+bool
+WriteAll(int aFd, const void* aData, size_t aSize)
+{
+  const char* data = static_cast<const char*>(aData);
+  while (aSize) {
+    ssize_t written = ::write(aFd, data, aSize);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    aSize -= written;
+  }
+  return true;
+}
+
+// Returns how many bytes were read before EOF
+ssize_t
+ReadAll(int aFd, void* aData, size_t aSize)
+{
+  char* data = static_cast<char*>(aData);
+  size_t total = 0;
+  while (total < aSize) {
+    ssize_t got = ::read(aFd, data + total, aSize - total);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      return -1;
+    }
+    if (!got) {
+      break;
+    }
+    total += got;
+  }
+  return total;
+}
+
+[[noreturn]] void
+FailChild(const ChildLaunch& aLaunch, ChildStep aStep)
+{
+  ChildFailure failure = {aStep, errno};
+  WriteAll(aLaunch.mErrorFd, &failure, sizeof(failure));
+  ::_exit(127);
+}
+
+[[noreturn]] void
+RunChild(const ChildLaunch& aLaunch)
+{
+  char resume;
+  if (aLaunch.mResumeFd >= 0 && ReadAll(aLaunch.mResumeFd, &resume, 1) != 1) {
+    FailChild(aLaunch, eStepResume);
+  }
+
+  if (aLaunch.mMakeMountsPrivate &&
+      ::mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr)) {
+    FailChild(aLaunch, eStepMountPrivate);
+  }
+
+  if (::prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)) {
+    FailChild(aLaunch, eStepNoNewPrivs);
+  }
+
+  // Only the descriptors that were passed explicitly survive exec
+  if (::syscall(SYS_close_range, 3U, ~0U, CLOSE_RANGE_CLOEXEC)) {
+    FailChild(aLaunch, eStepInheritFds);
+  }
+  for (size_t i = 0; i < aLaunch.mInheritCount; ++i) {
+    if (::fcntl(aLaunch.mInheritFds[i], F_SETFD, 0)) {
+      FailChild(aLaunch, eStepInheritFds);
+    }
+  }
+
+  ::execve(aLaunch.mPath, aLaunch.mArgv, aLaunch.mEnvp);
+  FailChild(aLaunch, eStepExec);
+}
+
+/**
+ * Joins a template's namespaces and forks the sandbox into a PID namespace
+ * of its own as a child of the launcher. Unprivileged processes may only
+ * create a PID namespace from within a user namespace that they own, so the
+ * launcher cannot create the sandbox directly.
+ *
+ * The stub shares the launcher's memory, running on a stack of its own while
+ * the launcher is suspended, so that only the sandbox pays for copying the
+ * launcher's page tables. Joining namespaces only requires that the stub has
+ * no threads and filesystem context of its own, which sharing memory does
+ * not affect.
+ */
+int
+RunTemplateStub(void* aLaunch)
+{
+  ChildLaunch& launch = *static_cast<ChildLaunch*>(aLaunch);
+  if (::setns(launch.mUserNs, CLONE_NEWUSER) ||
+      ::setns(launch.mMountNs, CLONE_NEWNS) ||
+      (launch.mNetNs >= 0 && ::setns(launch.mNetNs, CLONE_NEWNET))) {
+    FailChild(launch, eStepSetNs);
+  }
+
+  // A CLONE_PARENT child inherits the stub's exit signal. CLONE_VFORK holds
+  // the stub, and so the launcher, until the sandbox has exec'd, so that the
+  // launcher does not compete with it for a CPU in the meantime.
+  pid_t pid = Clone3(CLONE_NEWPID | CLONE_PARENT | CLONE_VFORK, nullptr,
+                     launch.mCgroup, 0);
+  if (pid < 0) {
+    FailChild(launch, eStepClone);
+  }
+  if (!pid) {
+    RunChild(launch);
+  }
+
+  launch.mSandboxPid = pid;
+  return 0;
+}
+
+bool
+WriteProcFile(pid_t aPid, const char* aName, const char* aContents)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/%s", static_cast<int>(aPid), aName);
+  UniqueFd file(::open(path, O_WRONLY | O_CLOEXEC));
+  return file && WriteAll(file.get(), aContents, strlen(aContents));
+}
+
+// Maps the launcher's user and group to root in aPid's new user namespace
+bool
+WriteIdMaps(pid_t aPid)
+{
+  char uidMap[32];
+  char gidMap[32];
+  snprintf(uidMap, sizeof(uidMap), "0 %u 1\n",
+           static_cast<unsigned int>(::getuid()));
+  snprintf(gidMap, sizeof(gidMap), "0 %u 1\n",
+           static_cast<unsigned int>(::getgid()));
+  // An unprivileged process may only map its group once setgroups is denied
+  return WriteProcFile(aPid, "setgroups", "deny") &&
+         WriteProcFile(aPid, "uid_map", uidMap) &&
+         WriteProcFile(aPid, "gid_map", gidMap);
+}
+
+UniqueFd
+OpenNamespace(pid_t aPid, const char* aName)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/ns/%s", static_cast<int>(aPid),
+           aName);
+  return UniqueFd(::open(path, O_RDONLY | O_CLOEXEC));
+}
+
+bool
+MakePipe(UniqueFd& aRead, UniqueFd& aWrite)
+{
+  int fds[2];
+  if (::pipe2(fds, O_CLOEXEC)) {
+    return false;
+  }
+  aRead.reset(fds[0]);
+  aWrite.reset(fds[1]);
+  return true;
+}
+
+void
+KillAndReap(pid_t aPid)
+{
+  ::kill(aPid, SIGKILL);
+  while (::waitpid(aPid, nullptr, __WALL) < 0 && errno == EINTR) {
+  }
+}
+
+} // anonymous namespace
+
+const std::string_view LinuxSandbox::SWITCH_STARTUP_BLOCK = "--startup"sv;
+
+LinuxSandbox::~LinuxSandbox()
+{
+  if (mStartupBlock) {
+    ::munmap(const_cast<StartupBlock*>(mStartupBlock), sizeof(StartupBlock));
+  }
+}
+
+bool
+LinuxSandbox::MapStartupBlock(int aFd)
+{
+  UniqueFd fd(aFd);
+  struct stat st;
+  if (mStartupBlock || ::fstat(fd.get(), &st) ||
+      st.st_size != sizeof(StartupBlock)) {
+    return false;
+  }
+
+  void* view = ::mmap(nullptr, sizeof(StartupBlock), PROT_READ, MAP_PRIVATE,
+                      fd.get(), 0);
+  if (view == MAP_FAILED) {
+    return false;
+  }
+
+  mStartupBlock = StartupBlock::Validate(view, sizeof(StartupBlock));
+  if (!mStartupBlock) {
+    ::munmap(view, sizeof(StartupBlock));
+    return false;
+  }
+  return true;
+}
+
+int
+LinuxSandbox::GetChannelFd(uint32_t aKind, uint32_t aNth) const
+{
+  if (!mStartupBlock) {
+    return -1;
+  }
+
+  const StartupChannel* channel = mStartupBlock->FindChannel(aKind, aNth);
+  return channel ? static_cast<int>(channel->mHandle) : -1;
+}
+
+bool
+LinuxSandbox::DropCapabilities()
+{
+  // The launcher set this before exec; it is only checked here
+  if (::prctl(PR_GET_NO_NEW_PRIVS, 0, 0, 0, 0) != 1) {
+    return false;
+  }
+
+  for (int cap = 0; ::prctl(PR_CAPBSET_READ, cap, 0, 0, 0) >= 0; ++cap) {
+    if (::prctl(PR_CAPBSET_DROP, cap, 0, 0, 0)) {
+      return false;
+    }
+  }
+  if (::prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_CLEAR_ALL, 0, 0, 0)) {
+    return false;
+  }
+
+  __user_cap_header_struct header = {_LINUX_CAPABILITY_VERSION_3, 0};
+  __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3] = {};
+  return !::syscall(SYS_capset, &header, data);
+}
+
+bool
+LinuxSandbox::InstallSyscallFilter()
+{
+  const StartupChannel* channel =
+    mStartupBlock->FindChannel(eChannelSyscallFilter);
+  if (!channel) {
+    return true;
+  }
+
+  static_assert(sizeof(BpfInstruction) == sizeof(sock_filter),
+                "BpfInstruction must be laid out like sock_filter");
+  UniqueFd fd(static_cast<int>(channel->mHandle));
+  const size_t size = channel->mSize;
+  struct stat st;
+  if (::fstat(fd.get(), &st) || static_cast<uint64_t>(st.st_size) != size ||
+      !size || size % sizeof(sock_filter) ||
+      size / sizeof(sock_filter) > SeccompProgram::kMaxLength) {
+    return false;
+  }
+
+  void* view = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+  if (view == MAP_FAILED) {
+    return false;
+  }
+
+  // The kernel copies the program, so it is unmapped again right away
+  struct sock_fprog program;
+  program.len = static_cast<unsigned short>(size / sizeof(sock_filter));
+  program.filter = static_cast<sock_filter*>(view);
+  bool ok = !::syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER,
+                       SECCOMP_FILTER_FLAG_TSYNC, &program);
+  ::munmap(view, size);
+  return ok;
+}
+
+bool
+LinuxSandbox::Init(int aArgc, char* aArgv[])
+{
+  for (int i = 1; i < aArgc; ++i) {
+    if (SWITCH_STARTUP_BLOCK == aArgv[i] && i + 1 < aArgc) {
+      char* end = nullptr;
+      long fd = strtol(aArgv[++i], &end, 16);
+      if (*end || fd < 0 || fd > INT32_MAX ||
+          !MapStartupBlock(static_cast<int>(fd))) {
+        return false;
+      }
+    }
+  }
+
+  if (!mStartupBlock) {
+    return false;
+  }
+
+  // Like the deferred mitigations on Windows, the filter goes on last so that
+  // it need not allow what the lockdown itself calls
+  return OnPrivInit() && DropCapabilities() && InstallSyscallFilter() &&
+         OnInit();
+}
+
+void
+LinuxSandbox::Fini()
+{
+  OnFini();
+}
+
+/* static */ std::shared_ptr<LinuxNamespaceTemplate>
+LinuxNamespaceTemplate::Create(uint32_t aInitFlags)
+{
+  const bool newNet = !(aInitFlags & LinuxSandboxLauncher::eInitShareNetwork);
+  UniqueFd resumeRead, resumeWrite;
+  if (!MakePipe(resumeRead, resumeWrite)) {
+    return nullptr;
+  }
+
+  // The holder only lives until the namespaces have been opened and its
+  // mounts made private
+  pid_t holder = Clone3(CLONE_NEWUSER | CLONE_NEWNS |
+                        (newNet ? CLONE_NEWNET : 0), nullptr, -1, SIGCHLD);
+  if (holder < 0) {
+    return nullptr;
+  }
+  if (!holder) {
+    char resume;
+    if (ReadAll(resumeRead.get(), &resume, 1) != 1 ||
+        ::mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr)) {
+      ::_exit(1);
+    }
+    ::_exit(0);
+  }
+  resumeRead.reset();
+
+  std::shared_ptr<LinuxNamespaceTemplate> result(new LinuxNamespaceTemplate());
+  result->mInitFlags = aInitFlags;
+  bool ok = WriteIdMaps(holder);
+  if (ok) {
+    result->mUserNs = OpenNamespace(holder, "user");
+    result->mMountNs = OpenNamespace(holder, "mnt");
+    if (newNet) {
+      result->mNetNs = OpenNamespace(holder, "net");
+    }
+    ok = result->mUserNs && result->mMountNs && (!newNet || result->mNetNs);
+  }
+  if (!ok) {
+    KillAndReap(holder);
+    return nullptr;
+  }
+
+  int status = 0;
+  const char resume = 1;
+  if (!WriteAll(resumeWrite.get(), &resume, 1)) {
+    KillAndReap(holder);
+    return nullptr;
+  }
+  while (::waitpid(holder, &status, 0) < 0 && errno == EINTR) {
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    return nullptr;
+  }
+  return result;
+}
+
+/* static */ std::shared_ptr<LinuxSyscallFilter>
+LinuxSyscallFilter::Create(const SeccompProgram& aProgram)
+{
+  const uint64_t size = aProgram.GetLength() * sizeof(BpfInstruction);
+  UniqueFd fd(::memfd_create("sandbox-seccomp",
+                             MFD_CLOEXEC | MFD_ALLOW_SEALING));
+  if (!fd || !WriteAll(fd.get(), aProgram.GetInstructions(), size) ||
+      ::fcntl(fd.get(), F_ADD_SEALS, F_SEAL_SEAL | F_SEAL_SHRINK |
+                                     F_SEAL_GROW | F_SEAL_WRITE)) {
+    return nullptr;
+  }
+
+  std::shared_ptr<LinuxSyscallFilter> result(new LinuxSyscallFilter());
+  result->mProgram = std::move(fd);
+  result->mSize = size;
+  return result;
+}
+
+LinuxSandboxLauncher::LinuxSandboxLauncher()
+  : mInitFlags(eInitNone)
+  , mPid(0)
+{
+}
+
+LinuxSandboxLauncher::~LinuxSandboxLauncher()
+{
+  if (mPid > 0 && !mExitStatus) {
+    Kill();
+    Reap(0);
+  }
+}
+
+bool
+LinuxSandboxLauncher::Init(uint32_t aInitFlags)
+{
+  if (aInitFlags & ~eInitShareNetwork) {
+    return false;
+  }
+  mInitFlags = aInitFlags;
+  return true;
+}
+
+bool
+LinuxSandboxLauncher::SetNamespaceTemplate(
+    const std::shared_ptr<LinuxNamespaceTemplate>& aTemplate)
+{
+  if (!aTemplate || aTemplate->mInitFlags != mInitFlags || mPid) {
+    return false;
+  }
+  mTemplate = aTemplate;
+  return true;
+}
+
+bool
+LinuxSandboxLauncher::SetCgroup(const std::string_view aPath)
+{
+  std::string path(aPath);
+  mCgroup.reset(::open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+  return !!mCgroup;
+}
+
+bool
+LinuxSandboxLauncher::SetSyscallFilter(
+    const std::shared_ptr<LinuxSyscallFilter>& aFilter)
+{
+  if (!aFilter || mSyscallFilter || mPid ||
+      !AddChannel(eChannelSyscallFilter, aFilter->mProgram.get(),
+                  aFilter->mSize)) {
+    return false;
+  }
+  // Keeps the memfd open until the sandbox has been launched
+  mSyscallFilter = aFilter;
+  return true;
+}
+
+bool
+LinuxSandboxLauncher::AddChannel(uint32_t aKind, int aFd, uint64_t aSize)
+{
+  if (aFd < 0 || mChannels.size() >= StartupBlock::kMaxChannels - 1) {
+    return false;
+  }
+  mChannels.push_back(StartupChannel{aKind, 0, static_cast<uint64_t>(aFd),
+                                     aSize});
+  return true;
+}
+
+bool
+LinuxSandboxLauncher::CreateStartupBlock(UniqueFd& aBlock)
+{
+  auto block = std::make_unique<StartupBlock>();
+  StartupBlockBuilder builder(*block);
+  builder.SetInitFlags(mInitFlags);
+  for (const StartupChannel& channel : mChannels) {
+    if (!builder.AddChannel(channel.mKind, channel.mHandle, channel.mSize,
+                            channel.mFlags)) {
+      return false;
+    }
+  }
+  builder.Finish();
+
+  // Sealed so that the sandbox may use it in place without copying it
+  UniqueFd fd(::memfd_create("sandbox-startup",
+                             MFD_CLOEXEC | MFD_ALLOW_SEALING));
+  if (!fd || !WriteAll(fd.get(), block.get(), sizeof(StartupBlock)) ||
+      ::fcntl(fd.get(), F_ADD_SEALS, F_SEAL_SEAL | F_SEAL_SHRINK |
+                                     F_SEAL_GROW | F_SEAL_WRITE)) {
+    return false;
+  }
+  aBlock = std::move(fd);
+  return true;
+}
+
+bool
+LinuxSandboxLauncher::Launch(const std::string_view aExecutablePath,
+                             const std::vector<std::string>& aArgs)
+{
+  // Joining a mount namespace changes the working directory
+  if (mPid || aExecutablePath.empty() || aExecutablePath[0] != '/') {
+    return false;
+  }
+
+  UniqueFd startupBlock;
+  if (!CreateStartupBlock(startupBlock)) {
+    return false;
+  }
+
+  // 1. Prepare everything that the child needs, since it cannot allocate
+  std::vector<std::string> args;
+  args.reserve(aArgs.size() + 3);
+  args.emplace_back(aExecutablePath);
+  args.insert(args.end(), aArgs.begin(), aArgs.end());
+  args.emplace_back(LinuxSandbox::SWITCH_STARTUP_BLOCK);
+  char blockArg[16];
+  snprintf(blockArg, sizeof(blockArg), "%x", startupBlock.get());
+  args.emplace_back(blockArg);
+
+  std::vector<char*> argv;
+  argv.reserve(args.size() + 1);
+  for (std::string& arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+  char* envp[] = {nullptr};
+
+  std::vector<int> inheritFds;
+  inheritFds.reserve(mChannels.size() + 1);
+  for (const StartupChannel& channel : mChannels) {
+    inheritFds.push_back(static_cast<int>(channel.mHandle));
+  }
+  inheritFds.push_back(startupBlock.get());
+
+  // Template launches have nothing to do between clone and exec, so their
+  // sandboxes are never blocked
+  UniqueFd resumeRead, resumeWrite, errorRead, errorWrite;
+  if ((!mTemplate && !MakePipe(resumeRead, resumeWrite)) ||
+      !MakePipe(errorRead, errorWrite)) {
+    return false;
+  }
+
+  ChildLaunch launch = {};
+  launch.mPath = args[0].c_str();
+  launch.mArgv = argv.data();
+  launch.mEnvp = envp;
+  launch.mInheritFds = inheritFds.data();
+  launch.mInheritCount = inheritFds.size();
+  launch.mResumeFd = resumeRead ? resumeRead.get() : -1;
+  launch.mErrorFd = errorWrite.get();
+  launch.mMakeMountsPrivate = !mTemplate;
+  launch.mUserNs = mTemplate ? mTemplate->mUserNs.get() : -1;
+  launch.mMountNs = mTemplate ? mTemplate->mMountNs.get() : -1;
+  launch.mNetNs = mTemplate ? mTemplate->mNetNs.get() : -1;
+  launch.mCgroup = mCgroup ? mCgroup.get() : -1;
+  launch.mSandboxPid = -1;
+
+  // 2. Create the sandbox, and let it exec
+  pid_t pid;
+  UniqueFd pidFd;
+  if (mTemplate) {
+    if (!PreResume()) {
+      return false;
+    }
+
+    std::unique_ptr<char[]> stack(new char[kTemplateStubStackSize]);
+    void* stackTop = stack.get() + kTemplateStubStackSize;
+    pid_t stub = ::clone(RunTemplateStub, stackTop,
+                         CLONE_VM | CLONE_VFORK | SIGCHLD, &launch);
+    if (stub < 0) {
+      return false;
+    }
+    // CLONE_VFORK only returns once the stub has exited, by which time the
+    // sandbox has exec'd or failed
+    while (::waitpid(stub, nullptr, 0) < 0 && errno == EINTR) {
+    }
+    pid = launch.mSandboxPid;
+    if (pid < 0) {
+      return false;
+    }
+    // The sandbox is the launcher's child, so its pid cannot be reused
+    // before the launcher reaps it
+    pidFd.reset(static_cast<int>(::syscall(SYS_pidfd_open, pid, 0)));
+    if (!pidFd) {
+      KillAndReap(pid);
+      return false;
+    }
+    errorWrite.reset();
+  } else {
+    int rawPidFd = -1;
+    uint64_t flags = CLONE_PIDFD | CLONE_NEWUSER | CLONE_NEWPID | CLONE_NEWNS;
+    if (!(mInitFlags & eInitShareNetwork)) {
+      flags |= CLONE_NEWNET;
+    }
+    pid = Clone3(flags, &rawPidFd, launch.mCgroup, SIGCHLD);
+    if (pid < 0) {
+      return false;
+    }
+    if (!pid) {
+      RunChild(launch);
+    }
+    pidFd.reset(rawPidFd);
+    resumeRead.reset();
+    errorWrite.reset();
+
+    // It stays blocked until its IDs have been mapped
+    const char resume = 1;
+    if (!WriteIdMaps(pid) || !PreResume() ||
+        !WriteAll(resumeWrite.get(), &resume, 1)) {
+      KillAndReap(pid);
+      return false;
+    }
+    resumeWrite.reset();
+  }
+
+  // 3. Wait for it to exec or fail
+  ChildFailure failure;
+  if (ReadAll(errorRead.get(), &failure, sizeof(failure))) {
+    KillAndReap(pid);
+    errno = failure.mErrno;
+    return false;
+  }
+
+  mPid = pid;
+  mPidFd = std::move(pidFd);
+  return true;
+}
+
+bool
+LinuxSandboxLauncher::Reap(int aOptions)
+{
+  siginfo_t info;
+  memset(&info, 0, sizeof(info));
+  int result;
+  while ((result = ::waitid(P_PID, mPid, &info, WEXITED | aOptions)) < 0 &&
+         errno == EINTR) {
+  }
+  if (result < 0 || !info.si_pid) {
+    return false;
+  }
+
+  mExitStatus = info.si_code == CLD_EXITED ? info.si_status :
+                128 + info.si_status;
+  return true;
+}
+
+bool
+LinuxSandboxLauncher::Wait(unsigned int aTimeoutMs)
+{
+  if (mExitStatus) {
+    return true;
+  }
+  if (!mPidFd) {
+    return false;
+  }
+
+  struct pollfd pfd = {mPidFd.get(), POLLIN, 0};
+  int ready;
+  while ((ready = ::poll(&pfd, 1, static_cast<int>(aTimeoutMs))) < 0 &&
+         errno == EINTR) {
+  }
+  return ready > 0 && Reap(WNOHANG);
+}
+
+bool
+LinuxSandboxLauncher::IsSandboxRunning()
+{
+  return mPidFd && !Wait(0);
+}
+
+bool
+LinuxSandboxLauncher::Kill()
+{
+  return mPidFd && !mExitStatus &&
+         !::syscall(SYS_pidfd_send_signal, mPidFd.get(), SIGKILL, nullptr, 0);
+}
+
+/* static */ bool
+LinuxSandboxLauncher::AreUserNamespacesAvailable()
+{
+  pid_t pid = Clone3(CLONE_NEWUSER, nullptr, -1, SIGCHLD);
+  if (pid < 0) {
+    return false;
+  }
+  if (!pid) {
+    ::_exit(0);
+  }
+
+  int status = 0;
+  while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+} // namespace mozilla
+
+#endif // defined(__linux__)
+
@@ -0,0 +1,181 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "MemoryPressure.h"
+
+#include <algorithm>
+
+namespace mozilla {
+
+bool
+MemoryPressurePolicy::Add(uint32_t aId, uint64_t aNowNs)
+{
+  if (Find(aId)) {
+    return false;
+  }
+
+  mEntries.push_back(Entry{aId, aNowNs, 0, 0, 0, 0, 0, false});
+  return true;
+}
+
+void
+MemoryPressurePolicy::Remove(uint32_t aId)
+{
+  mEntries.erase(std::remove_if(mEntries.begin(), mEntries.end(),
+                                [aId](const Entry& aEntry) -> bool {
+                   return aEntry.mId == aId;
+                 }), mEntries.end());
+}
+
+MemoryPressurePolicy::Entry*
+MemoryPressurePolicy::Find(uint32_t aId)
+{
+  for (auto&& entry : mEntries) {
+    if (entry.mId == aId) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+bool
+MemoryPressurePolicy::IsIdle(uint32_t aId, uint64_t aNowNs) const
+{
+  for (auto&& entry : mEntries) {
+    if (entry.mId == aId) {
+      return aNowNs - entry.mLastActiveNs >= mConfig.mIdleNs;
+    }
+  }
+  return false;
+}
+
+MemoryPressureLevel
+MemoryPressurePolicy::ComputeLevel(const HostMemory& aHost) const
+{
+  if (!aHost.mTotal) {
+    return mLevel;
+  }
+
+  double available = static_cast<double>(aHost.mAvailable) / aHost.mTotal;
+  if (available < mConfig.mCriticalWatermark) {
+    return eMemoryPressureCritical;
+  }
+  if (available < mConfig.mLowWatermark) {
+    return eMemoryPressureLow;
+  }
+  if (available >= mConfig.mReleaseWatermark) {
+    return eMemoryPressureNone;
+  }
+  // Between the low and release watermarks, pressure persists once raised
+  return std::min(mLevel, eMemoryPressureLow);
+}
+
+void
+MemoryPressurePolicy::Update(uint64_t aNowNs, const HostMemory& aHost,
+                             const std::vector<MemoryTelemetry>& aTelemetry,
+                             std::vector<MemoryAction>& aActions)
+{
+  for (auto&& sample : aTelemetry) {
+    Entry* entry = Find(sample.mId);
+    if (!entry) {
+      continue;
+    }
+    if (entry->mHasSample && (sample.mCpuTime != entry->mCpuTime ||
+                              sample.mPageFaults != entry->mPageFaults)) {
+      entry->mLastActiveNs = aNowNs;
+    }
+    entry->mCpuTime = sample.mCpuTime;
+    entry->mPageFaults = sample.mPageFaults;
+    entry->mWorkingSet = sample.mWorkingSet;
+    entry->mHasSample = true;
+  }
+
+  mLevel = ComputeLevel(aHost);
+  if (mLevel == eMemoryPressureNone) {
+    for (auto&& entry : mEntries) {
+      if (entry.mWorkingSetLimit) {
+        entry.mWorkingSetLimit = 0;
+        aActions.push_back(MemoryAction{entry.mId, eMemoryActionRestore, 0});
+      }
+    }
+    return;
+  }
+
+  const uint64_t wanted =
+    static_cast<uint64_t>(mConfig.mLowWatermark * aHost.mTotal);
+  if (aHost.mAvailable >= wanted) {
+    return;
+  }
+  const uint64_t shortfall = wanted - aHost.mAvailable;
+  uint64_t reclaimed = 0;
+
+  auto idleFor = [aNowNs](const Entry* aEntry) -> uint64_t {
+    return aNowNs - aEntry->mLastActiveNs;
+  };
+
+  // Trim the longest idle sandboxes first
+  std::vector<Entry*> candidates;
+  for (auto&& entry : mEntries) {
+    if (entry.mHasSample && idleFor(&entry) >= mConfig.mIdleNs &&
+        (!entry.mLastTrimNs ||
+         aNowNs - entry.mLastTrimNs >= mConfig.mTrimCooldownNs)) {
+      candidates.push_back(&entry);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [&](const Entry* aA, const Entry* aB) -> bool {
+    if (idleFor(aA) != idleFor(aB)) {
+      return idleFor(aA) > idleFor(aB);
+    }
+    return aA->mWorkingSet > aB->mWorkingSet;
+  });
+  for (Entry* entry : candidates) {
+    if (reclaimed >= shortfall) {
+      break;
+    }
+    aActions.push_back(MemoryAction{entry->mId, eMemoryActionTrim, 0});
+    entry->mLastTrimNs = aNowNs;
+    reclaimed += entry->mWorkingSet;
+  }
+
+  if (mLevel != eMemoryPressureCritical || reclaimed >= shortfall) {
+    return;
+  }
+
+  // Still short: cap working sets, idle sandboxes and large ones first
+  candidates.clear();
+  for (auto&& entry : mEntries) {
+    if (entry.mHasSample && entry.mWorkingSet > mConfig.mMinWorkingSet) {
+      candidates.push_back(&entry);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [&](const Entry* aA, const Entry* aB) -> bool {
+    bool idleA = idleFor(aA) >= mConfig.mIdleNs;
+    bool idleB = idleFor(aB) >= mConfig.mIdleNs;
+    if (idleA != idleB) {
+      return idleA;
+    }
+    return aA->mWorkingSet > aB->mWorkingSet;
+  });
+  for (Entry* entry : candidates) {
+    if (reclaimed >= shortfall) {
+      break;
+    }
+    uint64_t limit = std::max(
+      static_cast<uint64_t>(entry->mWorkingSet * mConfig.mLimitFactor),
+      mConfig.mMinWorkingSet);
+    if (entry->mWorkingSetLimit && entry->mWorkingSetLimit <= limit) {
+      continue;
+    }
+    aActions.push_back(MemoryAction{entry->mId, eMemoryActionLimit, limit});
+    entry->mWorkingSetLimit = limit;
+    reclaimed += entry->mWorkingSet - limit;
+  }
+}
+
+} // namespace mozilla
+
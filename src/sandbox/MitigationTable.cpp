@@ -0,0 +1,122 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "MitigationTable.h"
+
+namespace mozilla {
+
+namespace {
+
+constexpr bool
+StringsEqual(const char* aA, const char* aB)
+{
+  while (*aA && *aA == *aB) {
+    ++aA;
+    ++aB;
+  }
+  return *aA == *aB;
+}
+
+constexpr bool
+IsWellFormed(const MitigationMapping& aMapping)
+{
+  if (aMapping.mWord > 1 || !aMapping.mCreationFlags) {
+    return false;
+  }
+  if (aMapping.mKind == eMitigationCreationOnly) {
+    return !aMapping.mRuntimeFlags && !aMapping.mAttributes;
+  }
+  return aMapping.mKind < eMitigationKindCount && aMapping.mRuntimeFlags;
+}
+
+constexpr bool
+ValidateMappings()
+{
+  for (size_t i = 0; i < kMitigationMappingCount; ++i) {
+    const MitigationMapping& mapping = kMitigationMappings[i];
+    if (!IsWellFormed(mapping)) {
+      return false;
+    }
+
+    // Each creation flag set is mapped exactly once...
+    for (size_t j = i + 1; j < kMitigationMappingCount; ++j) {
+      if (mapping.mWord == kMitigationMappings[j].mWord &&
+          mapping.mCreationFlags == kMitigationMappings[j].mCreationFlags) {
+        return false;
+      }
+    }
+
+    // ...and has a name that may be used in textual policies
+    size_t named = 0;
+    for (auto&& name : mitigation::kNames) {
+      named += name.mWord == mapping.mWord &&
+               name.mValue == mapping.mCreationFlags;
+    }
+    if (named != 1) {
+      return false;
+    }
+  }
+
+  // Conversely, every named flag must be mapped
+  for (auto&& name : mitigation::kNames) {
+    size_t mapped = 0;
+    for (auto&& mapping : kMitigationMappings) {
+      mapped += name.mWord == mapping.mWord &&
+                name.mValue == mapping.mCreationFlags;
+    }
+    if (mapped != 1) {
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < mitigation::kNameCount; ++i) {
+    for (size_t j = i + 1; j < mitigation::kNameCount; ++j) {
+      if (StringsEqual(mitigation::kNames[i].mName,
+                       mitigation::kNames[j].mName)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+static_assert(ValidateMappings(),
+              "kMitigationMappings must map every named mitigation flag once");
+
+// Spot checks that the translation matches what the creation flags mean
+constexpr uint32_t
+RuntimeFlagsFor(uint32_t aWord, uint64_t aFlags, uint32_t aKind)
+{
+  uint32_t result = 0;
+  for (auto&& mapping : kMitigationMappings) {
+    if (mapping.mWord == aWord && mapping.mKind == aKind &&
+        (aFlags & mapping.mCreationFlags) == mapping.mCreationFlags) {
+      result |= mapping.mRuntimeFlags;
+    }
+  }
+  return result;
+}
+
+static_assert(RuntimeFlagsFor(0, mitigation::kForceRelocateImagesReqRelocs |
+                                 mitigation::kBottomUpAslr,
+                              eMitigationAslr) == 0xB,
+              "REQ_RELOCS implies forced relocation and no stripped images");
+static_assert(RuntimeFlagsFor(0, mitigation::kForceRelocateImages,
+                              eMitigationAslr) == 0x2,
+              "Forced relocation alone permits stripped images");
+static_assert(RuntimeFlagsFor(0, mitigation::kDepEnable |
+                                 mitigation::kDepAtlThunkEnable,
+                              eMitigationDep) == 0x3,
+              "DEP flags must map onto PROCESS_MITIGATION_DEP_POLICY");
+static_assert(RuntimeFlagsFor(1, mitigation::kSpeculativeStoreBypassDisable,
+                              eMitigationSideChannelIsolation) == 0x8,
+              "SSBD lives in the second policy word");
+
+} // anonymous namespace
+
+} // namespace mozilla
+
@@ -0,0 +1,453 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "PathCanonicalizer.h"
+
+#include <algorithm>
+
+namespace mozilla {
+
+using namespace pathcanon;
+
+namespace {
+
+const std::wstring_view kLongPrefix = L"\\\\?\\";
+const std::wstring_view kLongUncPrefix = L"\\\\?\\UNC\\";
+
+inline bool
+IsSeparator(wchar_t aChar)
+{
+  return aChar == L'\\' || aChar == L'/';
+}
+
+inline bool
+IsDriveLetter(wchar_t aChar)
+{
+  return (aChar >= L'A' && aChar <= L'Z') || (aChar >= L'a' && aChar <= L'z');
+}
+
+inline wchar_t
+ToUpperAscii(wchar_t aChar)
+{
+  return aChar >= L'a' && aChar <= L'z' ? aChar - L'a' + L'A' : aChar;
+}
+
+bool
+StartsWithNoCase(std::wstring_view aStr, std::wstring_view aPrefix)
+{
+  if (aStr.size() < aPrefix.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < aPrefix.size(); ++i) {
+    if (ToUpperAscii(aStr[i]) != ToUpperAscii(aPrefix[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Characters that may not appear in a file name; ':' is only allowed as part
+// of a drive specification, which is never inside a component.
+inline bool
+IsValidComponentChar(wchar_t aChar)
+{
+  switch (aChar) {
+    case L'"': case L'*': case L':': case L'<': case L'>': case L'?':
+    case L'|':
+      return false;
+    default:
+      return aChar >= 0x20;
+  }
+}
+
+bool
+IsDotSegment(std::wstring_view aComponent)
+{
+  return aComponent == L"." || aComponent == L"..";
+}
+
+/**
+ * Returns the length of the UNC root ("\\server\share") at the start of
+ * aPath, which must begin with two separators, or zero if either name is
+ * missing.
+ */
+size_t
+GetUncRootLength(std::wstring_view aPath, size_t aStart)
+{
+  size_t pos = aStart;
+  for (int name = 0; name < 2; ++name) {
+    size_t begin = pos;
+    while (pos < aPath.size() && !IsSeparator(aPath[pos])) {
+      if (!IsValidComponentChar(aPath[pos])) {
+        return 0;
+      }
+      ++pos;
+    }
+    if (pos == begin || IsDotSegment(aPath.substr(begin, pos - begin))) {
+      return 0;
+    }
+    if (!name) {
+      if (pos == aPath.size()) {
+        return 0;
+      }
+      ++pos;
+    }
+  }
+  return pos;
+}
+
+/**
+ * Checks the components of a verbatim path after its root. Separators must be
+ * single backslashes; a trailing one is only allowed directly after the root.
+ */
+bool
+ValidateVerbatim(std::wstring_view aPath, size_t aRootLen)
+{
+  size_t pos = aRootLen;
+  if (pos == aPath.size()) {
+    return true;
+  }
+  if (aPath[pos] != L'\\') {
+    return false;
+  }
+  if (pos + 1 == aPath.size()) {
+    return true;
+  }
+
+  while (pos < aPath.size()) {
+    // aPath[pos] is a backslash
+    size_t begin = ++pos;
+    while (pos < aPath.size() && aPath[pos] != L'\\') {
+      if (aPath[pos] == L'/' || !IsValidComponentChar(aPath[pos])) {
+        return false;
+      }
+      ++pos;
+    }
+    if (pos == begin || IsDotSegment(aPath.substr(begin, pos - begin))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Returns the length of the root of an absolute, non-verbatim path: "C:" or
+ * "\\server\share". The separator that follows the root is not included.
+ */
+size_t
+GetRootLength(std::wstring_view aPath, PathKind aKind)
+{
+  switch (aKind) {
+    case ePathDriveAbsolute:
+      return 2;
+    case ePathUnc:
+      return GetUncRootLength(aPath, 2);
+    default:
+      return 0;
+  }
+}
+
+// "//server/share" is the same root as "\\server\share"
+void
+NormalizeRootSeparators(std::wstring& aPath, size_t aRootLen)
+{
+  std::replace(aPath.begin(), aPath.begin() + aRootLen, L'/', L'\\');
+}
+
+/**
+ * Writes the absolute, non-verbatim form of a base directory to aOut and
+ * returns the length of its root, or zero if aBase is not absolute.
+ */
+size_t
+AssignBase(std::wstring_view aBase, std::wstring& aOut)
+{
+  PathKind kind = ClassifyPath(aBase);
+  switch (kind) {
+    case ePathLongDrive:
+      aBase.remove_prefix(kLongPrefix.size());
+      kind = ePathDriveAbsolute;
+      aOut.assign(aBase.data(), aBase.size());
+      break;
+    case ePathLongUnc:
+      aBase.remove_prefix(kLongUncPrefix.size());
+      kind = ePathUnc;
+      aOut.assign(L"\\\\");
+      aOut.append(aBase.data(), aBase.size());
+      break;
+    case ePathDriveAbsolute:
+    case ePathUnc:
+      aOut.assign(aBase.data(), aBase.size());
+      break;
+    default:
+      return 0;
+  }
+
+  size_t rootLen = GetRootLength(aOut, kind);
+  NormalizeRootSeparators(aOut, rootLen);
+  return rootLen;
+}
+
+/**
+ * Collapses everything after the root of aPath in place. Each component that
+ * is kept is written as a backslash followed by its name; the write position
+ * never overtakes the read position because every component that is read was
+ * preceded by at least one separator.
+ */
+bool
+NormalizeTail(std::wstring& aPath, size_t aRootLen)
+{
+  wchar_t* const buf = &aPath[0];
+  const size_t len = aPath.size();
+  size_t read = aRootLen;
+  size_t write = aRootLen;
+
+  while (read < len) {
+    if (!IsSeparator(buf[read])) {
+      return false;
+    }
+    while (read < len && IsSeparator(buf[read])) {
+      ++read;
+    }
+    if (read == len) {
+      break;
+    }
+
+    size_t begin = read;
+    while (read < len && !IsSeparator(buf[read])) {
+      if (!IsValidComponentChar(buf[read])) {
+        return false;
+      }
+      ++read;
+    }
+    size_t end = read;
+    std::wstring_view component(buf + begin, end - begin);
+
+    if (component == L".") {
+      continue;
+    }
+    if (component == L"..") {
+      while (write > aRootLen && buf[--write] != L'\\') {
+      }
+      continue;
+    }
+
+    // Win32 strips trailing dots and spaces from the last component. In any
+    // other component they would be preserved by some APIs and not others.
+    bool isLast = std::all_of(buf + end, buf + len, IsSeparator);
+    size_t trimmed = end;
+    while (trimmed > begin &&
+           (buf[trimmed - 1] == L'.' || buf[trimmed - 1] == L' ')) {
+      --trimmed;
+    }
+    if (trimmed != end && !isLast) {
+      return false;
+    }
+    if (trimmed == begin) {
+      continue;
+    }
+
+    buf[write++] = L'\\';
+    std::copy(buf + begin, buf + trimmed, buf + write);
+    write += trimmed - begin;
+  }
+
+  aPath.resize(write);
+  if (write == aRootLen) {
+    aPath.push_back(L'\\');
+  }
+  return true;
+}
+
+bool
+AddDefaultExtension(std::wstring& aPath, size_t aRootLen,
+                    std::wstring_view aExtension)
+{
+  size_t lastSep = aPath.rfind(L'\\');
+  if (lastSep == std::wstring::npos || lastSep < aRootLen ||
+      lastSep + 1 == aPath.size()) {
+    // There is no file name to add an extension to
+    return false;
+  }
+  if (aPath.find(L'.', lastSep + 1) != std::wstring::npos) {
+    return true;
+  }
+
+  if (!aExtension.empty() && aExtension.front() == L'.') {
+    aExtension.remove_prefix(1);
+  }
+  if (aExtension.empty()) {
+    return true;
+  }
+  aPath.push_back(L'.');
+  aPath.append(aExtension.data(), aExtension.size());
+  return true;
+}
+
+} // anonymous namespace
+
+PathKind
+ClassifyPath(std::wstring_view aPath)
+{
+  if (aPath.empty()) {
+    return ePathInvalid;
+  }
+
+  if (aPath.size() >= 2 && IsSeparator(aPath[0]) && IsSeparator(aPath[1])) {
+    // Only the exact \\?\ prefix bypasses normalization
+    if (aPath.substr(0, kLongPrefix.size()) == kLongPrefix) {
+      if (StartsWithNoCase(aPath, kLongUncPrefix)) {
+        return ePathLongUnc;
+      }
+      std::wstring_view rest = aPath.substr(kLongPrefix.size());
+      if (rest.size() >= 2 && IsDriveLetter(rest[0]) && rest[1] == L':' &&
+          (rest.size() == 2 || rest[2] == L'\\')) {
+        return ePathLongDrive;
+      }
+      return ePathDevice;
+    }
+    if (aPath.size() >= 3 && (aPath[2] == L'.' || aPath[2] == L'?') &&
+        (aPath.size() == 3 || IsSeparator(aPath[3]))) {
+      return ePathDevice;
+    }
+    return ePathUnc;
+  }
+
+  if (IsSeparator(aPath[0])) {
+    return ePathRooted;
+  }
+
+  if (aPath.size() >= 2 && IsDriveLetter(aPath[0]) && aPath[1] == L':') {
+    return aPath.size() >= 3 && IsSeparator(aPath[2]) ? ePathDriveAbsolute
+                                                       : ePathDriveRelative;
+  }
+
+  return ePathRelative;
+}
+
+bool
+CanonicalizePath(std::wstring_view aPath, const PathContext& aContext,
+                 std::wstring& aOut, uint32_t aFlags,
+                 std::wstring_view aDefaultExtension)
+{
+  if (aPath.size() > kMaxLongPath ||
+      aPath.find(L'\0') != std::wstring_view::npos) {
+    return false;
+  }
+
+  const PathKind kind = ClassifyPath(aPath);
+  size_t rootLen = 0;
+
+  switch (kind) {
+    case ePathLongDrive:
+    case ePathLongUnc: {
+      // Verbatim paths are only validated
+      if (kind == ePathLongDrive) {
+        rootLen = kLongPrefix.size() + 2;
+      } else {
+        rootLen = GetUncRootLength(aPath, kLongUncPrefix.size());
+        if (!rootLen) {
+          return false;
+        }
+      }
+      if (aPath.substr(0, rootLen).find(L'/') != std::wstring_view::npos ||
+          !ValidateVerbatim(aPath, rootLen)) {
+        return false;
+      }
+      aOut.assign(aPath.data(), aPath.size());
+      if (aOut.size() == rootLen) {
+        aOut.push_back(L'\\');
+      }
+      if ((aFlags & eCanonDefaultExtension) &&
+          !AddDefaultExtension(aOut, rootLen, aDefaultExtension)) {
+        return false;
+      }
+      return aOut.size() <= kMaxLongPath;
+    }
+    case ePathDriveAbsolute:
+    case ePathUnc:
+      rootLen = GetRootLength(aPath, kind);
+      if (!rootLen) {
+        return false;
+      }
+      aOut.assign(aPath.data(), aPath.size());
+      NormalizeRootSeparators(aOut, rootLen);
+      break;
+    case ePathDriveRelative: {
+      const wchar_t drive = aPath[0];
+      aPath.remove_prefix(2);
+      std::wstring_view cwd = aContext.mCurrentDirectory;
+      size_t cwdDrive = StartsWithNoCase(cwd, kLongPrefix) ? kLongPrefix.size()
+                                                           : 0;
+      if (cwd.size() > cwdDrive + 1 && cwd[cwdDrive + 1] == L':' &&
+          ToUpperAscii(cwd[cwdDrive]) == ToUpperAscii(drive)) {
+        rootLen = AssignBase(cwd, aOut);
+      } else {
+        std::optional<std::wstring> driveDir;
+        if (aContext.mDriveDirectory) {
+          driveDir = aContext.mDriveDirectory(drive);
+        }
+        if (driveDir) {
+          if (driveDir->size() < 2 ||
+              ToUpperAscii(driveDir->at(0)) != ToUpperAscii(drive)) {
+            return false;
+          }
+          rootLen = AssignBase(driveDir.value(), aOut);
+        } else {
+          aOut.assign(1, drive);
+          aOut.append(L":\\");
+          rootLen = 2;
+        }
+      }
+      if (!rootLen) {
+        return false;
+      }
+      aOut.push_back(L'\\');
+      aOut.append(aPath.data(), aPath.size());
+      break;
+    }
+    case ePathRooted:
+      rootLen = AssignBase(aContext.mCurrentDirectory, aOut);
+      if (!rootLen) {
+        return false;
+      }
+      aOut.resize(rootLen);
+      aOut.append(aPath.data(), aPath.size());
+      break;
+    case ePathRelative:
+      rootLen = AssignBase(aContext.mCurrentDirectory, aOut);
+      if (!rootLen) {
+        return false;
+      }
+      aOut.push_back(L'\\');
+      aOut.append(aPath.data(), aPath.size());
+      break;
+    default:
+      return false;
+  }
+
+  if (!NormalizeTail(aOut, rootLen)) {
+    return false;
+  }
+
+  if ((aFlags & eCanonDefaultExtension) &&
+      !AddDefaultExtension(aOut, rootLen, aDefaultExtension)) {
+    return false;
+  }
+
+  if ((aFlags & eCanonLongPathPrefix) && aOut.size() >= kMaxPath) {
+    if (aOut[1] == L':') {
+      aOut.insert(0, kLongPrefix.data(), kLongPrefix.size());
+    } else {
+      // \\server\share becomes \\?\UNC\server\share
+      aOut.insert(2, kLongUncPrefix.data() + 2, kLongUncPrefix.size() - 2);
+    }
+  }
+
+  return aOut.size() <= kMaxLongPath;
+}
+
+} // namespace mozilla
+
@@ -0,0 +1,253 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Placement.h"
+
+#include <algorithm>
+
+namespace mozilla {
+
+namespace {
+
+// Each sandbox already sharing a processor counts as this much extra load
+const double kSharingCost = 0.5;
+// ...and each one on an SMT sibling of the processor as this much
+const double kSiblingCost = 0.25;
+// Packing stops adding sandboxes to a processor at this cost
+const double kPackThreshold = 1.0;
+const uint32_t kMaxGroupProcessors = 64;
+
+} // anonymous namespace
+
+PlacementScheduler::PlacementScheduler(const PlacementTopology& aTopology)
+  : mTopology(aTopology)
+  , mState(aTopology.size())
+{
+  // Physical cores are numbered densely so that their load may be tracked
+  std::unordered_map<uint32_t, uint32_t> coreIndices;
+  for (size_t i = 0; i < mTopology.size(); ++i) {
+    auto entry = coreIndices.emplace(mTopology[i].mCore,
+                                     static_cast<uint32_t>(coreIndices.size()));
+    mState[i].mCore = entry.first->second;
+  }
+  mCoreAssigned.resize(coreIndices.size());
+
+  for (size_t i = 0; i < mTopology.size(); ++i) {
+    const LogicalProcessor& processor = mTopology[i];
+    if (processor.mNumber >= kMaxGroupProcessors) {
+      continue;
+    }
+
+    auto domain = std::find_if(mDomains.begin(), mDomains.end(),
+                               [&](const Domain& aDomain) -> bool {
+      return aDomain.mGroup == processor.mGroup &&
+             aDomain.mNode == processor.mNode;
+    });
+    if (domain == mDomains.end()) {
+      mDomains.push_back(Domain{processor.mGroup, processor.mNode, {}});
+      domain = mDomains.end() - 1;
+    }
+    domain->mProcessors.push_back(i);
+  }
+}
+
+double
+PlacementScheduler::GetCost(size_t aIndex) const
+{
+  const ProcessorState& state = mState[aIndex];
+  const uint32_t siblingsAssigned = mCoreAssigned[state.mCore] -
+                                    state.mAssigned;
+  return state.mLoad + state.mAssigned * kSharingCost +
+         siblingsAssigned * kSiblingCost;
+}
+
+bool
+PlacementScheduler::IsAvailable(size_t aIndex, PlacementPolicy aPolicy) const
+{
+  const ProcessorState& state = mState[aIndex];
+  if (state.mDedicated) {
+    return false;
+  }
+
+  switch (aPolicy) {
+    case ePlacementDedicated:
+      return !state.mAssigned;
+    case ePlacementPack:
+      return GetCost(aIndex) < kPackThreshold;
+    default:
+      return true;
+  }
+}
+
+bool
+PlacementScheduler::Choose(const Domain& aDomain,
+                           const PlacementRequest& aRequest,
+                           std::vector<size_t>& aChosen) const
+{
+  std::vector<size_t> candidates;
+  candidates.reserve(aDomain.mProcessors.size());
+  for (size_t index : aDomain.mProcessors) {
+    if (IsAvailable(index, aRequest.mPolicy)) {
+      candidates.push_back(index);
+    }
+  }
+  if (candidates.size() < aRequest.mProcessors) {
+    return false;
+  }
+
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [this](size_t aA, size_t aB) -> bool {
+    return GetCost(aA) < GetCost(aB);
+  });
+
+  // Prefer not to put the sandbox on both siblings of a physical core
+  aChosen.clear();
+  std::vector<size_t> siblings;
+  for (size_t index : candidates) {
+    if (aChosen.size() == aRequest.mProcessors) {
+      break;
+    }
+    bool coreTaken = std::any_of(aChosen.begin(), aChosen.end(),
+                                 [&](size_t aOther) -> bool {
+      return mState[aOther].mCore == mState[index].mCore;
+    });
+    if (coreTaken) {
+      siblings.push_back(index);
+    } else {
+      aChosen.push_back(index);
+    }
+  }
+  for (size_t index : siblings) {
+    if (aChosen.size() == aRequest.mProcessors) {
+      break;
+    }
+    aChosen.push_back(index);
+  }
+
+  return true;
+}
+
+const PlacementScheduler::Domain*
+PlacementScheduler::ChooseDomain(const PlacementRequest& aRequest,
+                                 std::vector<size_t>& aChosen) const
+{
+  const Domain* best = nullptr;
+  double bestCost = 0.0;
+  std::vector<size_t> chosen;
+  for (auto&& domain : mDomains) {
+    if (!Choose(domain, aRequest, chosen)) {
+      continue;
+    }
+
+    double cost = 0.0;
+    for (size_t index : domain.mProcessors) {
+      cost += GetCost(index);
+    }
+    cost /= domain.mProcessors.size();
+
+    // Packing favours the busiest node that still has room
+    bool better = aRequest.mPolicy == ePlacementPack ? cost > bestCost
+                                                     : cost < bestCost;
+    if (!best || better) {
+      best = &domain;
+      bestCost = cost;
+      aChosen.swap(chosen);
+    }
+  }
+
+  return best;
+}
+
+bool
+PlacementScheduler::Place(const PlacementRequest& aRequest,
+                          Placement& aPlacement)
+{
+  if (!aRequest.mProcessors ||
+      aRequest.mProcessors > kMaxGroupProcessors ||
+      aRequest.mPolicy > ePlacementDedicated) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  std::vector<size_t> chosen;
+  const Domain* domain = ChooseDomain(aRequest, chosen);
+  if (!domain && aRequest.mPolicy == ePlacementPack) {
+    // Every node is full; fall back to sharing the least loaded one
+    PlacementRequest spread = aRequest;
+    spread.mPolicy = ePlacementSpread;
+    domain = ChooseDomain(spread, chosen);
+  }
+  if (!domain) {
+    return false;
+  }
+
+  Placement placement;
+  placement.mPolicy = aRequest.mPolicy;
+  placement.mGroup = domain->mGroup;
+  placement.mNode = domain->mNode;
+  for (size_t index : chosen) {
+    ProcessorState& state = mState[index];
+    ++state.mAssigned;
+    ++mCoreAssigned[state.mCore];
+    state.mDedicated = aRequest.mPolicy == ePlacementDedicated;
+    placement.mAffinity |= 1ULL << mTopology[index].mNumber;
+  }
+
+  placement.mId = mNextId++;
+  if (!mNextId) {
+    mNextId = 1;
+  }
+  mPlacements[placement.mId] = std::move(chosen);
+  aPlacement = placement;
+  return true;
+}
+
+bool
+PlacementScheduler::Release(const Placement& aPlacement)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  auto entry = mPlacements.find(aPlacement.mId);
+  if (entry == mPlacements.end()) {
+    return false;
+  }
+
+  for (size_t index : entry->second) {
+    ProcessorState& state = mState[index];
+    --state.mAssigned;
+    --mCoreAssigned[state.mCore];
+    state.mDedicated = false;
+  }
+  mPlacements.erase(entry);
+  return true;
+}
+
+void
+PlacementScheduler::SetLoad(size_t aIndex, double aLoad)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (aIndex < mState.size()) {
+    mState[aIndex].mLoad = std::min(std::max(aLoad, 0.0), 1.0);
+  }
+}
+
+uint32_t
+PlacementScheduler::GetAssignedCount(size_t aIndex) const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return aIndex < mState.size() ? mState[aIndex].mAssigned : 0;
+}
+
+size_t
+PlacementScheduler::GetPlacementCount() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mPlacements.size();
+}
+
+} // namespace mozilla
+
@@ -0,0 +1,463 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "PolicyCompiler.h"
+#include "ArrayLength.h"
+#include "MitigationFlags.h"
+#include "SandboxPolicy.h"
+
+#include <cstring>
+#include <sstream>
+
+using namespace ::std::literals::string_view_literals;
+
+namespace mozilla {
+
+namespace {
+
+struct FlagName
+{
+  std::string_view  mName;
+  uint32_t          mValue;
+};
+
+const FlagName kInitFlagNames[] = {
+  {"no_separate_window_station"sv, ePolicyInitNoSeparateWindowStation},
+};
+
+const FlagName kRestrictingSidNames[] = {
+  {"everyone"sv,    eRestrictEveryone},
+  {"users"sv,       eRestrictUsers},
+  {"restricted"sv,  eRestrictRestricted},
+  {"logon"sv,       eRestrictLogon},
+  {"custom"sv,      eRestrictCustom},
+  {"all"sv,         eRestrictAll},
+};
+
+const FlagName kUiRestrictionNames[] = {
+  {"handles"sv,           joblimits::kUiLimitHandles},
+  {"read_clipboard"sv,    joblimits::kUiLimitReadClipboard},
+  {"write_clipboard"sv,   joblimits::kUiLimitWriteClipboard},
+  {"system_parameters"sv, joblimits::kUiLimitSystemParameters},
+  {"display_settings"sv,  joblimits::kUiLimitDisplaySettings},
+  {"global_atoms"sv,      joblimits::kUiLimitGlobalAtoms},
+  {"desktop"sv,           joblimits::kUiLimitDesktop},
+  {"exit_windows"sv,      joblimits::kUiLimitExitWindows},
+  {"all"sv,               joblimits::kUiLimitAll},
+  {"none"sv,              0},
+};
+
+struct NumericField
+{
+  std::string_view  mKey;
+  uint32_t          mField;
+  size_t            mOffset;
+  bool              mIs64Bit;
+};
+
+const NumericField kNumericFields[] = {
+  {"process_memory_limit"sv, eFieldProcessMemory,
+   offsetof(PolicyRecord, mProcessMemoryLimit), true},
+  {"job_memory_limit"sv, eFieldJobMemory,
+   offsetof(PolicyRecord, mJobMemoryLimit), true},
+  {"min_working_set"sv, eFieldWorkingSet,
+   offsetof(PolicyRecord, mMinWorkingSet), true},
+  {"max_working_set"sv, eFieldWorkingSet,
+   offsetof(PolicyRecord, mMaxWorkingSet), true},
+  {"process_cpu_time_ms"sv, eFieldProcessCpuTime,
+   offsetof(PolicyRecord, mProcessCpuTimeLimitMs), true},
+  {"cpu_rate_cap"sv, eFieldCpuRateCap,
+   offsetof(PolicyRecord, mCpuRateCap), false},
+  {"cpu_weight"sv, eFieldCpuWeight,
+   offsetof(PolicyRecord, mCpuWeight), false},
+  {"io_max_iops"sv, eFieldIoMaxIops,
+   offsetof(PolicyRecord, mIoMaxIops), true},
+  {"io_max_bandwidth"sv, eFieldIoMaxBandwidth,
+   offsetof(PolicyRecord, mIoMaxBandwidth), true},
+  {"notify_job_memory"sv, eFieldNotifyJobMemory,
+   offsetof(PolicyRecord, mNotifyJobMemory), true},
+  {"notify_io_read_bytes"sv, eFieldNotifyIoReadBytes,
+   offsetof(PolicyRecord, mNotifyIoReadBytes), true},
+  {"notify_io_write_bytes"sv, eFieldNotifyIoWriteBytes,
+   offsetof(PolicyRecord, mNotifyIoWriteBytes), true},
+  {"active_process_limit"sv, 0,
+   offsetof(PolicyRecord, mActiveProcessLimit), false},
+};
+
+std::string_view
+Trim(std::string_view aStr)
+{
+  const auto kWhitespace = " \t\r\n"sv;
+  size_t begin = aStr.find_first_not_of(kWhitespace);
+  if (begin == std::string_view::npos) {
+    return std::string_view();
+  }
+  size_t end = aStr.find_last_not_of(kWhitespace);
+  return aStr.substr(begin, end - begin + 1);
+}
+
+/**
+ * Calls aFunc for each element of a list separated by '|' or ','. Stops and
+ * returns false as soon as aFunc does.
+ */
+template <typename F>
+bool
+ForEachListItem(std::string_view aList, F&& aFunc)
+{
+  while (!aList.empty()) {
+    size_t sep = aList.find_first_of("|,"sv);
+    std::string_view item = Trim(aList.substr(0, sep));
+    if (item.empty() || !aFunc(item)) {
+      return false;
+    }
+    if (sep == std::string_view::npos) {
+      break;
+    }
+    aList.remove_prefix(sep + 1);
+  }
+  return true;
+}
+
+bool
+ParseFlags(std::string_view aValue, const FlagName* aNames, size_t aNameCount,
+           uint32_t& aResult)
+{
+  uint32_t result = 0;
+  bool ok = ForEachListItem(aValue, [&](std::string_view aItem) -> bool {
+    for (size_t i = 0; i < aNameCount; ++i) {
+      if (aNames[i].mName == aItem) {
+        result |= aNames[i].mValue;
+        return true;
+      }
+    }
+    return false;
+  });
+  if (ok) {
+    aResult = result;
+  }
+  return ok;
+}
+
+bool
+ParseMitigations(std::string_view aValue, uint64_t (&aResult)[2])
+{
+  uint64_t result[2] = {};
+  bool ok = ForEachListItem(aValue, [&](std::string_view aItem) -> bool {
+    for (auto&& name : mitigation::kNames) {
+      if (aItem == name.mName) {
+        result[name.mWord] |= name.mValue;
+        return true;
+      }
+    }
+    return false;
+  });
+  if (ok) {
+    aResult[0] = result[0];
+    aResult[1] = result[1];
+  }
+  return ok;
+}
+
+bool
+ParseNumber(std::string_view aValue, uint64_t& aResult)
+{
+  if (aValue.empty()) {
+    return false;
+  }
+
+  uint64_t multiplier = 1;
+  switch (aValue.back()) {
+    case 'K': case 'k': multiplier = 1ULL << 10; break;
+    case 'M': case 'm': multiplier = 1ULL << 20; break;
+    case 'G': case 'g': multiplier = 1ULL << 30; break;
+    default: break;
+  }
+  if (multiplier != 1) {
+    aValue.remove_suffix(1);
+  }
+  if (aValue.empty()) {
+    return false;
+  }
+
+  uint64_t result = 0;
+  for (char c : aValue) {
+    if (c < '0' || c > '9' || result > (UINT64_MAX - 9) / 10) {
+      return false;
+    }
+    result = result * 10 + (c - '0');
+  }
+  if (result > UINT64_MAX / multiplier) {
+    return false;
+  }
+
+  aResult = result * multiplier;
+  return true;
+}
+
+class Compiler
+{
+public:
+  Compiler()
+  {
+    // Offset 0 always holds an empty string
+    mStrings.push_back('\0');
+  }
+
+  bool Compile(std::string_view aSource, std::vector<uint8_t>& aOutput);
+  const std::string& GetError() const { return mError; }
+
+private:
+  bool Fail(const char* aMessage)
+  {
+    std::ostringstream oss;
+    oss << "line " << mLine << ": " << aMessage;
+    mError = oss.str();
+    return false;
+  }
+
+  PolicyString AddString(std::string_view aStr)
+  {
+    PolicyString result = {static_cast<uint32_t>(mStrings.size()),
+                           static_cast<uint32_t>(aStr.length())};
+    mStrings.append(aStr.data(), aStr.length());
+    mStrings.push_back('\0');
+    return result;
+  }
+
+  bool BeginPolicy(std::string_view aName);
+  bool SetValue(PolicyRecord& aRecord, std::string_view aKey,
+                std::string_view aValue);
+  void Emit(std::vector<uint8_t>& aOutput);
+
+  std::vector<PolicyRecord> mRecords;
+  std::string               mStrings;
+  std::string               mError;
+  unsigned int              mLine = 0;
+};
+
+bool
+Compiler::BeginPolicy(std::string_view aName)
+{
+  if (aName.empty()) {
+    return Fail("empty policy name");
+  }
+
+  uint32_t hash = HashPolicyName(aName);
+  for (auto&& record : mRecords) {
+    if (record.mNameHash == hash &&
+        std::string_view(&mStrings[record.mName.mOffset],
+                         record.mName.mLength) == aName) {
+      return Fail("duplicate policy name");
+    }
+  }
+
+  PolicyRecord record;
+  ::memset(&record, 0, sizeof(record));
+  record.mName = AddString(aName);
+  record.mNameHash = hash;
+  record.mRestrictingSids = eRestrictAll;
+  record.mUiRestrictions = joblimits::kUiLimitAll;
+  record.mActiveProcessLimit = 1;
+  mRecords.push_back(record);
+  return true;
+}
+
+bool
+Compiler::SetValue(PolicyRecord& aRecord, std::string_view aKey,
+                   std::string_view aValue)
+{
+  if (aKey == "init_flags"sv) {
+    return ParseFlags(aValue, kInitFlagNames, ArrayLength(kInitFlagNames),
+                      aRecord.mInitFlags) || Fail("unknown init flag");
+  }
+  if (aKey == "mitigations"sv) {
+    return ParseMitigations(aValue, aRecord.mMitigationPolicies) ||
+           Fail("unknown mitigation");
+  }
+  if (aKey == "deferred_mitigations"sv) {
+    return ParseMitigations(aValue, aRecord.mDeferredMitigationPolicies) ||
+           Fail("unknown mitigation");
+  }
+  if (aKey == "restricting_sids"sv) {
+    return ParseFlags(aValue, kRestrictingSidNames,
+                      ArrayLength(kRestrictingSidNames),
+                      aRecord.mRestrictingSids) ||
+           Fail("unknown restricting SID");
+  }
+  if (aKey == "ui_restrictions"sv) {
+    return ParseFlags(aValue, kUiRestrictionNames,
+                      ArrayLength(kUiRestrictionNames),
+                      aRecord.mUiRestrictions) ||
+           Fail("unknown UI restriction");
+  }
+  if (aKey == "kill_on_job_close"sv) {
+    if (aValue == "true"sv) {
+      aRecord.mJobLimitFields |= eFieldKillOnJobClose;
+    } else if (aValue == "false"sv) {
+      aRecord.mJobLimitFields &= ~eFieldKillOnJobClose;
+    } else {
+      return Fail("expected true or false");
+    }
+    return true;
+  }
+  if (aKey == "init_function"sv) {
+    aRecord.mInitFunction = AddString(aValue);
+    return true;
+  }
+  if (aKey == "deinit_function"sv) {
+    aRecord.mDeinitFunction = AddString(aValue);
+    return true;
+  }
+
+  for (auto&& field : kNumericFields) {
+    if (field.mKey != aKey) {
+      continue;
+    }
+
+    uint64_t value;
+    if (!ParseNumber(aValue, value)) {
+      return Fail("invalid number");
+    }
+    auto dest = reinterpret_cast<unsigned char*>(&aRecord) + field.mOffset;
+    if (field.mIs64Bit) {
+      ::memcpy(dest, &value, sizeof(value));
+    } else {
+      if (value > UINT32_MAX) {
+        return Fail("value out of range");
+      }
+      uint32_t value32 = static_cast<uint32_t>(value);
+      ::memcpy(dest, &value32, sizeof(value32));
+    }
+    aRecord.mJobLimitFields |= field.mField;
+    return true;
+  }
+
+  return Fail("unknown key");
+}
+
+bool
+Compiler::Compile(std::string_view aSource, std::vector<uint8_t>& aOutput)
+{
+  std::string logicalLine;
+  while (!aSource.empty()) {
+    ++mLine;
+    size_t eol = aSource.find('\n');
+    std::string_view physicalLine = Trim(aSource.substr(0, eol));
+    aSource.remove_prefix(eol == std::string_view::npos ? aSource.length()
+                                                        : eol + 1);
+
+    if (physicalLine.empty() || physicalLine.front() == '#') {
+      continue;
+    }
+
+    // Lists may be continued onto the next line after a trailing separator
+    logicalLine.append(physicalLine.data(), physicalLine.length());
+    if ((physicalLine.back() == '|' || physicalLine.back() == ',') &&
+        !aSource.empty()) {
+      logicalLine.push_back(' ');
+      continue;
+    }
+
+    std::string_view line(logicalLine);
+
+    if (line.front() == '[') {
+      if (line.back() != ']') {
+        return Fail("unterminated section header");
+      }
+      if (!BeginPolicy(Trim(line.substr(1, line.length() - 2)))) {
+        return false;
+      }
+      logicalLine.clear();
+      continue;
+    }
+
+    if (mRecords.empty()) {
+      return Fail("value outside of a policy section");
+    }
+
+    size_t eq = line.find('=');
+    if (eq == std::string_view::npos) {
+      return Fail("expected key = value");
+    }
+    if (!SetValue(mRecords.back(), Trim(line.substr(0, eq)),
+                  Trim(line.substr(eq + 1)))) {
+      return false;
+    }
+    logicalLine.clear();
+  }
+
+  Emit(aOutput);
+
+  const char* validationError = nullptr;
+  if (!ValidatePolicyFile(aOutput.data(), aOutput.size(), &validationError)) {
+    mError = validationError;
+    aOutput.clear();
+    return false;
+  }
+
+  return true;
+}
+
+void
+Compiler::Emit(std::vector<uint8_t>& aOutput)
+{
+  const uint32_t count = static_cast<uint32_t>(mRecords.size());
+  uint32_t buckets = 1;
+  while (buckets <= count * 2) {
+    buckets <<= 1;
+  }
+
+  PolicyFileHeader header;
+  ::memset(&header, 0, sizeof(header));
+  header.mMagic = PolicyFileHeader::kMagic;
+  header.mVersion = PolicyFileHeader::kVersion;
+  header.mPolicyCount = count;
+  header.mBucketCount = buckets;
+  header.mRecordsOffset = sizeof(PolicyFileHeader);
+  header.mBucketsOffset = header.mRecordsOffset + count * sizeof(PolicyRecord);
+  header.mStringsOffset = header.mBucketsOffset + buckets * sizeof(uint32_t);
+  header.mStringsSize = static_cast<uint32_t>(mStrings.size());
+  header.mFileSize = header.mStringsOffset + header.mStringsSize;
+
+  std::vector<uint32_t> bucketTable(buckets, 0);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t bucket = mRecords[i].mNameHash & (buckets - 1);
+    while (bucketTable[bucket]) {
+      bucket = (bucket + 1) & (buckets - 1);
+    }
+    bucketTable[bucket] = i + 1;
+  }
+
+  aOutput.assign(header.mFileSize, 0);
+  uint8_t* out = aOutput.data();
+  ::memcpy(out + header.mRecordsOffset, mRecords.data(),
+           count * sizeof(PolicyRecord));
+  ::memcpy(out + header.mBucketsOffset, bucketTable.data(),
+           buckets * sizeof(uint32_t));
+  ::memcpy(out + header.mStringsOffset, mStrings.data(), mStrings.size());
+  ::memcpy(out, &header, sizeof(header));
+
+  header.mChecksum = ComputePolicyFileChecksum(out, aOutput.size());
+  ::memcpy(out, &header, sizeof(header));
+}
+
+} // anonymous namespace
+
+bool
+CompilePolicies(std::string_view aSource, std::vector<uint8_t>& aOutput,
+                std::string& aError)
+{
+  Compiler compiler;
+  if (!compiler.Compile(aSource, aOutput)) {
+    aError = compiler.GetError();
+    return false;
+  }
+
+  return true;
+}
+
+} // namespace mozilla
+
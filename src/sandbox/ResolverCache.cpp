@@ -0,0 +1,79 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ResolverCache.h"
+
+namespace mozilla {
+
+std::optional<std::wstring>
+ResolverCache::Lookup(Map& aMap, const std::wstring& aKey,
+                      const Resolver& aResolver)
+{
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto entry = aMap.find(aKey);
+    if (entry != aMap.end()) {
+      ++mHits;
+      return entry->second;
+    }
+    ++mMisses;
+    generation = mGeneration;
+  }
+
+  std::optional<std::wstring> result = aResolver();
+  if (!result) {
+    return result;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (generation == mGeneration) {
+    aMap.emplace(aKey, result.value());
+  }
+  return result;
+}
+
+std::optional<std::wstring>
+ResolverCache::GetWorkingDirectory(const std::wstring& aUserSid,
+                                   const Resolver& aResolver)
+{
+  return Lookup(mWorkingDirectories, aUserSid, aResolver);
+}
+
+std::optional<std::wstring>
+ResolverCache::GetAbsolutePath(const std::wstring& aKey,
+                               const Resolver& aResolver)
+{
+  return Lookup(mAbsolutePaths, aKey, aResolver);
+}
+
+void
+ResolverCache::InvalidateUser(const std::wstring& aUserSid)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mWorkingDirectories.erase(aUserSid);
+  ++mGeneration;
+}
+
+void
+ResolverCache::InvalidateAll()
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mWorkingDirectories.clear();
+  mAbsolutePaths.clear();
+  ++mGeneration;
+}
+
+ResolverCache::Stats
+ResolverCache::GetStats() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return Stats{mHits, mMisses,
+               mWorkingDirectories.size() + mAbsolutePaths.size()};
+}
+
+} // namespace mozilla
+
@@ -0,0 +1,90 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "RingChannel.h"
+
+namespace mozilla {
+
+namespace {
+
+bool
+IsValidRingSize(uint32_t aRingSize)
+{
+  return aRingSize >= RingChannel::kMinRingSize &&
+         !(aRingSize & (aRingSize - 1));
+}
+
+uint8_t*
+GetRingData(void* aSection, uint32_t aRingSize, RingDirection aDirection)
+{
+  return reinterpret_cast<uint8_t*>(aSection) + sizeof(RingChannelHeader) +
+         size_t(aRingSize) * aDirection;
+}
+
+} // anonymous namespace
+
+/* static */ size_t
+RingChannel::GetSectionSize(uint32_t aRingSize)
+{
+  return sizeof(RingChannelHeader) + size_t(aRingSize) * eRingDirectionCount;
+}
+
+/* static */ bool
+RingChannel::Init(void* aSection, size_t aSectionSize, uint32_t aRingSize)
+{
+  if (!IsValidRingSize(aRingSize) ||
+      GetSectionSize(aRingSize) > aSectionSize ||
+      reinterpret_cast<uintptr_t>(aSection) % RingControl::kCacheLine) {
+    return false;
+  }
+
+  auto header = reinterpret_cast<RingChannelHeader*>(aSection);
+  header->mVersion = RingChannelHeader::kVersion;
+  header->mRingSize = aRingSize;
+  header->mReserved = 0;
+  for (RingControl& ring : header->mRings) {
+    ring.mWritten.store(0, std::memory_order_relaxed);
+    ring.mRead.store(0, std::memory_order_relaxed);
+  }
+  // Published last, so that a sandbox that attaches early sees no channel
+  std::atomic_thread_fence(std::memory_order_release);
+  header->mMagic = RingChannelHeader::kMagic;
+  return true;
+}
+
+bool
+RingChannel::Attach(void* aSection, size_t aSectionSize, RingChannelSide aSide)
+{
+  if (aSectionSize < sizeof(RingChannelHeader) ||
+      reinterpret_cast<uintptr_t>(aSection) % RingControl::kCacheLine) {
+    return false;
+  }
+
+  auto header = reinterpret_cast<RingChannelHeader*>(aSection);
+  if (header->mMagic != RingChannelHeader::kMagic ||
+      header->mVersion != RingChannelHeader::kVersion) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  // Read once; the launcher's side of a channel does not trust the sandbox
+  const uint32_t ringSize = header->mRingSize;
+  if (!IsValidRingSize(ringSize) || GetSectionSize(ringSize) > aSectionSize) {
+    return false;
+  }
+
+  RingDirection out = aSide == eRingSideLauncher ? eRingToSandbox :
+                                                   eRingToLauncher;
+  RingDirection in = aSide == eRingSideLauncher ? eRingToLauncher :
+                                                  eRingToSandbox;
+  mWriter.Init(&header->mRings[out], GetRingData(aSection, ringSize, out),
+               ringSize);
+  mReader.Init(&header->mRings[in], GetRingData(aSection, ringSize, in),
+               ringSize);
+  return true;
+}
+
+} // namespace mozilla
+
@@ -0,0 +1,129 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "SandboxAsync.h"
+
+#include <chrono>
+#include <vector>
+
+namespace mozilla {
+
+void
+QueueExecutor::Post(std::coroutine_handle<> aHandle)
+{
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mQueue.push_back(aHandle);
+  }
+  mCondVar.notify_one();
+}
+
+size_t
+QueueExecutor::Run(uint32_t aTimeoutMs)
+{
+  size_t resumed = 0;
+  std::unique_lock<std::mutex> lock(mMutex);
+  mCondVar.wait_for(lock, std::chrono::milliseconds(aTimeoutMs),
+                    [this]() -> bool { return !mQueue.empty(); });
+  while (!mQueue.empty()) {
+    std::coroutine_handle<> handle = mQueue.front();
+    mQueue.pop_front();
+    lock.unlock();
+    handle.resume();
+    ++resumed;
+    lock.lock();
+  }
+  return resumed;
+}
+
+size_t
+QueueExecutor::GetPendingCount() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mQueue.size();
+}
+
+struct CancellationState
+{
+  std::mutex  mMutex;
+  bool        mCancelled = false;
+  uint64_t    mNextId = 1;
+  std::vector<std::pair<uint64_t, std::function<void()>>> mCallbacks;
+};
+
+bool
+CancellationToken::IsCancelled() const
+{
+  if (!mState) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mState->mMutex);
+  return mState->mCancelled;
+}
+
+uint64_t
+CancellationToken::Register(std::function<void()>&& aCallback) const
+{
+  if (!mState) {
+    return 0;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mState->mMutex);
+    if (!mState->mCancelled) {
+      uint64_t id = mState->mNextId++;
+      mState->mCallbacks.emplace_back(id, std::move(aCallback));
+      return id;
+    }
+  }
+  aCallback();
+  return 0;
+}
+
+bool
+CancellationToken::Unregister(uint64_t aId) const
+{
+  if (!mState || !aId) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mState->mMutex);
+  auto& callbacks = mState->mCallbacks;
+  for (auto it = callbacks.begin(); it != callbacks.end(); ++it) {
+    if (it->first == aId) {
+      callbacks.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+CancellationSource::CancellationSource()
+  : mState(std::make_shared<CancellationState>())
+{
+}
+
+void
+CancellationSource::Cancel()
+{
+  std::vector<std::pair<uint64_t, std::function<void()>>> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(mState->mMutex);
+    if (mState->mCancelled) {
+      return;
+    }
+    mState->mCancelled = true;
+    callbacks.swap(mState->mCallbacks);
+  }
+
+  // Callbacks may register or unregister others, so none run under the lock
+  for (auto&& callback : callbacks) {
+    callback.second();
+  }
+}
+
+} // namespace mozilla
+
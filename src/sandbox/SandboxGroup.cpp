@@ -0,0 +1,90 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "SandboxGroup.h"
+
+#include <algorithm>
+
+namespace mozilla {
+
+SandboxGroupMembers::SandboxGroupMembers(uint32_t aCapacity)
+  : mSlots(aCapacity, Slot{eMemberFree, 0})
+  , mClosed(false)
+{
+}
+
+std::optional<uint32_t>
+SandboxGroupMembers::Reserve()
+{
+  if (mClosed) {
+    return std::nullopt;
+  }
+
+  for (uint32_t slot = 0; slot < mSlots.size(); ++slot) {
+    if (mSlots[slot].mState == eMemberFree) {
+      mSlots[slot] = Slot{eMemberLaunching, 0};
+      return slot;
+    }
+  }
+  return std::nullopt;
+}
+
+bool
+SandboxGroupMembers::Commit(uint32_t aSlot, uint32_t aProcessId)
+{
+  if (aSlot >= mSlots.size() || mSlots[aSlot].mState != eMemberLaunching) {
+    return false;
+  }
+
+  mSlots[aSlot] = Slot{eMemberRunning, aProcessId};
+  return true;
+}
+
+bool
+SandboxGroupMembers::Cancel(uint32_t aSlot)
+{
+  if (aSlot >= mSlots.size() || mSlots[aSlot].mState != eMemberLaunching) {
+    return false;
+  }
+
+  mSlots[aSlot] = Slot{eMemberFree, 0};
+  return true;
+}
+
+std::optional<uint32_t>
+SandboxGroupMembers::OnProcessExit(uint32_t aProcessId)
+{
+  for (uint32_t slot = 0; slot < mSlots.size(); ++slot) {
+    if (mSlots[slot].mState == eMemberRunning &&
+        mSlots[slot].mProcessId == aProcessId) {
+      mSlots[slot] = Slot{eMemberFree, 0};
+      return slot;
+    }
+  }
+  return std::nullopt;
+}
+
+uint32_t
+SandboxGroupMembers::GetCount(SandboxGroupMemberState aState) const
+{
+  return static_cast<uint32_t>(
+    std::count_if(mSlots.begin(), mSlots.end(),
+                  [aState](const Slot& aSlot) -> bool {
+      return aSlot.mState == aState;
+    }));
+}
+
+std::optional<uint32_t>
+SandboxGroupMembers::GetProcessId(uint32_t aSlot) const
+{
+  if (aSlot >= mSlots.size() || mSlots[aSlot].mState != eMemberRunning) {
+    return std::nullopt;
+  }
+  return mSlots[aSlot].mProcessId;
+}
+
+} // namespace mozilla
+
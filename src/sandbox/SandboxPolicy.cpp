@@ -0,0 +1,323 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "SandboxPolicy.h"
+#include "SandboxPolicyTraits.h"
+
+namespace mozilla {
+
+namespace {
+
+const uint32_t kFnvOffsetBasis = 2166136261U;
+const uint32_t kFnvPrime = 16777619U;
+
+uint32_t
+HashBytes(uint32_t aHash, const void* aData, size_t aLen)
+{
+  auto bytes = reinterpret_cast<const unsigned char*>(aData);
+  for (size_t i = 0; i < aLen; ++i) {
+    aHash ^= bytes[i];
+    aHash *= kFnvPrime;
+  }
+  return aHash;
+}
+
+inline bool
+IsInRange(uint64_t aOffset, uint64_t aLength, uint64_t aLimit)
+{
+  return aOffset <= aLimit && aLength <= aLimit - aOffset;
+}
+
+bool
+IsValidString(const PolicyString& aString, const char* aStrings,
+              uint32_t aStringsSize)
+{
+  // Strings must be followed by their null terminator
+  return IsInRange(aString.mOffset, uint64_t(aString.mLength) + 1,
+                   aStringsSize) &&
+         aStrings[aString.mOffset + aString.mLength] == '\0';
+}
+
+// Only for records whose name has been validated
+std::string_view
+GetName(const PolicyRecord& aRecord, const char* aStrings)
+{
+  return std::string_view(aStrings + aRecord.mName.mOffset,
+                          aRecord.mName.mLength);
+}
+
+const char*
+ValidateRecord(const PolicyRecord& aRecord, const char* aStrings,
+               uint32_t aStringsSize)
+{
+  if (!IsValidString(aRecord.mName, aStrings, aStringsSize) ||
+      !IsValidString(aRecord.mInitFunction, aStrings, aStringsSize) ||
+      !IsValidString(aRecord.mDeinitFunction, aStrings, aStringsSize)) {
+    return "string out of range";
+  }
+
+  std::string_view name = GetName(aRecord, aStrings);
+  if (name.empty() || HashPolicyName(name) != aRecord.mNameHash) {
+    return "bad policy name";
+  }
+
+  if (aRecord.mInitFlags & ~ePolicyInitAll) {
+    return "unknown init flags";
+  }
+
+  if ((aRecord.mRestrictingSids & eRestrictRequired) != eRestrictRequired ||
+      (aRecord.mRestrictingSids & ~eRestrictAll)) {
+    return "bad restricting SIDs";
+  }
+
+  if (aRecord.mJobLimitFields & ~eFieldAll) {
+    return "unknown job limit fields";
+  }
+
+  JobLimits limits;
+  JobLimitPlan plan;
+  aRecord.GetJobLimits(limits);
+  if (!TranslateJobLimits(limits, plan)) {
+    return "inconsistent job limits";
+  }
+
+  // Otherwise the sandboxed process would only find out once it is running
+  if (!CanDeferMitigations(aRecord.mDeferredMitigationPolicies)) {
+    return "deferred mitigations cannot be applied at runtime";
+  }
+
+  return nullptr;
+}
+
+} // anonymous namespace
+
+uint32_t
+HashPolicyName(std::string_view aName)
+{
+  return HashBytes(kFnvOffsetBasis, aName.data(), aName.length());
+}
+
+uint32_t
+ComputePolicyFileChecksum(const void* aData, size_t aDataLen)
+{
+  // Everything except mChecksum itself participates in the checksum
+  const size_t checksumOffset = offsetof(PolicyFileHeader, mChecksum);
+  const size_t afterChecksum = checksumOffset + sizeof(uint32_t);
+  if (aDataLen < afterChecksum) {
+    return 0;
+  }
+
+  auto bytes = reinterpret_cast<const unsigned char*>(aData);
+  uint32_t hash = HashBytes(kFnvOffsetBasis, bytes, checksumOffset);
+  return HashBytes(hash, bytes + afterChecksum, aDataLen - afterChecksum);
+}
+
+void
+PolicyRecord::GetJobLimits(JobLimits& aLimits) const
+{
+  aLimits = JobLimits();
+  aLimits.mActiveProcessLimit = mActiveProcessLimit;
+  aLimits.mUiRestrictions = mUiRestrictions;
+  aLimits.mKillOnJobClose = !!(mJobLimitFields & eFieldKillOnJobClose);
+  if (mJobLimitFields & eFieldProcessMemory) {
+    aLimits.mProcessMemoryLimit = mProcessMemoryLimit;
+  }
+  if (mJobLimitFields & eFieldJobMemory) {
+    aLimits.mJobMemoryLimit = mJobMemoryLimit;
+  }
+  if (mJobLimitFields & eFieldWorkingSet) {
+    aLimits.mMinWorkingSet = mMinWorkingSet;
+    aLimits.mMaxWorkingSet = mMaxWorkingSet;
+  }
+  if (mJobLimitFields & eFieldProcessCpuTime) {
+    aLimits.mProcessCpuTimeLimitMs = mProcessCpuTimeLimitMs;
+  }
+  if (mJobLimitFields & eFieldCpuRateCap) {
+    aLimits.mCpuRateCap = mCpuRateCap;
+  }
+  if (mJobLimitFields & eFieldCpuWeight) {
+    aLimits.mCpuWeight = mCpuWeight;
+  }
+  if (mJobLimitFields & eFieldIoMaxIops) {
+    aLimits.mIoMaxIops = mIoMaxIops;
+  }
+  if (mJobLimitFields & eFieldIoMaxBandwidth) {
+    aLimits.mIoMaxBandwidth = mIoMaxBandwidth;
+  }
+  if (mJobLimitFields & eFieldNotifyJobMemory) {
+    aLimits.mNotifyJobMemory = mNotifyJobMemory;
+  }
+  if (mJobLimitFields & eFieldNotifyIoReadBytes) {
+    aLimits.mNotifyIoReadBytes = mNotifyIoReadBytes;
+  }
+  if (mJobLimitFields & eFieldNotifyIoWriteBytes) {
+    aLimits.mNotifyIoWriteBytes = mNotifyIoWriteBytes;
+  }
+}
+
+bool
+ValidatePolicyFile(const void* aData, size_t aDataLen, const char** aError)
+{
+  const char* dummy;
+  const char*& error = aError ? *aError : dummy;
+
+  if (!aData || aDataLen < sizeof(PolicyFileHeader)) {
+    error = "file too small";
+    return false;
+  }
+  if (reinterpret_cast<uintptr_t>(aData) % alignof(PolicyRecord)) {
+    error = "buffer is misaligned";
+    return false;
+  }
+
+  auto header = reinterpret_cast<const PolicyFileHeader*>(aData);
+  if (header->mMagic != PolicyFileHeader::kMagic ||
+      header->mVersion != PolicyFileHeader::kVersion) {
+    error = "not a policy file, or unsupported version";
+    return false;
+  }
+  if (header->mFileSize != aDataLen) {
+    error = "file size mismatch";
+    return false;
+  }
+
+  const uint32_t count = header->mPolicyCount;
+  const uint32_t buckets = header->mBucketCount;
+  if (!buckets || (buckets & (buckets - 1)) || buckets <= count) {
+    error = "bad bucket count";
+    return false;
+  }
+  if (header->mRecordsOffset % alignof(PolicyRecord) ||
+      !IsInRange(header->mRecordsOffset, uint64_t(count) * sizeof(PolicyRecord),
+                 aDataLen) ||
+      header->mBucketsOffset % alignof(uint32_t) ||
+      !IsInRange(header->mBucketsOffset, uint64_t(buckets) * sizeof(uint32_t),
+                 aDataLen) ||
+      !IsInRange(header->mStringsOffset, header->mStringsSize, aDataLen)) {
+    error = "section out of range";
+    return false;
+  }
+
+  if (ComputePolicyFileChecksum(aData, aDataLen) != header->mChecksum) {
+    error = "checksum mismatch";
+    return false;
+  }
+
+  auto base = reinterpret_cast<const char*>(aData);
+  auto bucketTable = reinterpret_cast<const uint32_t*>(base +
+                                                       header->mBucketsOffset);
+  auto records = reinterpret_cast<const PolicyRecord*>(base +
+                                                       header->mRecordsOffset);
+  const char* strings = base + header->mStringsOffset;
+
+  uint32_t used = 0;
+  for (uint32_t i = 0; i < buckets; ++i) {
+    if (bucketTable[i] > count) {
+      error = "bucket out of range";
+      return false;
+    }
+    used += !!bucketTable[i];
+  }
+  // With every record reachable below, this means that each record is in
+  // exactly one bucket, and since there are more buckets than records, that
+  // probes always end at a free bucket
+  if (used != count) {
+    error = "bucket count does not match records";
+    return false;
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    const char* recordError = ValidateRecord(records[i], strings,
+                                             header->mStringsSize);
+    if (recordError) {
+      error = recordError;
+      return false;
+    }
+
+    // Every record must be reachable by probing from its home bucket. This
+    // also guarantees that names are unique.
+    uint32_t bucket = records[i].mNameHash & (buckets - 1);
+    for (uint32_t probes = 0; bucketTable[bucket] != i + 1; ++probes) {
+      uint32_t other = bucketTable[bucket];
+      if (!other || probes == buckets ||
+          (records[other - 1].mNameHash == records[i].mNameHash &&
+           GetName(records[other - 1], strings) ==
+           GetName(records[i], strings))) {
+        error = "record not reachable from index";
+        return false;
+      }
+      bucket = (bucket + 1) & (buckets - 1);
+    }
+  }
+
+  return true;
+}
+
+PolicyFile::PolicyFile()
+  : mHeader(nullptr)
+  , mBuckets(nullptr)
+  , mRecords(nullptr)
+  , mStrings(nullptr)
+{
+}
+
+bool
+PolicyFile::Init(const void* aData, size_t aDataLen)
+{
+  if (mHeader || !ValidatePolicyFile(aData, aDataLen)) {
+    return false;
+  }
+
+  auto base = reinterpret_cast<const char*>(aData);
+  mHeader = reinterpret_cast<const PolicyFileHeader*>(aData);
+  mBuckets = reinterpret_cast<const uint32_t*>(base + mHeader->mBucketsOffset);
+  mRecords = reinterpret_cast<const PolicyRecord*>(base +
+                                                   mHeader->mRecordsOffset);
+  mStrings = base + mHeader->mStringsOffset;
+  return true;
+}
+
+const PolicyRecord*
+PolicyFile::Find(std::string_view aName) const
+{
+  if (!mHeader) {
+    return nullptr;
+  }
+
+  const uint32_t hash = HashPolicyName(aName);
+  const uint32_t mask = mHeader->mBucketCount - 1;
+  // Validation guarantees a free bucket, but never probe more than once
+  // around the table
+  uint32_t bucket = hash & mask;
+  for (uint32_t probes = 0; probes <= mask && mBuckets[bucket];
+       ++probes, bucket = (bucket + 1) & mask) {
+    const PolicyRecord& record = mRecords[mBuckets[bucket] - 1];
+    if (record.mNameHash == hash && GetString(record.mName) == aName) {
+      return &record;
+    }
+  }
+
+  return nullptr;
+}
+
+const PolicyRecord*
+PolicyFile::GetRecord(uint32_t aIndex) const
+{
+  if (!mHeader || aIndex >= mHeader->mPolicyCount) {
+    return nullptr;
+  }
+
+  return &mRecords[aIndex];
+}
+
+std::string_view
+PolicyFile::GetString(const PolicyString& aString) const
+{
+  return std::string_view(mStrings + aString.mOffset, aString.mLength);
+}
+
+} // namespace mozilla
+
@@ -0,0 +1,317 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "SeccompFilter.h"
+
+#include <algorithm>
+
+namespace mozilla {
+
+namespace {
+
+// Classic BPF opcodes, from linux/bpf_common.h
+const uint16_t kLoadWordAbsolute = 0x20;
+const uint16_t kJumpAlways = 0x05;
+const uint16_t kJumpEqual = 0x15;
+const uint16_t kJumpGreaterEqual = 0x35;
+const uint16_t kReturn = 0x06;
+
+// Offsets within struct seccomp_data
+const uint32_t kSyscallOffset = 0;
+const uint32_t kArchOffset = 4;
+
+// x32 system calls are x86-64 calls with this bit set
+const uint32_t kX32SyscallBit = 0x40000000;
+
+const size_t kMaxConditionalJump = 0xFF;
+
+// Calls [mStart, next range's mStart) share mAction
+struct SyscallRange
+{
+  uint32_t  mStart;
+  uint32_t  mAction;
+  uint64_t  mWeight;
+};
+
+struct TreeNode
+{
+  // Inner nodes: calls at or above mSplit are decided by mRight
+  uint32_t  mSplit;
+  // Leaves only
+  uint32_t  mAction;
+  int32_t   mLeft;
+  int32_t   mRight;
+  size_t    mLength;
+};
+
+BpfInstruction
+MakeInstruction(uint16_t aCode, uint32_t aK, uint8_t aJumpTrue = 0,
+                uint8_t aJumpFalse = 0)
+{
+  return BpfInstruction{aCode, aJumpTrue, aJumpFalse, aK};
+}
+
+void
+EmitPrologue(const SyscallPolicy& aPolicy, std::vector<BpfInstruction>& aCode)
+{
+  aCode.push_back(MakeInstruction(kLoadWordAbsolute, kArchOffset));
+  aCode.push_back(MakeInstruction(kJumpEqual, aPolicy.mArch, 1, 0));
+  aCode.push_back(MakeInstruction(kReturn, eSyscallKill));
+  aCode.push_back(MakeInstruction(kLoadWordAbsolute, kSyscallOffset));
+  if (aPolicy.mArch == eSyscallArchX86_64) {
+    aCode.push_back(MakeInstruction(kJumpGreaterEqual, kX32SyscallBit, 0, 1));
+    aCode.push_back(MakeInstruction(kReturn, eSyscallKill));
+  }
+}
+
+// aRanges is sorted and covers every call, starting with call zero
+std::vector<SyscallRange>
+MakeRanges(const SyscallPolicy& aPolicy)
+{
+  std::vector<SyscallRule> rules(aPolicy.mRules);
+  std::sort(rules.begin(), rules.end(),
+            [](const SyscallRule& aA, const SyscallRule& aB) -> bool {
+              return aA.mSyscall < aB.mSyscall;
+            });
+
+  std::vector<SyscallRange> ranges;
+  auto append = [&](uint32_t aStart, uint32_t aAction,
+                    uint64_t aWeight) -> void {
+    if (!ranges.empty() && ranges.back().mAction == aAction) {
+      ranges.back().mWeight += aWeight;
+      return;
+    }
+    ranges.push_back(SyscallRange{aStart, aAction, aWeight});
+  };
+
+  // Weights are offset by one so that a policy without any is split evenly
+  uint64_t next = 0;
+  for (const SyscallRule& rule : rules) {
+    if (rule.mSyscall > next) {
+      append(static_cast<uint32_t>(next), aPolicy.mDefaultAction, 1);
+    }
+    append(rule.mSyscall, rule.mAction, uint64_t(rule.mWeight) + 1);
+    next = uint64_t(rule.mSyscall) + 1;
+  }
+  if (next <= UINT32_MAX) {
+    append(static_cast<uint32_t>(next), aPolicy.mDefaultAction, 1);
+  }
+  return ranges;
+}
+
+/**
+ * Builds the subtree that decides aRanges[aBegin, aEnd), splitting where the
+ * weights on either side are closest to equal. aPrefix[i] is the total
+ * weight of the ranges before i.
+ */
+int32_t
+BuildTree(const std::vector<SyscallRange>& aRanges,
+          const std::vector<uint64_t>& aPrefix, size_t aBegin, size_t aEnd,
+          std::vector<TreeNode>& aNodes)
+{
+  TreeNode node = {};
+  if (aEnd - aBegin == 1) {
+    node.mAction = aRanges[aBegin].mAction;
+    node.mLeft = node.mRight = -1;
+    node.mLength = 1;
+    aNodes.push_back(node);
+    return static_cast<int32_t>(aNodes.size() - 1);
+  }
+
+  size_t split = aBegin + 1;
+  uint64_t bestImbalance = UINT64_MAX;
+  for (size_t i = aBegin + 1; i < aEnd; ++i) {
+    uint64_t left = aPrefix[i] - aPrefix[aBegin];
+    uint64_t right = aPrefix[aEnd] - aPrefix[i];
+    uint64_t imbalance = left > right ? left - right : right - left;
+    if (imbalance < bestImbalance) {
+      bestImbalance = imbalance;
+      split = i;
+    }
+  }
+
+  node.mSplit = aRanges[split].mStart;
+  node.mLeft = BuildTree(aRanges, aPrefix, aBegin, split, aNodes);
+  node.mRight = BuildTree(aRanges, aPrefix, split, aEnd, aNodes);
+  size_t leftLength = aNodes[node.mLeft].mLength;
+  // A left subtree that a conditional jump cannot skip needs a trampoline
+  node.mLength = 1 + (leftLength > kMaxConditionalJump ? 1 : 0) +
+                 leftLength + aNodes[node.mRight].mLength;
+  aNodes.push_back(node);
+  return static_cast<int32_t>(aNodes.size() - 1);
+}
+
+void
+EmitTree(const std::vector<TreeNode>& aNodes, int32_t aIndex,
+         std::vector<BpfInstruction>& aCode)
+{
+  const TreeNode& node = aNodes[aIndex];
+  if (node.mLeft < 0) {
+    aCode.push_back(MakeInstruction(kReturn, node.mAction));
+    return;
+  }
+
+  size_t leftLength = aNodes[node.mLeft].mLength;
+  if (leftLength > kMaxConditionalJump) {
+    aCode.push_back(MakeInstruction(kJumpGreaterEqual, node.mSplit, 0, 1));
+    aCode.push_back(MakeInstruction(kJumpAlways,
+                                    static_cast<uint32_t>(leftLength)));
+  } else {
+    aCode.push_back(MakeInstruction(kJumpGreaterEqual, node.mSplit,
+                                    static_cast<uint8_t>(leftLength), 0));
+  }
+  EmitTree(aNodes, node.mLeft, aCode);
+  EmitTree(aNodes, node.mRight, aCode);
+}
+
+std::string
+MakeCacheKey(const SyscallPolicy& aPolicy, SeccompLayout aLayout)
+{
+  std::string key;
+  auto append = [&key](uint32_t aValue) -> void {
+    key.append(reinterpret_cast<const char*>(&aValue), sizeof(aValue));
+  };
+  append(aLayout);
+  append(aPolicy.mArch);
+  append(aPolicy.mDefaultAction);
+  for (const SyscallRule& rule : aPolicy.mRules) {
+    append(rule.mSyscall);
+    append(rule.mAction);
+    append(rule.mWeight);
+  }
+  return key;
+}
+
+} // anonymous namespace
+
+/* static */ std::shared_ptr<const SeccompProgram>
+SeccompProgram::Compile(const SyscallPolicy& aPolicy, SeccompLayout aLayout)
+{
+  std::vector<uint32_t> syscalls;
+  syscalls.reserve(aPolicy.mRules.size());
+  for (const SyscallRule& rule : aPolicy.mRules) {
+    syscalls.push_back(rule.mSyscall);
+  }
+  std::sort(syscalls.begin(), syscalls.end());
+  if (std::adjacent_find(syscalls.begin(), syscalls.end()) != syscalls.end()) {
+    return nullptr;
+  }
+
+  std::shared_ptr<SeccompProgram> program(new SeccompProgram());
+  std::vector<BpfInstruction>& code = program->mCode;
+  EmitPrologue(aPolicy, code);
+
+  if (aLayout == eSeccompLinear) {
+    for (const SyscallRule& rule : aPolicy.mRules) {
+      code.push_back(MakeInstruction(kJumpEqual, rule.mSyscall, 0, 1));
+      code.push_back(MakeInstruction(kReturn, rule.mAction));
+    }
+    code.push_back(MakeInstruction(kReturn, aPolicy.mDefaultAction));
+  } else {
+    std::vector<SyscallRange> ranges = MakeRanges(aPolicy);
+    std::vector<uint64_t> prefix(ranges.size() + 1);
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      prefix[i + 1] = prefix[i] + ranges[i].mWeight;
+    }
+    std::vector<TreeNode> nodes;
+    nodes.reserve(ranges.size() * 2);
+    int32_t root = BuildTree(ranges, prefix, 0, ranges.size(), nodes);
+    if (code.size() + nodes[root].mLength > kMaxLength) {
+      return nullptr;
+    }
+    EmitTree(nodes, root, code);
+  }
+
+  if (code.size() > kMaxLength) {
+    return nullptr;
+  }
+  return program;
+}
+
+uint32_t
+SeccompProgram::Evaluate(uint32_t aArch, uint32_t aSyscall,
+                         uint32_t* aSteps) const
+{
+  uint32_t accumulator = 0;
+  uint32_t steps = 0;
+  size_t pc = 0;
+  uint32_t result = eSyscallKill;
+  while (pc < mCode.size()) {
+    const BpfInstruction& insn = mCode[pc];
+    ++steps;
+    if (insn.mCode == kReturn) {
+      result = insn.mK;
+      break;
+    }
+
+    switch (insn.mCode) {
+      case kLoadWordAbsolute:
+        accumulator = insn.mK == kArchOffset ? aArch :
+                      insn.mK == kSyscallOffset ? aSyscall : 0;
+        pc += 1;
+        break;
+      case kJumpAlways:
+        pc += 1 + insn.mK;
+        break;
+      case kJumpEqual:
+        pc += 1 + (accumulator == insn.mK ? insn.mJumpTrue : insn.mJumpFalse);
+        break;
+      case kJumpGreaterEqual:
+        pc += 1 + (accumulator >= insn.mK ? insn.mJumpTrue : insn.mJumpFalse);
+        break;
+      default:
+        pc = mCode.size();
+        break;
+    }
+  }
+
+  if (aSteps) {
+    *aSteps = steps;
+  }
+  return result;
+}
+
+std::shared_ptr<const SeccompProgram>
+SeccompProgramCache::Get(const SyscallPolicy& aPolicy, SeccompLayout aLayout)
+{
+  std::string key = MakeCacheKey(aPolicy, aLayout);
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto entry = mPrograms.find(key);
+    if (entry != mPrograms.end()) {
+      ++mHits;
+      return entry->second;
+    }
+    ++mMisses;
+  }
+
+  // Compiled outside of the lock; a racing thread's program is as good
+  std::shared_ptr<const SeccompProgram> program =
+    SeccompProgram::Compile(aPolicy, aLayout);
+  if (!program) {
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mPrograms.emplace(std::move(key), program).first->second;
+}
+
+void
+SeccompProgramCache::InvalidateAll()
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mPrograms.clear();
+}
+
+SeccompProgramCache::Stats
+SeccompProgramCache::GetStats() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return Stats{mHits, mMisses, mPrograms.size()};
+}
+
+} // namespace mozilla
+
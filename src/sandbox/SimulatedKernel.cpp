@@ -0,0 +1,496 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "SimulatedKernel.h"
+
+#include <chrono>
+#include <cstring>
+
+namespace mozilla {
+
+namespace {
+
+const char* const kCallNames[eSimCallCount] = {
+  "ResolvePath",
+  "CreateSid",
+  "CreateToken",
+  "CreateWindowStation",
+  "CreateDesktop",
+  "SetObjectSecurity",
+  "CreateJob",
+  "SetJobInformation",
+  "CreateSection",
+  "ResolveWorkingDirectory",
+  "CreateProcess",
+  "SetThreadToken",
+  "ResumeThread",
+  "TerminateProcess",
+  "WaitForExit",
+  "CloseHandle",
+};
+
+void
+Spin(uint32_t aNs)
+{
+  if (!aNs) {
+    return;
+  }
+  auto end = std::chrono::steady_clock::now() + std::chrono::nanoseconds(aNs);
+  while (std::chrono::steady_clock::now() < end) {
+  }
+}
+
+} // anonymous namespace
+
+SimulatedKernel::SimulatedKernel(const Config& aConfig)
+  : mConfig(aConfig)
+  , mOpenTotal(0)
+  , mPeakOpenTotal(0)
+  , mNextObject(1)
+  , mDeniedAces(0)
+{
+  for (uint32_t i = 0; i < eSimCallCount; ++i) {
+    mCalls[i].store(0, std::memory_order_relaxed);
+    mOpenObjects[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+bool
+SimulatedKernel::Call(SimulatedCall aCall)
+{
+  if (aCall >= eSimCallCount) {
+    return false;
+  }
+
+  uint64_t count = mCalls[aCall].fetch_add(1, std::memory_order_relaxed) + 1;
+  Spin(mConfig.mLatencyNs[aCall]);
+  uint32_t failEvery = mConfig.mFailEvery[aCall];
+  return !failEvery || count % failEvery;
+}
+
+/* static */ bool
+SimulatedKernel::IsKind(ObjectId aObject, SimulatedCall aCall)
+{
+  return (aObject >> kKindShift) == static_cast<ObjectId>(aCall) + 1;
+}
+
+SimulatedKernel::ObjectId
+SimulatedKernel::Create(SimulatedCall aCall)
+{
+  if (!Call(aCall)) {
+    return 0;
+  }
+
+  mOpenObjects[aCall].fetch_add(1, std::memory_order_relaxed);
+  int64_t open = mOpenTotal.fetch_add(1, std::memory_order_relaxed) + 1;
+  int64_t peak = mPeakOpenTotal.load(std::memory_order_relaxed);
+  while (open > peak &&
+         !mPeakOpenTotal.compare_exchange_weak(peak, open,
+                                               std::memory_order_relaxed)) {
+  }
+
+  // The kind is kept in the top bits, offset so that no id is zero
+  ObjectId serial = mNextObject.fetch_add(1, std::memory_order_relaxed);
+  return ((static_cast<ObjectId>(aCall) + 1) << kKindShift) |
+         (serial & kSerialMask);
+}
+
+bool
+SimulatedKernel::Close(ObjectId aObject)
+{
+  ObjectId kind = (aObject >> kKindShift) - 1;
+  if (!aObject || kind >= eSimCallCount) {
+    return false;
+  }
+
+  // Closing never fails, but still counts and takes time
+  mCalls[eSimCloseHandle].fetch_add(1, std::memory_order_relaxed);
+  Spin(mConfig.mLatencyNs[eSimCloseHandle]);
+  mOpenObjects[kind].fetch_sub(1, std::memory_order_relaxed);
+  mOpenTotal.fetch_sub(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool
+SimulatedKernel::DenyDesktopAccess(ObjectId aSid)
+{
+  if (!IsKind(aSid, eSimCreateSid) || !Call(eSimSetObjectSecurity)) {
+    return false;
+  }
+
+  mDeniedAces.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool
+SimulatedKernel::RevertDesktopAccess(const ObjectId* aSids, size_t aCount)
+{
+  for (size_t i = 0; i < aCount; ++i) {
+    if (!IsKind(aSids[i], eSimCreateSid)) {
+      return false;
+    }
+  }
+  if (!Call(eSimSetObjectSecurity)) {
+    return false;
+  }
+
+  mDeniedAces.fetch_sub(static_cast<int64_t>(aCount),
+                        std::memory_order_relaxed);
+  return true;
+}
+
+uint64_t
+SimulatedKernel::GetCallCount(SimulatedCall aCall) const
+{
+  return aCall < eSimCallCount ?
+         mCalls[aCall].load(std::memory_order_relaxed) : 0;
+}
+
+int64_t
+SimulatedKernel::GetOpenObjectCount(SimulatedCall aCall) const
+{
+  return aCall < eSimCallCount ?
+         mOpenObjects[aCall].load(std::memory_order_relaxed) : 0;
+}
+
+int64_t
+SimulatedKernel::GetOpenObjectCount() const
+{
+  int64_t total = 0;
+  for (uint32_t i = 0; i < eSimCallCount; ++i) {
+    total += mOpenObjects[i].load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+int64_t
+SimulatedKernel::GetPeakOpenObjectCount() const
+{
+  return mPeakOpenTotal.load(std::memory_order_relaxed);
+}
+
+void
+SimulatedKernel::ResetPeakOpenObjectCount()
+{
+  mPeakOpenTotal.store(mOpenTotal.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+}
+
+int64_t
+SimulatedKernel::GetDeniedAceCount() const
+{
+  return mDeniedAces.load(std::memory_order_relaxed);
+}
+
+/* static */ const char*
+SimulatedKernel::GetCallName(SimulatedCall aCall)
+{
+  return aCall < eSimCallCount ? kCallNames[aCall] : "Unknown";
+}
+
+bool
+SimulatedKernelTeardown::TerminateJob(uintptr_t aJob)
+{
+  return aJob && mKernel.Call(eSimTerminateProcess);
+}
+
+size_t
+SimulatedKernelTeardown::WaitForExit(const std::vector<uintptr_t>& aProcesses,
+                                      uint32_t aTimeoutMs)
+{
+  return mKernel.Call(eSimWaitForExit) ? 0 : aProcesses.size();
+}
+
+bool
+SimulatedKernelTeardown::RevertDesktopAces(
+    uintptr_t aDesktop, const std::vector<const SidBytes*>& aSids)
+{
+  if (aDesktop != SimulatedKernel::kParentDesktop) {
+    return false;
+  }
+
+  std::vector<SimulatedKernel::ObjectId> sids(aSids.size());
+  for (size_t i = 0; i < aSids.size(); ++i) {
+    if (aSids[i]->size() != sizeof(sids[i])) {
+      return false;
+    }
+    memcpy(&sids[i], aSids[i]->data(), sizeof(sids[i]));
+  }
+  return mKernel.RevertDesktopAccess(sids.data(), sids.size());
+}
+
+size_t
+SimulatedKernelTeardown::CloseHandles(const TeardownHandle* aHandles,
+                                       size_t aCount)
+{
+  size_t failures = 0;
+  for (size_t i = 0; i < aCount; ++i) {
+    if (!mKernel.Close(static_cast<SimulatedKernel::ObjectId>(
+                         aHandles[i].mValue))) {
+      ++failures;
+    }
+  }
+  return failures;
+}
+
+namespace {
+
+// The key under which the simulated user's working directory is cached
+const wchar_t kSimulatedUserSid[] = L"S-1-5-21-0-0-0-1001";
+const wchar_t kSimulatedExecutableDir[] = L"C:\\Program Files\\Sandbox\\";
+const wchar_t kSimulatedWorkingDir[] =
+  L"C:\\Users\\Sandbox\\AppData\\LocalLow";
+
+std::optional<std::wstring>
+ResolveSimulatedPath(SimulatedKernel& aKernel,
+                     const std::wstring_view aExecutablePath)
+{
+  if (!aKernel.Call(eSimResolvePath)) {
+    return {};
+  }
+  std::wstring path(kSimulatedExecutableDir);
+  path += aExecutablePath;
+  return path;
+}
+
+std::optional<std::wstring>
+ResolveSimulatedWorkingDirectory(SimulatedKernel& aKernel)
+{
+  if (!aKernel.Call(eSimResolveWorkingDirectory)) {
+    return {};
+  }
+  return std::wstring(kSimulatedWorkingDir);
+}
+
+} // anonymous namespace
+
+/* static */ bool
+SimulatedLaunchBackend::WarmResolverCache(
+    SimulatedKernel& aKernel, ResolverCache& aCache,
+    const std::wstring_view aExecutablePath)
+{
+  return aCache.GetWorkingDirectory(kSimulatedUserSid,
+           [&]() -> std::optional<std::wstring> {
+             return ResolveSimulatedWorkingDirectory(aKernel);
+           }) &&
+         aCache.GetAbsolutePath(std::wstring(aExecutablePath),
+           [&]() -> std::optional<std::wstring> {
+             return ResolveSimulatedPath(aKernel, aExecutablePath);
+           });
+}
+
+SimulatedLaunchBackend::SimulatedLaunchBackend(
+    SimulatedKernel& aKernel, const std::wstring_view aExecutablePath,
+    const std::wstring_view aBaseCmdLine, ResolverCache* aCache)
+  : mKernel(aKernel)
+  , mCache(aCache)
+  , mExecutablePath(aExecutablePath)
+  , mBaseCmdLine(aBaseCmdLine)
+  , mObjects()
+  , mDeniedDesktopAccess(false)
+  , mLaunched(false)
+{
+}
+
+SimulatedLaunchBackend::~SimulatedLaunchBackend()
+{
+  if (mLaunched) {
+    mKernel.Call(eSimTerminateProcess);
+  }
+  ReleaseAll();
+}
+
+void
+SimulatedLaunchBackend::Release(Slot aSlot)
+{
+  if (mObjects[aSlot]) {
+    mKernel.Close(mObjects[aSlot]);
+    mObjects[aSlot] = 0;
+  }
+}
+
+void
+SimulatedLaunchBackend::ReleaseAll()
+{
+  // The ACE has to go before the SID that it names
+  if (mDeniedDesktopAccess) {
+    mKernel.RevertDesktopAccess(&mObjects[eSlotCustomSid], 1);
+    mDeniedDesktopAccess = false;
+  }
+  for (uint32_t i = 0; i < eSlotCount; ++i) {
+    Release(static_cast<Slot>(i));
+  }
+}
+
+bool
+SimulatedLaunchBackend::ResolveExecutable()
+{
+  auto resolve = [this]() -> std::optional<std::wstring> {
+    return ResolveSimulatedPath(mKernel, mExecutablePath);
+  };
+  auto path = mCache ?
+              mCache->GetAbsolutePath(std::wstring(mExecutablePath),
+                                      resolve) :
+              resolve();
+  if (!path) {
+    return false;
+  }
+  mAbsExePath = std::move(path.value());
+  return true;
+}
+
+bool
+SimulatedLaunchBackend::CreateCustomSid()
+{
+  mObjects[eSlotCustomSid] = mKernel.Create(eSimCreateSid);
+  return !!mObjects[eSlotCustomSid];
+}
+
+bool
+SimulatedLaunchBackend::CreateTokens()
+{
+  mObjects[eSlotRestrictedToken] = mKernel.Create(eSimCreateToken);
+  if (!mObjects[eSlotRestrictedToken]) {
+    return false;
+  }
+  mObjects[eSlotImpersonationToken] = mKernel.Create(eSimCreateToken);
+  return !!mObjects[eSlotImpersonationToken];
+}
+
+bool
+SimulatedLaunchBackend::CreateWindowStation()
+{
+  mObjects[eSlotWindowStation] = mKernel.Create(eSimCreateWindowStation);
+  return !!mObjects[eSlotWindowStation];
+}
+
+bool
+SimulatedLaunchBackend::CreateDesktop()
+{
+  if (!mKernel.DenyDesktopAccess(mObjects[eSlotCustomSid])) {
+    return false;
+  }
+  mDeniedDesktopAccess = true;
+  mObjects[eSlotDesktop] = mKernel.Create(eSimCreateDesktop);
+  return !!mObjects[eSlotDesktop];
+}
+
+bool
+SimulatedLaunchBackend::CreateJob()
+{
+  mObjects[eSlotJob] = mKernel.Create(eSimCreateJob);
+  return mObjects[eSlotJob] && mKernel.Call(eSimSetJobInformation);
+}
+
+bool
+SimulatedLaunchBackend::CreateStartupTrace()
+{
+  mObjects[eSlotTraceSection] = mKernel.Create(eSimCreateSection);
+  return !!mObjects[eSlotTraceSection];
+}
+
+bool
+SimulatedLaunchBackend::CreateStartupBlock()
+{
+  mObjects[eSlotStartupSection] = mKernel.Create(eSimCreateSection);
+  return !!mObjects[eSlotStartupSection];
+}
+
+bool
+SimulatedLaunchBackend::ResolveWorkingDirectory()
+{
+  auto resolve = [this]() -> std::optional<std::wstring> {
+    return ResolveSimulatedWorkingDirectory(mKernel);
+  };
+  auto dir = mCache ?
+             mCache->GetWorkingDirectory(kSimulatedUserSid, resolve) :
+             resolve();
+  if (!dir) {
+    return false;
+  }
+  mWorkingDir = std::move(dir.value());
+  return true;
+}
+
+bool
+SimulatedLaunchBackend::CreateSuspendedProcess()
+{
+  std::wstring cmdLine(mAbsExePath);
+  cmdLine += L' ';
+  cmdLine += mBaseCmdLine;
+  cmdLine += L" -sandboxStartupBlock ";
+  cmdLine += std::to_wstring(mObjects[eSlotStartupSection]);
+
+  mObjects[eSlotProcess] = mKernel.Create(eSimCreateProcess);
+  return !!mObjects[eSlotProcess];
+}
+
+bool
+SimulatedLaunchBackend::SetThreadToken()
+{
+  return mKernel.Call(eSimSetThreadToken);
+}
+
+bool
+SimulatedLaunchBackend::ResumeProcess()
+{
+  return mKernel.Call(eSimResumeThread);
+}
+
+void
+SimulatedLaunchBackend::TerminateProcess()
+{
+  mKernel.Call(eSimTerminateProcess);
+}
+
+void
+SimulatedLaunchBackend::ReleaseForTeardown(SandboxTeardown& aTeardown)
+{
+  TeardownTarget target;
+  auto addHandle = [&](Slot aSlot, TeardownHandleKind aKind) -> void {
+    if (mObjects[aSlot]) {
+      target.mHandles.push_back(TeardownHandle{mObjects[aSlot], aKind});
+      mObjects[aSlot] = 0;
+    }
+  };
+
+  target.mJob = mObjects[eSlotJob];
+  target.mProcess = mObjects[eSlotProcess];
+  addHandle(eSlotJob, eTeardownHandleKernel);
+  addHandle(eSlotProcess, eTeardownHandleKernel);
+  addHandle(eSlotDesktop, eTeardownHandleDesktop);
+  addHandle(eSlotWindowStation, eTeardownHandleWindowStation);
+  mLaunched = false;
+
+  if (mDeniedDesktopAccess) {
+    const SimulatedKernel::ObjectId sid = mObjects[eSlotCustomSid];
+    const uint8_t* sidBytes = reinterpret_cast<const uint8_t*>(&sid);
+    target.mParentDesktop = SimulatedKernel::kParentDesktop;
+    target.mDesktopAceSid.assign(sidBytes, sidBytes + sizeof(sid));
+    mDeniedDesktopAccess = false;
+  }
+
+  aTeardown.Add(std::move(target));
+}
+
+void
+SimulatedLaunchBackend::Finish(bool aSucceeded)
+{
+  if (!aSucceeded) {
+    ReleaseAll();
+    return;
+  }
+
+  // What the launcher closes once the sandbox is running
+  Release(eSlotRestrictedToken);
+  Release(eSlotImpersonationToken);
+  Release(eSlotTraceSection);
+  Release(eSlotStartupSection);
+  mLaunched = true;
+}
+
+} // namespace mozilla
+
@@ -0,0 +1,179 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "StartupBlock.h"
+
+#include <cstring>
+
+namespace mozilla {
+
+namespace {
+
+const uint32_t kFnvOffsetBasis = 2166136261U;
+const uint32_t kFnvPrime = 16777619U;
+
+uint32_t
+HashBytes(uint32_t aHash, const void* aData, size_t aLen)
+{
+  auto bytes = reinterpret_cast<const unsigned char*>(aData);
+  for (size_t i = 0; i < aLen; ++i) {
+    aHash ^= bytes[i];
+    aHash *= kFnvPrime;
+  }
+  return aHash;
+}
+
+} // anonymous namespace
+
+uint32_t
+StartupBlock::ComputeChecksum() const
+{
+  // Everything except mChecksum itself participates in the checksum
+  const size_t checksumOffset = offsetof(StartupBlock, mChecksum);
+  const size_t afterChecksum = checksumOffset + sizeof(mChecksum);
+  uint32_t hash = HashBytes(kFnvOffsetBasis, this, checksumOffset);
+  return HashBytes(hash, reinterpret_cast<const unsigned char*>(this) +
+                         afterChecksum, sizeof(*this) - afterChecksum);
+}
+
+/* static */ const StartupBlock*
+StartupBlock::Validate(const void* aData, size_t aDataLen)
+{
+  if (!aData || aDataLen < sizeof(StartupBlock)) {
+    return nullptr;
+  }
+
+  auto block = reinterpret_cast<const StartupBlock*>(aData);
+  if (block->mMagic != kMagic || block->mVersion != kVersion ||
+      block->mSize != sizeof(StartupBlock)) {
+    return nullptr;
+  }
+
+  if (block->mPreloadCount > kMaxPreloads ||
+      block->mChannelCount > kMaxChannels ||
+      block->mStringPoolUsed > kStringPoolLength) {
+    return nullptr;
+  }
+
+  // Strings are laid out back to back in the order of their preloads, each
+  // followed by its terminator, so none may start inside the one before it
+  uint32_t poolEnd = 0;
+  for (uint32_t i = 0; i < block->mPreloadCount; ++i) {
+    const StartupString& str = block->mPreloads[i];
+    if (str.mOffset < poolEnd || str.mOffset >= block->mStringPoolUsed ||
+        str.mLength >= block->mStringPoolUsed - str.mOffset ||
+        block->mStringPool[str.mOffset + str.mLength]) {
+      return nullptr;
+    }
+    poolEnd = str.mOffset + str.mLength + 1;
+  }
+
+  if (block->ComputeChecksum() != block->mChecksum) {
+    return nullptr;
+  }
+
+  return block;
+}
+
+std::u16string_view
+StartupBlock::GetPreload(uint32_t aIndex) const
+{
+  if (aIndex >= mPreloadCount) {
+    return std::u16string_view();
+  }
+
+  const StartupString& str = mPreloads[aIndex];
+  return std::u16string_view(&mStringPool[str.mOffset], str.mLength);
+}
+
+const StartupChannel*
+StartupBlock::FindChannel(uint32_t aKind, uint32_t aNth) const
+{
+  for (uint32_t i = 0; i < mChannelCount; ++i) {
+    if (mChannels[i].mKind != aKind) {
+      continue;
+    }
+    if (!aNth) {
+      return &mChannels[i];
+    }
+    --aNth;
+  }
+
+  return nullptr;
+}
+
+StartupBlockBuilder::StartupBlockBuilder(StartupBlock& aBlock)
+  : mBlock(aBlock)
+{
+  ::memset(&mBlock, 0, sizeof(mBlock));
+  mBlock.mMagic = StartupBlock::kMagic;
+  mBlock.mVersion = StartupBlock::kVersion;
+  mBlock.mSize = sizeof(StartupBlock);
+}
+
+void
+StartupBlockBuilder::SetMitigationPolicies(uint64_t aPolicies,
+                                           uint64_t aPolicies2)
+{
+  mBlock.mMitigationPolicies[0] = aPolicies;
+  mBlock.mMitigationPolicies[1] = aPolicies2;
+}
+
+void
+StartupBlockBuilder::SetDeferredMitigationPolicies(uint64_t aPolicies,
+                                                   uint64_t aPolicies2)
+{
+  mBlock.mDeferredMitigationPolicies[0] = aPolicies;
+  mBlock.mDeferredMitigationPolicies[1] = aPolicies2;
+}
+
+bool
+StartupBlockBuilder::AddPreload(std::u16string_view aPath)
+{
+  if (mBlock.mPreloadCount >= StartupBlock::kMaxPreloads) {
+    return false;
+  }
+
+  // Strings are stored null-terminated so that they may be passed directly to
+  // APIs expecting C strings. The terminator is not included in mLength.
+  uint32_t avail = StartupBlock::kStringPoolLength - mBlock.mStringPoolUsed;
+  if (aPath.empty() || aPath.length() >= avail) {
+    return false;
+  }
+
+  StartupString& str = mBlock.mPreloads[mBlock.mPreloadCount++];
+  str.mOffset = mBlock.mStringPoolUsed;
+  str.mLength = static_cast<uint32_t>(aPath.length());
+  ::memcpy(&mBlock.mStringPool[str.mOffset], aPath.data(),
+           aPath.length() * sizeof(char16_t));
+  mBlock.mStringPoolUsed += str.mLength + 1;
+  return true;
+}
+
+bool
+StartupBlockBuilder::AddChannel(uint32_t aKind, uint64_t aHandle,
+                                uint64_t aSize, uint32_t aFlags)
+{
+  if (mBlock.mChannelCount >= StartupBlock::kMaxChannels) {
+    return false;
+  }
+
+  StartupChannel& channel = mBlock.mChannels[mBlock.mChannelCount++];
+  channel.mKind = aKind;
+  channel.mFlags = aFlags;
+  channel.mHandle = aHandle;
+  channel.mSize = aSize;
+  return true;
+}
+
+void
+StartupBlockBuilder::Finish()
+{
+  mBlock.mChecksum = mBlock.ComputeChecksum();
+}
+
+} // namespace mozilla
+
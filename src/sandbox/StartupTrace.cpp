@@ -0,0 +1,126 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "StartupTrace.h"
+
+#include <cstring>
+
+namespace mozilla {
+
+namespace {
+
+const char* const kPhaseNames[] = {
+  "ProcessCreating",
+  "ProcessResumed",
+  "Entered",
+  "JobValidated",
+  "PreloadsLoaded",
+  "PrivInit",
+  "RevertedToSelf",
+  "IntegrityDropped",
+  "JobAssigned",
+  "MitigationsApplied",
+  "Ready",
+};
+
+static_assert(sizeof(kPhaseNames) / sizeof(kPhaseNames[0]) == ePhaseCount,
+              "Every StartupPhase needs a name");
+
+uint64_t
+TicksToNs(uint64_t aTicks, uint64_t aTicksPerSecond)
+{
+  // Split to avoid overflowing for large tick counts
+  return (aTicks / aTicksPerSecond) * 1000000000ULL +
+         (aTicks % aTicksPerSecond) * 1000000000ULL / aTicksPerSecond;
+}
+
+} // anonymous namespace
+
+const char*
+GetStartupPhaseName(uint32_t aPhase)
+{
+  if (aPhase >= ePhaseCount) {
+    return "None";
+  }
+  return kPhaseNames[aPhase];
+}
+
+void
+StartupTrace::Init(uint64_t aTicksPerSecond)
+{
+  mMagic = kMagic;
+  mVersion = kVersion;
+  mTicksPerSecond = aTicksPerSecond;
+  mCompleted.store(0, std::memory_order_relaxed);
+  mFailedPhase.store(ePhaseNone, std::memory_order_relaxed);
+  for (auto&& timestamp : mTimestamps) {
+    timestamp.store(0, std::memory_order_relaxed);
+  }
+}
+
+void
+StartupTrace::Mark(StartupPhase aPhase, uint64_t aTicks)
+{
+  if (aPhase >= ePhaseCount) {
+    return;
+  }
+  mTimestamps[aPhase].store(aTicks, std::memory_order_relaxed);
+  mCompleted.fetch_or(1U << aPhase, std::memory_order_release);
+}
+
+void
+StartupTrace::MarkFailed()
+{
+  uint32_t completed = mCompleted.load(std::memory_order_relaxed);
+  uint32_t phase = 0;
+  while (phase < ePhaseCount && (completed & (1U << phase))) {
+    ++phase;
+  }
+  mFailedPhase.store(phase, std::memory_order_release);
+}
+
+bool
+SummarizeStartupTrace(const StartupTrace& aTrace,
+                      StartupTraceSummary& aSummary)
+{
+  ::memset(&aSummary, 0, sizeof(aSummary));
+  if (aTrace.mMagic != StartupTrace::kMagic ||
+      aTrace.mVersion != StartupTrace::kVersion ||
+      !aTrace.mTicksPerSecond) {
+    return false;
+  }
+
+  aSummary.mCompleted = aTrace.mCompleted.load(std::memory_order_acquire);
+  aSummary.mFailedPhase = aTrace.mFailedPhase.load(std::memory_order_acquire);
+  aSummary.mReady = !!(aSummary.mCompleted & (1U << ePhaseReady));
+  if (!(aSummary.mCompleted & (1U << ePhaseProcessCreating))) {
+    return true;
+  }
+
+  const uint64_t start =
+    aTrace.mTimestamps[ePhaseProcessCreating].load(std::memory_order_relaxed);
+  uint64_t previous = start;
+  for (uint32_t phase = ePhaseProcessCreating + 1; phase < ePhaseCount;
+       ++phase) {
+    if (!(aSummary.mCompleted & (1U << phase))) {
+      continue;
+    }
+    uint64_t timestamp =
+      aTrace.mTimestamps[phase].load(std::memory_order_relaxed);
+    if (timestamp < previous) {
+      return false;
+    }
+    aSummary.mPhaseNs[phase] = TicksToNs(timestamp - previous,
+                                         aTrace.mTicksPerSecond);
+    previous = timestamp;
+  }
+
+  aSummary.mElapsedNs = TicksToNs(previous - start, aTrace.mTicksPerSecond);
+  return true;
+}
+
+} // namespace mozilla
+
@@ -0,0 +1,335 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "TaskGraph.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace mozilla {
+
+namespace {
+
+uint64_t
+ElapsedNs(const std::chrono::steady_clock::time_point& aStart)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now() - aStart).count();
+}
+
+/**
+ * The threads that help the calling thread with Run(). Each job is a helper
+ * for one Run() that may still be waiting to start, so Run() cancels those
+ * that did not get a thread before it returns. Threads are only started
+ * when every existing one is busy, and never exit until the process does.
+ */
+class WorkerPool final
+{
+public:
+  typedef void (*JobFunc)(void* aContext);
+
+  static WorkerPool& Get()
+  {
+    static WorkerPool sPool;
+    return sPool;
+  }
+
+  void Reserve(size_t aThreads)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    while (mThreads.size() < std::min(aThreads, kMaxThreads)) {
+      StartThreadLocked();
+    }
+  }
+
+  void Submit(JobFunc aFunc, void* aContext, size_t aCount)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      for (size_t i = 0; i < aCount; ++i) {
+        mJobs.push_back({aFunc, aContext});
+      }
+      while (mIdle < mJobs.size() && mThreads.size() < kMaxThreads) {
+        StartThreadLocked();
+      }
+    }
+    mCondVar.notify_all();
+  }
+
+  // Returns how many of aContext's jobs had not started yet
+  size_t Cancel(void* aContext)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    size_t before = mJobs.size();
+    mJobs.erase(std::remove_if(mJobs.begin(), mJobs.end(),
+                               [aContext](const Job& aJob) -> bool {
+                                 return aJob.mContext == aContext;
+                               }),
+                mJobs.end());
+    return before - mJobs.size();
+  }
+
+  ~WorkerPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStopping = true;
+    }
+    mCondVar.notify_all();
+    for (auto&& thread : mThreads) {
+      thread.join();
+    }
+  }
+
+private:
+  // Graphs are small, and the calling thread can always make progress on
+  // its own, so there is no need to go beyond this
+  static const size_t kMaxThreads = 64;
+
+  struct Job
+  {
+    JobFunc mFunc;
+    void*   mContext;
+  };
+
+  WorkerPool() = default;
+
+  void StartThreadLocked()
+  {
+    // Counted as idle until it takes its first job
+    ++mIdle;
+    mThreads.emplace_back(&WorkerPool::ThreadProc, this);
+  }
+
+  void ThreadProc()
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+      mCondVar.wait(lock, [this]() -> bool {
+        return mStopping || !mJobs.empty();
+      });
+      if (mStopping) {
+        return;
+      }
+
+      Job job = mJobs.front();
+      mJobs.pop_front();
+      --mIdle;
+      lock.unlock();
+      job.mFunc(job.mContext);
+      lock.lock();
+      ++mIdle;
+    }
+  }
+
+  std::mutex                mMutex;
+  std::condition_variable   mCondVar;
+  std::deque<Job>           mJobs;
+  std::vector<std::thread>  mThreads;
+  size_t                    mIdle = 0;
+  bool                      mStopping = false;
+};
+
+// There is no point in having more threads than tasks
+size_t
+GetHelperCount(unsigned int aMaxThreads, size_t aTaskCount)
+{
+  return std::min<size_t>(std::max(aMaxThreads, 1U) - 1,
+                          aTaskCount ? aTaskCount - 1 : 0);
+}
+
+} // anonymous namespace
+
+/**
+ * Holds the state of a single Run(). Tasks are handed out under mMutex and
+ * executed outside of it; the mutex also orders each task's side effects
+ * before those of its dependents.
+ */
+class TaskGraph::Scheduler final
+{
+public:
+  explicit Scheduler(std::vector<Task>& aTasks)
+    : mTasks(aTasks)
+  {
+    for (TaskId id = 0; id < mTasks.size(); ++id) {
+      if (!mTasks[id].mPendingDeps) {
+        Enqueue(id);
+      }
+    }
+  }
+
+  // Runs on a pool thread
+  static void Help(void* aScheduler)
+  {
+    auto scheduler = static_cast<Scheduler*>(aScheduler);
+    scheduler->Work(false);
+    std::lock_guard<std::mutex> lock(scheduler->mMutex);
+    ++scheduler->mHelpersDone;
+    scheduler->mCondVar.notify_all();
+  }
+
+  // Waits until aCount helpers have finished, so that none refers to us
+  void WaitForHelpers(size_t aCount)
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mCondVar.wait(lock, [&]() -> bool { return mHelpersDone == aCount; });
+  }
+
+  // Returns the failed task, or kInvalidTask if every task succeeded
+  TaskId Work(bool aIsCallingThread)
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+      mCondVar.wait(lock, [&]() -> bool {
+        return IsDone() || !mReady.empty() ||
+               (aIsCallingThread && !mReadyCallingThread.empty());
+      });
+      if (IsDone()) {
+        return mFailedTask;
+      }
+
+      std::deque<TaskId>& queue =
+        aIsCallingThread && !mReadyCallingThread.empty() ? mReadyCallingThread
+                                                         : mReady;
+      TaskId id = queue.front();
+      queue.pop_front();
+      ++mRunning;
+
+      lock.unlock();
+      Task& task = mTasks[id];
+      auto start = std::chrono::steady_clock::now();
+      bool ok = task.mFunc();
+      task.mDurationNs = ElapsedNs(start);
+      lock.lock();
+
+      --mRunning;
+      ++mFinished;
+      if (!ok && mFailedTask == kInvalidTask) {
+        mFailedTask = id;
+        // Cancel everything that has not started yet
+        mReady.clear();
+        mReadyCallingThread.clear();
+      } else if (ok && mFailedTask == kInvalidTask) {
+        for (TaskId dependent : task.mDependents) {
+          if (!--mTasks[dependent].mPendingDeps) {
+            Enqueue(dependent);
+          }
+        }
+      }
+      mCondVar.notify_all();
+    }
+  }
+
+private:
+  void Enqueue(TaskId aId)
+  {
+    if (mTasks[aId].mFlags & eTaskCallingThread) {
+      mReadyCallingThread.push_back(aId);
+    } else {
+      mReady.push_back(aId);
+    }
+  }
+
+  bool IsDone() const
+  {
+    return mFinished == mTasks.size() ||
+           (mFailedTask != kInvalidTask && !mRunning);
+  }
+
+  std::vector<Task>&      mTasks;
+  std::mutex              mMutex;
+  std::condition_variable mCondVar;
+  std::deque<TaskId>      mReady;
+  std::deque<TaskId>      mReadyCallingThread;
+  size_t                  mRunning = 0;
+  size_t                  mFinished = 0;
+  size_t                  mHelpersDone = 0;
+  TaskId                  mFailedTask = kInvalidTask;
+};
+
+TaskGraph::TaskId
+TaskGraph::Add(const char* aName, TaskFunc&& aFunc,
+               std::initializer_list<TaskId> aDeps, uint32_t aFlags)
+{
+  const TaskId id = static_cast<TaskId>(mTasks.size());
+  if (mHasRun || !aFunc || id == kInvalidTask) {
+    mMalformed = true;
+    return kInvalidTask;
+  }
+
+  for (TaskId dep : aDeps) {
+    if (dep >= id) {
+      mMalformed = true;
+      return kInvalidTask;
+    }
+  }
+
+  Task task = {aName, std::move(aFunc), aFlags,
+               static_cast<uint32_t>(aDeps.size()), {}, 0};
+  mTasks.push_back(std::move(task));
+  for (TaskId dep : aDeps) {
+    mTasks[dep].mDependents.push_back(id);
+  }
+  return id;
+}
+
+bool
+TaskGraph::Run(unsigned int aMaxThreads)
+{
+  if (mHasRun || mMalformed) {
+    return false;
+  }
+  mHasRun = true;
+
+  auto start = std::chrono::steady_clock::now();
+  Scheduler scheduler(mTasks);
+
+  WorkerPool& pool = WorkerPool::Get();
+  size_t helperCount = GetHelperCount(aMaxThreads, mTasks.size());
+  if (helperCount) {
+    pool.Submit(&Scheduler::Help, &scheduler, helperCount);
+  }
+
+  mFailedTask = scheduler.Work(true);
+  if (helperCount) {
+    // Helpers that have yet to start would find nothing left to do
+    scheduler.WaitForHelpers(helperCount - pool.Cancel(&scheduler));
+  }
+
+  mElapsedNs = ElapsedNs(start);
+  return mFailedTask == kInvalidTask;
+}
+
+/* static */ void
+TaskGraph::WarmUp(unsigned int aMaxThreads)
+{
+  WorkerPool::Get().Reserve(GetHelperCount(aMaxThreads, SIZE_MAX));
+}
+
+const char*
+TaskGraph::GetName(TaskId aTask) const
+{
+  if (aTask >= mTasks.size()) {
+    return nullptr;
+  }
+  return mTasks[aTask].mName;
+}
+
+uint64_t
+TaskGraph::GetDurationNs(TaskId aTask) const
+{
+  if (aTask >= mTasks.size()) {
+    return 0;
+  }
+  return mTasks[aTask].mDurationNs;
+}
+
+} // namespace mozilla
+
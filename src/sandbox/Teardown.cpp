@@ -0,0 +1,142 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Teardown.h"
+#include "TaskGraph.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+namespace mozilla {
+
+namespace {
+
+const char* const kTeardownPhaseNames[] = {
+  "Terminate",
+  "Wait",
+  "RevertDesktop",
+  "CloseHandles",
+};
+
+static_assert(sizeof(kTeardownPhaseNames) / sizeof(kTeardownPhaseNames[0]) ==
+              eTeardownPhaseCount, "Every teardown phase needs a name");
+
+uint64_t
+ElapsedNs(const std::chrono::steady_clock::time_point& aStart)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now() - aStart).count();
+}
+
+} // anonymous namespace
+
+const char*
+GetTeardownPhaseName(TeardownPhase aPhase)
+{
+  if (aPhase >= eTeardownPhaseCount) {
+    return nullptr;
+  }
+  return kTeardownPhaseNames[aPhase];
+}
+
+bool
+SandboxTeardown::Run(TeardownBackend& aBackend, uint32_t aTimeoutMs,
+                     TeardownReport& aReport)
+{
+  if (mHasRun) {
+    return false;
+  }
+  mHasRun = true;
+
+  aReport = TeardownReport();
+  aReport.mSandboxes = mTargets.size();
+  const auto start = std::chrono::steady_clock::now();
+
+  // 1. Kill every sandbox before waiting for any of them
+  auto phaseStart = std::chrono::steady_clock::now();
+  std::vector<uintptr_t> processes;
+  for (auto&& target : mTargets) {
+    if (target.mJob && !aBackend.TerminateJob(target.mJob)) {
+      ++aReport.mTerminateFailures;
+    }
+    if (target.mProcess) {
+      processes.push_back(target.mProcess);
+    }
+  }
+  aReport.mPhaseNs[eTeardownTerminate] = ElapsedNs(phaseStart);
+
+  // 2. Wait for them to exit, so that the desktop is no longer in use
+  phaseStart = std::chrono::steady_clock::now();
+  if (!processes.empty()) {
+    aReport.mStillRunning = aBackend.WaitForExit(processes, aTimeoutMs);
+  }
+  aReport.mPhaseNs[eTeardownWait] = ElapsedNs(phaseStart);
+
+  // 3. One DACL update per desktop for all of its sandboxes
+  phaseStart = std::chrono::steady_clock::now();
+  std::vector<uintptr_t> desktops;
+  for (auto&& target : mTargets) {
+    if (target.mParentDesktop && !target.mDesktopAceSid.empty() &&
+        std::find(desktops.begin(), desktops.end(),
+                  target.mParentDesktop) == desktops.end()) {
+      desktops.push_back(target.mParentDesktop);
+    }
+  }
+  for (uintptr_t desktop : desktops) {
+    std::vector<const SidBytes*> sids;
+    for (auto&& target : mTargets) {
+      if (target.mParentDesktop == desktop && !target.mDesktopAceSid.empty()) {
+        sids.push_back(&target.mDesktopAceSid);
+      }
+    }
+    if (!aBackend.RevertDesktopAces(desktop, sids)) {
+      ++aReport.mDesktopFailures;
+    }
+  }
+  aReport.mPhaseNs[eTeardownRevertDesktop] = ElapsedNs(phaseStart);
+
+  // 4. Close handles in batches, one kind at a time
+  phaseStart = std::chrono::steady_clock::now();
+  std::atomic<size_t> closeFailures(0);
+  for (int kind = 0; kind < eTeardownHandleKindCount; ++kind) {
+    std::vector<TeardownHandle> handles;
+    for (auto&& target : mTargets) {
+      for (auto&& handle : target.mHandles) {
+        if (handle.mKind == kind && handle.mValue) {
+          handles.push_back(handle);
+        }
+      }
+    }
+    if (handles.empty()) {
+      continue;
+    }
+
+    TaskGraph graph;
+    for (size_t first = 0; first < handles.size(); first += kCloseBatch) {
+      size_t count = std::min(kCloseBatch, handles.size() - first);
+      const TeardownHandle* batch = &handles[first];
+      graph.Add("CloseHandles", [&aBackend, &closeFailures, batch,
+                                 count]() -> bool {
+        closeFailures += aBackend.CloseHandles(batch, count);
+        return true;
+      });
+    }
+    graph.Run(kCloseThreads);
+    aReport.mHandlesClosed += handles.size();
+  }
+  aReport.mCloseFailures = closeFailures;
+  aReport.mHandlesClosed -= aReport.mCloseFailures;
+  aReport.mPhaseNs[eTeardownCloseHandles] = ElapsedNs(phaseStart);
+
+  mTargets.clear();
+  aReport.mTotalNs = ElapsedNs(start);
+  return !aReport.mTerminateFailures && !aReport.mStillRunning &&
+         !aReport.mDesktopFailures && !aReport.mCloseFailures;
+}
+
+} // namespace mozilla
+
@@ -0,0 +1,206 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "WaitWord.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <climits>
+#include <ctime>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || \
+    defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace mozilla {
+
+namespace {
+
+const uint32_t kMinSpinNs = 1000;
+const uint32_t kSpinsPerClockRead = 16;
+
+// With one CPU, the notifier cannot run while we spin
+bool
+CanSpin()
+{
+  static const bool sCanSpin = std::thread::hardware_concurrency() > 1;
+  return sCanSpin;
+}
+
+void
+CpuRelax()
+{
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || \
+    defined(__x86_64__)
+  _mm_pause();
+#elif defined(_M_ARM64)
+  __yield();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+/**
+ * Parks the calling thread until aWord might have changed from aOldValue or
+ * aTimeoutMs passes. May return early for no reason at all.
+ */
+void
+Park(WaitWord& aWord, uint32_t aOldValue, uint32_t aTimeoutMs,
+     WaitWordScope aScope, uintptr_t aParkEvent)
+{
+#if defined(_WIN32)
+  if (aScope == eWaitWordShared) {
+    ::WaitForSingleObject(reinterpret_cast<HANDLE>(aParkEvent), aTimeoutMs);
+  } else {
+    ::WaitOnAddress(&aWord.mValue, &aOldValue, sizeof(aOldValue),
+                    aTimeoutMs);
+  }
+#elif defined(__linux__)
+  struct timespec timeout = {static_cast<time_t>(aTimeoutMs / 1000),
+                             static_cast<long>(aTimeoutMs % 1000) * 1000000};
+  int op = FUTEX_WAIT | (aScope == eWaitWordProcess ? FUTEX_PRIVATE_FLAG : 0);
+  ::syscall(SYS_futex, &aWord.mValue, op, aOldValue,
+            aTimeoutMs == kWaitWordInfinite ? nullptr : &timeout, nullptr, 0);
+#else
+  // Without a way to wait on memory, keep polling, but politely
+  std::this_thread::sleep_for(std::chrono::microseconds(
+    std::min<uint32_t>(aTimeoutMs, 1) * 50));
+#endif
+}
+
+void
+Wake(WaitWord& aWord, WaitWordScope aScope, uintptr_t aParkEvent)
+{
+#if defined(_WIN32)
+  if (aScope == eWaitWordShared) {
+    ::SetEvent(reinterpret_cast<HANDLE>(aParkEvent));
+  } else {
+    ::WakeByAddressAll(&aWord.mValue);
+  }
+#elif defined(__linux__)
+  int op = FUTEX_WAKE | (aScope == eWaitWordProcess ? FUTEX_PRIVATE_FLAG : 0);
+  ::syscall(SYS_futex, &aWord.mValue, op, INT_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+} // anonymous namespace
+
+void
+WaitWord::Init(uint32_t aValue, uint32_t aMaxSpinNs)
+{
+  mValue.store(aValue, std::memory_order_relaxed);
+  mParked.store(0, std::memory_order_relaxed);
+  mSpinNs.store(std::min(aMaxSpinNs, kMinSpinNs), std::memory_order_relaxed);
+  mMaxSpinNs = aMaxSpinNs;
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+bool
+WaitForWordChange(WaitWord& aWord, uint32_t aOldValue, uint32_t aTimeoutMs,
+                  WaitWordScope aScope, uintptr_t aParkEvent)
+{
+  if (aWord.mValue.load(std::memory_order_acquire) != aOldValue) {
+    return true;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  auto elapsedNs = [&start]() -> uint64_t {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start).count();
+  };
+  const uint32_t maxSpinNs =
+    CanSpin() ? std::min(aWord.mMaxSpinNs, WaitWord::kMaxSpinNs) : 0;
+  const uint32_t spinNs =
+    std::min(aWord.mSpinNs.load(std::memory_order_relaxed), maxSpinNs);
+
+  // The clock is only read every few spins
+  for (uint32_t i = 1; spinNs; ++i) {
+    CpuRelax();
+    if (aWord.mValue.load(std::memory_order_acquire) != aOldValue) {
+      // Keep spinning for about twice as long as waits take
+      uint64_t waitedNs = elapsedNs();
+      aWord.mSpinNs.store(static_cast<uint32_t>(
+                            std::clamp<uint64_t>(waitedNs * 2,
+                                                 std::min(kMinSpinNs,
+                                                          maxSpinNs),
+                                                 maxSpinNs)),
+                          std::memory_order_relaxed);
+      return true;
+    }
+    if (!(i % kSpinsPerClockRead) && elapsedNs() >= spinNs) {
+      break;
+    }
+  }
+
+  const auto deadline = start + std::chrono::milliseconds(aTimeoutMs);
+  while (true) {
+    uint32_t remainingMs = kWaitWordInfinite;
+    if (aTimeoutMs != kWaitWordInfinite) {
+      auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                         deadline - std::chrono::steady_clock::now());
+      remainingMs = static_cast<uint32_t>(
+        std::max<int64_t>(remaining.count(), 0));
+    }
+
+    // Pairs with StoreWordAndNotify: either the notifier sees that we are
+    // parked, or we see its value
+    aWord.mParked.fetch_add(1, std::memory_order_seq_cst);
+    bool unchanged = aWord.mValue.load(std::memory_order_seq_cst) == aOldValue;
+    if (unchanged && remainingMs) {
+      Park(aWord, aOldValue, remainingMs, aScope, aParkEvent);
+    }
+    aWord.mParked.fetch_sub(1, std::memory_order_relaxed);
+
+    if (aWord.mValue.load(std::memory_order_acquire) != aOldValue) {
+      break;
+    }
+    if (!remainingMs) {
+      return false;
+    }
+  }
+
+  // A wait that a longer spin would have covered extends the spin, and
+  // any other wait halves it, but never below kMinSpinNs so that this can
+  // change its mind
+  if (maxSpinNs) {
+    uint64_t waitedNs = elapsedNs();
+    uint64_t nextNs = waitedNs < maxSpinNs / 2 ? waitedNs * 2 : spinNs / 2;
+    aWord.mSpinNs.store(static_cast<uint32_t>(
+                          std::clamp<uint64_t>(nextNs,
+                                               std::min(kMinSpinNs,
+                                                        maxSpinNs),
+                                               maxSpinNs)),
+                        std::memory_order_relaxed);
+  }
+  return true;
+}
+
+bool
+StoreWordAndNotify(WaitWord& aWord, uint32_t aValue, WaitWordScope aScope,
+                   uintptr_t aParkEvent)
+{
+  aWord.mValue.store(aValue, std::memory_order_seq_cst);
+  if (!aWord.mParked.load(std::memory_order_seq_cst)) {
+    return false;
+  }
+  Wake(aWord, aScope, aParkEvent);
+  return true;
+}
+
+} // namespace mozilla
+
@@ -7,13 +7,22 @@
 #include "WindowsSandbox.h"
 #include "ArrayLength.h"
 #include "dacl.h"
+#include "LaunchBackend.h"
 #include "MakeUniqueLen.h"
+#include "MitigationFlags.h"
+#include "MitigationTable.h"
+#include "PathCanonicalizer.h"
+#include "ResolverCache.h"
 #include "sidattrs.h"
+#include "TaskGraph.h"
+#include <algorithm>
+#include <chrono>
 #include <sstream>
 #include <string_view>
 
 #include <aclapi.h>
-#include <pathcch.h>
+#include <psapi.h>
+#include <sddl.h>
 #include <shlobj.h>
 #include <shlwapi.h>
 #include <VersionHelpers.h>
@@ -26,8 +35,96 @@ using std::hex;
 
 namespace mozilla {
 
+static_assert(joblimits::kLimitWorkingSet == JOB_OBJECT_LIMIT_WORKINGSET &&
+              joblimits::kLimitProcessTime == JOB_OBJECT_LIMIT_PROCESS_TIME &&
+              joblimits::kLimitActiveProcess == JOB_OBJECT_LIMIT_ACTIVE_PROCESS &&
+              joblimits::kLimitAffinity == JOB_OBJECT_LIMIT_AFFINITY &&
+              joblimits::kLimitPriorityClass == JOB_OBJECT_LIMIT_PRIORITY_CLASS &&
+              joblimits::kLimitProcessMemory == JOB_OBJECT_LIMIT_PROCESS_MEMORY &&
+              joblimits::kLimitJobMemory == JOB_OBJECT_LIMIT_JOB_MEMORY &&
+              joblimits::kLimitKillOnJobClose == JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE &&
+              joblimits::kLimitJobReadBytes == JOB_OBJECT_LIMIT_JOB_READ_BYTES &&
+              joblimits::kLimitJobWriteBytes == JOB_OBJECT_LIMIT_JOB_WRITE_BYTES,
+              "joblimits constants must match JOB_OBJECT_LIMIT_*");
+static_assert(joblimits::kCpuRateControlEnable == JOB_OBJECT_CPU_RATE_CONTROL_ENABLE &&
+              joblimits::kCpuRateControlWeightBased == JOB_OBJECT_CPU_RATE_CONTROL_WEIGHT_BASED &&
+              joblimits::kCpuRateControlHardCap == JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP,
+              "joblimits constants must match JOB_OBJECT_CPU_RATE_CONTROL_*");
+static_assert(joblimits::kMsgEndOfProcessTime == JOB_OBJECT_MSG_END_OF_PROCESS_TIME &&
+              joblimits::kMsgActiveProcessLimit == JOB_OBJECT_MSG_ACTIVE_PROCESS_LIMIT &&
+              joblimits::kMsgProcessMemoryLimit == JOB_OBJECT_MSG_PROCESS_MEMORY_LIMIT &&
+              joblimits::kMsgJobMemoryLimit == JOB_OBJECT_MSG_JOB_MEMORY_LIMIT &&
+              joblimits::kMsgNotificationLimit == JOB_OBJECT_MSG_NOTIFICATION_LIMIT,
+              "joblimits constants must match JOB_OBJECT_MSG_*");
+static_assert(joblimits::kUiLimitAll == (JOB_OBJECT_UILIMIT_DESKTOP |
+                                         JOB_OBJECT_UILIMIT_DISPLAYSETTINGS |
+                                         JOB_OBJECT_UILIMIT_EXITWINDOWS |
+                                         JOB_OBJECT_UILIMIT_GLOBALATOMS |
+                                         JOB_OBJECT_UILIMIT_HANDLES |
+                                         JOB_OBJECT_UILIMIT_READCLIPBOARD |
+                                         JOB_OBJECT_UILIMIT_SYSTEMPARAMETERS |
+                                         JOB_OBJECT_UILIMIT_WRITECLIPBOARD) &&
+              joblimits::kUiLimitDesktop == JOB_OBJECT_UILIMIT_DESKTOP &&
+              joblimits::kUiLimitHandles == JOB_OBJECT_UILIMIT_HANDLES,
+              "joblimits constants must match JOB_OBJECT_UILIMIT_*");
+static_assert(mitigation::kDepEnable == PROCESS_CREATION_MITIGATION_POLICY_DEP_ENABLE &&
+              mitigation::kDepAtlThunkEnable == PROCESS_CREATION_MITIGATION_POLICY_DEP_ATL_THUNK_ENABLE &&
+              mitigation::kSehopEnable == PROCESS_CREATION_MITIGATION_POLICY_SEHOP_ENABLE &&
+              mitigation::kForceRelocateImages == PROCESS_CREATION_MITIGATION_POLICY_FORCE_RELOCATE_IMAGES_ALWAYS_ON &&
+              mitigation::kForceRelocateImagesReqRelocs == PROCESS_CREATION_MITIGATION_POLICY_FORCE_RELOCATE_IMAGES_ALWAYS_ON_REQ_RELOCS &&
+              mitigation::kHeapTerminate == PROCESS_CREATION_MITIGATION_POLICY_HEAP_TERMINATE_ALWAYS_ON &&
+              mitigation::kBottomUpAslr == PROCESS_CREATION_MITIGATION_POLICY_BOTTOM_UP_ASLR_ALWAYS_ON &&
+              mitigation::kHighEntropyAslr == PROCESS_CREATION_MITIGATION_POLICY_HIGH_ENTROPY_ASLR_ALWAYS_ON &&
+              mitigation::kStrictHandleChecks == PROCESS_CREATION_MITIGATION_POLICY_STRICT_HANDLE_CHECKS_ALWAYS_ON &&
+              mitigation::kWin32kSystemCallDisable == PROCESS_CREATION_MITIGATION_POLICY_WIN32K_SYSTEM_CALL_DISABLE_ALWAYS_ON &&
+              mitigation::kExtensionPointDisable == PROCESS_CREATION_MITIGATION_POLICY_EXTENSION_POINT_DISABLE_ALWAYS_ON,
+              "mitigation constants must match PROCESS_CREATION_MITIGATION_POLICY_*");
+#if _WIN32_WINNT >= 0x0A00
+static_assert(mitigation::kProhibitDynamicCode == PROCESS_CREATION_MITIGATION_POLICY_PROHIBIT_DYNAMIC_CODE_ALWAYS_ON &&
+              mitigation::kControlFlowGuard == PROCESS_CREATION_MITIGATION_POLICY_CONTROL_FLOW_GUARD_ALWAYS_ON &&
+              mitigation::kBlockNonMicrosoftBinaries == PROCESS_CREATION_MITIGATION_POLICY_BLOCK_NON_MICROSOFT_BINARIES_ALWAYS_ON &&
+              mitigation::kFontDisable == PROCESS_CREATION_MITIGATION_POLICY_FONT_DISABLE_ALWAYS_ON &&
+              mitigation::kImageLoadNoRemote == PROCESS_CREATION_MITIGATION_POLICY_IMAGE_LOAD_NO_REMOTE_ALWAYS_ON &&
+              mitigation::kImageLoadNoLowLabel == PROCESS_CREATION_MITIGATION_POLICY_IMAGE_LOAD_NO_LOW_LABEL_ALWAYS_ON &&
+              mitigation::kImageLoadPreferSystem32 == PROCESS_CREATION_MITIGATION_POLICY_IMAGE_LOAD_PREFER_SYSTEM32_ALWAYS_ON,
+              "mitigation constants must match PROCESS_CREATION_MITIGATION_POLICY_*");
+#endif
+#if defined(PROCESS_CREATION_MITIGATION_POLICY2_SPECULATIVE_STORE_BYPASS_DISABLE_ALWAYS_ON)
+static_assert(mitigation::kLoaderIntegrityContinuity == PROCESS_CREATION_MITIGATION_POLICY2_LOADER_INTEGRITY_CONTINUITY_ALWAYS_ON &&
+              mitigation::kStrictControlFlowGuard == PROCESS_CREATION_MITIGATION_POLICY2_STRICT_CONTROL_FLOW_GUARD_ALWAYS_ON &&
+              mitigation::kModuleTamperingProtection == PROCESS_CREATION_MITIGATION_POLICY2_MODULE_TAMPERING_PROTECTION_ALWAYS_ON &&
+              mitigation::kRestrictIndirectBranchPrediction == PROCESS_CREATION_MITIGATION_POLICY2_RESTRICT_INDIRECT_BRANCH_PREDICTION_ALWAYS_ON &&
+              mitigation::kAllowDowngradeDynamicCode == PROCESS_CREATION_MITIGATION_POLICY2_ALLOW_DOWNGRADE_DYNAMIC_CODE_POLICY_ALWAYS_ON &&
+              mitigation::kSpeculativeStoreBypassDisable == PROCESS_CREATION_MITIGATION_POLICY2_SPECULATIVE_STORE_BYPASS_DISABLE_ALWAYS_ON,
+              "mitigation constants must match PROCESS_CREATION_MITIGATION_POLICY2_*");
+#endif
+static_assert(eMitigationDep == ProcessDEPPolicy &&
+              eMitigationAslr == ProcessASLRPolicy &&
+              eMitigationDynamicCode == ProcessDynamicCodePolicy &&
+              eMitigationStrictHandleCheck == ProcessStrictHandleCheckPolicy &&
+              eMitigationSystemCallDisable == ProcessSystemCallDisablePolicy &&
+              eMitigationExtensionPointDisable == ProcessExtensionPointDisablePolicy &&
+              eMitigationControlFlowGuard == ProcessControlFlowGuardPolicy &&
+              eMitigationSignature == ProcessSignaturePolicy &&
+              eMitigationFontDisable == ProcessFontDisablePolicy &&
+              eMitigationImageLoad == ProcessImageLoadPolicy,
+              "MitigationPolicyKind must match PROCESS_MITIGATION_POLICY");
+static_assert(GetMitigationPolicySize(eMitigationDep) == sizeof(PROCESS_MITIGATION_DEP_POLICY) &&
+              GetMitigationPolicySize(eMitigationAslr) == sizeof(PROCESS_MITIGATION_ASLR_POLICY) &&
+              GetMitigationPolicySize(eMitigationDynamicCode) == sizeof(PROCESS_MITIGATION_DYNAMIC_CODE_POLICY) &&
+              GetMitigationPolicySize(eMitigationSignature) == sizeof(PROCESS_MITIGATION_BINARY_SIGNATURE_POLICY) &&
+              GetMitigationPolicySize(eMitigationImageLoad) == sizeof(PROCESS_MITIGATION_IMAGE_LOAD_POLICY),
+              "GetMitigationPolicySize must match PROCESS_MITIGATION_*_POLICY");
+#if defined(PROCESS_CREATION_MITIGATION_POLICY2_SPECULATIVE_STORE_BYPASS_DISABLE_ALWAYS_ON)
+static_assert(eMitigationSideChannelIsolation == ProcessSideChannelIsolationPolicy,
+              "MitigationPolicyKind must match PROCESS_MITIGATION_POLICY");
+#endif
+static_assert(static_cast<uint32_t>(WindowsSandboxLauncher::eInitNoSeparateWindowStation) ==
+              ePolicyInitNoSeparateWindowStation,
+              "PolicyInitFlag must match WindowsSandboxLauncher::InitFlags");
+
 const std::wstring WindowsSandbox::DESKTOP_NAME = L"moz-sandbox"s;
-const std::wstring_view WindowsSandbox::SWITCH_JOB_HANDLE = L"--job"sv;
+const std::wstring_view WindowsSandbox::SWITCH_STARTUP_BLOCK = L"--startup"sv;
 
 bool
 WindowsSandbox::DropProcessIntegrityLevel()
@@ -47,105 +144,112 @@ WindowsSandbox::DropProcessIntegrityLevel()
   return result;
 }
 
+namespace {
+
+uint64_t
+ElapsedNs(const std::chrono::steady_clock::time_point& aStart)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now() - aStart).count();
+}
+
+struct MitigationSupport
+{
+  decltype(&SetProcessMitigationPolicy) mSetPolicy;
+  // Bit n is set when the OS understands MitigationPolicyKind n
+  uint32_t  mSupportedKinds;
+  uint64_t  mProbeNs;
+};
+
+/**
+ * Determines which runtime mitigation policies this OS supports. A policy
+ * kind is supported if it can be queried. This is only done once per process.
+ */
+const MitigationSupport&
+GetMitigationSupport()
+{
+  static const MitigationSupport sSupport = []() -> MitigationSupport {
+    auto start = std::chrono::steady_clock::now();
+    MitigationSupport support = {};
+    HMODULE kernel32 = ::GetModuleHandleW(L"kernel32.dll");
+    auto pGetProcessMitigationPolicy =
+      reinterpret_cast<decltype(&GetProcessMitigationPolicy)>(
+        ::GetProcAddress(kernel32, "GetProcessMitigationPolicy"));
+    support.mSetPolicy =
+      reinterpret_cast<decltype(&SetProcessMitigationPolicy)>(
+        ::GetProcAddress(kernel32, "SetProcessMitigationPolicy"));
+    if (pGetProcessMitigationPolicy && support.mSetPolicy) {
+      for (auto&& mapping : kMitigationMappings) {
+        const uint32_t kind = mapping.mKind;
+        if (kind == eMitigationCreationOnly ||
+            (support.mSupportedKinds & (1U << kind))) {
+          continue;
+        }
+        DWORD64 buf = 0;
+        if (pGetProcessMitigationPolicy(::GetCurrentProcess(),
+                                        static_cast<PROCESS_MITIGATION_POLICY>(kind),
+                                        &buf, GetMitigationPolicySize(kind))) {
+          support.mSupportedKinds |= 1U << kind;
+        }
+      }
+    }
+    support.mProbeNs = ElapsedNs(start);
+    return support;
+  }();
+  return sSupport;
+}
+
+} // anonymous namespace
+
 bool
-WindowsSandbox::SetMitigations(const DWORD64 aMitigations)
+WindowsSandbox::SetMitigations(const DWORD64 aMitigations,
+                               const DWORD64 aMitigations2)
 {
-  const DWORD64 kDEPPolicies =
-    PROCESS_CREATION_MITIGATION_POLICY_DEP_ENABLE |
-    PROCESS_CREATION_MITIGATION_POLICY_DEP_ATL_THUNK_ENABLE
-    ;
-  const DWORD64 kASLRPolicies =
-    PROCESS_CREATION_MITIGATION_POLICY_FORCE_RELOCATE_IMAGES_ALWAYS_ON_REQ_RELOCS |
-#if defined(_M_X64)
-    PROCESS_CREATION_MITIGATION_POLICY_HIGH_ENTROPY_ASLR_ALWAYS_ON |
-#endif
-    PROCESS_CREATION_MITIGATION_POLICY_BOTTOM_UP_ASLR_ALWAYS_ON
-    ;
+  ZeroMemory(&mMitigationReport, sizeof(mMitigationReport));
+
   // Not all mitigations can be set at runtime
-  const DWORD64 kAvailableMitigations =
-    kDEPPolicies |
-    kASLRPolicies |
-    PROCESS_CREATION_MITIGATION_POLICY_STRICT_HANDLE_CHECKS_ALWAYS_ON |
-    PROCESS_CREATION_MITIGATION_POLICY_WIN32K_SYSTEM_CALL_DISABLE_ALWAYS_ON |
-#if _WIN32_WINNT >= 0x0A00
-    PROCESS_CREATION_MITIGATION_POLICY_BLOCK_NON_MICROSOFT_BINARIES_ALWAYS_ON |
-#endif
-    PROCESS_CREATION_MITIGATION_POLICY_EXTENSION_POINT_DISABLE_ALWAYS_ON
-    ;
-  if ((aMitigations & ~kAvailableMitigations) != 0) {
+  const uint64_t flags[2] = {aMitigations, aMitigations2};
+  MitigationPlan plan;
+  if (!PlanMitigations(flags, sizeof(void*) == 8, plan)) {
     return false;
   }
-  auto pSetProcessMitigationPolicy =
-    reinterpret_cast<decltype(&SetProcessMitigationPolicy)>(::GetProcAddress(::GetModuleHandleW(L"kernel32.dll"),
-          "SetProcessMitigationPolicy"));
-  if (!pSetProcessMitigationPolicy) {
+
+  const MitigationSupport& support = GetMitigationSupport();
+  mMitigationReport.mProbeNs = support.mProbeNs;
+  if (!support.mSetPolicy) {
     // Not available
     return true;
   }
-  BOOL ok = TRUE;
-  if (aMitigations & kDEPPolicies) {
-    PROCESS_MITIGATION_DEP_POLICY depPolicy = {0};
-    if (aMitigations & PROCESS_CREATION_MITIGATION_POLICY_DEP_ENABLE) {
-      depPolicy.Enable = 1;
-    }
-    if (aMitigations & PROCESS_CREATION_MITIGATION_POLICY_DEP_ATL_THUNK_ENABLE) {
-      depPolicy.DisableAtlThunkEmulation = 1;
-    }
-    ok &= pSetProcessMitigationPolicy(ProcessDEPPolicy, &depPolicy,
-                                      sizeof(depPolicy));
-  }
-  if (aMitigations & kASLRPolicies) {
-    PROCESS_MITIGATION_ASLR_POLICY aslrPolicy = {0};
-    if (aMitigations &
-        PROCESS_CREATION_MITIGATION_POLICY_FORCE_RELOCATE_IMAGES_ALWAYS_ON_REQ_RELOCS) {
-      aslrPolicy.EnableForceRelocateImages = 1;
-      aslrPolicy.DisallowStrippedImages = 1;
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t kind = 0; kind < eMitigationKindCount; ++kind) {
+    if (!(plan.mKinds & (1U << kind))) {
+      continue;
     }
-    if (aMitigations &
-        PROCESS_CREATION_MITIGATION_POLICY_BOTTOM_UP_ASLR_ALWAYS_ON) {
-      aslrPolicy.EnableBottomUpRandomization = 1;
+
+    MitigationResult& result =
+      mMitigationReport.mResults[mMitigationReport.mCount++];
+    result.mKind = kind;
+    result.mRuntimeFlags = plan.mRuntimeFlags[kind];
+    if (!(support.mSupportedKinds & (1U << kind))) {
+      result.mError = ERROR_NOT_SUPPORTED;
+      result.mSkipped = true;
+      continue;
     }
-#if defined(_M_X64)
-    if (aMitigations &
-        PROCESS_CREATION_MITIGATION_POLICY_HIGH_ENTROPY_ASLR_ALWAYS_ON) {
-      aslrPolicy.EnableHighEntropy = 1;
+
+    // Every PROCESS_MITIGATION_*_POLICY begins with its DWORD of flags
+    DWORD64 policy = result.mRuntimeFlags;
+    auto policyStart = std::chrono::steady_clock::now();
+    if (!support.mSetPolicy(static_cast<PROCESS_MITIGATION_POLICY>(kind),
+                            &policy, GetMitigationPolicySize(kind))) {
+      result.mError = ::GetLastError();
+      ++mMitigationReport.mFailures;
     }
-#endif
-    ok &= pSetProcessMitigationPolicy(ProcessASLRPolicy, &aslrPolicy,
-                                      sizeof(aslrPolicy));
-  }
-  if (aMitigations &
-      PROCESS_CREATION_MITIGATION_POLICY_STRICT_HANDLE_CHECKS_ALWAYS_ON) {
-    PROCESS_MITIGATION_STRICT_HANDLE_CHECK_POLICY handleChkPolicy = {0};
-    handleChkPolicy.RaiseExceptionOnInvalidHandleReference = 1;
-    handleChkPolicy.HandleExceptionsPermanentlyEnabled = 1;
-    ok &= pSetProcessMitigationPolicy(ProcessStrictHandleCheckPolicy,
-                                      &handleChkPolicy, sizeof(handleChkPolicy));
-  }
-  if (aMitigations &
-      PROCESS_CREATION_MITIGATION_POLICY_WIN32K_SYSTEM_CALL_DISABLE_ALWAYS_ON) {
-    PROCESS_MITIGATION_SYSTEM_CALL_DISABLE_POLICY win32kPolicy = {0};
-    win32kPolicy.DisallowWin32kSystemCalls = 1;
-    ok &= pSetProcessMitigationPolicy(ProcessSystemCallDisablePolicy,
-                                      &win32kPolicy, sizeof(win32kPolicy));
-  }
-#if _WIN32_WINNT >= 0x0A00
-  if (IsWindows10OrGreater() && (aMitigations &
-      PROCESS_CREATION_MITIGATION_POLICY_BLOCK_NON_MICROSOFT_BINARIES_ALWAYS_ON)) {
-    PROCESS_MITIGATION_BINARY_SIGNATURE_POLICY signPolicy = {0};
-    signPolicy.MicrosoftSignedOnly = 1;
-    ok &= pSetProcessMitigationPolicy(ProcessSignaturePolicy,
-                                      &signPolicy, sizeof(signPolicy));
+    result.mDurationNs = ElapsedNs(policyStart);
   }
-#endif
-  if (aMitigations &
-      PROCESS_CREATION_MITIGATION_POLICY_EXTENSION_POINT_DISABLE_ALWAYS_ON) {
-    PROCESS_MITIGATION_EXTENSION_POINT_DISABLE_POLICY dllPolicy = {0};
-    dllPolicy.DisableExtensionPoints = 1;
-    ok &= pSetProcessMitigationPolicy(ProcessExtensionPointDisablePolicy,
-                                      &dllPolicy, sizeof(dllPolicy));
-  }
-  return !!ok;
+  mMitigationReport.mTotalNs = ElapsedNs(start);
+
+  return !mMitigationReport.mFailures;
 }
 
 bool
@@ -163,35 +267,220 @@ WindowsSandbox::ValidateJobHandle(HANDLE aJob)
   return !!ok;
 }
 
+bool
+WindowsSandbox::MapStartupBlock(HANDLE aSection)
+{
+  mStartupSection.reset(aSection);
+  void* view = ::MapViewOfFile(aSection, FILE_MAP_READ, 0, 0,
+                               sizeof(StartupBlock));
+  if (!view) {
+    return false;
+  }
+
+  UniqueMappedFileView<const StartupBlock> uniqueView(
+      reinterpret_cast<const StartupBlock*>(view));
+  if (!StartupBlock::Validate(view, sizeof(StartupBlock))) {
+    return false;
+  }
+
+  mStartupBlock = std::move(uniqueView);
+  return true;
+}
+
+namespace {
+
+uint64_t
+GetTraceTicks()
+{
+  LARGE_INTEGER ticks;
+  ::QueryPerformanceCounter(&ticks);
+  return ticks.QuadPart;
+}
+
+} // anonymous namespace
+
+void
+WindowsSandbox::MapStartupTrace()
+{
+  // Tracing is best effort; the sandbox runs the same without it
+  HANDLE section = GetChannelHandle(eChannelStartupTrace);
+  if (!section) {
+    return;
+  }
+
+  mStartupTrace.reset(reinterpret_cast<StartupTrace*>(
+      ::MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, sizeof(StartupTrace))));
+  ::CloseHandle(section);
+  if (mStartupTrace && mStartupTrace->mMagic != StartupTrace::kMagic) {
+    mStartupTrace.reset();
+  }
+}
+
+bool
+WindowsSandbox::TracePhase(StartupPhase aPhase)
+{
+  if (mStartupTrace) {
+    mStartupTrace->Mark(aPhase, GetTraceTicks());
+  }
+  return true;
+}
+
+bool
+WindowsSandbox::LoadPreloads()
+{
+  // The string pool is null-terminated, so these may be used in place
+  for (uint32_t i = 0; i < mStartupBlock->mPreloadCount; ++i) {
+    auto path = reinterpret_cast<const wchar_t*>(
+                  mStartupBlock->GetPreload(i).data());
+    if (!::LoadLibraryW(path)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+HANDLE
+WindowsSandbox::GetChannelHandle(uint32_t aKind, uint32_t aNth) const
+{
+  if (!mStartupBlock) {
+    return nullptr;
+  }
+
+  const StartupChannel* channel = mStartupBlock->FindChannel(aKind, aNth);
+  if (!channel) {
+    return nullptr;
+  }
+
+  return reinterpret_cast<HANDLE>(static_cast<uintptr_t>(channel->mHandle));
+}
+
+bool
+WindowsSandbox::AttachRingChannel(uint32_t aKind, RingChannel& aChannel,
+                                  uint32_t aNth)
+{
+  const StartupChannel* channel =
+    mStartupBlock ? mStartupBlock->FindChannel(aKind, aNth) : nullptr;
+  if (!channel || !channel->mSize || channel->mSize > SIZE_MAX) {
+    return false;
+  }
+
+  HANDLE section = reinterpret_cast<HANDLE>(
+                     static_cast<uintptr_t>(channel->mHandle));
+  UniqueMappedFileView<void> view(::MapViewOfFile(section,
+                                                  FILE_MAP_READ |
+                                                  FILE_MAP_WRITE, 0, 0,
+                                                  static_cast<SIZE_T>(
+                                                    channel->mSize)));
+  if (!view || !aChannel.Attach(view.get(),
+                                static_cast<size_t>(channel->mSize),
+                                eRingSideSandbox)) {
+    return false;
+  }
+
+  mRingViews.push_back(std::move(view));
+  return true;
+}
+
 bool
 WindowsSandbox::Init(int aArgc, wchar_t* aArgv[])
 {
-  UniqueKernelHandle job;
   for (int i = 1; i < aArgc; ++i) {
-    if (SWITCH_JOB_HANDLE == aArgv[i] && i + 1 < aArgc) {
-      uintptr_t uijob;
+    if (SWITCH_STARTUP_BLOCK == aArgv[i] && i + 1 < aArgc) {
+      uintptr_t uisection;
       std::wistringstream iss(aArgv[++i]);
-      iss >> hex >> uijob;
-      if (!iss) {
+      iss >> hex >> uisection;
+      if (!iss || !MapStartupBlock(reinterpret_cast<HANDLE>(uisection))) {
         return false;
       }
-
-      job.reset(reinterpret_cast<HANDLE>(uijob));
     }
   }
 
-  bool ok = ValidateJobHandle(job.get());
-  ok = ok && OnPrivInit();
-  ok = ok && ::RevertToSelf();
-  ok = ok && DropProcessIntegrityLevel();
-  ok = ok && ::AssignProcessToJobObject(job.get(), ::GetCurrentProcess());
-  ok = ok && SetMitigations(GetDeferredMitigationPolicies());
-  if (!ok) {
-    return ok;
+  if (!mStartupBlock) {
+    return false;
+  }
+
+  MapStartupTrace();
+  TracePhase(ePhaseEntered);
+
+  UniqueKernelHandle job(reinterpret_cast<HANDLE>(
+                           static_cast<uintptr_t>(mStartupBlock->mJobHandle)));
+
+  DWORD64 deferredMitigations = GetDeferredMitigationPolicies() |
+    mStartupBlock->mDeferredMitigationPolicies[0];
+  DWORD64 deferredMitigations2 = GetDeferredMitigationPolicies2() |
+    mStartupBlock->mDeferredMitigationPolicies[1];
+
+  bool ok = ValidateJobHandle(job.get()) && TracePhase(ePhaseJobValidated);
+  ok = ok && LoadPreloads() && TracePhase(ePhasePreloadsLoaded);
+  ok = ok && OnPrivInit() && TracePhase(ePhasePrivInit);
+  ok = ok && ::RevertToSelf() && TracePhase(ePhaseRevertedToSelf);
+  ok = ok && DropProcessIntegrityLevel() && TracePhase(ePhaseIntegrityDropped);
+  ok = ok && ::AssignProcessToJobObject(job.get(), ::GetCurrentProcess()) &&
+       TracePhase(ePhaseJobAssigned);
+  ok = ok && SetMitigations(deferredMitigations, deferredMitigations2) &&
+       TracePhase(ePhaseMitigationsApplied);
+  if (ok) {
+    job.reset();
+    ok = OnInit() && TracePhase(ePhaseReady);
+  }
+
+  if (!ok && mStartupTrace) {
+    mStartupTrace->MarkFailed();
+  }
+  // The launcher keeps its own view of the trace
+  mStartupTrace.reset();
+  return ok;
+}
+
+bool
+WindowsSandbox::RunWorker()
+{
+  UniqueKernelHandle section(GetChannelHandle(eChannelWorkerMailbox));
+  UniqueKernelHandle taskEvent(GetChannelHandle(eChannelWorkerTaskEvent));
+  UniqueKernelHandle resultEvent(GetChannelHandle(eChannelWorkerResultEvent));
+  if (!section || !taskEvent || !resultEvent) {
+    return false;
+  }
+
+  // The view keeps the section alive
+  UniqueMappedFileView<WorkerMailbox> mailbox(
+    reinterpret_cast<WorkerMailbox*>(
+      ::MapViewOfFile(section.get(), FILE_MAP_READ | FILE_MAP_WRITE, 0, 0,
+                      sizeof(WorkerMailbox))));
+  section.reset();
+  if (!mailbox || mailbox->mMagic != WorkerMailbox::kMagic ||
+      mailbox->mVersion != WorkerMailbox::kVersion) {
+    return false;
+  }
+
+  WorkerTaskHandler handler = [this](uint32_t aKind, const uint8_t* aInput,
+                                     uint32_t aInputSize,
+                                     std::vector<uint8_t>& aOutput)
+                                -> WorkerTaskStatus {
+    return OnTask(aKind, aInput, aInputSize, aOutput);
+  };
+
+  while (::WaitForSingleObject(taskEvent.get(), INFINITE) == WAIT_OBJECT_0) {
+    PROCESS_MEMORY_COUNTERS counters = {sizeof(counters)};
+    uint64_t workingSet = 0;
+    if (::GetProcessMemoryInfo(::GetCurrentProcess(), &counters,
+                               sizeof(counters))) {
+      workingSet = counters.WorkingSetSize;
+    }
+
+    switch (ServeWorkerTask(*mailbox, handler, workingSet)) {
+      case eServeShutdown:
+        return true;
+      case eServeRan:
+        ::SetEvent(resultEvent.get());
+        break;
+      case eServeNothing:
+        break;
+    }
   }
 
-  job.reset();
-  return OnInit();
+  return false;
 }
 
 void
@@ -200,6 +489,9 @@ WindowsSandbox::Fini()
   OnFini();
 }
 
+// Launch preparation has at most four independent chains of work
+const unsigned int WindowsSandboxLauncher::kLaunchThreads = 4;
+
 const DWORD64 WindowsSandboxLauncher::DEFAULT_MITIGATION_POLICIES =
   PROCESS_CREATION_MITIGATION_POLICY_DEP_ENABLE |
   PROCESS_CREATION_MITIGATION_POLICY_DEP_ATL_THUNK_ENABLE |
@@ -246,16 +538,29 @@ WindowsSandboxLauncher::CreateTokens(const Sid& aCustomSid,
   }
 
   // Create the restricted token...
-  SID_AND_ATTRIBUTES toRestrict[] = {{mozilla::Sid::GetEveryone()},
-                                     {mozilla::Sid::GetUsers()},
-                                     {mozilla::Sid::GetRestricted()},
-                                     {aLogonSid},
-                                     {const_cast<mozilla::Sid&>(aCustomSid)}};
+  const struct {
+    RestrictingSid  mFlag;
+    PSID            mSid;
+  } kRestrictingSids[] = {
+    {eRestrictEveryone, mozilla::Sid::GetEveryone()},
+    {eRestrictUsers, mozilla::Sid::GetUsers()},
+    {eRestrictRestricted, mozilla::Sid::GetRestricted()},
+    {eRestrictLogon, aLogonSid},
+    {eRestrictCustom, aCustomSid}
+  };
+  SID_AND_ATTRIBUTES toRestrict[sizeof(kRestrictingSids) /
+                                sizeof(kRestrictingSids[0])] = {};
+  DWORD numToRestrict = 0;
+  for (auto&& entry : kRestrictingSids) {
+    if (mRestrictingSids & entry.mFlag) {
+      toRestrict[numToRestrict++].Sid = entry.mSid;
+    }
+  }
   tmp = nullptr;
   bool result = !!::CreateRestrictedToken(processToken.get(),
                                           DISABLE_MAX_PRIVILEGE | SANDBOX_INERT,
                                           toDisable.Count(), toDisable, 0,
-                                          nullptr, ArrayLength(toRestrict),
+                                          nullptr, numToRestrict,
                                           toRestrict, &tmp);
   aRestrictedToken.reset(tmp);
   if (!result) {
@@ -358,9 +663,28 @@ WindowsSandboxLauncher::GetWindowStationName(HWINSTA aWinsta)
   return name;
 }
 
+namespace {
+
+/**
+ * The process window station is process-wide, and so is the DACL of the
+ * desktop that every launcher denies its custom SID. Launches that run
+ * concurrently must not switch the former or update the latter at the same
+ * time.
+ */
+std::mutex&
+GetDesktopMutex()
+{
+  static std::mutex sMutex;
+  return sMutex;
+}
+
+} // anonymous namespace
+
 HDESK
 WindowsSandboxLauncher::CreateDesktop(HWINSTA aWinsta, const Sid& aCustomSid)
 {
+  std::lock_guard<std::mutex> lock(GetDesktopMutex());
+
   // 3. Create a new desktop for the sandbox.
   // 3a. Get the current desktop's DACL and Mandatory Label
   HDESK curDesktop = ::GetThreadDesktop(::GetCurrentThreadId());
@@ -438,6 +762,7 @@ WindowsSandboxLauncher::CreateDesktop(HWINSTA aWinsta, const Sid& aCustomSid)
   if (!result) {
     return nullptr;
   }
+  mParentDesktop = curDesktop;
 
   // 3e. Temporarily set the window station to the sandbox window station
   HWINSTA curWinsta = ::GetProcessWindowStation();
@@ -455,6 +780,9 @@ WindowsSandboxLauncher::CreateDesktop(HWINSTA aWinsta, const Sid& aCustomSid)
   // 3g. Revert to our previous window station
   if (aWinsta) {
     if (!::SetProcessWindowStation(curWinsta)) {
+      if (desktop) {
+        ::CloseDesktop(desktop);
+      }
       return nullptr;
     }
   }
@@ -476,235 +804,1689 @@ WindowsSandboxLauncher::CreateJob(UniqueKernelHandle& aJob)
     return false;
   }
 
-  // 4a. Assign basic limits. This will prevent the sandboxed process from
-  //     creating any new processes.
-  JOBOBJECT_BASIC_LIMIT_INFORMATION basicLimits;
-  ZeroMemory(&basicLimits, sizeof(basicLimits));
-  basicLimits.LimitFlags = JOB_OBJECT_LIMIT_ACTIVE_PROCESS;
-  basicLimits.ActiveProcessLimit = 1;
-  if (!::SetInformationJobObject(aJob.get(), JobObjectBasicLimitInformation,
-                                 &basicLimits, sizeof(basicLimits))) {
+  // 4a. Assign resource limits. By default this only prevents the sandboxed
+  //     process from creating any new processes.
+  if (!ApplyJobLimits(aJob.get())) {
     return false;
   }
 
-  // 4b. Assign all UI limits.
+  // 4b. Assign UI limits. By default, this is all of them.
   // To explicitly grant user handles, call UserHandleGrantAccess
   JOBOBJECT_BASIC_UI_RESTRICTIONS uiLimits;
   ZeroMemory(&uiLimits, sizeof(uiLimits));
-  uiLimits.UIRestrictionsClass = JOB_OBJECT_UILIMIT_DESKTOP |
-                                 JOB_OBJECT_UILIMIT_DISPLAYSETTINGS |
-                                 JOB_OBJECT_UILIMIT_EXITWINDOWS |
-                                 JOB_OBJECT_UILIMIT_GLOBALATOMS |
-                                 JOB_OBJECT_UILIMIT_HANDLES |
-                                 JOB_OBJECT_UILIMIT_READCLIPBOARD |
-                                 JOB_OBJECT_UILIMIT_SYSTEMPARAMETERS |
-                                 JOB_OBJECT_UILIMIT_WRITECLIPBOARD;
+  uiLimits.UIRestrictionsClass = mJobLimitPlan.mUiRestrictions;
   if (!::SetInformationJobObject(aJob.get(), JobObjectBasicUIRestrictions,
                                  &uiLimits, sizeof(uiLimits))) {
     return false;
   }
 
-  return true;
-}
-
-WindowsSandboxLauncher::WindowsSandboxLauncher()
-  : mInitFlags(eInitNormal)
-  , mHasWin8APIs(false)
-  , mHasWin10APIs(false)
-  , mMitigationPolicies(0)
-  , mProcess(nullptr)
-  , mWinsta(nullptr)
-  , mDesktop(nullptr)
-{
-  ZeroMemory(&mInheritableSd, sizeof(mInheritableSd));
-}
-
-WindowsSandboxLauncher::~WindowsSandboxLauncher()
-{
-  if (mProcess) {
-    ::CloseHandle(mProcess);
-  }
-  if (mDesktop) {
-    ::CloseDesktop(mDesktop);
-  }
-  if (mWinsta) {
-    ::CloseWindowStation(mWinsta);
+  // 4c. Route limit violations to a completion port so that they may be
+  //     reported by ProcessJobNotifications.
+  mJobPort.reset(::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1));
+  if (!mJobPort) {
+    return false;
   }
-}
 
-bool
-WindowsSandboxLauncher::Init(InitFlags aInitFlags, DWORD64 aMitigationPolicies)
-{
-  mInitFlags = aInitFlags;
-  OSVERSIONINFO osv = {sizeof(osv)};
-  if (!::GetVersionEx(&osv)) {
+  JOBOBJECT_ASSOCIATE_COMPLETION_PORT portInfo;
+  portInfo.CompletionKey = this;
+  portInfo.CompletionPort = mJobPort.get();
+  if (!::SetInformationJobObject(aJob.get(),
+                                 JobObjectAssociateCompletionPortInformation,
+                                 &portInfo, sizeof(portInfo))) {
     return false;
   }
-  mHasWin8APIs = osv.dwMajorVersion > 6 ||
-          osv.dwMajorVersion == 6 && osv.dwMinorVersion >= 2;
-  mHasWin10APIs = osv.dwMajorVersion >= 10;
-  mMitigationPolicies = aMitigationPolicies;
-#if _WIN32_WINNT >= 0x0A00
-  if (!mHasWin10APIs) {
-    mMitigationPolicies &=
-      ~PROCESS_CREATION_MITIGATION_POLICY_BLOCK_NON_MICROSOFT_BINARIES_ALWAYS_ON;
-  }
-#endif
+
   return true;
 }
 
-bool
-WindowsSandboxLauncher::Wait(unsigned int aTimeoutMs) const
-{
-  return mProcess &&
-         ::WaitForSingleObject(mProcess, aTimeoutMs) == WAIT_OBJECT_0;
-}
+namespace {
 
+/**
+ * The CPU rate control that a job gets at launch: the policy's own cap or
+ * weight if it has one, otherwise its priority class's weight. Returns false
+ * if the CPU rate is not controlled at all.
+ */
 bool
-WindowsSandboxLauncher::IsSandboxRunning() const
+GetBaseCpuRateControl(const JobLimitPlan& aPlan,
+                      const std::optional<SandboxPriority>& aPriority,
+                      JOBOBJECT_CPU_RATE_CONTROL_INFORMATION& aInfo)
 {
-  return mProcess && ::WaitForSingleObject(mProcess, 0) == WAIT_TIMEOUT;
-}
-
-std::optional<std::wstring>
-WindowsSandboxLauncher::GetWorkingDirectory(UniqueKernelHandle& aToken)
-{
-  if (!aToken) {
-    return {};
+  ZeroMemory(&aInfo, sizeof(aInfo));
+  if (aPlan.mCpuRateControlFlags) {
+    aInfo.ControlFlags = aPlan.mCpuRateControlFlags;
+    if (aPlan.mCpuRateControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_WEIGHT_BASED) {
+      aInfo.Weight = aPlan.mCpuRateOrWeight;
+    } else {
+      aInfo.CpuRate = aPlan.mCpuRateOrWeight;
+    }
+    return true;
   }
 
-  PWSTR shWorkingDir = nullptr;
-  if (FAILED(::SHGetKnownFolderPath(FOLDERID_LocalAppDataLow, 0, aToken.get(),
-                                    &shWorkingDir))) {
-    return {};
+  if (aPriority) {
+    aInfo.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE |
+                         JOB_OBJECT_CPU_RATE_CONTROL_WEIGHT_BASED;
+    aInfo.Weight = GetCpuShare(aPriority.value()).mWeight;
+    return true;
   }
-  UniqueCOMAllocatedString shWorkingDirUniq(shWorkingDir);
 
-  return std::make_optional<std::wstring>(shWorkingDir);
+  return false;
 }
 
-std::optional<std::wstring>
-WindowsSandboxLauncher::CreateAbsolutePath(const std::wstring_view aInputPath)
-{
-  wchar_t buf[MAX_PATH + 1] = {};
-  if (!_wfullpath(buf, std::wstring(aInputPath).c_str(), ArrayLength(buf))) {
-    return {};
-  }
-
-  HRESULT hr = ::PathCchAddExtension(buf, ArrayLength(buf), L"exe");
-  if (FAILED(hr)) {
-    return {};
-  }
-
-  return std::make_optional<std::wstring>(buf);
-}
+} // anonymous namespace
 
 bool
-WindowsSandboxLauncher::Launch(const std::wstring_view aExecutablePath,
-                               const std::wstring_view aBaseCmdLine)
+WindowsSandboxLauncher::ApplyJobLimits(HANDLE aJob)
 {
-  auto absExePath = CreateAbsolutePath(aExecutablePath);
-  if (!absExePath) {
+  const JobLimitPlan& plan = mJobLimitPlan;
+
+  JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+  ZeroMemory(&limits, sizeof(limits));
+  limits.BasicLimitInformation.LimitFlags = plan.mLimitFlags;
+  limits.BasicLimitInformation.ActiveProcessLimit = plan.mActiveProcessLimit;
+  limits.BasicLimitInformation.PerProcessUserTimeLimit.QuadPart =
+    plan.mPerProcessUserTimeLimit;
+  limits.BasicLimitInformation.MinimumWorkingSetSize =
+    static_cast<SIZE_T>(plan.mMinimumWorkingSetSize);
+  limits.BasicLimitInformation.MaximumWorkingSetSize =
+    static_cast<SIZE_T>(plan.mMaximumWorkingSetSize);
+  limits.ProcessMemoryLimit = static_cast<SIZE_T>(plan.mProcessMemoryLimit);
+  limits.JobMemoryLimit = static_cast<SIZE_T>(plan.mJobMemoryLimit);
+  // Without group affinity for jobs, only placements in group 0 may be applied
+  if (mPlacement && !mHasWin10APIs) {
+    if (mPlacement->mGroup) {
+      return false;
+    }
+    limits.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_AFFINITY;
+    limits.BasicLimitInformation.Affinity =
+      static_cast<ULONG_PTR>(mPlacement->mAffinity);
+  }
+  if (!::SetInformationJobObject(aJob, JobObjectExtendedLimitInformation,
+                                 &limits, sizeof(limits))) {
     return false;
   }
 
-  // customSid guards against the SetThreadDesktop() security hole
-  mozilla::Sid customSid;
-  if (!customSid.InitCustom()) {
+  if (!ApplyPlacement(aJob)) {
     return false;
   }
 
-  mozilla::Sid logonSid;
-  UniqueKernelHandle restrictedToken;
-  UniqueKernelHandle impersonationToken;
-  if (!CreateTokens(customSid, restrictedToken, impersonationToken, logonSid)) {
+  // The remaining information classes are not available before Windows 8
+  bool needsWin8 = plan.mCpuRateControlFlags || plan.mIoRateControlFlags ||
+                   plan.mNotificationLimitFlags;
+  if (needsWin8 && !mHasWin8APIs) {
     return false;
   }
 
-  if (!(mInitFlags & eInitNoSeparateWindowStation)) {
-    mWinsta = CreateWindowStation();
-    if (!mWinsta) {
+  // Priority classes are a hint, so they are dropped where unsupported
+  JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cpuInfo;
+  if (mHasWin8APIs && GetBaseCpuRateControl(plan, mPriority, cpuInfo)) {
+    if (!::SetInformationJobObject(aJob, JobObjectCpuRateControlInformation,
+                                   &cpuInfo, sizeof(cpuInfo))) {
       return false;
     }
   }
 
-  mDesktop = CreateDesktop(mWinsta, customSid);
-  if (!mDesktop) {
-    return false;
+  if (plan.mIoRateControlFlags) {
+    auto pSetIoRateControlInformationJobObject =
+      reinterpret_cast<decltype(&SetIoRateControlInformationJobObject)>(
+          ::GetProcAddress(::GetModuleHandleW(L"kernel32.dll"),
+                           "SetIoRateControlInformationJobObject"));
+    if (!pSetIoRateControlInformationJobObject) {
+      return false;
+    }
+
+    JOBOBJECT_IO_RATE_CONTROL_INFORMATION ioInfo;
+    ZeroMemory(&ioInfo, sizeof(ioInfo));
+    ioInfo.MaxIops = plan.mIoMaxIops;
+    ioInfo.MaxBandwidth = plan.mIoMaxBandwidth;
+    ioInfo.ControlFlags = plan.mIoRateControlFlags;
+    if (!pSetIoRateControlInformationJobObject(aJob, &ioInfo)) {
+      return false;
+    }
   }
 
-  UniqueKernelHandle job;
-  if (!CreateJob(job)) {
-    return false;
+  if (plan.mNotificationLimitFlags) {
+    JOBOBJECT_NOTIFICATION_LIMIT_INFORMATION notifyInfo;
+    ZeroMemory(&notifyInfo, sizeof(notifyInfo));
+    notifyInfo.LimitFlags = plan.mNotificationLimitFlags;
+    notifyInfo.JobMemoryLimit = plan.mNotifyJobMemoryLimit;
+    notifyInfo.IoReadBytesLimit = plan.mNotifyIoReadBytesLimit;
+    notifyInfo.IoWriteBytesLimit = plan.mNotifyIoWriteBytesLimit;
+    if (!::SetInformationJobObject(aJob, JobObjectNotificationLimitInformation,
+                                   &notifyInfo, sizeof(notifyInfo))) {
+      return false;
+    }
   }
 
-  // 5. Build the command line string
-  wostringstream oss;
-  oss << absExePath.value();
-  oss << L" "sv;
-  oss << aBaseCmdLine;
-  oss << L" "sv;
-  oss << WindowsSandbox::SWITCH_JOB_HANDLE;
-  oss << L" "sv;
-  oss << hex << job.get();
+  return true;
+}
 
-  // 6. Set the working directory. With low integrity levels on Vista most
-  //    directories are inaccessible.
-  auto workingDir = GetWorkingDirectory(restrictedToken);
-  if (!workingDir) {
+bool
+WindowsSandboxLauncher::SetCpuRateCap(uint32_t aCpuRate)
+{
+  if (!mJob || !mHasWin8APIs || !aCpuRate) {
     return false;
   }
 
-  // 7. Initialize the explicit list of handles to inherit (Vista+).
-  bool result = false;
-  DECLARE_UNIQUE_LEN(LPPROC_THREAD_ATTRIBUTE_LIST, attrList);
-  std::unique_ptr<HANDLE[]> inheritableHandles;
-  SIZE_T attrListSize = 0;
+  // The controller may only tighten what the policy allows. A weight cannot
+  // be combined with a cap, so it is suspended while the job is capped.
+  JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cpuInfo;
+  bool hasBase = GetBaseCpuRateControl(mJobLimitPlan, mPriority, cpuInfo);
+  bool baseIsCap = hasBase &&
+                   (cpuInfo.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP);
+  if (aCpuRate < joblimits::kMaxCpuRate &&
+      (!baseIsCap || aCpuRate < cpuInfo.CpuRate)) {
+    ZeroMemory(&cpuInfo, sizeof(cpuInfo));
+    cpuInfo.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE |
+                           JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+    cpuInfo.CpuRate = aCpuRate;
+  }
+  // Otherwise this restores the base, and with none, zeroed flags turn rate
+  // control off again
+  return !!::SetInformationJobObject(mJob.get(),
+                                     JobObjectCpuRateControlInformation,
+                                     &cpuInfo, sizeof(cpuInfo));
+}
 
-  /* PROC_THREAD_ATTRIBUTE_HANDLE_LIST and
-   * PROC_THREAD_ATTRIBUTE_MITIGATION_POLICY
-   */
-  const DWORD attrCount = 2;
-  if (!::InitializeProcThreadAttributeList(nullptr, attrCount, 0,
-                                           &attrListSize) &&
-      GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+bool
+WindowsSandboxLauncher::QueryMemoryTelemetry(MemoryTelemetry& aTelemetry) const
+{
+  if (!mProcess || !mJob) {
     return false;
   }
 
-  ALLOC_UNIQUE_LEN(attrList, attrListSize);
-  if (!::InitializeProcThreadAttributeList(attrList, attrCount, 0,
-                                           &attrListSize)) {
+  PROCESS_MEMORY_COUNTERS_EX counters;
+  if (!::GetProcessMemoryInfo(mProcess,
+        reinterpret_cast<PPROCESS_MEMORY_COUNTERS>(&counters),
+        sizeof(counters))) {
     return false;
   }
 
-  UniqueProcAttributeList listDeleter(attrList);
-  size_t handleCount = mHandlesToInherit.size();
-  inheritableHandles = std::make_unique<HANDLE[]>(handleCount + 2);
-  memcpy(inheritableHandles.get(), &mHandlesToInherit[0],
-         handleCount * sizeof(HANDLE));
-  inheritableHandles[handleCount++] = impersonationToken.get();
-  inheritableHandles[handleCount++] = job.get();
-  result = !!::UpdateProcThreadAttribute(attrList, 0,
-                                         PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
-                                         inheritableHandles.get(),
-                                         handleCount * sizeof(HANDLE), nullptr,
-                                         nullptr);
-  if (!result) {
+  // CPU time is taken from the job so that child processes count as activity
+  JOBOBJECT_BASIC_ACCOUNTING_INFORMATION accounting;
+  if (!::QueryInformationJobObject(mJob.get(),
+                                   JobObjectBasicAccountingInformation,
+                                   &accounting, sizeof(accounting), nullptr)) {
     return false;
   }
 
-  result = !!::UpdateProcThreadAttribute(attrList, 0,
-                                         PROC_THREAD_ATTRIBUTE_MITIGATION_POLICY,
-                                         &mMitigationPolicies,
-                                         sizeof(DWORD64), nullptr, nullptr);
-  if (!result) {
+  aTelemetry.mCommit = counters.PrivateUsage;
+  aTelemetry.mWorkingSet = counters.WorkingSetSize;
+  aTelemetry.mCpuTime = accounting.TotalUserTime.QuadPart +
+                        accounting.TotalKernelTime.QuadPart;
+  aTelemetry.mPageFaults = accounting.TotalPageFaultCount;
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::ApplyMemoryAction(const MemoryAction& aAction)
+{
+  if (!mProcess) {
     return false;
   }
 
-  // 8. Create the process using the restricted token
-  std::wstring desktop;
-  if (mWinsta) {
-    auto winstaName = GetWindowStationName(mWinsta);
+  switch (aAction.mKind) {
+    case eMemoryActionTrim:
+      return !!::SetProcessWorkingSetSize(mProcess, static_cast<SIZE_T>(-1),
+                                          static_cast<SIZE_T>(-1));
+    case eMemoryActionLimit:
+    case eMemoryActionRestore: {
+      // The minimum is left alone; only the maximum becomes a hard limit
+      SIZE_T minimum, maximum;
+      DWORD flags;
+      if (!::GetProcessWorkingSetSizeEx(mProcess, &minimum, &maximum,
+                                        &flags)) {
+        return false;
+      }
+      if (aAction.mKind == eMemoryActionRestore) {
+        return !!::SetProcessWorkingSetSizeEx(mProcess, minimum, maximum,
+                                              QUOTA_LIMITS_HARDWS_MAX_DISABLE);
+      }
+      maximum = static_cast<SIZE_T>(aAction.mWorkingSetLimit);
+      if (maximum <= minimum) {
+        maximum = minimum + 1;
+      }
+      return !!::SetProcessWorkingSetSizeEx(mProcess, minimum, maximum,
+                                            QUOTA_LIMITS_HARDWS_MIN_DISABLE |
+                                            QUOTA_LIMITS_HARDWS_MAX_ENABLE);
+    }
+    default:
+      return false;
+  }
+}
+
+/* static */ bool
+WindowsSandboxLauncher::GetHostMemory(HostMemory& aHost)
+{
+  MEMORYSTATUSEX status;
+  status.dwLength = sizeof(status);
+  if (!::GlobalMemoryStatusEx(&status)) {
+    return false;
+  }
+
+  aHost.mTotal = status.ullTotalPhys;
+  aHost.mAvailable = status.ullAvailPhys;
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::ApplyPlacement(HANDLE aJob)
+{
+  if (!mPlacement || !mHasWin10APIs) {
+    return true;
+  }
+
+  GROUP_AFFINITY affinity;
+  ZeroMemory(&affinity, sizeof(affinity));
+  affinity.Mask = static_cast<KAFFINITY>(mPlacement->mAffinity);
+  affinity.Group = mPlacement->mGroup;
+  return !!::SetInformationJobObject(aJob, JobObjectGroupInformationEx,
+                                     &affinity, sizeof(affinity));
+}
+
+/* static */ bool
+WindowsSandboxLauncher::GetPlacementTopology(PlacementTopology& aTopology)
+{
+  DWORD len = 0;
+  if (::GetLogicalProcessorInformationEx(RelationAll, nullptr, &len) ||
+      ::GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+    return false;
+  }
+
+  auto buf = std::make_unique<BYTE[]>(len);
+  if (!::GetLogicalProcessorInformationEx(RelationAll,
+        reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buf.get()),
+        &len)) {
+    return false;
+  }
+
+  auto forEach = [&](LOGICAL_PROCESSOR_RELATIONSHIP aRelationship,
+                     auto&& aFunc) -> void {
+    for (DWORD offset = 0; offset < len;) {
+      auto info = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(
+                    buf.get() + offset);
+      if (info->Relationship == aRelationship) {
+        aFunc(*info);
+      }
+      offset += info->Size;
+    }
+  };
+
+  // Each core contributes one processor per bit in its group masks
+  PlacementTopology topology;
+  uint32_t core = 0;
+  forEach(RelationProcessorCore,
+          [&](const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX& aInfo) -> void {
+    for (WORD i = 0; i < aInfo.Processor.GroupCount; ++i) {
+      const GROUP_AFFINITY& mask = aInfo.Processor.GroupMask[i];
+      for (uint8_t bit = 0; bit < 64; ++bit) {
+        if (mask.Mask & (static_cast<KAFFINITY>(1) << bit)) {
+          topology.push_back({mask.Group, bit, 0, core});
+        }
+      }
+    }
+    ++core;
+  });
+
+  forEach(RelationNumaNode,
+          [&](const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX& aInfo) -> void {
+    const GROUP_AFFINITY& mask = aInfo.NumaNode.GroupMask;
+    for (auto&& processor : topology) {
+      if (processor.mGroup == mask.Group &&
+          (mask.Mask & (static_cast<KAFFINITY>(1) << processor.mNumber))) {
+        processor.mNode = aInfo.NumaNode.NodeNumber;
+      }
+    }
+  });
+
+  if (topology.empty()) {
+    return false;
+  }
+
+  aTopology = std::move(topology);
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::SetJobLimits(const JobLimits& aLimits)
+{
+  return TranslateJobLimits(aLimits, mJobLimitPlan);
+}
+
+bool
+WindowsSandboxLauncher::ProcessJobNotifications(unsigned int aTimeoutMs)
+{
+  if (!mJobPort) {
+    return false;
+  }
+
+  bool dispatched = false;
+  DWORD timeout = aTimeoutMs;
+  DWORD message;
+  ULONG_PTR key;
+  LPOVERLAPPED overlapped;
+  while (::GetQueuedCompletionStatus(mJobPort.get(), &message, &key,
+                                     &overlapped, timeout)) {
+    // Only wait for the first message; drain whatever else is already queued
+    timeout = 0;
+
+    JobLimitViolation violation = TranslateJobMessage(message);
+    if (violation == eViolationNone) {
+      continue;
+    }
+
+    // For process-level messages the "overlapped" value is the process id
+    JobLimitNotification notification = {
+      violation, static_cast<uint32_t>(reinterpret_cast<uintptr_t>(overlapped)),
+      0};
+    if (violation == eViolationNotificationLimit) {
+      JOBOBJECT_LIMIT_VIOLATION_INFORMATION violationInfo;
+      if (::QueryInformationJobObject(mJob.get(),
+                                      JobObjectLimitViolationInformation,
+                                      &violationInfo, sizeof(violationInfo),
+                                      nullptr)) {
+        notification.mLimitFlags = violationInfo.ViolationLimitFlags;
+      }
+    }
+
+    OnJobLimitViolation(notification);
+    dispatched = true;
+  }
+
+  return dispatched;
+}
+
+bool
+WindowsSandboxLauncher::QueryAccounting(JobAccountingSample& aSample)
+{
+  if (!mJob) {
+    return false;
+  }
+
+  JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION info;
+  if (!::QueryInformationJobObject(mJob.get(),
+                                   JobObjectBasicAndIoAccountingInformation,
+                                   &info, sizeof(info), nullptr)) {
+    return false;
+  }
+
+  // Peak memory usage is only available from the extended limit information
+  JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+  if (!::QueryInformationJobObject(mJob.get(),
+                                   JobObjectExtendedLimitInformation,
+                                   &limits, sizeof(limits), nullptr)) {
+    return false;
+  }
+
+  const JOBOBJECT_BASIC_ACCOUNTING_INFORMATION& basic = info.BasicInfo;
+  aSample.mTotalUserTime = basic.TotalUserTime.QuadPart;
+  aSample.mTotalKernelTime = basic.TotalKernelTime.QuadPart;
+  aSample.mPageFaults = basic.TotalPageFaultCount;
+  aSample.mActiveProcesses = basic.ActiveProcesses;
+  aSample.mReadOperations = info.IoInfo.ReadOperationCount;
+  aSample.mWriteOperations = info.IoInfo.WriteOperationCount;
+  aSample.mReadBytes = info.IoInfo.ReadTransferCount;
+  aSample.mWriteBytes = info.IoInfo.WriteTransferCount;
+  aSample.mOtherBytes = info.IoInfo.OtherTransferCount;
+  aSample.mPeakProcessMemory = limits.PeakProcessMemoryUsed;
+  aSample.mPeakJobMemory = limits.PeakJobMemoryUsed;
+  return true;
+}
+
+WindowsSandboxLauncher::WindowsSandboxLauncher()
+  : mInitFlags(eInitNormal)
+  , mHasWin8APIs(false)
+  , mHasWin10APIs(false)
+  , mMitigationPolicies{0, 0}
+  , mDeferredMitigationPolicies{0, 0}
+  , mRestrictingSids(eRestrictAll)
+  , mAdmission(nullptr)
+  , mAdmissionTimeoutMs(0)
+  , mProcess(nullptr)
+  , mWinsta(nullptr)
+  , mDesktop(nullptr)
+  , mParentDesktop(nullptr)
+{
+  ZeroMemory(&mInheritableSd, sizeof(mInheritableSd));
+}
+
+WindowsSandboxLauncher::~WindowsSandboxLauncher()
+{
+  if (mProcess) {
+    ::CloseHandle(mProcess);
+  }
+  if (mDesktop) {
+    ::CloseDesktop(mDesktop);
+  }
+  if (mWinsta) {
+    ::CloseWindowStation(mWinsta);
+  }
+}
+
+bool
+WindowsSandboxLauncher::Init(InitFlags aInitFlags, DWORD64 aMitigationPolicies,
+                             DWORD64 aMitigationPolicies2)
+{
+  mInitFlags = aInitFlags;
+  OSVERSIONINFO osv = {sizeof(osv)};
+  if (!::GetVersionEx(&osv)) {
+    return false;
+  }
+  mHasWin8APIs = osv.dwMajorVersion > 6 ||
+          osv.dwMajorVersion == 6 && osv.dwMinorVersion >= 2;
+  mHasWin10APIs = osv.dwMajorVersion >= 10;
+  mMitigationPolicies[0] = aMitigationPolicies;
+  mMitigationPolicies[1] = aMitigationPolicies2;
+#if _WIN32_WINNT >= 0x0A00
+  if (!mHasWin10APIs) {
+    mMitigationPolicies[0] &=
+      ~PROCESS_CREATION_MITIGATION_POLICY_BLOCK_NON_MICROSOFT_BINARIES_ALWAYS_ON;
+    // Older versions reject the second word outright
+    mMitigationPolicies[1] = 0;
+  }
+#endif
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::Init(const PolicyRecord& aPolicy)
+{
+  if ((aPolicy.mRestrictingSids & eRestrictRequired) != eRestrictRequired) {
+    return false;
+  }
+
+  JobLimits limits;
+  aPolicy.GetJobLimits(limits);
+  if (!SetJobLimits(limits)) {
+    return false;
+  }
+
+  InitFlags initFlags = eInitNormal;
+  if (aPolicy.mInitFlags & ePolicyInitNoSeparateWindowStation) {
+    initFlags = eInitNoSeparateWindowStation;
+  }
+  if (!Init(initFlags, aPolicy.mMitigationPolicies[0],
+            aPolicy.mMitigationPolicies[1])) {
+    return false;
+  }
+
+  SetDeferredMitigationPolicies(aPolicy.mDeferredMitigationPolicies[0],
+                                aPolicy.mDeferredMitigationPolicies[1]);
+  mRestrictingSids = aPolicy.mRestrictingSids;
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::Init(const CompiledSandboxPolicy& aPolicy)
+{
+  InitFlags initFlags = eInitNormal;
+  if (aPolicy.mInitFlags & ePolicyInitNoSeparateWindowStation) {
+    initFlags = eInitNoSeparateWindowStation;
+  }
+  if (!Init(initFlags, aPolicy.mMitigationPolicies[0],
+            aPolicy.mMitigationPolicies[1])) {
+    return false;
+  }
+
+  mJobLimitPlan = aPolicy.mJobLimitPlan;
+  SetDeferredMitigationPolicies(aPolicy.mDeferredMitigationPolicies[0],
+                                aPolicy.mDeferredMitigationPolicies[1]);
+  mRestrictingSids = aPolicy.mRestrictingSids;
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::AddChannel(uint32_t aKind, HANDLE aHandle,
+                                   uint64_t aSize, uint32_t aFlags)
+{
+  if (!aHandle || mChannels.size() >= kMaxPersistentChannels) {
+    return false;
+  }
+
+  StartupChannel channel = {aKind, aFlags,
+                            reinterpret_cast<uintptr_t>(aHandle), aSize};
+  mChannels.push_back(channel);
+  AddHandleToInherit(aHandle);
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::AddPreload(const std::wstring_view aLibPath)
+{
+  if (aLibPath.empty() || mPreloads.size() >= StartupBlock::kMaxPreloads) {
+    return false;
+  }
+
+  mPreloads.emplace_back(aLibPath);
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::Wait(unsigned int aTimeoutMs) const
+{
+  return mProcess &&
+         ::WaitForSingleObject(mProcess, aTimeoutMs) == WAIT_OBJECT_0;
+}
+
+bool
+WindowsSandboxLauncher::IsSandboxRunning() const
+{
+  return mProcess && ::WaitForSingleObject(mProcess, 0) == WAIT_TIMEOUT;
+}
+
+namespace {
+
+class WindowsTeardownBackend final : public TeardownBackend
+{
+public:
+  bool TerminateJob(uintptr_t aJob) override
+  {
+    return !!::TerminateJobObject(reinterpret_cast<HANDLE>(aJob),
+                                  ERROR_PROCESS_ABORTED);
+  }
+
+  size_t WaitForExit(const std::vector<uintptr_t>& aProcesses,
+                     uint32_t aTimeoutMs) override
+  {
+    const ULONGLONG deadline = ::GetTickCount64() + aTimeoutMs;
+    size_t stillRunning = 0;
+    for (size_t first = 0; first < aProcesses.size();
+         first += MAXIMUM_WAIT_OBJECTS) {
+      DWORD count = static_cast<DWORD>(
+        std::min<size_t>(MAXIMUM_WAIT_OBJECTS, aProcesses.size() - first));
+      const HANDLE* batch =
+        reinterpret_cast<const HANDLE*>(&aProcesses[first]);
+
+      ULONGLONG now = ::GetTickCount64();
+      DWORD remaining = now < deadline ? static_cast<DWORD>(deadline - now) : 0;
+      DWORD result = ::WaitForMultipleObjects(count, batch, TRUE, remaining);
+      if (result >= WAIT_OBJECT_0 && result < WAIT_OBJECT_0 + count) {
+        continue;
+      }
+      for (DWORD i = 0; i < count; ++i) {
+        if (::WaitForSingleObject(batch[i], 0) != WAIT_OBJECT_0) {
+          ++stillRunning;
+        }
+      }
+    }
+    return stillRunning;
+  }
+
+  bool RevertDesktopAces(uintptr_t aDesktop,
+                         const std::vector<const SidBytes*>& aSids) override
+  {
+    // Launches may be adding their own deny ACEs to the same DACL
+    std::lock_guard<std::mutex> lock(GetDesktopMutex());
+    HDESK desktop = reinterpret_cast<HDESK>(aDesktop);
+    SECURITY_INFORMATION secInfo = DACL_SECURITY_INFORMATION;
+    DWORD sdSize = 0;
+    if (!::GetUserObjectSecurity(desktop, &secInfo, nullptr, 0, &sdSize) &&
+        ::GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+      return false;
+    }
+    auto sd = std::make_unique<BYTE[]>(sdSize);
+    if (!::GetUserObjectSecurity(desktop, &secInfo, sd.get(), sdSize,
+                                 &sdSize)) {
+      return false;
+    }
+
+    BOOL present = FALSE;
+    BOOL defaulted = FALSE;
+    PACL dacl = nullptr;
+    if (!::GetSecurityDescriptorDacl(sd.get(), &present, &dacl, &defaulted)) {
+      return false;
+    }
+    if (!present || !dacl) {
+      return true;
+    }
+
+    ACL_SIZE_INFORMATION sizeInfo;
+    if (!::GetAclInformation(dacl, &sizeInfo, sizeof(sizeInfo),
+                             AclSizeInformation)) {
+      return false;
+    }
+
+    // Copy every ACE except the deny ACEs for the sandboxes' custom SIDs
+    auto newAclBuf = std::make_unique<BYTE[]>(sizeInfo.AclBytesInUse);
+    PACL newAcl = reinterpret_cast<PACL>(newAclBuf.get());
+    if (!::InitializeAcl(newAcl, sizeInfo.AclBytesInUse, dacl->AclRevision)) {
+      return false;
+    }
+    bool removed = false;
+    for (DWORD i = 0; i < sizeInfo.AceCount; ++i) {
+      LPVOID ace = nullptr;
+      if (!::GetAce(dacl, i, &ace)) {
+        return false;
+      }
+      auto header = static_cast<PACE_HEADER>(ace);
+      if (header->AceType == ACCESS_DENIED_ACE_TYPE) {
+        PSID aceSid = &static_cast<PACCESS_DENIED_ACE>(ace)->SidStart;
+        bool isSandboxSid = std::any_of(aSids.begin(), aSids.end(),
+                                        [aceSid](const SidBytes* aSid) -> bool {
+          return ::EqualSid(aceSid, const_cast<uint8_t*>(aSid->data()));
+        });
+        if (isSandboxSid) {
+          removed = true;
+          continue;
+        }
+      }
+      if (!::AddAce(newAcl, dacl->AclRevision, MAXDWORD, ace,
+                    header->AceSize)) {
+        return false;
+      }
+    }
+    if (!removed) {
+      return true;
+    }
+
+    SECURITY_DESCRIPTOR newSd;
+    if (!::InitializeSecurityDescriptor(&newSd, SECURITY_DESCRIPTOR_REVISION) ||
+        !::SetSecurityDescriptorDacl(&newSd, TRUE, newAcl, FALSE)) {
+      return false;
+    }
+    secInfo = DACL_SECURITY_INFORMATION;
+    return !!::SetUserObjectSecurity(desktop, &secInfo, &newSd);
+  }
+
+  size_t CloseHandles(const TeardownHandle* aHandles, size_t aCount) override
+  {
+    size_t failures = 0;
+    for (size_t i = 0; i < aCount; ++i) {
+      BOOL ok = FALSE;
+      switch (aHandles[i].mKind) {
+        case eTeardownHandleKernel:
+          ok = ::CloseHandle(reinterpret_cast<HANDLE>(aHandles[i].mValue));
+          break;
+        case eTeardownHandleDesktop:
+          ok = ::CloseDesktop(reinterpret_cast<HDESK>(aHandles[i].mValue));
+          break;
+        case eTeardownHandleWindowStation:
+          ok = ::CloseWindowStation(
+                 reinterpret_cast<HWINSTA>(aHandles[i].mValue));
+          break;
+        default:
+          break;
+      }
+      failures += !ok;
+    }
+    return failures;
+  }
+};
+
+} // anonymous namespace
+
+void
+WindowsSandboxLauncher::ReleaseForTeardown(SandboxTeardown& aTeardown)
+{
+  TeardownTarget target;
+  auto addHandle = [&target](uintptr_t aValue,
+                             TeardownHandleKind aKind) -> void {
+    if (aValue) {
+      target.mHandles.push_back(TeardownHandle{aValue, aKind});
+    }
+  };
+
+  target.mJob = reinterpret_cast<uintptr_t>(mJob.get());
+  target.mProcess = reinterpret_cast<uintptr_t>(mProcess);
+  addHandle(reinterpret_cast<uintptr_t>(mJob.release()),
+            eTeardownHandleKernel);
+  addHandle(reinterpret_cast<uintptr_t>(mJobPort.release()),
+            eTeardownHandleKernel);
+  addHandle(reinterpret_cast<uintptr_t>(mProcess), eTeardownHandleKernel);
+  addHandle(reinterpret_cast<uintptr_t>(mDesktop), eTeardownHandleDesktop);
+  addHandle(reinterpret_cast<uintptr_t>(mWinsta),
+            eTeardownHandleWindowStation);
+  mProcess = nullptr;
+  mDesktop = nullptr;
+  mWinsta = nullptr;
+  mStartupTrace.reset();
+
+  if (mParentDesktop && mCustomSid.IsValid()) {
+    const uint8_t* sid = static_cast<const uint8_t*>(
+                           static_cast<PSID>(mCustomSid));
+    target.mParentDesktop = reinterpret_cast<uintptr_t>(mParentDesktop);
+    target.mDesktopAceSid.assign(sid, sid + ::GetLengthSid(mCustomSid));
+    mParentDesktop = nullptr;
+  }
+
+  aTeardown.Add(std::move(target));
+}
+
+/* static */ bool
+WindowsSandboxLauncher::Teardown(
+    const std::vector<WindowsSandboxLauncher*>& aLaunchers,
+    uint32_t aTimeoutMs, TeardownReport& aReport)
+{
+  SandboxTeardown teardown;
+  for (WindowsSandboxLauncher* launcher : aLaunchers) {
+    launcher->ReleaseForTeardown(teardown);
+  }
+
+  WindowsTeardownBackend backend;
+  return teardown.Run(backend, aTimeoutMs, aReport);
+}
+
+namespace {
+
+// Shared by every launcher in the process
+ResolverCache&
+GetResolverCache()
+{
+  static ResolverCache sCache;
+  return sCache;
+}
+
+std::optional<std::wstring>
+GetTokenUserSid(HANDLE aToken)
+{
+  DWORD len = 0;
+  if (::GetTokenInformation(aToken, TokenUser, nullptr, 0, &len) ||
+      ::GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+    return {};
+  }
+
+  auto buf = std::make_unique<BYTE[]>(len);
+  if (!::GetTokenInformation(aToken, TokenUser, buf.get(), len, &len)) {
+    return {};
+  }
+
+  PWSTR sidStr = nullptr;
+  if (!::ConvertSidToStringSidW(
+        reinterpret_cast<PTOKEN_USER>(buf.get())->User.Sid, &sidStr)) {
+    return {};
+  }
+
+  std::wstring result(sidStr);
+  ::LocalFree(sidStr);
+  return result;
+}
+
+std::optional<std::wstring>
+ResolveWorkingDirectory(HANDLE aToken)
+{
+  PWSTR shWorkingDir = nullptr;
+  if (FAILED(::SHGetKnownFolderPath(FOLDERID_LocalAppDataLow, 0, aToken,
+                                    &shWorkingDir))) {
+    return {};
+  }
+  UniqueCOMAllocatedString shWorkingDirUniq(shWorkingDir);
+
+  return std::make_optional<std::wstring>(shWorkingDir);
+}
+
+std::optional<std::wstring>
+GetCurrentDirectoryString()
+{
+  DWORD len = ::GetCurrentDirectoryW(0, nullptr);
+  if (!len) {
+    return {};
+  }
+
+  std::wstring curDir(len, L'\0');
+  len = ::GetCurrentDirectoryW(len, &curDir[0]);
+  if (!len || len >= curDir.size()) {
+    return {};
+  }
+  curDir.resize(len);
+  return curDir;
+}
+
+// The per-drive current directories live in "=C:" style variables
+std::optional<std::wstring>
+GetDriveDirectory(wchar_t aDrive)
+{
+  const wchar_t name[] = {L'=', aDrive, L':', L'\0'};
+  DWORD len = ::GetEnvironmentVariableW(name, nullptr, 0);
+  if (!len) {
+    return {};
+  }
+
+  std::wstring dir(len, L'\0');
+  len = ::GetEnvironmentVariableW(name, &dir[0], len);
+  if (!len || len >= dir.size()) {
+    return {};
+  }
+  dir.resize(len);
+  return dir;
+}
+
+std::optional<std::wstring>
+ResolveAbsolutePath(std::wstring_view aInputPath, std::wstring_view aCurDir)
+{
+  PathContext context;
+  context.mCurrentDirectory = aCurDir;
+  context.mDriveDirectory = &GetDriveDirectory;
+
+  std::wstring result;
+  if (!CanonicalizePath(aInputPath, context, result,
+                        eCanonDefaultExtension | eCanonLongPathPrefix)) {
+    return {};
+  }
+  return result;
+}
+
+// The restricted token keeps the launcher's user, so its known folders are the
+// same as the launcher's and may be shared between launches.
+std::optional<std::wstring>
+GetCachedWorkingDirectory(HANDLE aToken)
+{
+  auto userSid = GetTokenUserSid(aToken);
+  if (!userSid) {
+    return ResolveWorkingDirectory(aToken);
+  }
+
+  return GetResolverCache().GetWorkingDirectory(userSid.value(),
+    [aToken]() -> std::optional<std::wstring> {
+      return ResolveWorkingDirectory(aToken);
+    });
+}
+
+std::optional<std::wstring>
+GetCachedAbsolutePath(const std::wstring_view aInputPath)
+{
+  auto curDir = GetCurrentDirectoryString();
+  if (!curDir) {
+    return {};
+  }
+
+  // Relative paths depend upon the current directory, so it is part of the
+  // key. '|' may not appear in either path.
+  std::wstring key(std::move(curDir.value()));
+  const size_t curDirLen = key.size();
+  key += L'|';
+  key.append(aInputPath.data(), aInputPath.size());
+
+  return GetResolverCache().GetAbsolutePath(key,
+    [&]() -> std::optional<std::wstring> {
+      std::wstring_view keyView(key);
+      return ResolveAbsolutePath(keyView.substr(curDirLen + 1),
+                                 keyView.substr(0, curDirLen));
+    });
+}
+
+} // anonymous namespace
+
+std::optional<std::wstring>
+WindowsSandboxLauncher::GetWorkingDirectory(UniqueKernelHandle& aToken)
+{
+  if (!aToken) {
+    return {};
+  }
+
+  return GetCachedWorkingDirectory(aToken.get());
+}
+
+std::optional<std::wstring>
+WindowsSandboxLauncher::CreateAbsolutePath(const std::wstring_view aInputPath)
+{
+  return GetCachedAbsolutePath(aInputPath);
+}
+
+/* static */ bool
+WindowsSandboxLauncher::WarmResolverCache(
+    const std::wstring_view aExecutablePath)
+{
+  HANDLE processToken = nullptr;
+  if (!::OpenProcessToken(::GetCurrentProcess(),
+                          TOKEN_QUERY | TOKEN_IMPERSONATE | TOKEN_DUPLICATE,
+                          &processToken)) {
+    return false;
+  }
+  UniqueKernelHandle token(processToken);
+
+  if (!GetCachedWorkingDirectory(token.get())) {
+    return false;
+  }
+
+  return aExecutablePath.empty() || !!GetCachedAbsolutePath(aExecutablePath);
+}
+
+/* static */ void
+WindowsSandboxLauncher::InvalidateResolverCache()
+{
+  GetResolverCache().InvalidateAll();
+}
+
+bool
+WindowsSandboxLauncher::CreateStartupBlock(HANDLE aJob, HANDLE aTraceSection,
+                                           UniqueKernelHandle& aSection)
+{
+  // The section is created non-inheritable and writable; the sandbox only
+  // ever receives a read-only duplicate of it.
+  UniqueKernelHandle section(::CreateFileMapping(INVALID_HANDLE_VALUE, nullptr,
+                                                 PAGE_READWRITE, 0,
+                                                 sizeof(StartupBlock),
+                                                 nullptr));
+  if (!section) {
+    return false;
+  }
+
+  UniqueMappedFileView<StartupBlock> block(reinterpret_cast<StartupBlock*>(
+      ::MapViewOfFile(section.get(), FILE_MAP_WRITE, 0, 0,
+                      sizeof(StartupBlock))));
+  if (!block) {
+    return false;
+  }
+
+  StartupBlockBuilder builder(*block);
+  builder.SetJobHandle(reinterpret_cast<uintptr_t>(aJob));
+  builder.SetInitFlags(mInitFlags);
+  builder.SetMitigationPolicies(mMitigationPolicies[0], mMitigationPolicies[1]);
+  builder.SetDeferredMitigationPolicies(mDeferredMitigationPolicies[0],
+                                        mDeferredMitigationPolicies[1]);
+  for (auto&& preload : mPreloads) {
+    std::u16string_view path(reinterpret_cast<const char16_t*>(preload.c_str()),
+                             preload.length());
+    if (!builder.AddPreload(path)) {
+      return false;
+    }
+  }
+  for (auto&& channel : mChannels) {
+    if (!builder.AddChannel(channel.mKind, channel.mHandle, channel.mSize,
+                            channel.mFlags)) {
+      return false;
+    }
+  }
+  // The trace belongs to this launch only, so it is not in mChannels
+  if (aTraceSection &&
+      !builder.AddChannel(eChannelStartupTrace,
+                          reinterpret_cast<uintptr_t>(aTraceSection),
+                          sizeof(StartupTrace))) {
+    return false;
+  }
+  builder.Finish();
+  block.reset();
+
+  HANDLE readOnlySection = nullptr;
+  if (!::DuplicateHandle(::GetCurrentProcess(), section.get(),
+                         ::GetCurrentProcess(), &readOnlySection,
+                         FILE_MAP_READ, TRUE, 0)) {
+    return false;
+  }
+
+  aSection.reset(readOnlySection);
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::CreateStartupTrace(UniqueKernelHandle& aSection)
+{
+  UniqueKernelHandle section(::CreateFileMapping(INVALID_HANDLE_VALUE, nullptr,
+                                                 PAGE_READWRITE, 0,
+                                                 sizeof(StartupTrace),
+                                                 nullptr));
+  if (!section) {
+    return false;
+  }
+
+  mStartupTrace.reset(reinterpret_cast<StartupTrace*>(
+      ::MapViewOfFile(section.get(), FILE_MAP_WRITE, 0, 0,
+                      sizeof(StartupTrace))));
+  if (!mStartupTrace) {
+    return false;
+  }
+
+  LARGE_INTEGER frequency;
+  ::QueryPerformanceFrequency(&frequency);
+  mStartupTrace->Init(frequency.QuadPart);
+
+  // The sandbox may write to the trace but cannot resize or remap it
+  HANDLE childSection = nullptr;
+  if (!::DuplicateHandle(::GetCurrentProcess(), section.get(),
+                         ::GetCurrentProcess(), &childSection,
+                         FILE_MAP_READ | FILE_MAP_WRITE, TRUE, 0)) {
+    return false;
+  }
+
+  aSection.reset(childSection);
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::EnableWorkerMode()
+{
+  // The mailbox and both events are passed as channels
+  if (mWorkerMailbox || mProcess ||
+      mChannels.size() + 3 > kMaxPersistentChannels) {
+    return false;
+  }
+
+  UniqueKernelHandle section(::CreateFileMapping(INVALID_HANDLE_VALUE, nullptr,
+                                                 PAGE_READWRITE, 0,
+                                                 sizeof(WorkerMailbox),
+                                                 nullptr));
+  UniqueKernelHandle taskEvent(::CreateEvent(nullptr, FALSE, FALSE, nullptr));
+  UniqueKernelHandle resultEvent(::CreateEvent(nullptr, FALSE, FALSE,
+                                               nullptr));
+  if (!section || !taskEvent || !resultEvent) {
+    return false;
+  }
+
+  UniqueMappedFileView<WorkerMailbox> mailbox(
+    reinterpret_cast<WorkerMailbox*>(
+      ::MapViewOfFile(section.get(), FILE_MAP_WRITE, 0, 0,
+                      sizeof(WorkerMailbox))));
+  if (!mailbox) {
+    return false;
+  }
+  mailbox->Init();
+
+  // The worker may only wait for tasks and signal results
+  struct ChildHandle
+  {
+    uint32_t  mKind;
+    HANDLE    mHandle;
+    DWORD     mAccess;
+    uint64_t  mSize;
+  } const childHandles[] = {
+    {eChannelWorkerMailbox, section.get(), FILE_MAP_READ | FILE_MAP_WRITE,
+     sizeof(WorkerMailbox)},
+    {eChannelWorkerTaskEvent, taskEvent.get(), SYNCHRONIZE, 0},
+    {eChannelWorkerResultEvent, resultEvent.get(), EVENT_MODIFY_STATE, 0},
+  };
+  std::vector<UniqueKernelHandle> duplicates;
+  for (auto&& childHandle : childHandles) {
+    HANDLE duplicate = nullptr;
+    if (!::DuplicateHandle(::GetCurrentProcess(), childHandle.mHandle,
+                           ::GetCurrentProcess(), &duplicate,
+                           childHandle.mAccess, TRUE, 0)) {
+      return false;
+    }
+    duplicates.emplace_back(duplicate);
+    if (!AddChannel(childHandle.mKind, duplicate, childHandle.mSize)) {
+      return false;
+    }
+  }
+
+  mWorkerMailbox = std::move(mailbox);
+  mWorkerTaskEvent = std::move(taskEvent);
+  mWorkerResultEvent = std::move(resultEvent);
+  mWorkerChildHandles = std::move(duplicates);
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::SignalWorkerTask()
+{
+  return mWorkerTaskEvent && !!::SetEvent(mWorkerTaskEvent.get());
+}
+
+bool
+WindowsSandboxLauncher::WaitForWorkerResult(uint32_t aTimeoutMs)
+{
+  if (!mWorkerResultEvent || !mProcess) {
+    return false;
+  }
+
+  HANDLE handles[] = {mWorkerResultEvent.get(), mProcess};
+  return ::WaitForMultipleObjects(static_cast<DWORD>(ArrayLength(handles)),
+                                  handles, FALSE, aTimeoutMs) ==
+         WAIT_OBJECT_0;
+}
+
+void
+WindowsSandboxLauncher::ShutdownWorker(uint32_t aTimeoutMs)
+{
+  if (!mWorkerMailbox || !mProcess) {
+    return;
+  }
+
+  if (RequestWorkerShutdown(*mWorkerMailbox) && SignalWorkerTask() &&
+      ::WaitForSingleObject(mProcess, aTimeoutMs) == WAIT_OBJECT_0) {
+    return;
+  }
+  ::TerminateProcess(mProcess, 1);
+}
+
+namespace {
+
+/**
+ * Completes an AsyncOperation once one of a set of handles is signaled or a
+ * timeout elapses, using one thread pool wait per handle. Whichever of the
+ * wait callbacks or the cancel handler settles the operation releases the
+ * waits and deletes the HandleWaiter.
+ */
+template <typename T>
+class HandleWaiter final
+{
+public:
+  // aSignaled is the signaled handle, or null after a timeout or failure
+  typedef std::function<T(std::optional<size_t> aIndex, HANDLE aSignaled)>
+    Translator;
+
+  static void Start(const AsyncOperation<T>& aOperation,
+                    std::initializer_list<HANDLE> aHandles, DWORD aTimeoutMs,
+                    Translator&& aTranslate)
+  {
+    auto waiter = new HandleWaiter(aOperation, std::move(aTranslate));
+    for (HANDLE handle : aHandles) {
+      // The caller's handles may be closed while we wait
+      HANDLE dup;
+      if (!::DuplicateHandle(::GetCurrentProcess(), handle,
+                             ::GetCurrentProcess(), &dup, 0, FALSE,
+                             DUPLICATE_SAME_ACCESS)) {
+        waiter->Fail();
+        return;
+      }
+      waiter->mSlots.emplace_back(new Slot{waiter, waiter->mSlots.size(),
+                                           UniqueKernelHandle(dup), nullptr});
+      Slot* slot = waiter->mSlots.back().get();
+      slot->mWait = ::CreateThreadpoolWait(&HandleWaiter::OnWait, slot,
+                                           nullptr);
+      if (!slot->mWait) {
+        waiter->Fail();
+        return;
+      }
+    }
+
+    // Relative timeouts are negative, in 100ns units
+    ULARGE_INTEGER timeout;
+    timeout.QuadPart = static_cast<ULONGLONG>(
+                         -static_cast<LONGLONG>(aTimeoutMs) * 10000LL);
+    FILETIME fileTime = {timeout.LowPart, timeout.HighPart};
+    for (auto&& slot : waiter->mSlots) {
+      ::SetThreadpoolWait(slot->mWait, slot->mHandle.get(),
+                          aTimeoutMs == INFINITE ? nullptr : &fileTime);
+    }
+
+    // If a wait has already settled the operation, waiter may be gone, but
+    // the handler will then never run
+    aOperation.SetCancelHandler([waiter]() -> void {
+      waiter->Release(nullptr);
+    });
+  }
+
+private:
+  struct Slot
+  {
+    HandleWaiter*       mOwner;
+    size_t              mIndex;
+    UniqueKernelHandle  mHandle;
+    PTP_WAIT            mWait;
+  };
+
+  HandleWaiter(const AsyncOperation<T>& aOperation, Translator&& aTranslate)
+    : mOperation(aOperation)
+    , mTranslate(std::move(aTranslate))
+  {}
+
+  static void CALLBACK OnWait(PTP_CALLBACK_INSTANCE aInstance, PVOID aContext,
+                              PTP_WAIT aWait, TP_WAIT_RESULT aResult)
+  {
+    auto slot = static_cast<Slot*>(aContext);
+    HandleWaiter* waiter = slot->mOwner;
+    bool signaled = aResult == WAIT_OBJECT_0;
+    T value = waiter->mTranslate(
+      signaled ? std::optional<size_t>(slot->mIndex) : std::nullopt,
+      signaled ? slot->mHandle.get() : nullptr);
+    // Otherwise another wait or the cancel handler owns the waiter, and waits
+    // for this callback before releasing it
+    if (waiter->mOperation.Complete(std::move(value))) {
+      waiter->Release(aWait);
+    }
+  }
+
+  void Fail()
+  {
+    mOperation.Complete(mTranslate(std::nullopt, nullptr));
+    Release(nullptr);
+  }
+
+  // aCurrentWait is the wait whose callback is running on this thread
+  void Release(PTP_WAIT aCurrentWait)
+  {
+    for (auto&& slot : mSlots) {
+      if (!slot->mWait) {
+        continue;
+      }
+      if (slot->mWait != aCurrentWait) {
+        ::SetThreadpoolWait(slot->mWait, nullptr, nullptr);
+        ::WaitForThreadpoolWaitCallbacks(slot->mWait, TRUE);
+      }
+      // Callbacks may close their own wait
+      ::CloseThreadpoolWait(slot->mWait);
+    }
+    delete this;
+  }
+
+  AsyncOperation<T>                   mOperation;
+  Translator                          mTranslate;
+  std::vector<std::unique_ptr<Slot>>  mSlots;
+};
+
+struct AsyncLaunch
+{
+  AsyncOperation<bool>    mOperation;
+  WindowsSandboxLauncher* mLauncher;
+  std::wstring            mExecutablePath;
+  std::wstring            mBaseCmdLine;
+};
+
+void CALLBACK
+RunAsyncLaunch(PTP_CALLBACK_INSTANCE aInstance, PVOID aContext)
+{
+  std::unique_ptr<AsyncLaunch> launch(static_cast<AsyncLaunch*>(aContext));
+  // Nothing is waiting for a cancelled launch
+  if (launch->mOperation.IsDone()) {
+    return;
+  }
+  launch->mOperation.Complete(
+    launch->mLauncher->Launch(launch->mExecutablePath, launch->mBaseCmdLine));
+}
+
+void CALLBACK
+ResumeCoroutine(PTP_CALLBACK_INSTANCE aInstance, PVOID aContext)
+{
+  std::coroutine_handle<>::from_address(aContext).resume();
+}
+
+} // anonymous namespace
+
+void
+WindowsThreadpoolExecutor::Post(std::coroutine_handle<> aHandle)
+{
+  if (!::TrySubmitThreadpoolCallback(&ResumeCoroutine, aHandle.address(),
+                                     nullptr)) {
+    // Better late on the wrong thread than never
+    aHandle.resume();
+  }
+}
+
+AsyncOperation<bool>
+WindowsSandboxLauncher::LaunchAsync(AsyncExecutor& aExecutor,
+                                    const std::wstring_view aExecutablePath,
+                                    const std::wstring_view aBaseCmdLine,
+                                    const CancellationToken& aToken)
+{
+  AsyncOperation<bool> operation(aExecutor, aToken);
+  auto launch = new AsyncLaunch{operation, this,
+                                std::wstring(aExecutablePath),
+                                std::wstring(aBaseCmdLine)};
+  if (!::TrySubmitThreadpoolCallback(&RunAsyncLaunch, launch, nullptr)) {
+    delete launch;
+    operation.Complete(false);
+  }
+  return operation;
+}
+
+AsyncOperation<uint32_t>
+WindowsSandboxLauncher::Exited(AsyncExecutor& aExecutor,
+                               const CancellationToken& aToken)
+{
+  AsyncOperation<uint32_t> operation(aExecutor, aToken);
+  if (!mProcess) {
+    operation.Complete(STILL_ACTIVE);
+    return operation;
+  }
+
+  HandleWaiter<uint32_t>::Start(operation, {mProcess}, INFINITE,
+    [](std::optional<size_t> aIndex, HANDLE aSignaled) -> uint32_t {
+      DWORD exitCode = STILL_ACTIVE;
+      if (aSignaled) {
+        ::GetExitCodeProcess(aSignaled, &exitCode);
+      }
+      return exitCode;
+    });
+  return operation;
+}
+
+AsyncOperation<bool>
+WindowsSandboxLauncher::ReceiveWorkerResult(AsyncExecutor& aExecutor,
+                                            uint32_t aTimeoutMs,
+                                            const CancellationToken& aToken)
+{
+  AsyncOperation<bool> operation(aExecutor, aToken);
+  if (!mWorkerResultEvent || !mProcess) {
+    operation.Complete(false);
+    return operation;
+  }
+
+  HandleWaiter<bool>::Start(operation, {mWorkerResultEvent.get(), mProcess},
+                            aTimeoutMs,
+    [](std::optional<size_t> aIndex, HANDLE aSignaled) -> bool {
+      return aIndex == 0;
+    });
+  return operation;
+}
+
+void
+WindowsSandboxLauncher::TracePhase(StartupPhase aPhase)
+{
+  if (mStartupTrace) {
+    mStartupTrace->Mark(aPhase, GetTraceTicks());
+  }
+}
+
+bool
+WindowsSandboxLauncher::GetStartupTrace(StartupTraceSummary& aSummary) const
+{
+  if (!mStartupTrace) {
+    return false;
+  }
+
+  return SummarizeStartupTrace(*mStartupTrace, aSummary);
+}
+
+bool
+WindowsSandboxLauncher::SetGroup(
+    const std::shared_ptr<WindowsSandboxGroup>& aGroup)
+{
+  if (!aGroup || mProcess) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(aGroup->mMutex);
+  if (!aGroup->mInitialized) {
+    return false;
+  }
+  mJobLimitPlan = aGroup->mJobLimitPlan;
+  mGroup = aGroup;
+  return true;
+}
+
+bool
+WindowsSandboxLauncher::Launch(const std::wstring_view aExecutablePath,
+                               const std::wstring_view aBaseCmdLine)
+{
+  auto launch = [&]() -> bool {
+    return mGroup ? LaunchGroupMember(aExecutablePath, aBaseCmdLine) :
+                    LaunchAdmitted(aExecutablePath, aBaseCmdLine);
+  };
+  if (!mAdmission) {
+    return launch();
+  }
+
+  if (!mAdmission->Enter(mPriority.value_or(ePriorityNormal),
+                         mAdmissionTimeoutMs)) {
+    ::SetLastError(ERROR_TIMEOUT);
+    return false;
+  }
+  auto start = std::chrono::steady_clock::now();
+  bool result = launch();
+  mAdmission->Leave(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start).count());
+  return result;
+}
+
+bool
+WindowsSandboxLauncher::LaunchGroupMember(
+    const std::wstring_view aExecutablePath,
+    const std::wstring_view aBaseCmdLine)
+{
+  // The first member to launch creates the objects that the group shares, so
+  // the group stays locked until it has done so.
+  std::unique_lock<std::mutex> lock(mGroup->mMutex);
+  std::optional<uint32_t> slot = mGroup->mMembers.Reserve();
+  if (!slot) {
+    ::SetLastError(ERROR_NOT_ENOUGH_QUOTA);
+    return false;
+  }
+
+  const bool creating = !mGroup->mJob;
+  if (!creating) {
+    lock.unlock();
+  }
+  bool result = LaunchAdmitted(aExecutablePath, aBaseCmdLine,
+                               creating ? nullptr : mGroup.get());
+  if (!creating) {
+    lock.lock();
+  }
+
+  if (result && creating) {
+    HANDLE groupJob;
+    result = !!::DuplicateHandle(::GetCurrentProcess(), mJob.get(),
+                                 ::GetCurrentProcess(), &groupJob, 0, FALSE,
+                                 DUPLICATE_SAME_ACCESS);
+    if (result) {
+      mGroup->mJob.reset(groupJob);
+      mGroup->mJobPort = std::move(mJobPort);
+      mGroup->mWinsta = mWinsta;
+      mGroup->mDesktop = mDesktop;
+      mGroup->mParentDesktop = mParentDesktop;
+      mGroup->mCustomSid = mCustomSid;
+      mWinsta = nullptr;
+      mDesktop = nullptr;
+      mParentDesktop = nullptr;
+    } else {
+      ::TerminateProcess(mProcess, 1);
+    }
+  }
+
+  if (result) {
+    mGroup->mMembers.Commit(slot.value(), ::GetProcessId(mProcess));
+  } else {
+    mGroup->mMembers.Cancel(slot.value());
+  }
+  return result;
+}
+
+/**
+ * Launches a sandbox for a WindowsSandboxLauncher. The objects that the
+ * launch creates live here until Finish hands them over to the launcher.
+ */
+class Win32LaunchBackend final : public LaunchBackend
+{
+public:
+  Win32LaunchBackend(WindowsSandboxLauncher& aLauncher,
+                     const std::wstring_view aExecutablePath,
+                     const std::wstring_view aBaseCmdLine,
+                     const WindowsSandboxGroup* aJoinGroup)
+    : mLauncher(aLauncher)
+    , mExecutablePath(aExecutablePath)
+    , mBaseCmdLine(aBaseCmdLine)
+    , mJoinGroup(aJoinGroup)
+    , mMainThreadHandle(nullptr)
+  {}
+
+  bool ResolveExecutable() override;
+  bool CreateCustomSid() override;
+  bool CreateTokens() override;
+  bool CreateWindowStation() override;
+  bool CreateDesktop() override;
+  bool CreateJob() override;
+  bool CreateStartupTrace() override;
+  bool CreateStartupBlock() override;
+  bool ResolveWorkingDirectory() override;
+  bool CreateSuspendedProcess() override;
+  bool SetThreadToken() override;
+  bool PreResume() override { return mLauncher.PreResume(); }
+  bool ResumeProcess() override;
+  void TerminateProcess() override;
+  void Finish(bool aSucceeded) override;
+
+private:
+  WindowsSandboxLauncher&     mLauncher;
+  std::wstring_view           mExecutablePath;
+  std::wstring_view           mBaseCmdLine;
+  // The group whose shared objects the sandbox joins, if any
+  const WindowsSandboxGroup*  mJoinGroup;
+  std::optional<std::wstring> mAbsExePath;
+  Sid                         mCustomSid;
+  Sid                         mLogonSid;
+  UniqueKernelHandle          mRestrictedToken;
+  UniqueKernelHandle          mImpersonationToken;
+  UniqueKernelHandle          mJob;
+  UniqueKernelHandle          mTraceSection;
+  UniqueKernelHandle          mStartupSection;
+  std::optional<std::wstring> mWorkingDir;
+  UniqueKernelHandle          mChildProcess;
+  UniqueKernelHandle          mMainThread;
+  // SetThreadToken wants the address of a handle
+  HANDLE                      mMainThreadHandle;
+};
+
+bool
+Win32LaunchBackend::ResolveExecutable()
+{
+  mAbsExePath = mLauncher.CreateAbsolutePath(mExecutablePath);
+  return !!mAbsExePath;
+}
+
+bool
+Win32LaunchBackend::CreateCustomSid()
+{
+  if (mJoinGroup) {
+    mCustomSid = mJoinGroup->mCustomSid;
+    return mCustomSid.IsValid();
+  }
+  return mCustomSid.InitCustom();
+}
+
+bool
+Win32LaunchBackend::CreateTokens()
+{
+  return mLauncher.CreateTokens(mCustomSid, mRestrictedToken,
+                                mImpersonationToken, mLogonSid);
+}
+
+bool
+Win32LaunchBackend::CreateWindowStation()
+{
+  if (mJoinGroup || (mLauncher.mInitFlags &
+                     WindowsSandboxLauncher::eInitNoSeparateWindowStation)) {
+    return true;
+  }
+  mLauncher.mWinsta = mLauncher.CreateWindowStation();
+  return !!mLauncher.mWinsta;
+}
+
+bool
+Win32LaunchBackend::CreateDesktop()
+{
+  if (mJoinGroup) {
+    return true;
+  }
+  mLauncher.mDesktop = mLauncher.CreateDesktop(mLauncher.mWinsta, mCustomSid);
+  return !!mLauncher.mDesktop;
+}
+
+bool
+Win32LaunchBackend::CreateJob()
+{
+  // Group members inherit their own handle to the group's job
+  if (mJoinGroup) {
+    HANDLE groupJob;
+    if (!::DuplicateHandle(::GetCurrentProcess(), mJoinGroup->mJob.get(),
+                           ::GetCurrentProcess(), &groupJob, 0, TRUE,
+                           DUPLICATE_SAME_ACCESS)) {
+      return false;
+    }
+    mJob.reset(groupJob);
+    return true;
+  }
+  return mLauncher.CreateJob(mJob);
+}
+
+bool
+Win32LaunchBackend::CreateStartupTrace()
+{
+  return mLauncher.CreateStartupTrace(mTraceSection);
+}
+
+// 5. Write the startup block. Everything that the sandbox needs at startup is
+//    passed this way; the command line only carries its handle.
+bool
+Win32LaunchBackend::CreateStartupBlock()
+{
+  return mLauncher.CreateStartupBlock(mJob.get(), mTraceSection.get(),
+                                      mStartupSection);
+}
+
+// 6. Set the working directory. With low integrity levels on Vista most
+//    directories are inaccessible.
+bool
+Win32LaunchBackend::ResolveWorkingDirectory()
+{
+  mWorkingDir = mLauncher.GetWorkingDirectory(mRestrictedToken);
+  return !!mWorkingDir;
+}
+
+bool
+Win32LaunchBackend::CreateSuspendedProcess()
+{
+  // 7. Build the command line string
+  wostringstream oss;
+  oss << mAbsExePath.value();
+  oss << L" "sv;
+  oss << mBaseCmdLine;
+  oss << L" "sv;
+  oss << WindowsSandbox::SWITCH_STARTUP_BLOCK;
+  oss << L" "sv;
+  oss << hex << mStartupSection.get();
+
+  // 8. Initialize the explicit list of handles to inherit (Vista+).
+  bool result = false;
+  DECLARE_UNIQUE_LEN(LPPROC_THREAD_ATTRIBUTE_LIST, attrList);
+  std::unique_ptr<HANDLE[]> inheritableHandles;
+  SIZE_T attrListSize = 0;
+
+  /* PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+   * PROC_THREAD_ATTRIBUTE_MITIGATION_POLICY and, when placed,
+   * PROC_THREAD_ATTRIBUTE_PREFERRED_NODE
+   */
+  const DWORD attrCount = mLauncher.mPlacement ? 3 : 2;
+  if (!::InitializeProcThreadAttributeList(nullptr, attrCount, 0,
+                                           &attrListSize) &&
+      GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+    return false;
+  }
+
+  ALLOC_UNIQUE_LEN(attrList, attrListSize);
+  if (!::InitializeProcThreadAttributeList(attrList, attrCount, 0,
+                                           &attrListSize)) {
+    return false;
+  }
+
+  UniqueProcAttributeList listDeleter(attrList);
+  const std::vector<HANDLE>& handlesToInherit = mLauncher.mHandlesToInherit;
+  size_t handleCount = handlesToInherit.size();
+  inheritableHandles = std::make_unique<HANDLE[]>(handleCount + 4);
+  memcpy(inheritableHandles.get(), handlesToInherit.data(),
+         handleCount * sizeof(HANDLE));
+  inheritableHandles[handleCount++] = mImpersonationToken.get();
+  inheritableHandles[handleCount++] = mJob.get();
+  inheritableHandles[handleCount++] = mStartupSection.get();
+  // Like the startup section, the trace is only inherited by this launch
+  if (mTraceSection) {
+    inheritableHandles[handleCount++] = mTraceSection.get();
+  }
+  result = !!::UpdateProcThreadAttribute(attrList, 0,
+                                         PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+                                         inheritableHandles.get(),
+                                         handleCount * sizeof(HANDLE), nullptr,
+                                         nullptr);
+  if (!result) {
+    return false;
+  }
+
+  DWORD64 (&mitigationPolicies)[2] = mLauncher.mMitigationPolicies;
+  result = !!::UpdateProcThreadAttribute(attrList, 0,
+                                         PROC_THREAD_ATTRIBUTE_MITIGATION_POLICY,
+                                         mitigationPolicies,
+                                         mitigationPolicies[1] ?
+                                           sizeof(mitigationPolicies) :
+                                           sizeof(DWORD64), nullptr, nullptr);
+  if (!result) {
+    return false;
+  }
+
+  USHORT preferredNode = 0;
+  if (mLauncher.mPlacement) {
+    preferredNode = static_cast<USHORT>(mLauncher.mPlacement->mNode);
+    result = !!::UpdateProcThreadAttribute(attrList, 0,
+                                           PROC_THREAD_ATTRIBUTE_PREFERRED_NODE,
+                                           &preferredNode,
+                                           sizeof(preferredNode), nullptr,
+                                           nullptr);
+    if (!result) {
+      return false;
+    }
+  }
+
+  // 9. Create the process using the restricted token
+  std::wstring desktop;
+  HWINSTA winsta = mJoinGroup ? mJoinGroup->mWinsta : mLauncher.mWinsta;
+  if (winsta) {
+    auto winstaName = mLauncher.GetWindowStationName(winsta);
     if (!winstaName) {
       return false;
     }
@@ -720,7 +2502,7 @@ WindowsSandboxLauncher::Launch(const std::wstring_view aExecutablePath,
   siex.StartupInfo.cb = sizeof(STARTUPINFOEX);
   siex.lpAttributeList = attrList;
 
-  if (!mHasWin8APIs) {
+  if (!mLauncher.mHasWin8APIs) {
     // Job objects don't nest until Windows 8. To create a process that is to be
     // part of a job, we need to create it as a "breakaway" process.
     creationFlags |= CREATE_BREAKAWAY_FROM_JOB;
@@ -728,35 +2510,66 @@ WindowsSandboxLauncher::Launch(const std::wstring_view aExecutablePath,
 
   SECURITY_ATTRIBUTES sa = {sizeof(sa), nullptr, FALSE};
 
+  mLauncher.TracePhase(ePhaseProcessCreating);
+
   PROCESS_INFORMATION procInfo;
-  result = !!::CreateProcessAsUser(restrictedToken.get(), absExePath.value().c_str(),
+  result = !!::CreateProcessAsUser(mRestrictedToken.get(), mAbsExePath.value().c_str(),
                                    const_cast<wchar_t*>(oss.str().c_str()), &sa,
-                                   &sa, TRUE, creationFlags, L"", workingDir.value().c_str(),
+                                   &sa, TRUE, creationFlags, L"", mWorkingDir.value().c_str(),
                                    &siex.StartupInfo, &procInfo);
-
-  UniqueKernelHandle childProcess(procInfo.hProcess);
-  UniqueKernelHandle mainThread(procInfo.hThread);
   if (!result) {
     return false;
   }
 
-  if (!::SetThreadToken(&procInfo.hThread, impersonationToken.get())) {
-    ::TerminateProcess(procInfo.hProcess, 1);
-    return false;
-  }
+  mChildProcess.reset(procInfo.hProcess);
+  mMainThread.reset(procInfo.hThread);
+  mMainThreadHandle = procInfo.hThread;
+  return true;
+}
 
-  if (!PreResume()) {
-    ::TerminateProcess(procInfo.hProcess, 1);
-    return false;
+bool
+Win32LaunchBackend::SetThreadToken()
+{
+  return !!::SetThreadToken(&mMainThreadHandle, mImpersonationToken.get());
+}
+
+bool
+Win32LaunchBackend::ResumeProcess()
+{
+  // Marked beforehand so that it cannot race with the sandbox's own phases
+  mLauncher.TracePhase(ePhaseProcessResumed);
+  return ::ResumeThread(mMainThread.get()) != static_cast<DWORD>(-1);
+}
+
+void
+Win32LaunchBackend::TerminateProcess()
+{
+  ::TerminateProcess(mChildProcess.get(), 1);
+}
+
+void
+Win32LaunchBackend::Finish(bool aSucceeded)
+{
+  // Kept so that teardown can remove it from the parent desktop's DACL, even
+  // if the launch failed after CreateDesktop denied it access. Group members
+  // leave that to the group.
+  if (!mJoinGroup && mLauncher.mParentDesktop) {
+    mLauncher.mCustomSid = mCustomSid;
   }
 
-  if (::ResumeThread(mainThread.get()) == static_cast<DWORD>(-1)) {
-    ::TerminateProcess(procInfo.hProcess, 1);
-    return false;
+  if (aSucceeded) {
+    mLauncher.mProcess = mChildProcess.release();
+    mLauncher.mJob = std::move(mJob);
   }
+}
 
-  mProcess = childProcess.release();
-  return true;
+bool
+WindowsSandboxLauncher::LaunchAdmitted(const std::wstring_view aExecutablePath,
+                                       const std::wstring_view aBaseCmdLine,
+                                       const WindowsSandboxGroup* aJoinGroup)
+{
+  Win32LaunchBackend backend(*this, aExecutablePath, aBaseCmdLine, aJoinGroup);
+  return RunLaunchSequence(backend, kLaunchThreads);
 }
 
 bool
@@ -800,5 +2613,185 @@ WindowsSandboxLauncher::GetInheritableSecurityDescriptor(SECURITY_ATTRIBUTES &aS
   return true;
 }
 
+const uint32_t WindowsWorkerChannel::kShutdownTimeoutMs = 1000;
+
+WindowsWorkerChannel::WindowsWorkerChannel(
+    LauncherFactory&& aFactory, const std::wstring_view aExecutablePath,
+    const std::wstring_view aBaseCmdLine)
+  : mFactory(std::move(aFactory))
+  , mExecutablePath(aExecutablePath)
+  , mBaseCmdLine(aBaseCmdLine)
+{
+}
+
+WindowsWorkerChannel::~WindowsWorkerChannel()
+{
+  if (mLauncher) {
+    mLauncher->ShutdownWorker(kShutdownTimeoutMs);
+  }
+}
+
+bool
+WindowsWorkerChannel::Start()
+{
+  std::unique_ptr<WindowsSandboxLauncher> launcher = mFactory();
+  if (!launcher || !launcher->EnableWorkerMode() ||
+      !launcher->Launch(mExecutablePath, mBaseCmdLine)) {
+    return false;
+  }
+
+  mLauncher = std::move(launcher);
+  return true;
+}
+
+WorkerMailbox*
+WindowsWorkerChannel::GetMailbox()
+{
+  return mLauncher ? mLauncher->GetWorkerMailbox() : nullptr;
+}
+
+void
+WindowsWorkerChannel::SignalTask()
+{
+  if (mLauncher) {
+    mLauncher->SignalWorkerTask();
+  }
+}
+
+bool
+WindowsWorkerChannel::WaitForResult(uint32_t aTimeoutMs)
+{
+  return mLauncher && mLauncher->WaitForWorkerResult(aTimeoutMs);
+}
+
+bool
+WindowsWorkerChannel::Recycle()
+{
+  if (mLauncher) {
+    mLauncher->ShutdownWorker(kShutdownTimeoutMs);
+    mLauncher.reset();
+  }
+  return Start();
+}
+
+WindowsSandboxGroup::WindowsSandboxGroup()
+  : mInitialized(false)
+  , mWinsta(nullptr)
+  , mDesktop(nullptr)
+  , mParentDesktop(nullptr)
+{
+}
+
+WindowsSandboxGroup::~WindowsSandboxGroup()
+{
+  if (mParentDesktop && mCustomSid.IsValid()) {
+    const uint8_t* sid = static_cast<const uint8_t*>(
+                           static_cast<PSID>(mCustomSid));
+    SidBytes sidBytes(sid, sid + ::GetLengthSid(mCustomSid));
+    WindowsTeardownBackend().RevertDesktopAces(
+      reinterpret_cast<uintptr_t>(mParentDesktop), {&sidBytes});
+  }
+  if (mDesktop) {
+    ::CloseDesktop(mDesktop);
+  }
+  if (mWinsta) {
+    ::CloseWindowStation(mWinsta);
+  }
+}
+
+bool
+WindowsSandboxGroup::Init(const JobLimits& aLimits)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (mInitialized || !aLimits.mActiveProcessLimit ||
+      !TranslateJobLimits(aLimits, mJobLimitPlan)) {
+    return false;
+  }
+
+  mMembers = SandboxGroupMembers(aLimits.mActiveProcessLimit);
+  mInitialized = true;
+  return true;
+}
+
+void
+WindowsSandboxGroup::Close()
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mMembers.Close();
+}
+
+bool
+WindowsSandboxGroup::ProcessJobNotifications(
+    unsigned int aTimeoutMs, std::vector<JobLimitNotification>& aViolations)
+{
+  // Once the first member has created them, the job and its port live as long
+  // as the group, so only finding them needs the lock. Waiting on the port
+  // with it held would stall member launches for the whole timeout.
+  HANDLE job;
+  HANDLE port;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    job = mJob.get();
+    port = mJobPort.get();
+  }
+  if (!port) {
+    return false;
+  }
+
+  std::vector<uint32_t> exited;
+  bool appended = false;
+  DWORD timeout = aTimeoutMs;
+  DWORD message;
+  ULONG_PTR key;
+  LPOVERLAPPED overlapped;
+  while (::GetQueuedCompletionStatus(port, &message, &key, &overlapped,
+                                     timeout)) {
+    timeout = 0;
+
+    // For process-level messages the "overlapped" value is the process id
+    uint32_t processId =
+      static_cast<uint32_t>(reinterpret_cast<uintptr_t>(overlapped));
+    if (message == JOB_OBJECT_MSG_EXIT_PROCESS ||
+        message == JOB_OBJECT_MSG_ABNORMAL_EXIT_PROCESS) {
+      exited.push_back(processId);
+      continue;
+    }
+
+    JobLimitViolation violation = TranslateJobMessage(message);
+    if (violation == eViolationNone) {
+      continue;
+    }
+
+    JobLimitNotification notification = {violation, processId, 0};
+    if (violation == eViolationNotificationLimit) {
+      JOBOBJECT_LIMIT_VIOLATION_INFORMATION violationInfo;
+      if (::QueryInformationJobObject(job, JobObjectLimitViolationInformation,
+                                      &violationInfo, sizeof(violationInfo),
+                                      nullptr)) {
+        notification.mLimitFlags = violationInfo.ViolationLimitFlags;
+      }
+    }
+    aViolations.push_back(notification);
+    appended = true;
+  }
+
+  // Frees the slots of members that have exited for launches to reuse
+  if (!exited.empty()) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (uint32_t processId : exited) {
+      mMembers.OnProcessExit(processId);
+    }
+  }
+
+  return appended;
+}
+
+uint32_t
+WindowsSandboxGroup::GetMemberCount() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mMembers.GetCapacity() - mMembers.GetCount(eMemberFree);
+}
+
 } // namespace mozilla
 
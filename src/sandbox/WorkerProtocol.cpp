@@ -0,0 +1,227 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "WorkerProtocol.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace mozilla {
+
+void
+WorkerMailbox::Init()
+{
+  mMagic = kMagic;
+  mVersion = kVersion;
+  mKind = 0;
+  mTaskId = 0;
+  mPayloadSize = 0;
+  mStatus = eTaskOk;
+  mWorkingSet.store(0, std::memory_order_relaxed);
+  mTasksServed = 0;
+  mState.store(eWorkerIdle, std::memory_order_release);
+}
+
+bool
+PostWorkerTask(WorkerMailbox& aMailbox, uint64_t aTaskId, uint32_t aKind,
+               const uint8_t* aInput, uint32_t aInputSize)
+{
+  if (aMailbox.mState.load(std::memory_order_acquire) != eWorkerIdle ||
+      aInputSize > WorkerMailbox::kPayloadSize) {
+    return false;
+  }
+
+  aMailbox.mTaskId = aTaskId;
+  aMailbox.mKind = aKind;
+  aMailbox.mPayloadSize = aInputSize;
+  if (aInputSize) {
+    memcpy(aMailbox.mPayload, aInput, aInputSize);
+  }
+  aMailbox.mState.store(eWorkerTaskPosted, std::memory_order_release);
+  return true;
+}
+
+bool
+TakeWorkerResult(WorkerMailbox& aMailbox, uint64_t& aTaskId,
+                 WorkerTaskStatus& aStatus, std::vector<uint8_t>& aOutput)
+{
+  if (aMailbox.mState.load(std::memory_order_acquire) != eWorkerResultPosted) {
+    return false;
+  }
+
+  // The worker is untrusted, so nothing that it wrote is taken at face value
+  uint32_t size = std::min(aMailbox.mPayloadSize, WorkerMailbox::kPayloadSize);
+  aTaskId = aMailbox.mTaskId;
+  aStatus = aMailbox.mStatus <= eTaskOutputTooLarge ?
+            static_cast<WorkerTaskStatus>(aMailbox.mStatus) : eTaskFailed;
+  aOutput.assign(aMailbox.mPayload, aMailbox.mPayload + size);
+  aMailbox.mState.store(eWorkerIdle, std::memory_order_release);
+  return true;
+}
+
+bool
+RequestWorkerShutdown(WorkerMailbox& aMailbox)
+{
+  uint32_t state = aMailbox.mState.load(std::memory_order_acquire);
+  if (state == eWorkerTaskPosted) {
+    return false;
+  }
+
+  aMailbox.mState.store(eWorkerShutdown, std::memory_order_release);
+  return true;
+}
+
+WorkerServeResult
+ServeWorkerTask(WorkerMailbox& aMailbox, const WorkerTaskHandler& aHandler,
+                uint64_t aWorkingSet)
+{
+  switch (aMailbox.mState.load(std::memory_order_acquire)) {
+    case eWorkerTaskPosted:
+      break;
+    case eWorkerShutdown:
+      return eServeShutdown;
+    default:
+      return eServeNothing;
+  }
+
+  uint32_t inputSize = std::min(aMailbox.mPayloadSize,
+                                WorkerMailbox::kPayloadSize);
+  std::vector<uint8_t> output;
+  WorkerTaskStatus status = aHandler(aMailbox.mKind, aMailbox.mPayload,
+                                     inputSize, output);
+  if (output.size() > WorkerMailbox::kPayloadSize) {
+    status = eTaskOutputTooLarge;
+    output.clear();
+  }
+
+  aMailbox.mStatus = status;
+  aMailbox.mPayloadSize = static_cast<uint32_t>(output.size());
+  if (!output.empty()) {
+    memcpy(aMailbox.mPayload, output.data(), output.size());
+  }
+  ++aMailbox.mTasksServed;
+  aMailbox.mWorkingSet.store(aWorkingSet, std::memory_order_relaxed);
+  aMailbox.mState.store(eWorkerResultPosted, std::memory_order_release);
+  return eServeRan;
+}
+
+bool
+WorkerRecyclePolicy::ShouldRecycle(uint32_t aTasksServed,
+                                   uint64_t aBaselineWorkingSet,
+                                   uint64_t aWorkingSet) const
+{
+  if (mMaxTasks && aTasksServed >= mMaxTasks) {
+    return true;
+  }
+  return mMaxWorkingSetGrowth && aWorkingSet > aBaselineWorkingSet &&
+         aWorkingSet - aBaselineWorkingSet > mMaxWorkingSetGrowth;
+}
+
+WorkerTaskQueue::WorkerTaskQueue(WorkerChannel& aChannel,
+                                 const WorkerRecyclePolicy& aPolicy)
+  : mChannel(aChannel)
+  , mPolicy(aPolicy)
+  , mNextId(1)
+  , mTasksServed(0)
+  , mBaselineWorkingSet(0)
+  , mStats()
+{
+}
+
+std::optional<uint64_t>
+WorkerTaskQueue::Submit(uint32_t aKind, std::vector<uint8_t>&& aInput)
+{
+  if (aInput.size() > WorkerMailbox::kPayloadSize) {
+    return std::nullopt;
+  }
+
+  uint64_t id = mNextId++;
+  mQueue.push_back(Task{id, aKind, std::move(aInput)});
+  ++mStats.mSubmitted;
+  mStats.mPeakQueueDepth = std::max(mStats.mPeakQueueDepth, mQueue.size());
+  return id;
+}
+
+bool
+WorkerTaskQueue::Recycle()
+{
+  ++mStats.mRecycles;
+  mTasksServed = 0;
+  mBaselineWorkingSet = 0;
+  return mChannel.Recycle();
+}
+
+bool
+WorkerTaskQueue::RunOne(const Task& aTask, uint32_t aTimeoutMs,
+                        WorkerResult& aResult)
+{
+  aResult.mTaskId = aTask.mId;
+  aResult.mOutput.clear();
+
+  WorkerMailbox* mailbox = mChannel.GetMailbox();
+  if (!mailbox || !PostWorkerTask(*mailbox, aTask.mId, aTask.mKind,
+                                  aTask.mInput.data(),
+                                  static_cast<uint32_t>(aTask.mInput.size()))) {
+    aResult.mStatus = eTaskWorkerLost;
+    return Recycle();
+  }
+
+  mChannel.SignalTask();
+  uint64_t taskId = 0;
+  if (!mChannel.WaitForResult(aTimeoutMs) ||
+      !TakeWorkerResult(*mailbox, taskId, aResult.mStatus, aResult.mOutput) ||
+      taskId != aTask.mId) {
+    aResult.mStatus = eTaskTimedOut;
+    aResult.mOutput.clear();
+    return Recycle();
+  }
+
+  uint64_t workingSet = mailbox->mWorkingSet.load(std::memory_order_relaxed);
+  if (!mTasksServed++) {
+    mBaselineWorkingSet = workingSet;
+  }
+  if (mPolicy.ShouldRecycle(mTasksServed, mBaselineWorkingSet, workingSet)) {
+    return Recycle();
+  }
+  return true;
+}
+
+size_t
+WorkerTaskQueue::Run(size_t aMaxTasks, uint32_t aTimeoutMs,
+                     std::vector<WorkerResult>& aResults)
+{
+  size_t ran = 0;
+  while (!mQueue.empty() && (!aMaxTasks || ran < aMaxTasks)) {
+    Task task = std::move(mQueue.front());
+    mQueue.pop_front();
+
+    WorkerResult result;
+    bool workerOk = RunOne(task, aTimeoutMs, result);
+    ++ran;
+    if (result.mStatus == eTaskOk) {
+      ++mStats.mCompleted;
+    } else {
+      ++mStats.mFailed;
+    }
+    aResults.push_back(std::move(result));
+    // Without a worker, the rest of the queue waits for the next Run
+    if (!workerOk) {
+      break;
+    }
+  }
+  return ran;
+}
+
+WorkerTaskQueue::Stats
+WorkerTaskQueue::GetStats() const
+{
+  Stats stats = mStats;
+  stats.mQueueDepth = mQueue.size();
+  return stats;
+}
+
+} // namespace mozilla
+